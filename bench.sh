@@ -0,0 +1,149 @@
+#!/bin/bash
+#
+# Run the bench/ workloads on a freshly made toyfs, on a loop device backed
+# by a file in /tmp, or on a ram disk with -r.
+#
+# Every workload gets a new filesystem, so no run depends on what the
+# previous ones left behind. Results go to stdout, one JSON object per
+# workload and run, tagged with the kernel and the commit they were
+# measured on. Everything else goes to the log file.
+
+TEST_DIR="/toyfs_bench_mnt/"
+TEST_IMG="/tmp/toyfs_bench.img"
+LOGFILE="/tmp/toyfs_bench.log"
+
+BLOCKS=262144		# 512MiB
+COUNT=10000
+FILE_SIZE=$((64 << 20))
+RUNS=1
+WORKLOADS=""
+SEED=1
+RAM=0
+
+DEV=""
+
+usage() {
+	echo "Usage: $0 [-b blocks] [-n count] [-S file-size] [-R runs] [-s seed]"
+	echo "       [-w workload,...] [-r]"
+	echo
+	echo "  -b  filesystem size in 2KiB blocks, $BLOCKS by default"
+	echo "  -n  metadata and random I/O operations per workload, $COUNT by default"
+	echo "  -S  data workloads file size in bytes, $FILE_SIZE by default"
+	echo "  -R  runs of each workload, $RUNS by default"
+	echo "  -s  random seed, $SEED by default"
+	echo "  -w  workloads to run, all of them by default, see bench/toyfs_bench"
+	echo "  -r  use a ram disk instead of a loop device"
+	exit 1
+}
+
+fatal() {
+	echo "$0: $1" >&2
+	cleanup
+	exit 1
+}
+
+cleanup() {
+	sudo umount $TEST_DIR &>> $LOGFILE
+	sudo rm -rf $TEST_DIR &>> $LOGFILE
+
+	if [ $RAM -eq 0 ] && [ -n "$DEV" ]; then
+		sudo losetup -d $DEV &>> $LOGFILE
+		rm -f $TEST_IMG &>> $LOGFILE
+	fi
+	DEV=""
+
+	[ $RAM -eq 1 ] && sudo rmmod brd &>> $LOGFILE
+	sudo rmmod toyfs &>> $LOGFILE
+}
+
+setup() {
+	sudo mkdir -p $TEST_DIR
+
+	make clean &> /dev/null
+	make &>> $LOGFILE || fatal "module build failed, see $LOGFILE"
+	make tools &>> $LOGFILE || fatal "tools build failed, see $LOGFILE"
+	make bench &>> $LOGFILE || fatal "bench build failed, see $LOGFILE"
+
+	sudo insmod ./toyfs.ko || fatal "insmod failed"
+}
+
+# Make a new filesystem, and mount it
+mkfs_mount() {
+	if [ $RAM -eq 1 ]; then
+		# rd_size is in KiB
+		sudo modprobe brd rd_nr=1 rd_size=$((BLOCKS * 2)) &>> $LOGFILE ||
+			fatal "no ram disk"
+		DEV=/dev/ram0
+		sudo ./tools/mkfs.toyfs -q $DEV &>> $LOGFILE ||
+			fatal "mkfs failed, see $LOGFILE"
+	else
+		rm -f $TEST_IMG
+		./tools/mkfs.toyfs -q $TEST_IMG $BLOCKS &>> $LOGFILE ||
+			fatal "mkfs failed, see $LOGFILE"
+		DEV=`sudo losetup -f --show $TEST_IMG`
+		[ -n "$DEV" ] || fatal "losetup failed"
+	fi
+
+	sudo mount -t toyfs $DEV $TEST_DIR &>> $LOGFILE || fatal "mount failed"
+	sudo chmod 1777 $TEST_DIR
+}
+
+# Unmount, and make sure the workload left a consistent filesystem behind
+umount_check() {
+	sudo umount $TEST_DIR || fatal "umount failed"
+	sudo ./tools/fsck.toyfs -f $DEV &>> $LOGFILE ||
+		echo "$0: fsck found problems after $1, see $LOGFILE" >&2
+
+	if [ $RAM -eq 1 ]; then
+		sudo rmmod brd &>> $LOGFILE
+	else
+		sudo losetup -d $DEV &>> $LOGFILE
+		rm -f $TEST_IMG
+	fi
+	DEV=""
+}
+
+run_workload() {
+	local wl=$1
+	local run=$2
+	local kver=`uname -r`
+	local commit=`git rev-parse --short HEAD 2> /dev/null`
+
+	mkfs_mount
+	sudo ./bench/toyfs_bench -c -n $COUNT -S $FILE_SIZE -s $SEED -w $wl \
+		$TEST_DIR 2>> $LOGFILE |
+		sed "s/^{/{\"kernel\":\"$kver\",\"commit\":\"$commit\",\"run\":$run,/"
+	[ ${PIPESTATUS[0]} -eq 0 ] ||
+		echo "$0: $wl failed, see $LOGFILE" >&2
+	umount_check $wl
+}
+
+while getopts "b:n:S:R:s:w:r" opt; do
+	case $opt in
+	b) BLOCKS=$OPTARG ;;
+	n) COUNT=$OPTARG ;;
+	S) FILE_SIZE=$OPTARG ;;
+	R) RUNS=$OPTARG ;;
+	s) SEED=$OPTARG ;;
+	w) WORKLOADS=${OPTARG//,/ } ;;
+	r) RAM=1 ;;
+	*) usage ;;
+	esac
+done
+
+: > $LOGFILE
+cleanup
+setup
+
+if [ -z "$WORKLOADS" ]; then
+	WORKLOADS=`./bench/toyfs_bench 2>&1 | sed -n 's/^  \([a-z_]*\)  .*/\1/p'`
+fi
+
+for wl in $WORKLOADS; do
+	for run in `seq $RUNS`; do
+		run_workload $wl $run
+	done
+done
+
+cleanup
+exit 0
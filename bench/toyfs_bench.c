@@ -0,0 +1,669 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * toyfs_bench - Filesystem workloads, timed
+ *
+ * Every workload runs in its own directory below the one given, which it
+ * sets up first and cleans up after, neither being timed. Each operation is
+ * timed on its own, and the results go out as one JSON object per workload
+ * on stdout: operations per second, and latency percentiles.
+ *
+ * The random workloads use their own generator, seeded with -s, so a given
+ * seed always gives the same sequence of operations.
+ *
+ * This isn't toyfs specific, and can be pointed at any filesystem to get a
+ * reference to compare with.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_COUNT		10000		/* Metadata operations */
+#define BENCH_FILE_SIZE		(64UL << 20)	/* Data workloads file size */
+#define BENCH_SEQ_BSIZE		(64UL << 10)
+#define BENCH_RAND_BSIZE	4096UL
+#define BENCH_SEED		1
+
+struct bench_opts {
+	const char	*dir;
+	unsigned long	count;
+	unsigned long	size;
+	unsigned long	bsize;		/* Sequential I/O size */
+	uint64_t	seed;
+	bool		drop_caches;
+};
+
+struct bench_result {
+	unsigned long	ops;
+	uint64_t	*lat;		/* Nanoseconds, one per operation */
+	uint64_t	start;
+	uint64_t	elapsed;	/* Setup and cleanup excluded */
+	uint64_t	bytes;		/* Data workloads only */
+	bool		cold;		/* Caches dropped after setup */
+};
+
+struct bench_workload {
+	const char	*name;
+	const char	*desc;
+	int		(*run)(struct bench_opts *opts, struct bench_result *res);
+};
+
+static const char *prog;
+static uint64_t rand_state;
+
+/* xorshift64*, the same everywhere, unlike random() */
+static uint64_t bench_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_start(struct bench_result *res)
+{
+	res->start = now_ns();
+}
+
+/* Record how long operation @res->ops took, given when it started */
+static void bench_op(struct bench_result *res, uint64_t start)
+{
+	res->lat[res->ops++] = now_ns() - start;
+}
+
+static void bench_stop(struct bench_result *res)
+{
+	res->elapsed = now_ns() - res->start;
+}
+
+static int bench_fail(const char *what, const char *path)
+{
+	int error = errno;
+
+	fprintf(stderr, "%s: %s %s: %s\n", prog, what, path, strerror(error));
+	return -error;
+}
+
+/*
+ * bench_drop_caches()
+ *	- Write everything back, and drop the page, inode and dentry caches
+ *	  so that what follows has to go to the filesystem
+ *	- Only root can, returns whether caches were dropped
+ */
+static bool bench_drop_caches(struct bench_opts *opts)
+{
+	int fd;
+
+	sync();
+	if (!opts->drop_caches)
+		return false;
+
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		return false;
+	if (write(fd, "3", 1) != 1) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+static void bench_path(char *buf, size_t len, const char *dir,
+		       const char *sub, unsigned long i)
+{
+	snprintf(buf, len, "%s/%s/f%lu", dir, sub, i);
+}
+
+static int bench_mkdir(struct bench_opts *opts, const char *sub)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", opts->dir, sub);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return bench_fail("mkdir", path);
+	return 0;
+}
+
+static void bench_rmdir(struct bench_opts *opts, const char *sub)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", opts->dir, sub);
+	rmdir(path);
+}
+
+/* Create @count empty files in @sub, untimed */
+static int bench_populate(struct bench_opts *opts, const char *sub,
+			  unsigned long count)
+{
+	char		path[PATH_MAX];
+	unsigned long	i;
+	int		fd;
+	int		error;
+
+	error = bench_mkdir(opts, sub);
+	if (error)
+		return error;
+
+	for (i = 0; i < count; i++) {
+		bench_path(path, sizeof(path), opts->dir, sub, i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0)
+			return bench_fail("create", path);
+		close(fd);
+	}
+	return 0;
+}
+
+/* Remove what bench_populate() created, untimed */
+static void bench_depopulate(struct bench_opts *opts, const char *sub,
+			     unsigned long count)
+{
+	char		path[PATH_MAX];
+	unsigned long	i;
+
+	for (i = 0; i < count; i++) {
+		bench_path(path, sizeof(path), opts->dir, sub, i);
+		unlink(path);
+	}
+	bench_rmdir(opts, sub);
+}
+
+static int bench_create(struct bench_opts *opts, struct bench_result *res)
+{
+	char		path[PATH_MAX];
+	unsigned long	i;
+	uint64_t	t;
+	int		fd;
+	int		error;
+
+	error = bench_mkdir(opts, "create");
+	if (error)
+		return error;
+
+	bench_start(res);
+	for (i = 0; i < opts->count; i++) {
+		bench_path(path, sizeof(path), opts->dir, "create", i);
+		t = now_ns();
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd < 0)
+			return bench_fail("create", path);
+		close(fd);
+		bench_op(res, t);
+	}
+	bench_stop(res);
+
+	bench_depopulate(opts, "create", opts->count);
+	return 0;
+}
+
+static int bench_unlink(struct bench_opts *opts, struct bench_result *res)
+{
+	char		path[PATH_MAX];
+	unsigned long	i;
+	uint64_t	t;
+	int		error;
+
+	error = bench_populate(opts, "unlink", opts->count);
+	if (error)
+		return error;
+
+	bench_start(res);
+	for (i = 0; i < opts->count; i++) {
+		bench_path(path, sizeof(path), opts->dir, "unlink", i);
+		t = now_ns();
+		if (unlink(path) < 0)
+			return bench_fail("unlink", path);
+		bench_op(res, t);
+	}
+	bench_stop(res);
+
+	bench_rmdir(opts, "unlink");
+	return 0;
+}
+
+/*
+ * bench_lookup_names()
+ *	- Look names up at random in one large directory, all of them
+ *	  there, or none of them with @miss
+ */
+static int bench_lookup_names(struct bench_opts *opts, struct bench_result *res,
+			      bool miss)
+{
+	struct stat	st;
+	char		path[PATH_MAX];
+	unsigned long	i, n;
+	uint64_t	t;
+	int		ret;
+	int		error;
+
+	error = bench_populate(opts, "lookup", opts->count);
+	if (error)
+		return error;
+	res->cold = bench_drop_caches(opts);
+
+	bench_start(res);
+	for (i = 0; i < opts->count; i++) {
+		n = bench_rand() % opts->count;
+		if (miss)
+			snprintf(path, sizeof(path), "%s/lookup/m%lu", opts->dir, n);
+		else
+			bench_path(path, sizeof(path), opts->dir, "lookup", n);
+		t = now_ns();
+		ret = stat(path, &st);
+		if (ret < 0 && (!miss || errno != ENOENT))
+			return bench_fail("stat", path);
+		if (!ret && miss) {
+			fprintf(stderr, "%s: %s should not exist\n", prog, path);
+			return -EEXIST;
+		}
+		bench_op(res, t);
+	}
+	bench_stop(res);
+
+	bench_depopulate(opts, "lookup", opts->count);
+	return 0;
+}
+
+static int bench_lookup(struct bench_opts *opts, struct bench_result *res)
+{
+	return bench_lookup_names(opts, res, false);
+}
+
+static int bench_lookup_miss(struct bench_opts *opts, struct bench_result *res)
+{
+	return bench_lookup_names(opts, res, true);
+}
+
+/*
+ * bench_io()
+ *	- Write or read the whole of @fd, @bsize bytes at a time, in order,
+ *	  or at random offsets @count times
+ */
+static int bench_io(struct bench_opts *opts, struct bench_result *res, int fd,
+		    const char *path, size_t bsize, unsigned long count,
+		    bool write, bool random)
+{
+	unsigned long	nblocks = opts->size / bsize;
+	unsigned long	i;
+	ssize_t		ret;
+	off_t		off;
+	uint64_t	t;
+	char		*buf;
+
+	buf = malloc(bsize);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0x5a, bsize);
+
+	bench_start(res);
+	for (i = 0; i < count; i++) {
+		off = (random ? bench_rand() % nblocks : i) * bsize;
+		t = now_ns();
+		if (write)
+			ret = pwrite(fd, buf, bsize, off);
+		else
+			ret = pread(fd, buf, bsize, off);
+		if (ret != (ssize_t)bsize) {
+			free(buf);
+			if (ret >= 0)
+				errno = EIO;
+			return bench_fail(write ? "write" : "read", path);
+		}
+		bench_op(res, t);
+		res->bytes += bsize;
+	}
+	/* Written data only counts once it is on disk */
+	if (write && fsync(fd) < 0) {
+		free(buf);
+		return bench_fail("fsync", path);
+	}
+	bench_stop(res);
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * bench_data()
+ *	- Run an I/O workload on a file of @opts->size bytes, which is
+ *	  written first, untimed, unless the workload is the one writing it
+ */
+static int bench_data(struct bench_opts *opts, struct bench_result *res,
+		      bool write, bool random)
+{
+	struct bench_result	setup = { 0 };
+	char			path[PATH_MAX];
+	size_t			bsize = random ? BENCH_RAND_BSIZE : opts->bsize;
+	unsigned long		count;
+	int			fd;
+	int			error;
+
+	snprintf(path, sizeof(path), "%s/data", opts->dir);
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return bench_fail("create", path);
+
+	if (!write || random) {
+		setup.lat = malloc(opts->size / opts->bsize * sizeof(uint64_t));
+		if (!setup.lat) {
+			error = -ENOMEM;
+			goto out;
+		}
+		error = bench_io(opts, &setup, fd, path, opts->bsize,
+				 opts->size / opts->bsize, true, false);
+		free(setup.lat);
+		if (error)
+			goto out;
+		res->cold = bench_drop_caches(opts);
+	}
+
+	count = random ? opts->count : opts->size / bsize;
+	error = bench_io(opts, res, fd, path, bsize, count, write, random);
+out:
+	close(fd);
+	unlink(path);
+	return error;
+}
+
+static int bench_seq_write(struct bench_opts *opts, struct bench_result *res)
+{
+	return bench_data(opts, res, true, false);
+}
+
+static int bench_seq_read(struct bench_opts *opts, struct bench_result *res)
+{
+	return bench_data(opts, res, false, false);
+}
+
+static int bench_rand_write(struct bench_opts *opts, struct bench_result *res)
+{
+	return bench_data(opts, res, true, true);
+}
+
+static int bench_rand_read(struct bench_opts *opts, struct bench_result *res)
+{
+	return bench_data(opts, res, false, true);
+}
+
+/* Append a block and fsync it, as a log would */
+static int bench_fsync(struct bench_opts *opts, struct bench_result *res)
+{
+	char		path[PATH_MAX];
+	char		buf[BENCH_RAND_BSIZE];
+	unsigned long	i;
+	uint64_t	t;
+	int		fd;
+	int		error = 0;
+
+	snprintf(path, sizeof(path), "%s/fsync", opts->dir);
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+	if (fd < 0)
+		return bench_fail("create", path);
+	memset(buf, 0xa5, sizeof(buf));
+
+	bench_start(res);
+	for (i = 0; i < opts->count; i++) {
+		t = now_ns();
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) < 0) {
+			error = bench_fail("write", path);
+			break;
+		}
+		bench_op(res, t);
+		res->bytes += sizeof(buf);
+	}
+	bench_stop(res);
+
+	close(fd);
+	unlink(path);
+	return error;
+}
+
+/*
+ * bench_rename()
+ *	- Move files picked at random between two directories, back and
+ *	  forth
+ */
+static int bench_rename(struct bench_opts *opts, struct bench_result *res)
+{
+	char		from[PATH_MAX], to[PATH_MAX];
+	unsigned char	*where;
+	unsigned long	i, n;
+	uint64_t	t;
+	int		error;
+
+	where = calloc(opts->count, 1);
+	if (!where)
+		return -ENOMEM;
+
+	error = bench_populate(opts, "rename0", opts->count);
+	if (!error)
+		error = bench_mkdir(opts, "rename1");
+	if (error)
+		goto out;
+
+	bench_start(res);
+	for (i = 0; i < opts->count; i++) {
+		n = bench_rand() % opts->count;
+		bench_path(from, sizeof(from), opts->dir,
+			   where[n] ? "rename1" : "rename0", n);
+		bench_path(to, sizeof(to), opts->dir,
+			   where[n] ? "rename0" : "rename1", n);
+		t = now_ns();
+		if (rename(from, to) < 0) {
+			error = bench_fail("rename", from);
+			goto out;
+		}
+		bench_op(res, t);
+		where[n] = !where[n];
+	}
+	bench_stop(res);
+
+	for (n = 0; n < opts->count; n++) {
+		bench_path(from, sizeof(from), opts->dir,
+			   where[n] ? "rename1" : "rename0", n);
+		unlink(from);
+	}
+out:
+	bench_rmdir(opts, "rename0");
+	bench_rmdir(opts, "rename1");
+	free(where);
+	return error;
+}
+
+static const struct bench_workload workloads[] = {
+	{ "create",	 "create empty files in a directory",	bench_create },
+	{ "unlink",	 "unlink files from a directory",	bench_unlink },
+	{ "lookup",	 "stat existing names at random",	bench_lookup },
+	{ "lookup_miss", "stat missing names at random",	bench_lookup_miss },
+	{ "seq_write",	 "buffered sequential writes, fsync",	bench_seq_write },
+	{ "seq_read",	 "buffered sequential reads",		bench_seq_read },
+	{ "rand_write",	 "buffered 4KiB random writes, fsync",	bench_rand_write },
+	{ "rand_read",	 "buffered 4KiB random reads",		bench_rand_read },
+	{ "fsync",	 "4KiB appends, each one fsynced",	bench_fsync },
+	{ "rename",	 "move files between two directories",	bench_rename },
+};
+
+#define NR_WORKLOADS	(sizeof(workloads) / sizeof(workloads[0]))
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile, in microseconds */
+static double percentile(const struct bench_result *res, unsigned int pct)
+{
+	unsigned long rank;
+
+	if (!res->ops)
+		return 0;
+	rank = (res->ops * pct + 99) / 100;
+	return res->lat[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static void bench_report(const struct bench_workload *wl,
+			 struct bench_result *res)
+{
+	double secs = res->elapsed / 1e9;
+
+	qsort(res->lat, res->ops, sizeof(*res->lat), cmp_u64);
+
+	printf("{\"workload\":\"%s\",\"ops\":%lu,\"seconds\":%.6f,"
+	       "\"ops_per_sec\":%.1f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+	       "\"max_us\":%.2f,\"mib_per_sec\":%.2f,\"cold\":%s}\n",
+	       wl->name, res->ops, secs, secs ? res->ops / secs : 0,
+	       percentile(res, 50), percentile(res, 99),
+	       res->ops ? res->lat[res->ops - 1] / 1000.0 : 0,
+	       secs ? res->bytes / secs / (1 << 20) : 0,
+	       res->cold ? "true" : "false");
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+		"Usage: %s [-n count] [-S size] [-b bsize] [-s seed] [-c]\n"
+		"       [-w workload,...] dir\n\n"
+		"  -n  metadata and random I/O operations, %u by default\n"
+		"  -S  data file size in bytes, %lu by default\n"
+		"  -b  sequential I/O size in bytes, %lu by default\n"
+		"  -s  random seed, %u by default\n"
+		"  -c  drop caches before reads and lookups, needs root\n"
+		"  -w  workloads to run, all of them by default\n\n"
+		"Workloads:\n",
+		prog, BENCH_COUNT, BENCH_FILE_SIZE, BENCH_SEQ_BSIZE, BENCH_SEED);
+	for (i = 0; i < NR_WORKLOADS; i++)
+		fprintf(stderr, "  %-12s %s\n", workloads[i].name,
+			workloads[i].desc);
+	exit(1);
+}
+
+static unsigned long parse_num(const char *arg)
+{
+	unsigned long	val;
+	char		*end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 0);
+	if (errno || *end || end == arg || !val) {
+		fprintf(stderr, "%s: invalid number: %s\n", prog, arg);
+		usage();
+	}
+	return val;
+}
+
+/* Is workload @name listed in @list, NULL standing for all of them */
+static bool bench_selected(const char *list, const char *name)
+{
+	size_t		len = strlen(name);
+	const char	*p;
+
+	if (!list)
+		return true;
+	for (p = list; (p = strstr(p, name)); p += len) {
+		if ((p == list || p[-1] == ',') && (!p[len] || p[len] == ','))
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts	opts = {
+		.count	= BENCH_COUNT,
+		.size	= BENCH_FILE_SIZE,
+		.bsize	= BENCH_SEQ_BSIZE,
+		.seed	= BENCH_SEED,
+	};
+	struct bench_result	res;
+	const char		*list = NULL;
+	unsigned long		max_ops;
+	unsigned int		i;
+	int			error = 0;
+	int			c;
+
+	prog = argv[0];
+	while ((c = getopt(argc, argv, "n:S:b:s:cw:")) != -1) {
+		switch (c) {
+		case 'n':
+			opts.count = parse_num(optarg);
+			break;
+		case 'S':
+			opts.size = parse_num(optarg);
+			break;
+		case 'b':
+			opts.bsize = parse_num(optarg);
+			break;
+		case 's':
+			opts.seed = parse_num(optarg);
+			break;
+		case 'c':
+			opts.drop_caches = true;
+			break;
+		case 'w':
+			list = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	opts.dir = argv[optind];
+
+	if (opts.size < opts.bsize || opts.size < BENCH_RAND_BSIZE) {
+		fprintf(stderr, "%s: the file must hold an I/O at least\n", prog);
+		return 1;
+	}
+
+	for (i = 0; i < NR_WORKLOADS; i++) {
+		if (!bench_selected(list, workloads[i].name))
+			continue;
+
+		max_ops = opts.count;
+		if (max_ops < opts.size / BENCH_RAND_BSIZE)
+			max_ops = opts.size / BENCH_RAND_BSIZE;
+
+		memset(&res, 0, sizeof(res));
+		res.lat = malloc(max_ops * sizeof(uint64_t));
+		if (!res.lat) {
+			fprintf(stderr, "%s: %s\n", prog, strerror(ENOMEM));
+			return 1;
+		}
+
+		/* Every workload starts from the same point of the sequence */
+		rand_state = opts.seed;
+		error = workloads[i].run(&opts, &res);
+		if (!error)
+			bench_report(&workloads[i], &res);
+		free(res.lat);
+		if (error)
+			break;
+	}
+	return error ? 1 : 0;
+}
@@ -6,6 +6,12 @@ TEST_IMG="./toyfs.img"
 LOGFILE="/tmp/toyfs_tests.log"
 SUBDIR="sudir"
 
+# Versioned filesystems made with mkfs.toyfs, for what the legacy image lacks
+NEW_DIR="/toyfs_new_mnt/"
+NEW_IMG="/tmp/toyfs_new.img"
+SRC_DIR="/tmp/toyfs_src"
+CRASH_DM="toyfs_crash"
+
 LOOP_DEV=""
 MOUNT_DEV=""
 
@@ -33,6 +39,11 @@ cleanup() {
 	local loop_dev=`sudo losetup | grep toyfs | awk '{print $1}'`
 	sudo umount $TEST_DIR &>> $LOGFILE
 	sudo rm -rf $TEST_DIR &>> $LOGFILE
+	sudo umount $NEW_DIR &>> $LOGFILE
+	sudo dmsetup remove $CRASH_DM &>> $LOGFILE
+	sudo rm -rf $NEW_DIR &>> $LOGFILE
+	rm -f $NEW_IMG &>> $LOGFILE
+	rm -rf $SRC_DIR &>> $LOGFILE
 
 	if [ -n $loop_dev ]; then
 		sudo losetup -D &>> $LOGFILE
@@ -53,6 +64,9 @@ setup() {
 	[ -e toyfs.ko ] || failed "setup"
 	passed "build module"
 
+	make tools &>> $LOGFILE
+	report_test $? "build tools"
+
 	sudo insmod ./toyfs.ko || failed "insmod"
 	cp $ORIG_IMG $TEST_IMG
 	passed "insmod"
@@ -119,6 +133,20 @@ test_write() {
 	report_test $? "write_2"
 }
 
+test_direct_io() {
+	local dest=$TEST_DIR/$SUBDIR/direct
+
+	sudo dd if=/dev/urandom of=/tmp/toyfs_dio bs=2048 count=4 &>> $LOGFILE
+	sudo dd if=/tmp/toyfs_dio of=$dest bs=2048 oflag=direct &>> $LOGFILE
+	report_test $? "direct_io_1"
+
+	sudo dd if=$dest of=/tmp/toyfs_dio.out bs=2048 iflag=direct &>> $LOGFILE
+	cmp -s /tmp/toyfs_dio /tmp/toyfs_dio.out
+	report_test $? "direct_io_2"
+
+	rm -f /tmp/toyfs_dio /tmp/toyfs_dio.out
+}
+
 test_read() {
 	cat $TEST_DIR/sunshine.txt &> /dev/null
 	report_test $? "read"
@@ -194,6 +222,355 @@ test_symlink() {
 	report_test $? "symlink_2"
 }
 
+# Make a new filesystem in $NEW_IMG, attach it and print its loop device
+new_fs() {
+	rm -f $NEW_IMG
+	tools/mkfs.toyfs -q $NEW_IMG 16384 &>> $LOGFILE || return 1
+	sudo losetup -f --show $NEW_IMG
+}
+
+# Mount a new filesystem on $NEW_DIR, check it once unmounted
+mount_new_fs() {
+	NEW_LOOP=`new_fs`
+	[ -n "$NEW_LOOP" ] || return 1
+	sudo mkdir -p $NEW_DIR
+	sudo mount -t toyfs $NEW_LOOP $NEW_DIR &>> $LOGFILE
+}
+
+umount_new_fs() {
+	sudo umount $NEW_DIR &>> $LOGFILE
+	sudo losetup -d $NEW_LOOP
+	tools/fsck.toyfs -n $NEW_IMG &>> $LOGFILE
+}
+
+# Read everything back from the disk
+drop_caches() {
+	sudo sync
+	sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+}
+
+# renameat2 <old> <new> <flags>, exits with the errno
+renameat2() {
+	sudo python3 -c 'import ctypes, sys
+libc = ctypes.CDLL(None, use_errno=True)
+ret = libc.renameat2(-100, sys.argv[1].encode(), -100, sys.argv[2].encode(),
+		     int(sys.argv[3]))
+sys.exit(ctypes.get_errno() if ret else 0)' "$@"
+}
+
+# Enough names for the index to split its leaf blocks many times over
+test_dir_index() {
+	local dir=$NEW_DIR/big
+
+	mount_new_fs
+	report_test $? "dir_index_mount"
+
+	sudo mkdir $dir
+	sudo sh -c "cd $dir && for i in \`seq 1 1500\`; do touch file\$i; done"
+	report_test $? "dir_index_create"
+
+	drop_caches
+	[ `ls $dir | wc -l` = 1500 ] && [ -e $dir/file1 ] &&
+		[ -e $dir/file750 ] && [ -e $dir/file1500 ] &&
+		[ ! -e $dir/file1501 ]
+	report_test $? "dir_index_lookup"
+
+	sudo sh -c "cd $dir && for i in \`seq 1 2 1500\`; do rm file\$i; done"
+	drop_caches
+	[ `ls $dir | wc -l` = 750 ] && [ ! -e $dir/file1 ] &&
+		[ -e $dir/file2 ] && [ ! -e $dir/file749 ] && [ -e $dir/file1500 ]
+	report_test $? "dir_index_unlink"
+
+	# Freed slots are reused
+	sudo sh -c "cd $dir && for i in \`seq 1 2 1500\`; do touch new\$i; done"
+	drop_caches
+	[ `ls $dir | wc -l` = 1500 ] && [ -e $dir/new1 ] && [ -e $dir/file2 ]
+	report_test $? "dir_index_reuse"
+
+	umount_new_fs
+	report_test $? "dir_index_fsck"
+}
+
+# Small files and symlinks live in the inode until they outgrow it
+test_inline() {
+	local file=$NEW_DIR/small
+	local lnk=$NEW_DIR/lnk
+
+	mount_new_fs
+	report_test $? "inline_mount"
+
+	sudo sh -c "printf 0123456789 > $file"
+	sudo ln -s small $lnk
+	drop_caches
+	[ `stat -c %b $file` = 0 ] && [ "`cat $file`" = 0123456789 ] &&
+		[ `stat -c %b $lnk` = 0 ] && [ `readlink $lnk` = small ]
+	report_test $? "inline_small"
+
+	# Past TFS_INLINE_SIZE the data moves out to a block
+	sudo sh -c "printf %0100d 0 >> $file"
+	drop_caches
+	[ `stat -c %b $file` -gt 0 ] && [ `stat -c %s $file` = 110 ] &&
+		[ "`head -c 10 $file`" = 0123456789 ]
+	report_test $? "inline_convert"
+
+	umount_new_fs
+	report_test $? "inline_fsck"
+}
+
+# mkfs -d copies a tree in, holes, links and directory index included
+test_mkfs_dir() {
+	local src=$SRC_DIR
+
+	rm -rf $src
+	mkdir -p $src/sub
+	seq 1 20000 > $src/sub/seq
+	printf tiny > $src/tiny
+	ln -s tiny $src/lnk
+	ln $src/sub/seq $src/hard
+	for i in `seq 1 300`; do touch $src/sub/f$i; done
+	truncate -s 8M $src/sparse
+	dd if=/dev/urandom of=$src/sparse bs=4096 count=2 seek=1000 \
+		conv=notrunc &>> $LOGFILE
+
+	rm -f $NEW_IMG
+	tools/mkfs.toyfs -q -d $src $NEW_IMG 16384 &>> $LOGFILE &&
+		tools/fsck.toyfs -n $NEW_IMG &>> $LOGFILE
+	report_test $? "mkfs_dir"
+
+	NEW_LOOP=`sudo losetup -f --show $NEW_IMG`
+	sudo mkdir -p $NEW_DIR
+	sudo mount -t toyfs $NEW_LOOP $NEW_DIR &>> $LOGFILE
+	report_test $? "mkfs_dir_mount"
+
+	diff -r --no-dereference $src $NEW_DIR &>> $LOGFILE
+	report_test $? "mkfs_dir_contents"
+
+	[ `stat -c %h $NEW_DIR/hard` = 2 ] &&
+		[ `stat -c %i $NEW_DIR/hard` = `stat -c %i $NEW_DIR/sub/seq` ]
+	report_test $? "mkfs_dir_links"
+
+	# Only the 8k written are mapped, in 512 bytes units
+	[ `stat -c %b $NEW_DIR/sparse` = 16 ] && [ `stat -c %b $NEW_DIR/tiny` = 0 ]
+	report_test $? "mkfs_dir_sparse"
+
+	umount_new_fs
+	report_test $? "mkfs_dir_fsck"
+}
+
+# fsync <path>, on a file or a directory
+fsync() {
+	sudo python3 -c 'import os, sys
+fd = os.open(sys.argv[1], os.O_RDONLY)
+os.fsync(fd)' "$1" &>> $LOGFILE
+}
+
+# With a journal to commit on the new filesystem, without on the legacy one
+test_dir_fsync() {
+	sudo touch $TEST_DIR/fsync_file
+	fsync $TEST_DIR
+	report_test $? "dir_fsync_legacy"
+
+	mount_new_fs
+	sudo touch $NEW_DIR/fsync_file
+	fsync $NEW_DIR
+	report_test $? "dir_fsync"
+	umount_new_fs
+	report_test $? "dir_fsync_fsck"
+}
+
+RENAME_NOREPLACE=1
+RENAME_EXCHANGE=2
+EEXIST=17
+ENOTEMPTY=39
+
+test_rename_flags() {
+	local dir=$NEW_DIR
+	local ino1
+	local ino2
+
+	mount_new_fs
+	report_test $? "rename_flags_mount"
+
+	# A file and a directory swap places, across directories
+	sudo mkdir -p $dir/a $dir/b/sub
+	sudo sh -c "echo KOMETA > $dir/a/file"
+	ino1=`stat -c %i $dir/a/file`
+	ino2=`stat -c %i $dir/b/sub`
+	renameat2 $dir/a/file $dir/b/sub $RENAME_EXCHANGE
+	report_test $? "rename_exchange_1"
+
+	drop_caches
+	[ -d $dir/a/file ] && [ "`cat $dir/b/sub`" = KOMETA ] &&
+		[ `stat -c %i $dir/a/file` = $ino2 ] &&
+		[ `stat -c %i $dir/b/sub` = $ino1 ]
+	report_test $? "rename_exchange_2"
+
+	sudo sh -c "echo KOMETA > $dir/x; echo SPARTA > $dir/y"
+	renameat2 $dir/x $dir/y $RENAME_NOREPLACE
+	[ $? = $EEXIST ] && [ "`cat $dir/x`" = KOMETA ] &&
+		[ "`cat $dir/y`" = SPARTA ]
+	report_test $? "rename_noreplace_1"
+
+	renameat2 $dir/x $dir/z $RENAME_NOREPLACE && [ ! -e $dir/x ] &&
+		[ "`cat $dir/z`" = KOMETA ]
+	report_test $? "rename_noreplace_2"
+
+	# Only empty directories can be renamed over
+	sudo mkdir $dir/src $dir/empty $dir/full
+	sudo touch $dir/full/file
+	renameat2 $dir/src $dir/full 0
+	[ $? = $ENOTEMPTY ] && [ -d $dir/src ] && [ -e $dir/full/file ]
+	report_test $? "rename_dir_1"
+
+	renameat2 $dir/src $dir/empty 0 && [ ! -e $dir/src ] && [ -d $dir/empty ]
+	report_test $? "rename_dir_2"
+
+	# fsck checks ".." points to the new parent
+	sudo mkdir -p $dir/p1/child $dir/p2
+	sudo touch $dir/p1/child/file
+	sudo mv $dir/p1/child $dir/p2/ && sudo rmdir $dir/p1 &&
+		[ `stat -c %i $dir/p2/child/..` = `stat -c %i $dir/p2` ]
+	report_test $? "rename_dotdot"
+
+	umount_new_fs
+	report_test $? "rename_flags_fsck"
+}
+
+test_fallocate() {
+	local file=$NEW_DIR/falloc
+	local punch=$NEW_DIR/punch
+	local exp=/tmp/toyfs_falloc
+
+	mount_new_fs
+	report_test $? "fallocate_mount"
+
+	sudo fallocate -l 1M $file
+	report_test $? "fallocate_1"
+
+	[ `stat -c %s $file` = 1048576 ] && [ `stat -c %b $file` = 2048 ] &&
+		sudo cmp -s -n 1048576 $file /dev/zero
+	report_test $? "fallocate_2"
+
+	# Writing within unwritten blocks leaves the rest of them zeroed
+	dd if=/dev/urandom of=$exp bs=2048 count=32 &>> $LOGFILE
+	sudo dd if=$exp of=$file bs=2048 seek=100 count=4 conv=notrunc &>> $LOGFILE
+	drop_caches
+	sudo cmp -s -n 204800 $file /dev/zero &&
+		sudo cmp -s -i 204800:0 -n 8192 $file $exp &&
+		sudo cmp -s -i 212992 -n 835584 $file /dev/zero
+	report_test $? "fallocate_3"
+
+	sudo cp $exp $punch
+	sudo fallocate -p -o 8192 -l 16384 $punch
+	report_test $? "fallocate_punch_1"
+
+	dd if=/dev/zero of=$exp bs=2048 seek=4 count=8 conv=notrunc &>> $LOGFILE
+	drop_caches
+	sudo cmp -s $exp $punch && [ `stat -c %s $punch` = 65536 ] &&
+		[ `stat -c %b $punch` = 96 ]
+	report_test $? "fallocate_punch_2"
+
+	sudo fallocate -z -o 2048 -l 4096 $punch
+	report_test $? "fallocate_zero_1"
+
+	dd if=/dev/zero of=$exp bs=2048 seek=1 count=2 conv=notrunc &>> $LOGFILE
+	drop_caches
+	sudo cmp -s $exp $punch && [ `stat -c %s $punch` = 65536 ]
+	report_test $? "fallocate_zero_2"
+
+	rm -f $exp
+	umount_new_fs
+	report_test $? "fallocate_fsck"
+}
+
+test_truncate() {
+	local file=$NEW_DIR/trunc
+	local exp=/tmp/toyfs_trunc
+
+	mount_new_fs
+	report_test $? "truncate_mount"
+
+	dd if=/dev/urandom of=$exp bs=2048 count=32 &>> $LOGFILE
+	sudo cp $exp $file
+	sudo truncate -s 10000 $file
+	drop_caches
+	[ `stat -c %s $file` = 10000 ] && [ `stat -c %b $file` = 20 ] &&
+		sudo cmp -s -n 10000 $file $exp
+	report_test $? "truncate_shrink"
+
+	# The tail of the last block was zeroed, the rest is a hole
+	sudo truncate -s 100000 $file
+	drop_caches
+	[ `stat -c %s $file` = 100000 ] && [ `stat -c %b $file` = 20 ] &&
+		sudo cmp -s -n 10000 $file $exp &&
+		sudo cmp -s -i 10000 -n 90000 $file /dev/zero
+	report_test $? "truncate_grow"
+
+	rm -f $exp
+	umount_new_fs
+	report_test $? "truncate_fsck"
+}
+
+# Everything synced before the device goes away must be there after replay
+test_journal_crash() {
+	local data=/tmp/toyfs_crash_data
+	local loop
+	local sectors
+	local count
+
+	loop=`new_fs`
+	report_test $? "journal_crash_1"
+	[ -n "$loop" ] || return
+
+	sectors=`sudo blockdev --getsz $loop`
+	echo "0 $sectors linear $loop 0" | sudo dmsetup create $CRASH_DM
+	sudo mkdir -p $NEW_DIR
+	sudo mount -t toyfs /dev/mapper/$CRASH_DM $NEW_DIR &>> $LOGFILE
+	report_test $? "journal_crash_2"
+
+	dd if=/dev/urandom of=$data bs=2048 count=64 &>> $LOGFILE
+	sudo mkdir $NEW_DIR/kept
+	for i in `seq 1 50`; do
+		sudo sh -c "echo $i > $NEW_DIR/kept/file$i"
+	done
+	sudo cp $data $NEW_DIR/kept/data
+	sudo sync
+
+	# Keep allocating and freeing while the device starts failing
+	sudo sh -c "mkdir $NEW_DIR/work; for i in \`seq 1 2000\`; do
+		dd if=/dev/zero of=$NEW_DIR/work/file\$i bs=2048 count=8;
+		rm -f $NEW_DIR/work/file\$((i / 2));
+	done" &>> $LOGFILE &
+	sleep 1
+	sudo dmsetup suspend --noflush $CRASH_DM
+	sudo dmsetup load $CRASH_DM --table "0 $sectors error"
+	sudo dmsetup resume $CRASH_DM
+	wait
+
+	sudo umount $NEW_DIR &>> $LOGFILE || sudo umount -l $NEW_DIR
+	sleep 1
+	sudo dmsetup remove $CRASH_DM &>> $LOGFILE
+
+	# Read-only mounts don't replay, and must not pretend all is well
+	! sudo mount -t toyfs -o ro $loop $NEW_DIR &>> $LOGFILE
+	report_test $? "journal_crash_ro"
+
+	sudo mount -t toyfs $loop $NEW_DIR &>> $LOGFILE
+	report_test $? "journal_crash_3"
+
+	count=`ls $NEW_DIR/kept | wc -l`
+	[ "$count" = 51 ] && sudo cmp -s $data $NEW_DIR/kept/data &&
+		[ "`cat $NEW_DIR/kept/file50`" = 50 ]
+	report_test $? "journal_crash_4"
+
+	sudo umount $NEW_DIR &>> $LOGFILE
+	sudo losetup -d $loop
+	tools/fsck.toyfs -n $NEW_IMG &>> $LOGFILE
+	report_test $? "journal_crash_5"
+
+	rm -f $data $NEW_IMG
+}
+
 #sudo sh -c "echo -n 'module toyfs -p' > /sys/kernel/debug/dynamic_debug/control"
 cleanup
 setup
@@ -203,6 +580,7 @@ test_stat
 test_read
 test_readdir
 test_write
+test_direct_io
 test_read
 test_readdir
 test_unlink
@@ -210,6 +588,14 @@ test_rmdir
 test_rename
 test_link
 test_symlink
+test_dir_index
+test_inline
+test_mkfs_dir
+test_dir_fsync
+test_rename_flags
+test_fallocate
+test_truncate
+test_journal_crash
 test_umount
 cleanup
 exit 0
@@ -0,0 +1,1643 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * fsck.toyfs - Check and repair a toyfs filesystem
+ *
+ * The check runs in passes:
+ *
+ *	0. Replay the journal, if the filesystem wasn't cleanly unmounted
+ *	1. Inodes: modes and block maps
+ *	2. Directories: entries, index, and the references they hold. Each
+ *	   directory is checked on its own, by a pool of threads.
+ *	3. Link counts, unreferenced inodes and ".." entries
+ *	4. Block bitmap, inode bitmap and free counts
+ *
+ * The inode table and both bitmaps are contiguous, and are read as a whole
+ * with large sequential reads. Directories are read an extent at a time.
+ * Fixes are applied in memory, and written back at the end.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "toyfs_lib.h"
+
+/* Exit codes, as fsck(8) expects them */
+#define FSCK_OK			0
+#define FSCK_FIXED		1
+#define FSCK_UNFIXED		4
+#define FSCK_ERROR		8
+
+#define FSCK_MAX_THREADS	64
+
+#define EFSCORRUPTED		EUCLEAN
+
+/* fsck_inode states */
+enum {
+	FSCK_FREE = 0,
+	FSCK_INUSE,
+	FSCK_BAD,		/* In use on disk, but beyond repair */
+};
+
+/* What we know about each inode */
+struct fsck_inode {
+	uint8_t			state;
+	uint32_t		nextents;
+	struct tfs_extent	*ext;
+
+	/* Number of directory entries pointing to the inode */
+	uint32_t		refs;
+
+	/* Directories only */
+	uint32_t		parent;		/* Directory holding its entry */
+	uint32_t		dotdot;		/* What its ".." points to */
+	uint32_t		nchildren;	/* Entries besides "." and ".." */
+	uint32_t		*children;
+};
+
+/* A directory entry, while checking its directory */
+struct fsck_dentry {
+	uint32_t		hash;
+	uint32_t		slot;
+	uint32_t		ino;
+	const char		*name;
+};
+
+struct fsck {
+	struct tfs_dev		dev;
+	struct tfs_geometry	geo;
+	struct tfs_dsb		*dsb;		/* Superblock buffer */
+	bool			fix;
+	bool			verbose;
+	unsigned int		nthreads;
+
+	/* Inode table, inode bitmap and block bitmap, read in one go */
+	void			*meta;
+	struct tfs_dinode	*itable;
+	unsigned long		*imap;		/* Built from s_inodes if legacy */
+	unsigned long		*bmap;
+	unsigned long		*itable_dirty;	/* One bit per inode table block */
+	bool			imap_dirty;
+	bool			bmap_dirty;
+	bool			sb_dirty;
+
+	/* Blocks found in use */
+	unsigned long		*used;
+	struct fsck_inode	*inodes;
+
+	/* Directories to check, handed out to the threads by next_dir */
+	uint32_t		*dirs;
+	uint32_t		ndirs;
+	uint32_t		next_dir;
+
+	/*
+	 * A committed transaction found in the journal. Unless we're fixing
+	 * things, it is only applied to what we read.
+	 */
+	struct tfs_journal_desc	*jdesc;
+	void			**jcopies;
+	uint32_t		jcount;
+
+	pthread_mutex_t		lock;		/* Messages and counters */
+	unsigned int		fixed;
+	unsigned int		unfixed;
+};
+
+static const char *prog;
+
+/*
+ * fsck_problem()
+ *	- Report a problem, and whether it gets fixed: only if it can be,
+ *	  and we were asked to.
+ *	- Returns true if the caller has to fix it.
+ */
+static bool __attribute__((format(printf, 3, 4)))
+fsck_problem(struct fsck *fs, bool fixable, const char *fmt, ...)
+{
+	bool	fix = fixable && fs->fix;
+	va_list	ap;
+
+	pthread_mutex_lock(&fs->lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+
+	if (fix) {
+		printf(": fixed\n");
+		fs->fixed++;
+	} else {
+		printf(fixable ? ": not fixed\n" : "\n");
+		fs->unfixed++;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return fix;
+}
+
+static void __attribute__((format(printf, 2, 3)))
+fsck_info(struct fsck *fs, const char *fmt, ...)
+{
+	va_list	ap;
+
+	if (!fs->verbose)
+		return;
+
+	pthread_mutex_lock(&fs->lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&fs->lock);
+}
+
+/*
+ * fsck_read()
+ *	- Read @count blocks starting at @blk, as the journal replay leaves
+ *	  them
+ */
+static int fsck_read(struct fsck *fs, void *buf, uint32_t blk, uint32_t count)
+{
+	uint32_t	home;
+	uint32_t	i;
+	int		error;
+
+	error = tfs_read_blocks(&fs->dev, buf, blk, count);
+	if (error)
+		return error;
+
+	for (i = 0; i < fs->jcount; i++) {
+		home = fs->jdesc->jd_blocks[i];
+		if (home >= blk && home < blk + count)
+			memcpy((char *)buf + (size_t)(home - blk) * fs->geo.bsize,
+			       fs->jcopies[i], fs->geo.bsize);
+	}
+	return 0;
+}
+
+static inline uint8_t fsck_dtype(uint32_t mode)
+{
+	return IFTODT(mode & S_IFMT);
+}
+
+/*
+ * fsck_reset_journal()
+ *	- Write a fresh journal superblock and an empty log
+ */
+static int fsck_reset_journal(struct fsck *fs, uint32_t seq)
+{
+	struct tfs_journal_super	*jsb;
+	int				error;
+
+	jsb = calloc(2, fs->geo.bsize);
+	if (!jsb)
+		return -ENOMEM;
+
+	jsb->js_header.jh_magic = TFS_JOURNAL_MAGIC;
+	jsb->js_header.jh_type = TFS_JOURNAL_SUPER;
+	jsb->js_header.jh_seq = seq;
+	jsb->js_blocks = fs->geo.journal_blocks;
+
+	error = tfs_write_blocks(&fs->dev, jsb, fs->geo.journal_start, 2);
+	free(jsb);
+	return error;
+}
+
+/*
+ * fsck_replay()
+ *	- Pass 0: find the transaction the journal holds, and check it was
+ *	  fully committed, just like toyfs_journal_replay() does
+ *	- When fixing, write it back home, and reset the journal. Otherwise,
+ *	  keep it around for fsck_read().
+ */
+static int fsck_replay(struct fsck *fs)
+{
+	struct tfs_geometry		*geo = &fs->geo;
+	struct tfs_journal_super	*jsb;
+	struct tfs_journal_commit	*commit;
+	struct tfs_journal_desc		*desc;
+	void				*buf;
+	uint32_t			max;
+	uint32_t			count = 0;
+	uint32_t			seq;
+	uint32_t			i;
+	int				error;
+
+	max = tfs_journal_max(geo->journal_blocks, geo->bsize);
+	buf = malloc(geo->bsize);
+	desc = malloc(geo->bsize);
+	if (!buf || !desc)
+		return -ENOMEM;
+
+	error = tfs_read_blocks(&fs->dev, buf, geo->journal_start, 1);
+	if (error)
+		goto out_free;
+
+	jsb = buf;
+	seq = jsb->js_header.jh_seq;
+	if (jsb->js_header.jh_magic != TFS_JOURNAL_MAGIC ||
+	    jsb->js_header.jh_type != TFS_JOURNAL_SUPER ||
+	    jsb->js_blocks != geo->journal_blocks) {
+		if (fsck_problem(fs, true, "journal superblock is corrupted"))
+			error = fsck_reset_journal(fs, 1);
+		goto out_free;
+	}
+
+	error = tfs_read_blocks(&fs->dev, desc, geo->journal_start + 1, 1);
+	if (error)
+		goto out_free;
+
+	count = desc->jd_count;
+	if (desc->jd_header.jh_magic != TFS_JOURNAL_MAGIC ||
+	    desc->jd_header.jh_type != TFS_JOURNAL_DESC ||
+	    !count || count > max) {
+		fsck_info(fs, "journal is empty\n");
+		goto out_free;
+	}
+
+	fs->jcopies = calloc(count, sizeof(void *));
+	if (!fs->jcopies) {
+		error = -ENOMEM;
+		goto out_free;
+	}
+	for (i = 0; i < count; i++) {
+		fs->jcopies[i] = malloc(geo->bsize);
+		if (!fs->jcopies[i]) {
+			error = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	for (i = 0; i < count && !error; i++)
+		error = tfs_read_blocks(&fs->dev, fs->jcopies[i],
+					geo->journal_start + 2 + i, 1);
+	if (!error)
+		error = tfs_read_blocks(&fs->dev, buf,
+					geo->journal_start + 2 + count, 1);
+	if (error)
+		goto out_free;
+
+	commit = buf;
+	if (commit->jc_header.jh_magic != TFS_JOURNAL_MAGIC ||
+	    commit->jc_header.jh_type != TFS_JOURNAL_COMMIT ||
+	    commit->jc_header.jh_seq != desc->jd_header.jh_seq ||
+	    commit->jc_count != count ||
+	    commit->jc_crc != tfs_journal_crc(desc, fs->jcopies, geo->bsize)) {
+		fsck_info(fs, "transaction %u was never committed\n",
+			  desc->jd_header.jh_seq);
+		goto out_free;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (desc->jd_blocks[i] < geo->nblocks &&
+		    (desc->jd_blocks[i] < geo->journal_start ||
+		     desc->jd_blocks[i] >= geo->journal_start +
+					   geo->journal_blocks))
+			continue;
+
+		if (fsck_problem(fs, true,
+				 "transaction %u logs invalid block %u",
+				 desc->jd_header.jh_seq, desc->jd_blocks[i]))
+			error = fsck_reset_journal(fs, seq);
+		goto out_free;
+	}
+
+	printf("%s: recovering journal, transaction %u: %u blocks\n",
+	       fs->dev.path, desc->jd_header.jh_seq, count);
+
+	if ((int32_t)(desc->jd_header.jh_seq - seq) >= 0)
+		seq = desc->jd_header.jh_seq + 1;
+
+	if (fs->fix) {
+		for (i = 0; i < count && !error; i++)
+			error = tfs_write_blocks(&fs->dev, fs->jcopies[i],
+						 desc->jd_blocks[i], 1);
+		if (!error)
+			error = tfs_dev_sync(&fs->dev);
+		if (!error)
+			error = fsck_reset_journal(fs, seq);
+		goto out_free;
+	}
+
+	fs->jdesc = desc;
+	fs->jcount = count;
+	free(buf);
+	return 0;
+
+out_free:
+	if (fs->jcopies) {
+		for (i = 0; i < count; i++)
+			free(fs->jcopies[i]);
+		free(fs->jcopies);
+		fs->jcopies = NULL;
+	}
+	free(desc);
+	free(buf);
+	return error;
+}
+
+/*
+ * fsck_load()
+ *	- Read the inode table and the bitmaps, and, for legacy filesystems,
+ *	  build the inode bitmap out of the superblock inode list
+ */
+static int fsck_load(struct fsck *fs)
+{
+	struct tfs_geometry	*geo = &fs->geo;
+	uint32_t		nblocks = geo->data_start - geo->itable_start;
+	uint32_t		i;
+	int			error;
+
+	fs->meta = malloc((size_t)nblocks * geo->bsize);
+	fs->itable_dirty = calloc(BITS_TO_LONGS(geo->itable_blocks),
+				  sizeof(unsigned long));
+	fs->used = calloc(BITS_TO_LONGS(geo->nblocks), sizeof(unsigned long));
+	fs->inodes = calloc(geo->ninodes, sizeof(struct fsck_inode));
+	fs->dirs = malloc(geo->ninodes * sizeof(uint32_t));
+	if (!fs->meta || !fs->itable_dirty || !fs->used || !fs->inodes ||
+	    !fs->dirs)
+		return -ENOMEM;
+
+	error = fsck_read(fs, fs->meta, geo->itable_start, nblocks);
+	if (error)
+		return error;
+
+	fs->itable = fs->meta;
+	fs->bmap = (unsigned long *)((char *)fs->meta +
+		   (size_t)(geo->bmap_start - geo->itable_start) * geo->bsize);
+
+	if (!geo->legacy) {
+		fs->imap = (unsigned long *)((char *)fs->meta +
+			   (size_t)(geo->imap_start - geo->itable_start) *
+			   geo->bsize);
+		return 0;
+	}
+
+	fs->imap = calloc(BITS_TO_LONGS(TFS_INODE_COUNT), sizeof(unsigned long));
+	if (!fs->imap)
+		return -ENOMEM;
+	for (i = 0; i < TFS_INODE_COUNT; i++)
+		if (fs->dsb->s_inodes[i] != TFS_INODE_FREE)
+			tfs_set_bit(fs->imap, i);
+	return 0;
+}
+
+/* Free @inum, in memory only */
+static void fsck_free_inode(struct fsck *fs, uint32_t inum)
+{
+	memset(&fs->itable[inum], 0, sizeof(struct tfs_dinode));
+	tfs_set_bit(fs->itable_dirty,
+		    inum / TFS_INODES_PER_BLOCK(fs->geo.bsize));
+	tfs_clear_bit(fs->imap, inum);
+	fs->imap_dirty = true;
+	fs->inodes[inum].state = FSCK_FREE;
+}
+
+static void fsck_inode_dirty(struct fsck *fs, uint32_t inum)
+{
+	tfs_set_bit(fs->itable_dirty,
+		    inum / TFS_INODES_PER_BLOCK(fs->geo.bsize));
+}
+
+/*
+ * fsck_load_map()
+ *	- Gather the block map of @inum, as a sorted extent list, and check
+ *	  it is one toyfs_ext_load() would take
+ *	- Returns the reason it isn't, or NULL
+ */
+static const char *fsck_load_map(struct fsck *fs, uint32_t inum)
+{
+	struct tfs_geometry	*geo = &fs->geo;
+	struct tfs_dinode	*dip = &fs->itable[inum];
+	struct fsck_inode	*fi = &fs->inodes[inum];
+	struct tfs_extent_block	*eb;
+	struct tfs_extent	*ext;
+	uint32_t		i, n = 0;
+
+	fi->ext = calloc(TFS_MAX_EXTENTS(geo->bsize), sizeof(struct tfs_extent));
+	if (!fi->ext)
+		return "out of memory";
+	ext = fi->ext;
+
+	if (geo->legacy) {
+		for (i = 0; i < TFS_MAX_INO_BLKS; i++) {
+			if (dip->i_addr[i] == TFS_INVALID)
+				continue;
+			if (dip->i_addr[i] < geo->data_start ||
+			    dip->i_addr[i] >= geo->nblocks)
+				return "invalid block address";
+
+			if (n && toyfs_ext_end(&ext[n - 1]) == i &&
+			    ext[n - 1].e_pblk + ext[n - 1].e_len == dip->i_addr[i]) {
+				ext[n - 1].e_len++;
+				continue;
+			}
+			ext[n].e_lblk = i;
+			ext[n].e_pblk = dip->i_addr[i];
+			ext[n].e_len = 1;
+			n++;
+		}
+		fi->nextents = n;
+		return NULL;
+	}
+
+	for (i = 0; i < TFS_INODE_EXTENTS; i++) {
+		if (!toyfs_ext_len(&dip->i_extents[i]))
+			break;
+		ext[n++] = dip->i_extents[i];
+	}
+
+	if (dip->i_ext_block != TFS_INVALID) {
+		if (dip->i_ext_block < geo->data_start ||
+		    dip->i_ext_block >= geo->nblocks)
+			return "invalid extent block address";
+
+		eb = malloc(geo->bsize);
+		if (!eb)
+			return "out of memory";
+		if (fsck_read(fs, eb, dip->i_ext_block, 1) ||
+		    eb->eb_count > TFS_EXTENTS_PER_BLOCK(geo->bsize)) {
+			free(eb);
+			return "unreadable extent block";
+		}
+		memcpy(&ext[n], eb->eb_extents,
+		       eb->eb_count * sizeof(struct tfs_extent));
+		n += eb->eb_count;
+		free(eb);
+	}
+	fi->nextents = n;
+
+	for (i = 0; i < n; i++) {
+		if (!toyfs_ext_len(&ext[i]) ||
+		    ext[i].e_pblk < geo->data_start ||
+		    (uint64_t)ext[i].e_pblk + toyfs_ext_len(&ext[i]) >
+		    geo->nblocks ||
+		    (i && ext[i].e_lblk < toyfs_ext_end(&ext[i - 1])))
+			return "invalid extent";
+	}
+	return NULL;
+}
+
+/*
+ * fsck_check_inode()
+ *	- Returns why @inum can't be used at all, or NULL. Smaller problems
+ *	  are fixed right away.
+ */
+static const char *fsck_check_inode(struct fsck *fs, uint32_t inum)
+{
+	struct tfs_dinode	*dip = &fs->itable[inum];
+	struct fsck_inode	*fi = &fs->inodes[inum];
+	uint32_t		mode = dip->i_mode & TFS_IMODE_MASK;
+	bool			inline_data = dip->i_mode & TFS_IMODE_INLINE;
+	uint32_t		mapped = 0;
+	uint32_t		i;
+	const char		*msg;
+
+	if (!S_ISREG(mode) && !S_ISDIR(mode) && !S_ISLNK(mode))
+		return "invalid file type";
+	if (dip->i_mode & ~(TFS_IMODE_MASK | TFS_IMODE_INLINE))
+		return "unknown flags";
+	if (S_ISLNK(mode) && dip->i_size >= TFS_MAX_NLEN)
+		return "symlink target too long";
+
+	if (inline_data) {
+		if (fs->geo.legacy || S_ISDIR(mode))
+			return "unexpected inline data";
+		if (dip->i_size > TFS_INLINE_SIZE)
+			return "inline data too large";
+		if (dip->i_blocks &&
+		    fsck_problem(fs, true, "inode %u: inline, but has %u blocks",
+				 inum, dip->i_blocks)) {
+			dip->i_blocks = 0;
+			fsck_inode_dirty(fs, inum);
+		}
+		return NULL;
+	}
+
+	msg = fsck_load_map(fs, inum);
+	if (msg)
+		return msg;
+
+	for (i = 0; i < fi->nextents; i++)
+		mapped += toyfs_ext_len(&fi->ext[i]);
+
+	if (S_ISDIR(mode)) {
+		/* Directory blocks are mapped one after the other from 0 */
+		for (i = 0; i < fi->nextents; i++) {
+			if (toyfs_ext_unwritten(&fi->ext[i]) ||
+			    fi->ext[i].e_lblk != (i ? toyfs_ext_end(&fi->ext[i - 1]) : 0))
+				return "directory block map has holes";
+		}
+		if (mapped != dip->i_blocks)
+			return "directory block count doesn't match its map";
+		if (mapped < (fs->geo.legacy ? 1 : 2))
+			return "directory too small";
+		return NULL;
+	}
+
+	if (S_ISLNK(mode) && (mapped != 1 || fi->ext[0].e_lblk))
+		return "symlink not mapped";
+
+	if (mapped != dip->i_blocks &&
+	    fsck_problem(fs, true, "inode %u: %u blocks mapped, %u accounted",
+			 inum, mapped, dip->i_blocks)) {
+		dip->i_blocks = mapped;
+		fsck_inode_dirty(fs, inum);
+	}
+	return NULL;
+}
+
+/*
+ * fsck_inodes()
+ *	- Pass 1: check every inode in use, and list the directories
+ */
+static int fsck_inodes(struct fsck *fs)
+{
+	struct fsck_inode	*fi;
+	const char		*msg;
+	uint32_t		inum;
+
+	for (inum = 0; inum < fs->geo.ninodes; inum++) {
+		fi = &fs->inodes[inum];
+		fi->parent = TFS_INVALID;
+		fi->dotdot = TFS_INVALID;
+
+		if (!tfs_test_bit(fs->imap, inum))
+			continue;
+
+		msg = fsck_check_inode(fs, inum);
+		if (msg) {
+			if (!inum) {
+				printf("root inode: %s, giving up\n", msg);
+				return -EFSCORRUPTED;
+			}
+			fi->state = FSCK_BAD;
+			if (fsck_problem(fs, true, "inode %u: %s, clearing",
+					 inum, msg)) {
+				fsck_free_inode(fs, inum);
+				fi->state = FSCK_BAD;
+			}
+			continue;
+		}
+
+		fi->state = FSCK_INUSE;
+		if (S_ISDIR(fs->itable[inum].i_mode))
+			fs->dirs[fs->ndirs++] = inum;
+	}
+
+	if (fs->inodes[0].state != FSCK_INUSE ||
+	    !S_ISDIR(fs->itable[0].i_mode)) {
+		printf("root inode is not a directory, giving up\n");
+		return -EFSCORRUPTED;
+	}
+	return 0;
+}
+
+static int fsck_cmp_hash(const void *a, const void *b)
+{
+	const struct fsck_dentry *da = a, *db = b;
+
+	if (da->hash != db->hash)
+		return da->hash < db->hash ? -1 : 1;
+	return strcmp(da->name, db->name);
+}
+
+static int fsck_cmp_slot(const void *a, const void *b)
+{
+	const struct fsck_dentry *da = a, *db = b;
+
+	if (da->slot != db->slot)
+		return da->slot < db->slot ? -1 : 1;
+	return da->hash < db->hash ? -1 : da->hash > db->hash;
+}
+
+/* Everything a thread needs to check a single directory */
+struct fsck_dir {
+	struct fsck		*fs;
+	uint32_t		ino;
+	uint32_t		nblocks;
+	uint32_t		per_block;	/* Entries per block */
+	uint32_t		first;		/* First dentry block */
+	char			*buf;
+	unsigned long		*dirty;		/* Blocks to write back */
+	unsigned long		*bad;		/* Slots of entries found broken */
+	struct fsck_dentry	*de;
+	uint32_t		nde;
+	bool			dx_ok;		/* The index can be trusted */
+	struct fsck_dentry	*dx;		/* Index entries, by slot */
+	uint32_t		ndx;
+};
+
+static inline struct tfs_dentry *fsck_dir_slot(struct fsck_dir *d,
+					       uint32_t slot)
+{
+	return (struct tfs_dentry *)(d->buf + (size_t)slot * sizeof(struct tfs_dentry));
+}
+
+static inline struct tfs_dx_block *fsck_dx_block(struct fsck_dir *d,
+						 uint32_t lblk)
+{
+	struct tfs_dx_block *dxb;
+
+	dxb = (struct tfs_dx_block *)(d->buf + (size_t)lblk * d->fs->geo.bsize);
+	return dxb->dx_magic == TFS_DX_MAGIC ? dxb : NULL;
+}
+
+/*
+ * fsck_dx_walk()
+ *	- Check the index is well formed and, if @gather is set, gather its
+ *	  entries in d->dx
+ *	- Returns false if it isn't, in which case we can't fix it.
+ */
+static bool fsck_dx_walk(struct fsck_dir *d, bool gather)
+{
+	struct tfs_dx_block	*root = fsck_dx_block(d, 0);
+	struct tfs_dx_block	*leaf;
+	uint32_t		max = TFS_DX_ENTRIES(d->fs->geo.bsize);
+	uint32_t		nleaves, lo, hi;
+	uint32_t		i, j, lblk, slot;
+
+	if (!root || root->dx_levels > 1 || root->dx_count > max ||
+	    (root->dx_levels && !root->dx_count))
+		return false;
+
+	nleaves = root->dx_levels ? root->dx_count : 1;
+	for (i = 0; i < nleaves; i++) {
+		if (root->dx_levels) {
+			lblk = root->dx_entries[i].dx_ptr;
+			lo = root->dx_entries[i].dx_hash;
+			if ((!i && lo) ||
+			    (i && lo <= root->dx_entries[i - 1].dx_hash))
+				return false;
+			if (!lblk || lblk >= d->nblocks)
+				return false;
+			leaf = fsck_dx_block(d, lblk);
+			if (!leaf)
+				return false;
+		} else {
+			lo = 0;
+			leaf = root;
+		}
+		hi = i + 1 < nleaves ? root->dx_entries[i + 1].dx_hash : 0;
+
+		if (leaf->dx_count > max)
+			return false;
+
+		for (j = 0; j < leaf->dx_count; j++) {
+			if (leaf->dx_entries[j].dx_hash < lo ||
+			    (hi && leaf->dx_entries[j].dx_hash >= hi) ||
+			    (j && leaf->dx_entries[j].dx_hash <
+				  leaf->dx_entries[j - 1].dx_hash))
+				return false;
+
+			slot = leaf->dx_entries[j].dx_ptr;
+			if (slot / d->per_block >= d->nblocks ||
+			    fsck_dx_block(d, slot / d->per_block))
+				return false;
+
+			if (!gather)
+				continue;
+			d->dx[d->ndx].hash = leaf->dx_entries[j].dx_hash;
+			d->dx[d->ndx].slot = slot;
+			d->ndx++;
+		}
+	}
+	return true;
+}
+
+/* Returns the leaf of the index of @d covering @hash */
+static struct tfs_dx_block *fsck_dx_leaf(struct fsck_dir *d, uint32_t hash,
+					 uint32_t *lblkp)
+{
+	struct tfs_dx_block	*root = fsck_dx_block(d, 0);
+	uint32_t		i;
+
+	*lblkp = 0;
+	if (!root->dx_levels)
+		return root;
+
+	for (i = 1; i < root->dx_count; i++)
+		if (root->dx_entries[i].dx_hash > hash)
+			break;
+	*lblkp = root->dx_entries[i - 1].dx_ptr;
+	return fsck_dx_block(d, *lblkp);
+}
+
+/* Remove entry @i of the index leaf at @lblk */
+static void fsck_dx_remove(struct fsck_dir *d, uint32_t lblk, uint32_t i)
+{
+	struct tfs_dx_block *leaf = fsck_dx_block(d, lblk);
+
+	leaf->dx_count--;
+	memmove(&leaf->dx_entries[i], &leaf->dx_entries[i + 1],
+		(leaf->dx_count - i) * sizeof(struct tfs_dx_entry));
+	tfs_set_bit(d->dirty, lblk);
+}
+
+/*
+ * fsck_dx_forget()
+ *	- Remove whatever index entry points to @slot. The name it holds may
+ *	  be garbage, so we can't rely on its hash to find it.
+ */
+static void fsck_dx_forget(struct fsck_dir *d, uint32_t slot)
+{
+	struct tfs_dx_block	*root = fsck_dx_block(d, 0);
+	struct tfs_dx_block	*leaf;
+	uint32_t		nleaves = root->dx_levels ? root->dx_count : 1;
+	uint32_t		lblk;
+	uint32_t		i, j;
+
+	for (i = 0; i < nleaves; i++) {
+		lblk = root->dx_levels ? root->dx_entries[i].dx_ptr : 0;
+		leaf = fsck_dx_block(d, lblk);
+
+		for (j = 0; j < leaf->dx_count; j++) {
+			if (leaf->dx_entries[j].dx_ptr == slot) {
+				fsck_dx_remove(d, lblk, j);
+				return;
+			}
+		}
+	}
+}
+
+/* Add the index entry of @de, returns false if its leaf is full */
+static bool fsck_dx_add(struct fsck_dir *d, struct fsck_dentry *de)
+{
+	struct tfs_dx_block	*leaf;
+	uint32_t		lblk;
+	uint32_t		i;
+
+	leaf = fsck_dx_leaf(d, de->hash, &lblk);
+	if (leaf->dx_count >= TFS_DX_ENTRIES(d->fs->geo.bsize))
+		return false;
+
+	for (i = 0; i < leaf->dx_count; i++)
+		if (leaf->dx_entries[i].dx_hash > de->hash)
+			break;
+
+	memmove(&leaf->dx_entries[i + 1], &leaf->dx_entries[i],
+		(leaf->dx_count - i) * sizeof(struct tfs_dx_entry));
+	leaf->dx_entries[i].dx_hash = de->hash;
+	leaf->dx_entries[i].dx_ptr = de->slot;
+	leaf->dx_count++;
+	tfs_set_bit(d->dirty, lblk);
+	return true;
+}
+
+/* Remove the index entry mapping @de->hash to @de->slot */
+static void fsck_dx_del(struct fsck_dir *d, struct fsck_dentry *de)
+{
+	struct tfs_dx_block	*leaf;
+	uint32_t		lblk;
+	uint32_t		i;
+
+	leaf = fsck_dx_leaf(d, de->hash, &lblk);
+	for (i = 0; i < leaf->dx_count; i++) {
+		if (leaf->dx_entries[i].dx_hash == de->hash &&
+		    leaf->dx_entries[i].dx_ptr == de->slot) {
+			fsck_dx_remove(d, lblk, i);
+			return;
+		}
+	}
+}
+
+/* Remove the entry at @slot, along with its index entry */
+static void fsck_dir_clear(struct fsck_dir *d, uint32_t slot)
+{
+	struct tfs_dentry *de = fsck_dir_slot(d, slot);
+
+	de->d_ino = TFS_INVALID;
+	de->d_name[0] = '\0';
+	de->d_type = DT_UNKNOWN;
+	tfs_set_bit(d->dirty, slot / d->per_block);
+
+	if (d->dx_ok)
+		fsck_dx_forget(d, slot);
+}
+
+/*
+ * fsck_dir_dots()
+ *	- "." and ".." hold the first two slots of the first dentry block.
+ *	  What ".." points to is checked once we know every parent.
+ */
+static void fsck_dir_dots(struct fsck_dir *d)
+{
+	struct fsck		*fs = d->fs;
+	struct tfs_dentry	*de = fsck_dir_slot(d, d->first * d->per_block);
+
+	if ((de[0].d_ino != d->ino || strcmp(de[0].d_name, ".")) &&
+	    fsck_problem(fs, true, "directory %u: bad \".\" entry", d->ino)) {
+		memset(&de[0], 0, sizeof(*de));
+		strcpy(de[0].d_name, ".");
+		de[0].d_ino = d->ino;
+		if (!fs->geo.legacy)
+			de[0].d_type = DT_DIR;
+		tfs_set_bit(d->dirty, d->first);
+	}
+
+	if (de[1].d_ino == TFS_INVALID || strcmp(de[1].d_name, "..")) {
+		if (fsck_problem(fs, true, "directory %u: bad \"..\" entry",
+				 d->ino)) {
+			memset(&de[1], 0, sizeof(*de));
+			strcpy(de[1].d_name, "..");
+			de[1].d_ino = TFS_INVALID;
+			if (!fs->geo.legacy)
+				de[1].d_type = DT_DIR;
+			tfs_set_bit(d->dirty, d->first);
+		}
+		return;
+	}
+	fs->inodes[d->ino].dotdot = de[1].d_ino;
+}
+
+/*
+ * fsck_dir_entries()
+ *	- Check every entry but "." and "..", removing the broken ones, and
+ *	  gather the others in d->de
+ */
+static int fsck_dir_entries(struct fsck_dir *d)
+{
+	struct fsck		*fs = d->fs;
+	struct tfs_dentry	*de;
+	const char		*msg;
+	uint32_t		lblk, slot;
+	uint32_t		j;
+
+	d->de = malloc((size_t)d->nblocks * d->per_block *
+		       sizeof(struct fsck_dentry));
+	if (!d->de)
+		return -ENOMEM;
+
+	for (lblk = 0; lblk < d->nblocks; lblk++) {
+		if (!fs->geo.legacy && fsck_dx_block(d, lblk))
+			continue;
+
+		for (j = 0; j < d->per_block; j++) {
+			slot = lblk * d->per_block + j;
+			de = fsck_dir_slot(d, slot);
+			if (de->d_ino == TFS_INVALID)
+				continue;
+			if (lblk == d->first && j < 2)
+				continue;
+
+			msg = NULL;
+			/* Legacy names may fill d_name, d_type is their NUL */
+			if (strnlen(de->d_name, sizeof(de->d_name)) == sizeof(de->d_name) &&
+			    (!fs->geo.legacy || de->d_type))
+				msg = "name too long";
+			else if (!de->d_name[0] || strchr(de->d_name, '/') ||
+				 !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				msg = "invalid name";
+			else if (!de->d_ino || de->d_ino >= fs->geo.ninodes ||
+				 fs->inodes[de->d_ino].state != FSCK_INUSE)
+				msg = "invalid inode";
+
+			if (msg) {
+				if (fsck_problem(fs, true, "directory %u: slot %u, inode %u: %s, removing",
+						 d->ino, slot, de->d_ino, msg))
+					fsck_dir_clear(d, slot);
+				tfs_set_bit(d->bad, slot);
+				continue;
+			}
+
+			if (de->d_type != DT_UNKNOWN &&
+			    de->d_type != fsck_dtype(fs->itable[de->d_ino].i_mode) &&
+			    fsck_problem(fs, true, "directory %u: \"%s\": wrong file type",
+					 d->ino, de->d_name)) {
+				de->d_type = fsck_dtype(fs->itable[de->d_ino].i_mode);
+				tfs_set_bit(d->dirty, lblk);
+			}
+
+			d->de[d->nde].hash = tfs_name_hash(de->d_name);
+			d->de[d->nde].slot = slot;
+			d->de[d->nde].ino = de->d_ino;
+			d->de[d->nde].name = de->d_name;
+			d->nde++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * fsck_dir_dups()
+ *	- Remove all but the first of entries sharing a name
+ */
+static void fsck_dir_dups(struct fsck_dir *d)
+{
+	uint32_t	i, n = 0;
+
+	qsort(d->de, d->nde, sizeof(*d->de), fsck_cmp_hash);
+
+	for (i = 0; i < d->nde; i++) {
+		if (n && d->de[i].hash == d->de[n - 1].hash &&
+		    !strcmp(d->de[i].name, d->de[n - 1].name) &&
+		    fsck_problem(d->fs, true, "directory %u: duplicate entry \"%s\", removing",
+				 d->ino, d->de[i].name)) {
+			fsck_dir_clear(d, d->de[i].slot);
+			continue;
+		}
+		d->de[n++] = d->de[i];
+	}
+	d->nde = n;
+}
+
+/*
+ * fsck_dir_refs()
+ *	- Account for the references the entries of @d hold. Each directory
+ *	  must be pointed to by a single entry, extra ones are removed.
+ */
+static int fsck_dir_refs(struct fsck_dir *d)
+{
+	struct fsck		*fs = d->fs;
+	struct fsck_inode	*fi = &fs->inodes[d->ino];
+	struct fsck_inode	*child;
+	struct fsck_dentry	*de;
+	uint32_t		expected;
+	uint32_t		i, n = 0;
+
+	fi->children = malloc((d->nde ? d->nde : 1) * sizeof(uint32_t));
+	if (!fi->children)
+		return -ENOMEM;
+
+	for (i = 0; i < d->nde; i++) {
+		de = &d->de[i];
+		child = &fs->inodes[de->ino];
+
+		expected = TFS_INVALID;
+		if (S_ISDIR(fs->itable[de->ino].i_mode) &&
+		    !__atomic_compare_exchange_n(&child->parent, &expected,
+						 d->ino, false, __ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED) &&
+		    fsck_problem(fs, true, "directory %u: \"%s\": directory %u is already linked from %u, removing",
+				 d->ino, de->name, de->ino, expected)) {
+			fsck_dir_clear(d, de->slot);
+			continue;
+		}
+
+		__atomic_fetch_add(&child->refs, 1, __ATOMIC_RELAXED);
+		fi->children[fi->nchildren++] = de->ino;
+		d->de[n++] = *de;
+	}
+	d->nde = n;
+	return 0;
+}
+
+/*
+ * fsck_dir_index()
+ *	- Check the index maps every entry left, and nothing else
+ *	- With both lists sorted by slot, stale index entries are removed,
+ *	  and missing ones added if their leaf has room.
+ *	- Check the root's dx_free hint doesn't skip free slots, which
+ *	  would leave them unused for good.
+ */
+static int fsck_dir_index(struct fsck_dir *d)
+{
+	struct fsck		*fs = d->fs;
+	struct tfs_dx_block	*root = fsck_dx_block(d, 0);
+	struct tfs_dentry	*de;
+	uint32_t		i = 0, j = 0;
+	uint32_t		lblk, slot;
+	int			cmp;
+
+	d->dx = malloc((size_t)d->nblocks * TFS_DX_ENTRIES(fs->geo.bsize) *
+		       sizeof(struct fsck_dentry));
+	if (!d->dx)
+		return -ENOMEM;
+	fsck_dx_walk(d, true);
+
+	qsort(d->de, d->nde, sizeof(*d->de), fsck_cmp_slot);
+	qsort(d->dx, d->ndx, sizeof(*d->dx), fsck_cmp_slot);
+
+	while (i < d->nde || j < d->ndx) {
+		if (i == d->nde)
+			cmp = 1;
+		else if (j == d->ndx)
+			cmp = -1;
+		else
+			cmp = fsck_cmp_slot(&d->de[i], &d->dx[j]);
+
+		if (!cmp) {
+			i++;
+			j++;
+		} else if (cmp < 0) {
+			if (fsck_problem(fs, true, "directory %u: \"%s\" is not indexed",
+					 d->ino, d->de[i].name) &&
+			    !fsck_dx_add(d, &d->de[i]))
+				fsck_problem(fs, false, "directory %u: no room to index \"%s\"",
+					     d->ino, d->de[i].name);
+			i++;
+		} else {
+			/* Broken entries were reported already */
+			if (!tfs_test_bit(d->bad, d->dx[j].slot) &&
+			    fsck_problem(fs, true, "directory %u: stale index entry for slot %u",
+					 d->ino, d->dx[j].slot))
+				fsck_dx_del(d, &d->dx[j]);
+			j++;
+		}
+	}
+
+	for (lblk = d->first; lblk < d->nblocks && lblk < root->dx_free; lblk++) {
+		if (fsck_dx_block(d, lblk))
+			continue;
+		for (slot = 0; slot < d->per_block; slot++) {
+			de = fsck_dir_slot(d, lblk * d->per_block + slot);
+			if (de->d_ino != TFS_INVALID)
+				continue;
+			if (fsck_problem(fs, true, "directory %u: free slots before block %u",
+					 d->ino, root->dx_free)) {
+				root->dx_free = lblk;
+				tfs_set_bit(d->dirty, 0);
+			}
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * fsck_dir_io()
+ *	- Read, or write back the modified blocks of, the directory in @d,
+ *	  an extent at a time
+ */
+static int fsck_dir_io(struct fsck_dir *d, bool write)
+{
+	struct fsck		*fs = d->fs;
+	struct fsck_inode	*fi = &fs->inodes[d->ino];
+	struct tfs_extent	*ext;
+	uint32_t		i, j;
+	int			error = 0;
+
+	for (i = 0; i < fi->nextents && !error; i++) {
+		ext = &fi->ext[i];
+		if (!write) {
+			error = fsck_read(fs, d->buf + (size_t)ext->e_lblk * fs->geo.bsize,
+					  ext->e_pblk, ext->e_len);
+			continue;
+		}
+
+		for (j = 0; j < ext->e_len && !error; j++) {
+			if (!tfs_test_bit(d->dirty, ext->e_lblk + j))
+				continue;
+			error = tfs_write_blocks(&fs->dev,
+					d->buf + (size_t)(ext->e_lblk + j) * fs->geo.bsize,
+					ext->e_pblk + j, 1);
+		}
+	}
+	return error;
+}
+
+/*
+ * fsck_check_dir()
+ *	- Check a single directory
+ *	- Entries are still accounted for if the index or "." and ".." are
+ *	  beyond repair, so what they point to isn't taken for unreferenced.
+ */
+static int fsck_check_dir(struct fsck *fs, uint32_t ino)
+{
+	struct fsck_dir	d = {
+		.fs	= fs,
+		.ino	= ino,
+		.nblocks = fs->itable[ino].i_blocks,
+		.per_block = TFS_ENTRIES_PER_BLOCK(fs->geo.bsize),
+		.first	= fs->geo.legacy ? 0 : 1,
+	};
+	bool		dots_ok = true;
+	int		error = -ENOMEM;
+
+	d.buf = malloc((size_t)d.nblocks * fs->geo.bsize);
+	d.dirty = calloc(BITS_TO_LONGS(d.nblocks), sizeof(unsigned long));
+	d.bad = calloc(BITS_TO_LONGS(d.nblocks * d.per_block),
+		       sizeof(unsigned long));
+	if (!d.buf || !d.dirty || !d.bad)
+		goto out_free;
+
+	error = fsck_dir_io(&d, false);
+	if (error)
+		goto out_free;
+
+	if (!fs->geo.legacy) {
+		dots_ok = !fsck_dx_block(&d, d.first);
+		d.dx_ok = dots_ok && fsck_dx_walk(&d, false);
+		if (!d.dx_ok)
+			fsck_problem(fs, false, "directory %u: index is corrupted",
+				     ino);
+	}
+
+	if (dots_ok)
+		fsck_dir_dots(&d);
+
+	error = fsck_dir_entries(&d);
+	if (error)
+		goto out_free;
+
+	fsck_dir_dups(&d);
+	error = fsck_dir_refs(&d);
+	if (!error && d.dx_ok)
+		error = fsck_dir_index(&d);
+	if (!error && fs->fix)
+		error = fsck_dir_io(&d, true);
+
+	fsck_info(fs, "directory %u: %u blocks, %u entries\n", ino, d.nblocks,
+		  d.nde);
+out_free:
+	free(d.dx);
+	free(d.de);
+	free(d.bad);
+	free(d.dirty);
+	free(d.buf);
+	return error;
+}
+
+static void *fsck_dir_worker(void *arg)
+{
+	struct fsck	*fs = arg;
+	uint32_t	i;
+	int		error;
+
+	while ((i = __atomic_fetch_add(&fs->next_dir, 1, __ATOMIC_RELAXED)) <
+	       fs->ndirs) {
+		error = fsck_check_dir(fs, fs->dirs[i]);
+		if (error)
+			return (void *)(intptr_t)error;
+	}
+	return NULL;
+}
+
+/*
+ * fsck_dirs()
+ *	- Pass 2: check all directories, in parallel. Directories only share
+ *	  the reference counts and parents of the inodes they point to,
+ *	  which are updated atomically.
+ */
+static int fsck_dirs(struct fsck *fs)
+{
+	pthread_t	threads[FSCK_MAX_THREADS];
+	unsigned int	nthreads = fs->nthreads;
+	unsigned int	i;
+	void		*ret;
+	int		error = 0;
+
+	if (nthreads > fs->ndirs)
+		nthreads = fs->ndirs;
+
+	for (i = 0; i < nthreads; i++) {
+		error = -pthread_create(&threads[i], NULL, fsck_dir_worker, fs);
+		if (error)
+			break;
+	}
+	/* Checking goes on as long as a single thread runs */
+	if (!i)
+		return error;
+	nthreads = i;
+
+	error = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], &ret);
+		if (ret)
+			error = (int)(intptr_t)ret;
+	}
+	return error;
+}
+
+/*
+ * fsck_release_orphan()
+ *	- Free an inode no entry points to anymore. Whatever a directory
+ *	  pointed to loses a reference, and is freed in turn if it was the
+ *	  last one.
+ */
+static void fsck_release_orphan(struct fsck *fs, uint32_t inum)
+{
+	struct fsck_inode	*fi = &fs->inodes[inum];
+	struct fsck_inode	*child;
+	uint32_t		i;
+
+	fsck_free_inode(fs, inum);
+
+	for (i = 0; i < fi->nchildren; i++) {
+		child = &fs->inodes[fi->children[i]];
+		if (child->state != FSCK_INUSE)
+			continue;
+		if (child->parent == inum)
+			child->parent = TFS_INVALID;
+		if (!--child->refs)
+			fsck_release_orphan(fs, fi->children[i]);
+	}
+	fi->nchildren = 0;
+}
+
+/*
+ * fsck_dotdot()
+ *	- Point the ".." entry of directory @inum back to its parent
+ */
+static int fsck_dotdot(struct fsck *fs, uint32_t inum, uint32_t parent)
+{
+	struct fsck_inode	*fi = &fs->inodes[inum];
+	struct tfs_extent	*ext = fi->ext;
+	struct tfs_dentry	*de;
+	uint32_t		first = fs->geo.legacy ? 0 : 1;
+	uint32_t		pblk;
+	void			*buf;
+	int			error;
+
+	/* Directory maps have no holes, see fsck_check_inode() */
+	while (toyfs_ext_end(ext) <= first)
+		ext++;
+	pblk = ext->e_pblk + first - ext->e_lblk;
+
+	buf = malloc(fs->geo.bsize);
+	if (!buf)
+		return -ENOMEM;
+
+	error = fsck_read(fs, buf, pblk, 1);
+	if (!error) {
+		de = buf;
+		de[1].d_ino = parent;
+		error = tfs_write_blocks(&fs->dev, buf, pblk, 1);
+	}
+	free(buf);
+	return error;
+}
+
+/*
+ * fsck_links()
+ *	- Pass 3: free unreferenced inodes, check link counts against the
+ *	  references found, and ".." against the parents.
+ *	- Directories hold a link for each entry, besides their own two.
+ */
+static int fsck_links(struct fsck *fs)
+{
+	struct tfs_dinode	*dip;
+	struct fsck_inode	*fi;
+	uint32_t		inum;
+	uint32_t		nlink;
+	uint32_t		parent;
+	int			error;
+
+	for (inum = 1; inum < fs->geo.ninodes; inum++) {
+		fi = &fs->inodes[inum];
+		if (fi->state == FSCK_INUSE && !fi->refs &&
+		    fsck_problem(fs, true, "inode %u is not linked to any directory, freeing",
+				 inum))
+			fsck_release_orphan(fs, inum);
+	}
+
+	for (inum = 0; inum < fs->geo.ninodes; inum++) {
+		fi = &fs->inodes[inum];
+		dip = &fs->itable[inum];
+		if (fi->state != FSCK_INUSE)
+			continue;
+
+		if (S_ISDIR(dip->i_mode)) {
+			nlink = 2 + fi->nchildren;
+			parent = inum ? fi->parent : 0;
+
+			if (parent != TFS_INVALID && fi->dotdot != parent &&
+			    fsck_problem(fs, true, "directory %u: \"..\" is %u, not %u",
+					 inum, fi->dotdot, parent)) {
+				error = fsck_dotdot(fs, inum, parent);
+				if (error)
+					return error;
+			}
+		} else if (fi->refs) {
+			nlink = fi->refs;
+		} else {
+			/* Unreferenced, and left alone */
+			continue;
+		}
+
+		if (dip->i_nlink != nlink &&
+		    fsck_problem(fs, true, "inode %u: link count is %u, should be %u",
+				 inum, dip->i_nlink, nlink)) {
+			dip->i_nlink = nlink;
+			fsck_inode_dirty(fs, inum);
+		}
+	}
+	return 0;
+}
+
+/* Mark @len blocks at @blk in use by @inum, which must not share them */
+static void fsck_use_blocks(struct fsck *fs, uint32_t inum, uint32_t blk,
+			    uint32_t len)
+{
+	uint32_t i;
+
+	for (i = blk; i < blk + len; i++) {
+		if (tfs_test_and_set_bit(fs->used, i))
+			fsck_problem(fs, false, "inode %u: block %u is already in use",
+				     inum, i);
+	}
+}
+
+/*
+ * fsck_bitmaps()
+ *	- Pass 4: rebuild the block bitmap out of the metadata layout and of
+ *	  every block map, and check the on-disk bitmaps and free counts
+ *	  against what we found
+ */
+static void fsck_bitmaps(struct fsck *fs)
+{
+	struct tfs_geometry	*geo = &fs->geo;
+	struct tfs_dinode	*dip;
+	struct fsck_inode	*fi;
+	uint32_t		inum, i;
+	uint32_t		ifree = 0, bfree = 0;
+	uint32_t		missing = 0, extra = 0;
+	bool			used;
+
+	for (i = 0; i < geo->data_start; i++)
+		tfs_set_bit(fs->used, i);
+	if (geo->journal_blocks)
+		fsck_use_blocks(fs, TFS_INVALID, geo->journal_start,
+				geo->journal_blocks);
+
+	for (inum = 0; inum < geo->ninodes; inum++) {
+		fi = &fs->inodes[inum];
+		dip = &fs->itable[inum];
+
+		if (fi->state == FSCK_FREE && tfs_test_bit(fs->imap, inum) &&
+		    fsck_problem(fs, true, "inode %u is free, but marked in use",
+				 inum)) {
+			tfs_clear_bit(fs->imap, inum);
+			fs->imap_dirty = true;
+		}
+		if (fi->state != FSCK_INUSE) {
+			ifree++;
+			continue;
+		}
+
+		for (i = 0; i < fi->nextents; i++)
+			fsck_use_blocks(fs, inum, fi->ext[i].e_pblk,
+					toyfs_ext_len(&fi->ext[i]));
+		if (!geo->legacy && !(dip->i_mode & TFS_IMODE_INLINE) &&
+		    dip->i_ext_block != TFS_INVALID)
+			fsck_use_blocks(fs, inum, dip->i_ext_block, 1);
+	}
+
+	for (i = 0; i < geo->nblocks; i++) {
+		used = tfs_test_bit(fs->used, i);
+		if (!used)
+			bfree++;
+		if (used == tfs_test_bit(fs->bmap, i))
+			continue;
+		if (used)
+			missing++;
+		else
+			extra++;
+	}
+
+	if ((missing || extra) &&
+	    fsck_problem(fs, true, "block bitmap: %u blocks in use marked free, %u free marked in use",
+			 missing, extra)) {
+		for (i = 0; i < geo->nblocks; i++) {
+			if (tfs_test_bit(fs->used, i))
+				tfs_set_bit(fs->bmap, i);
+			else
+				tfs_clear_bit(fs->bmap, i);
+		}
+		fs->bmap_dirty = true;
+	}
+
+	if (fs->dsb->s_ifree != ifree &&
+	    fsck_problem(fs, true, "free inode count is %u, should be %u",
+			 fs->dsb->s_ifree, ifree)) {
+		fs->dsb->s_ifree = ifree;
+		fs->sb_dirty = true;
+	}
+	if (fs->dsb->s_bfree != bfree &&
+	    fsck_problem(fs, true, "free block count is %u, should be %u",
+			 fs->dsb->s_bfree, bfree)) {
+		fs->dsb->s_bfree = bfree;
+		fs->sb_dirty = true;
+	}
+
+	printf("%s: %u/%u inodes, %u/%u blocks\n", fs->dev.path,
+	       geo->ninodes - ifree, geo->ninodes, geo->nblocks - bfree,
+	       geo->nblocks);
+}
+
+/* Write runs of the modified inode table blocks */
+static int fsck_write_itable(struct fsck *fs)
+{
+	uint32_t	i, j;
+	int		error = 0;
+
+	for (i = 0; i < fs->geo.itable_blocks && !error; i = j) {
+		if (!tfs_test_bit(fs->itable_dirty, i)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < fs->geo.itable_blocks; j++)
+			if (!tfs_test_bit(fs->itable_dirty, j))
+				break;
+
+		error = tfs_write_blocks(&fs->dev,
+				(char *)fs->itable + (size_t)i * fs->geo.bsize,
+				fs->geo.itable_start + i, j - i);
+	}
+	return error;
+}
+
+/*
+ * fsck_write()
+ *	- Write back everything we fixed, the superblock last, clean if
+ *	  nothing is left to fix
+ */
+static int fsck_write(struct fsck *fs)
+{
+	struct tfs_geometry	*geo = &fs->geo;
+	uint32_t		i;
+	int			error;
+
+	error = fsck_write_itable(fs);
+	if (error)
+		return error;
+
+	if (fs->imap_dirty && geo->legacy) {
+		for (i = 0; i < TFS_INODE_COUNT; i++)
+			fs->dsb->s_inodes[i] = tfs_test_bit(fs->imap, i) ?
+					       TFS_INODE_INUSE : TFS_INODE_FREE;
+		fs->sb_dirty = true;
+	} else if (fs->imap_dirty) {
+		error = tfs_write_blocks(&fs->dev, fs->imap, geo->imap_start,
+					 geo->imap_blocks);
+		if (error)
+			return error;
+	}
+
+	if (fs->bmap_dirty) {
+		error = tfs_write_blocks(&fs->dev, fs->bmap, geo->bmap_start,
+					 geo->bmap_blocks);
+		if (error)
+			return error;
+	}
+
+	if (fs->dsb->s_flags != TFS_SB_CLEAN && !fs->unfixed) {
+		fs->dsb->s_flags = TFS_SB_CLEAN;
+		fs->sb_dirty = true;
+	}
+
+	error = tfs_dev_sync(&fs->dev);
+	if (error || !fs->sb_dirty)
+		return error;
+
+	error = tfs_write_blocks(&fs->dev, fs->dsb, TFS_SB_BLOCK, 1);
+	if (!error)
+		error = tfs_dev_sync(&fs->dev);
+	return error;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-n|-y|-p] [-f] [-v] [-j threads] device\n\n"
+		"  -n  check only, change nothing (default)\n"
+		"  -y  fix everything that can be fixed\n"
+		"  -p  same as -y\n"
+		"  -f  check even if the filesystem is clean\n"
+		"  -v  verbose\n"
+		"  -j  number of threads checking directories\n", prog);
+	exit(FSCK_ERROR);
+}
+
+int main(int argc, char **argv)
+{
+	struct fsck	fs = {
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+	};
+	const char	*msg;
+	bool		force = false;
+	long		ncpus;
+	int		error;
+	int		c;
+
+	prog = argv[0];
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	fs.nthreads = ncpus > 0 ? ncpus : 1;
+
+	while ((c = getopt(argc, argv, "nypfvj:")) != -1) {
+		switch (c) {
+		case 'n':
+			fs.fix = false;
+			break;
+		case 'y':
+		case 'p':
+			fs.fix = true;
+			break;
+		case 'f':
+			force = true;
+			break;
+		case 'v':
+			fs.verbose = true;
+			break;
+		case 'j':
+			fs.nthreads = atoi(optarg);
+			if (fs.nthreads < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if (fs.nthreads > FSCK_MAX_THREADS)
+		fs.nthreads = FSCK_MAX_THREADS;
+
+	error = tfs_dev_open(&fs.dev, argv[optind], fs.fix);
+	if (error) {
+		fprintf(stderr, "%s: %s: %s\n", prog, argv[optind],
+			strerror(-error));
+		return FSCK_ERROR;
+	}
+
+	fs.dsb = malloc(TFS_MAX_BSIZE);
+	if (!fs.dsb) {
+		error = -ENOMEM;
+		goto out_error;
+	}
+	error = tfs_read_blocks(&fs.dev, fs.dsb, TFS_SB_BLOCK, 1);
+	if (error)
+		goto out_error;
+
+	msg = tfs_load_geometry(&fs.geo, fs.dsb, fs.dev.size);
+	if (msg) {
+		fprintf(stderr, "%s: %s: superblock: %s\n", prog, fs.dev.path,
+			msg);
+		return FSCK_UNFIXED;
+	}
+
+	/* Read the rest of the superblock, it is written back whole */
+	fs.dev.bsize = fs.geo.bsize;
+	error = tfs_read_blocks(&fs.dev, fs.dsb, TFS_SB_BLOCK, 1);
+	if (error)
+		goto out_error;
+
+	if (fs.dsb->s_flags == TFS_SB_CLEAN && !force) {
+		printf("%s: clean\n", fs.dev.path);
+		return FSCK_OK;
+	}
+	if (fs.dsb->s_flags != TFS_SB_CLEAN)
+		printf("%s: not cleanly unmounted, checking\n", fs.dev.path);
+
+	/* 0: journal */
+	if (fs.geo.journal_blocks && fs.dsb->s_flags == TFS_SB_DIRTY) {
+		error = fsck_replay(&fs);
+		if (error)
+			goto out_error;
+
+		/* The superblock may have been logged */
+		error = fsck_read(&fs, fs.dsb, TFS_SB_BLOCK, 1);
+		if (error)
+			goto out_error;
+		msg = tfs_load_geometry(&fs.geo, fs.dsb, fs.dev.size);
+		if (!msg && fs.geo.bsize != fs.dev.bsize)
+			msg = "block size changed";
+		if (msg) {
+			fprintf(stderr, "%s: %s: superblock: %s\n", prog,
+				fs.dev.path, msg);
+			return FSCK_UNFIXED;
+		}
+	}
+
+	error = fsck_load(&fs);
+	if (error)
+		goto out_error;
+
+	/* 1: inodes */
+	error = fsck_inodes(&fs);
+	if (error == -EFSCORRUPTED)
+		return FSCK_UNFIXED;
+	if (error)
+		goto out_error;
+
+	/* 2: directories */
+	error = fsck_dirs(&fs);
+	if (error)
+		goto out_error;
+
+	/* 3: links */
+	error = fsck_links(&fs);
+	if (error)
+		goto out_error;
+
+	/* 4: bitmaps and counts */
+	fsck_bitmaps(&fs);
+
+	if (fs.fix) {
+		error = fsck_write(&fs);
+		if (error)
+			goto out_error;
+	}
+
+	tfs_dev_close(&fs.dev);
+	if (fs.unfixed)
+		return FSCK_UNFIXED;
+	return fs.fixed ? FSCK_FIXED : FSCK_OK;
+
+out_error:
+	fprintf(stderr, "%s: %s: %s\n", prog, fs.dev.path, strerror(-error));
+	return FSCK_ERROR;
+}
@@ -0,0 +1,1169 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * mkfs.toyfs - Create a toyfs filesystem
+ *
+ * The layout is sized from the device: one inode per TFS_BYTES_PER_INODE
+ * bytes, one block bitmap bit per block, and a journal in front of the data
+ * blocks. All metadata is built in memory, and written with a few large
+ * sequential writes.
+ *
+ * With -d, the filesystem is populated from a directory tree. The tree is
+ * scanned first, so every inode and block is allocated in memory before
+ * anything gets written: inodes are numbered in the order they are found,
+ * and each of them gets a single contiguous run of blocks, right after the
+ * previous one's. Holes in files are found with SEEK_DATA and SEEK_HOLE,
+ * and left unmapped. Directory blocks and file contents then go out as one
+ * sequential stream.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "toyfs_lib.h"
+
+/* Default inode density */
+#define TFS_BYTES_PER_INODE	16384
+
+/* Default journal size: 1/32th of the device, within what can be used */
+#define TFS_JOURNAL_RATIO	32
+#define TFS_JOURNAL_MAX_BLOCKS(bsize)	(TFS_JOURNAL_TAGS(bsize) + 3)
+
+/* Largest file an inode can map, see toyfs_max_file_blocks() */
+#define TFS_MAX_FILE_BLOCKS(bsize)	(UINT32_MAX / (bsize))
+
+struct mkfs_opts {
+	uint32_t	bsize;
+	uint64_t	nblocks;
+	uint64_t	ninodes;
+	uint64_t	bytes_per_inode;
+	int64_t		journal_blocks;		/* -1: default size */
+	const char	*srcdir;
+	bool		quiet;
+};
+
+struct mkfs_inode;
+
+/* A directory entry to be, dentry slots are used in entries order */
+struct mkfs_entry {
+	char			name[TFS_NAME_LEN + 1];
+	struct mkfs_inode	*inode;
+};
+
+/*
+ * Everything needed to write an inode and its blocks. Entries are sorted
+ * by name in each directory, so the same tree always gives the same image.
+ */
+struct mkfs_inode {
+	uint32_t		ino;
+	struct stat		st;
+	uint32_t		nlink;
+	uint32_t		pblk;		/* First block of the run */
+	uint32_t		nblocks;
+	char			*path;		/* Where to read a file from */
+	__u8			data[TFS_INLINE_SIZE];	/* Inline data */
+
+	/* Files only, e_pblk counts from pblk, see mkfs_map_file() */
+	struct tfs_extent	*ext;
+	uint32_t		nextents;
+
+	/* Directories only */
+	uint32_t		parent;
+	struct mkfs_entry	*entries;
+	uint32_t		nentries;
+	struct tfs_dx_entry	*dx;		/* Entries sorted by hash */
+	uint32_t		*leaves;	/* First dx entry of each leaf */
+	uint32_t		nleaves;
+	uint32_t		dentry_blocks;
+};
+
+/* The tree to load, in inode number order */
+struct mkfs_tree {
+	struct mkfs_inode	**inodes;
+	uint32_t		bsize;		/* Block size it is laid out for */
+	uint32_t		ninodes;
+	uint32_t		size;		/* Room in inodes[] */
+	uint64_t		nblocks;	/* Data blocks needed */
+	void			*links;		/* See mkfs_link() */
+};
+
+/* Blocks written in disk order, TFS_IO_BLOCKS at a time */
+struct mkfs_stream {
+	struct tfs_dev	*dev;
+	char		*buf;
+	uint32_t	start;		/* Where buf goes on disk */
+	uint32_t	count;		/* Blocks held in buf */
+};
+
+static const char *prog;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-b block-size] [-N inodes] [-i bytes-per-inode]\n"
+		"       [-J journal-blocks] [-d srcdir] [-q] device [blocks]\n\n"
+		"  -b  block size in bytes, a power of two from %u to %u,\n"
+		"      %u by default\n"
+		"  -N  number of inodes\n"
+		"  -i  bytes per inode, %u by default\n"
+		"  -J  journal size in blocks, 0 for no journal\n"
+		"  -d  copy the contents of srcdir into the new filesystem\n"
+		"  -q  quiet\n\n"
+		"An image file is grown to [blocks] if needed.\n",
+		prog, TFS_MIN_BSIZE, TFS_MAX_BSIZE, TFS_MIN_BSIZE,
+		TFS_BYTES_PER_INODE);
+	exit(1);
+}
+
+static uint64_t parse_num(const char *arg)
+{
+	char			*end;
+	unsigned long long	val;
+
+	errno = 0;
+	val = strtoull(arg, &end, 0);
+	if (errno || *end || end == arg) {
+		fprintf(stderr, "%s: invalid number: %s\n", prog, arg);
+		usage();
+	}
+	return val;
+}
+
+static struct mkfs_inode *mkfs_new_inode(struct mkfs_tree *t,
+					 const struct stat *st)
+{
+	struct mkfs_inode	**inodes;
+	struct mkfs_inode	*ip;
+
+	if (t->ninodes == t->size) {
+		t->size = t->size ? 2 * t->size : 1024;
+		inodes = realloc(t->inodes, t->size * sizeof(*inodes));
+		if (!inodes)
+			return NULL;
+		t->inodes = inodes;
+	}
+
+	ip = calloc(1, sizeof(*ip));
+	if (!ip)
+		return NULL;
+
+	ip->ino = t->ninodes;
+	ip->st = *st;
+	ip->nlink = 1;
+	t->inodes[t->ninodes++] = ip;
+	return ip;
+}
+
+static int mkfs_cmp_link(const void *a, const void *b)
+{
+	const struct stat *sa = &((const struct mkfs_inode *)a)->st;
+	const struct stat *sb = &((const struct mkfs_inode *)b)->st;
+
+	if (sa->st_dev != sb->st_dev)
+		return sa->st_dev < sb->st_dev ? -1 : 1;
+	if (sa->st_ino != sb->st_ino)
+		return sa->st_ino < sb->st_ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * mkfs_link()
+ *	- Files with more than one link are only loaded once, the names
+ *	  found after the first one become hard links to it.
+ *	- Returns the inode the file @ip was scanned from is already loaded
+ *	  as, or NULL if @ip is the first.
+ */
+static struct mkfs_inode *mkfs_link(struct mkfs_tree *t, struct mkfs_inode *ip)
+{
+	struct mkfs_inode	**found;
+
+	if (S_ISDIR(ip->st.st_mode) || ip->st.st_nlink < 2)
+		return NULL;
+
+	found = tsearch(ip, &t->links, mkfs_cmp_link);
+	if (!found || *found == ip)
+		return NULL;
+	return *found;
+}
+
+static int mkfs_cmp_name(const void *a, const void *b)
+{
+	return strcmp(((const struct mkfs_entry *)a)->name,
+		      ((const struct mkfs_entry *)b)->name);
+}
+
+static int mkfs_cmp_hash(const void *a, const void *b)
+{
+	const struct tfs_dx_entry *da = a, *db = b;
+
+	if (da->dx_hash != db->dx_hash)
+		return da->dx_hash < db->dx_hash ? -1 : 1;
+	return da->dx_ptr < db->dx_ptr ? -1 : da->dx_ptr > db->dx_ptr;
+}
+
+/*
+ * mkfs_dir_layout()
+ *	- Lay @dir out as the kernel would have: the index root in block 0,
+ *	  the dentry blocks from block 1, "." and ".." first, then the index
+ *	  leaves, if the root can't index every entry by itself.
+ *	- Leaves are filled up, and only split where the hash changes, so
+ *	  that names with the same hash always share a leaf.
+ */
+static const char *mkfs_dir_layout(const struct mkfs_tree *t,
+				   struct mkfs_inode *dir)
+{
+	uint32_t	per_block = TFS_ENTRIES_PER_BLOCK(t->bsize);
+	uint32_t	max = TFS_DX_ENTRIES(t->bsize);
+	uint32_t	n = dir->nentries;
+	uint32_t	start, end;
+	uint32_t	i;
+
+	dir->dentry_blocks = DIV_ROUND_UP(n + 2, per_block);
+
+	dir->dx = malloc((n ? n : 1) * sizeof(*dir->dx));
+	dir->leaves = malloc((n ? n : 1) * sizeof(*dir->leaves));
+	if (!dir->dx || !dir->leaves)
+		return "out of memory";
+
+	for (i = 0; i < n; i++) {
+		dir->dx[i].dx_hash = tfs_name_hash(dir->entries[i].name);
+		dir->dx[i].dx_ptr = per_block + 2 + i;
+	}
+	qsort(dir->dx, n, sizeof(*dir->dx), mkfs_cmp_hash);
+
+	if (n > max) {
+		for (start = 0; start < n; start = end) {
+			end = start + max;
+			if (end >= n) {
+				end = n;
+			} else {
+				while (end > start &&
+				       dir->dx[end].dx_hash == dir->dx[end - 1].dx_hash)
+					end--;
+				if (end == start)
+					return "too many names with the same hash";
+			}
+			if (dir->nleaves == max)
+				return "too many entries";
+			dir->leaves[dir->nleaves++] = start;
+		}
+	}
+
+	dir->nblocks = 1 + dir->dentry_blocks + dir->nleaves;
+	dir->nlink = 2 + n;
+	return NULL;
+}
+
+/*
+ * mkfs_map_file()
+ *	- Give each run of data in @fd its own extent, the holes between them
+ *	  are left unmapped, as the kernel would have them.
+ *	- The blocks are counted in the order they will be written: the data
+ *	  runs one after the other, then the overflow extent block, if the
+ *	  inode can't hold every extent.
+ *	- A file with more runs than an inode can map is stored whole, its
+ *	  holes included, in a single extent.
+ */
+static const char *mkfs_map_file(const struct mkfs_tree *t,
+				 struct mkfs_inode *ip, int fd)
+{
+	uint32_t		max = TFS_MAX_EXTENTS(t->bsize);
+	off_t			size = ip->st.st_size;
+	off_t			data, hole = 0;
+	struct tfs_extent	*ext;
+	uint32_t		lblk, end;
+
+	ip->ext = calloc(max, sizeof(*ip->ext));
+	if (!ip->ext)
+		return "out of memory";
+
+	while (hole < size) {
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data < 0)
+			return strerror(errno);
+		if (data >= size)
+			break;
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return strerror(errno);
+		if (hole > size)
+			hole = size;
+
+		lblk = data / t->bsize;
+		end = DIV_ROUND_UP(hole, t->bsize);
+
+		/* Runs less than a block apart share that block */
+		ext = ip->nextents ? &ip->ext[ip->nextents - 1] : NULL;
+		if (ext && lblk <= toyfs_ext_end(ext)) {
+			ip->nblocks += end - toyfs_ext_end(ext);
+			ext->e_len = end - ext->e_lblk;
+			continue;
+		}
+
+		if (ip->nextents == max) {
+			ip->ext[0].e_lblk = 0;
+			ip->ext[0].e_pblk = 0;
+			ip->ext[0].e_len = DIV_ROUND_UP(size, t->bsize);
+			ip->nextents = 1;
+			ip->nblocks = ip->ext[0].e_len;
+			return NULL;
+		}
+
+		ext = &ip->ext[ip->nextents++];
+		ext->e_lblk = lblk;
+		ext->e_pblk = ip->nblocks;
+		ext->e_len = end - lblk;
+		ip->nblocks += ext->e_len;
+	}
+
+	if (ip->nextents > TFS_INODE_EXTENTS)
+		ip->nblocks++;
+	return NULL;
+}
+
+/*
+ * mkfs_scan_entry()
+ *	- Load the inode @de refers to, unless it was already.
+ *	- Symlink targets and small files are read right away, they are
+ *	  kept inline and need no block.
+ *	- Returns NULL, or why it can't be loaded.
+ */
+static const char *mkfs_scan_entry(struct mkfs_tree *t, struct mkfs_inode *dir,
+				   int dirfd, const char *path,
+				   struct mkfs_entry *de, const struct stat *st)
+{
+	struct mkfs_inode	*ip, *link;
+	const char		*msg;
+	ssize_t			len;
+	int			fd;
+
+	if (t->ninodes >= TFS_INVALID - 1)
+		return "too many files";
+
+	ip = mkfs_new_inode(t, st);
+	if (!ip)
+		return "out of memory";
+	de->inode = ip;
+
+	link = mkfs_link(t, ip);
+	if (link) {
+		/* Just loaded, nothing points to it yet */
+		t->inodes[--t->ninodes] = NULL;
+		free(ip);
+		de->inode = link;
+		link->nlink++;
+		return NULL;
+	}
+
+	if (S_ISDIR(st->st_mode)) {
+		ip->parent = dir->ino;
+		if (asprintf(&ip->path, "%s/%s", path, de->name) < 0)
+			return "out of memory";
+		return NULL;
+	}
+
+	if (S_ISLNK(st->st_mode)) {
+		/* The target always fits in i_data, see toyfs_symlink_set() */
+		len = readlinkat(dirfd, de->name, (char *)ip->data,
+				 TFS_MAX_NLEN);
+		if (len < 0)
+			return strerror(errno);
+		if (len >= TFS_MAX_NLEN)
+			return "symlink target too long";
+		ip->st.st_size = len;
+		return NULL;
+	}
+
+	if (st->st_size > (off_t)TFS_MAX_FILE_BLOCKS(t->bsize) * t->bsize)
+		return "file too large";
+
+	fd = openat(dirfd, de->name, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return strerror(errno);
+
+	if (st->st_size <= TFS_INLINE_SIZE) {
+		len = pread(fd, ip->data, st->st_size, 0);
+		close(fd);
+		return len < 0 ? strerror(errno) : NULL;
+	}
+
+	msg = mkfs_map_file(t, ip, fd);
+	close(fd);
+	if (msg)
+		return msg;
+	if (asprintf(&ip->path, "%s/%s", path, de->name) < 0)
+		return "out of memory";
+	t->nblocks += ip->nblocks;
+	return NULL;
+}
+
+/*
+ * mkfs_read_dir()
+ *	- Read the names in @dp, opened from @path, into @dir, sorted
+ */
+static int mkfs_read_dir(struct mkfs_inode *dir, DIR *dp, const char *path)
+{
+	struct mkfs_entry	*entries;
+	struct dirent		*dent;
+	uint32_t		size = 0;
+
+	while ((errno = 0, dent = readdir(dp))) {
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+		if (strlen(dent->d_name) > TFS_NAME_LEN) {
+			fprintf(stderr, "%s: %s/%s: name too long\n", prog, path,
+				dent->d_name);
+			return -ENAMETOOLONG;
+		}
+
+		if (dir->nentries == size) {
+			size = size ? 2 * size : 64;
+			entries = realloc(dir->entries, size * sizeof(*entries));
+			if (!entries)
+				return -ENOMEM;
+			dir->entries = entries;
+		}
+		strcpy(dir->entries[dir->nentries++].name, dent->d_name);
+	}
+	if (errno) {
+		fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+		return -EIO;
+	}
+
+	qsort(dir->entries, dir->nentries, sizeof(*dir->entries),
+	      mkfs_cmp_name);
+	return 0;
+}
+
+/*
+ * mkfs_scan_dir()
+ *	- Load the entries of @dir from @path, numbering the inodes they
+ *	  refer to before going down any subdirectory, so that siblings end
+ *	  up next to each other, in the inode table and on disk.
+ *	- Devices, fifos and sockets can't be stored, and are skipped.
+ */
+static int mkfs_scan_dir(struct mkfs_tree *t, struct mkfs_inode *dir,
+			 const char *path)
+{
+	struct mkfs_inode	*ip;
+	struct mkfs_entry	*de;
+	struct stat		st;
+	const char		*msg, *name = NULL;
+	uint32_t		first = t->ninodes;
+	uint32_t		last;
+	uint32_t		i, n = 0;
+	int			error;
+	DIR			*dp;
+
+	dp = opendir(path);
+	if (!dp) {
+		fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+		return -EIO;
+	}
+
+	error = mkfs_read_dir(dir, dp, path);
+	if (error) {
+		closedir(dp);
+		return error;
+	}
+
+	for (i = 0, msg = NULL; !msg && i < dir->nentries; i++) {
+		de = &dir->entries[i];
+		if (fstatat(dirfd(dp), de->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			msg = strerror(errno);
+		} else if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) &&
+			   !S_ISLNK(st.st_mode)) {
+			fprintf(stderr, "%s: %s/%s: unsupported file type, skipped\n",
+				prog, path, de->name);
+			continue;
+		} else {
+			dir->entries[n] = *de;
+			msg = mkfs_scan_entry(t, dir, dirfd(dp), path,
+					      &dir->entries[n], &st);
+			n++;
+		}
+		if (msg)
+			name = de->name;
+	}
+	closedir(dp);
+	dir->nentries = n;
+
+	if (!msg)
+		msg = mkfs_dir_layout(t, dir);
+	if (msg) {
+		fprintf(stderr, "%s: %s%s%s: %s\n", prog, path,
+			name ? "/" : "", name ? name : "", msg);
+		return -EINVAL;
+	}
+	t->nblocks += dir->nblocks;
+
+	/* Only the directories found in this one, links don't count */
+	last = t->ninodes;
+	for (i = first; i < last; i++) {
+		ip = t->inodes[i];
+		if (!S_ISDIR(ip->st.st_mode))
+			continue;
+
+		error = mkfs_scan_dir(t, ip, ip->path);
+		free(ip->path);
+		ip->path = NULL;
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+/*
+ * mkfs_scan()
+ *	- Load the tree to copy, or a lone empty root directory without -d.
+ *	  The root is inode 0, and is its own parent.
+ */
+static int mkfs_scan(struct mkfs_tree *t, const struct mkfs_opts *opts)
+{
+	struct mkfs_inode	*root;
+	struct stat		st;
+
+	t->bsize = opts->bsize;
+	memset(&st, 0, sizeof(st));
+	if (opts->srcdir) {
+		if (stat(opts->srcdir, &st) < 0) {
+			fprintf(stderr, "%s: %s: %s\n", prog, opts->srcdir,
+				strerror(errno));
+			return -EIO;
+		}
+		if (!S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "%s: %s: %s\n", prog, opts->srcdir,
+				strerror(ENOTDIR));
+			return -ENOTDIR;
+		}
+	} else {
+		st.st_mode = S_IFDIR | 0755;
+		st.st_uid = getuid();
+		st.st_gid = getgid();
+		st.st_atime = st.st_mtime = st.st_ctime = time(NULL);
+	}
+
+	root = mkfs_new_inode(t, &st);
+	if (!root)
+		return -ENOMEM;
+
+	if (opts->srcdir)
+		return mkfs_scan_dir(t, root, opts->srcdir);
+
+	if (mkfs_dir_layout(t, root))
+		return -ENOMEM;
+	t->nblocks += root->nblocks;
+	return 0;
+}
+
+/*
+ * mkfs_geometry()
+ *	- Lay the regions out one after the other, followed by the journal
+ *	  and the blocks of the tree loaded.
+ *	- The inode count is rounded up to fill the last inode table block.
+ */
+static const char *mkfs_geometry(struct tfs_dsb *dsb, struct mkfs_opts *opts,
+				 const struct mkfs_tree *t)
+{
+	uint32_t	bsize = opts->bsize;
+	uint64_t	ninodes = opts->ninodes;
+	uint64_t	jblocks;
+	uint64_t	used;
+
+	if (opts->nblocks >= TFS_INVALID)
+		opts->nblocks = TFS_INVALID - 1;
+
+	if (ninodes && ninodes < t->ninodes)
+		return "not enough inodes for the files to copy";
+	if (!ninodes)
+		ninodes = opts->nblocks * bsize / opts->bytes_per_inode;
+	if (ninodes < TFS_INODE_COUNT)
+		ninodes = TFS_INODE_COUNT;
+	if (ninodes < t->ninodes)
+		ninodes = t->ninodes;
+	ninodes = DIV_ROUND_UP(ninodes, TFS_INODES_PER_BLOCK(bsize)) *
+		  TFS_INODES_PER_BLOCK(bsize);
+	if (ninodes >= TFS_INVALID)
+		return "too many inodes";
+
+	dsb->s_magic = TFS_MAGIC;
+	dsb->s_flags = TFS_SB_CLEAN;
+	dsb->s_version = TFS_SB_VERSION;
+	dsb->s_nblocks = opts->nblocks;
+	dsb->s_ninodes = ninodes;
+	dsb->s_log_block_size = __builtin_ctz(bsize) - TFS_MIN_BSIZE_BITS;
+	dsb->s_itable_start = TFS_INODE_BLOCK;
+	dsb->s_itable_blocks = ninodes / TFS_INODES_PER_BLOCK(bsize);
+	dsb->s_imap_start = dsb->s_itable_start + dsb->s_itable_blocks;
+	dsb->s_imap_blocks = DIV_ROUND_UP(ninodes, TFS_BITS_PER_BLOCK(bsize));
+	dsb->s_bmap_start = dsb->s_imap_start + dsb->s_imap_blocks;
+	dsb->s_bmap_blocks = DIV_ROUND_UP(opts->nblocks,
+					  TFS_BITS_PER_BLOCK(bsize));
+	dsb->s_data_start = dsb->s_bmap_start + dsb->s_bmap_blocks;
+
+	if (opts->journal_blocks < 0) {
+		jblocks = opts->nblocks / TFS_JOURNAL_RATIO;
+		if (jblocks > TFS_JOURNAL_MAX_BLOCKS(bsize))
+			jblocks = TFS_JOURNAL_MAX_BLOCKS(bsize);
+		/* No room for a journal worth its space */
+		if (jblocks < TFS_JOURNAL_MIN_BLOCKS)
+			jblocks = 0;
+	} else {
+		jblocks = opts->journal_blocks;
+		if (jblocks && jblocks < TFS_JOURNAL_MIN_BLOCKS)
+			return "journal is too small";
+	}
+
+	dsb->s_journal_start = jblocks ? dsb->s_data_start : 0;
+	dsb->s_journal_blocks = jblocks;
+
+	used = (uint64_t)dsb->s_data_start + jblocks + t->nblocks;
+	if (used >= opts->nblocks)
+		return "device is too small";
+
+	dsb->s_ifree = ninodes - t->ninodes;
+	dsb->s_bfree = opts->nblocks - used;
+	return NULL;
+}
+
+/*
+ * mkfs_alloc()
+ *	- Give every inode its run of blocks, in inode number order, from
+ *	  right after the journal
+ *	- Returns the first block left free
+ */
+static uint32_t mkfs_alloc(struct mkfs_tree *t, const struct tfs_dsb *dsb)
+{
+	uint32_t	blk = dsb->s_data_start + dsb->s_journal_blocks;
+	uint32_t	i;
+
+	for (i = 0; i < t->ninodes; i++) {
+		t->inodes[i]->pblk = blk;
+		blk += t->inodes[i]->nblocks;
+	}
+	return blk;
+}
+
+static void mkfs_fill_dinode(struct tfs_dinode *dip,
+			     const struct mkfs_inode *ip)
+{
+	uint32_t i;
+
+	dip->i_mode = ip->st.st_mode & (S_IFMT | 07777);
+	dip->i_nlink = ip->nlink;
+	dip->i_uid = ip->st.st_uid;
+	dip->i_gid = ip->st.st_gid;
+	dip->i_atime = ip->st.st_atime;
+	dip->i_mtime = ip->st.st_mtime;
+	dip->i_ctime = ip->st.st_ctime;
+
+	if (S_ISDIR(ip->st.st_mode))
+		dip->i_size = (2 + ip->nentries) * sizeof(struct tfs_dentry);
+	else
+		dip->i_size = ip->st.st_size;
+
+	/* Symlinks and small files are inline, see toyfs_new_inode() */
+	if (S_ISLNK(ip->st.st_mode) ||
+	    (S_ISREG(ip->st.st_mode) && dip->i_size <= TFS_INLINE_SIZE)) {
+		dip->i_mode |= TFS_IMODE_INLINE;
+		memcpy(dip->i_data, ip->data, TFS_INLINE_SIZE);
+		return;
+	}
+
+	dip->i_ext_block = TFS_INVALID;
+	if (S_ISDIR(ip->st.st_mode)) {
+		dip->i_blocks = ip->nblocks;
+		dip->i_extents[0].e_lblk = 0;
+		dip->i_extents[0].e_pblk = ip->pblk;
+		dip->i_extents[0].e_len = ip->nblocks;
+		return;
+	}
+
+	for (i = 0; i < ip->nextents && i < TFS_INODE_EXTENTS; i++) {
+		dip->i_extents[i] = ip->ext[i];
+		dip->i_extents[i].e_pblk += ip->pblk;
+	}
+
+	/* The overflow block ends the run, and isn't counted in i_blocks */
+	dip->i_blocks = ip->nblocks;
+	if (ip->nextents > TFS_INODE_EXTENTS) {
+		dip->i_blocks--;
+		dip->i_ext_block = ip->pblk + ip->nblocks - 1;
+	}
+}
+
+/*
+ * mkfs_write_itable()
+ *	- Write the inode table: the inodes in use are filled in memory and
+ *	  written at once, the rest of the table is zeroed
+ */
+static int mkfs_write_itable(struct tfs_dev *dev, const struct tfs_dsb *dsb,
+			     const struct mkfs_tree *t)
+{
+	struct tfs_dinode	*itable;
+	uint32_t		nblocks;
+	uint32_t		i;
+	int			error;
+
+	nblocks = DIV_ROUND_UP(t->ninodes, TFS_INODES_PER_BLOCK(dev->bsize));
+	itable = calloc(nblocks, dev->bsize);
+	if (!itable)
+		return -ENOMEM;
+
+	for (i = 0; i < t->ninodes; i++)
+		mkfs_fill_dinode(&itable[i], t->inodes[i]);
+
+	error = tfs_write_blocks(dev, itable, dsb->s_itable_start, nblocks);
+	if (!error)
+		error = tfs_zero_blocks(dev, dsb->s_itable_start + nblocks,
+					dsb->s_itable_blocks - nblocks);
+	free(itable);
+	return error;
+}
+
+/*
+ * mkfs_write_bitmaps()
+ *	- Write the inode bitmap, with the inodes loaded in use, and the block
+ *	  bitmap, with every block below @used in use. Both are contiguous, so
+ *	  they go out as a single write.
+ */
+static int mkfs_write_bitmaps(struct tfs_dev *dev, const struct tfs_dsb *dsb,
+			      const struct mkfs_tree *t, uint32_t used)
+{
+	unsigned long	*imap, *bmap;
+	uint32_t	nblocks = dsb->s_imap_blocks + dsb->s_bmap_blocks;
+	uint32_t	i;
+	int		error;
+
+	imap = calloc(nblocks, dev->bsize);
+	if (!imap)
+		return -ENOMEM;
+	bmap = (unsigned long *)((char *)imap +
+				 (size_t)dsb->s_imap_blocks * dev->bsize);
+
+	for (i = 0; i < t->ninodes; i++)
+		tfs_set_bit(imap, i);
+	for (i = 0; i < used; i++)
+		tfs_set_bit(bmap, i);
+
+	error = tfs_write_blocks(dev, imap, dsb->s_imap_start, nblocks);
+	free(imap);
+	return error;
+}
+
+/*
+ * mkfs_write_journal()
+ *	- Write the journal superblock, and zero the log so no transaction
+ *	  a previous filesystem left there can ever be replayed
+ */
+static int mkfs_write_journal(struct tfs_dev *dev, const struct tfs_dsb *dsb)
+{
+	struct tfs_journal_super	*jsb;
+	int				error;
+
+	if (!dsb->s_journal_blocks)
+		return 0;
+
+	error = tfs_zero_blocks(dev, dsb->s_journal_start + 1,
+				dsb->s_journal_blocks - 1);
+	if (error)
+		return error;
+
+	jsb = calloc(1, dev->bsize);
+	if (!jsb)
+		return -ENOMEM;
+
+	jsb->js_header.jh_magic = TFS_JOURNAL_MAGIC;
+	jsb->js_header.jh_type = TFS_JOURNAL_SUPER;
+	jsb->js_header.jh_seq = 1;
+	jsb->js_blocks = dsb->s_journal_blocks;
+
+	error = tfs_write_blocks(dev, jsb, dsb->s_journal_start, 1);
+	free(jsb);
+	return error;
+}
+
+static int mkfs_stream_flush(struct mkfs_stream *s)
+{
+	int error = 0;
+
+	if (s->count)
+		error = tfs_write_blocks(s->dev, s->buf, s->start, s->count);
+	s->start += s->count;
+	s->count = 0;
+	return error;
+}
+
+/*
+ * mkfs_stream_get()
+ *	- Get up to @want zeroed blocks to fill, the next ones on disk
+ *	- Returns how many blocks @bufp holds, or a negative error
+ */
+static int mkfs_stream_get(struct mkfs_stream *s, uint32_t want, void **bufp)
+{
+	int error;
+
+	if (s->count == TFS_IO_BLOCKS) {
+		error = mkfs_stream_flush(s);
+		if (error)
+			return error;
+	}
+
+	if (want > TFS_IO_BLOCKS - s->count)
+		want = TFS_IO_BLOCKS - s->count;
+	*bufp = s->buf + (size_t)s->count * s->dev->bsize;
+	memset(*bufp, 0, (size_t)want * s->dev->bsize);
+	s->count += want;
+	return want;
+}
+
+/* Fill block @lblk of @dir, see mkfs_dir_layout() */
+static void mkfs_dir_block(const struct mkfs_inode *dir, uint32_t lblk,
+			   void *buf, uint32_t bsize)
+{
+	struct tfs_dx_block	*dxb = buf;
+	struct tfs_dentry	*d_array = buf;
+	struct mkfs_entry	*de;
+	uint32_t		per_block = TFS_ENTRIES_PER_BLOCK(bsize);
+	uint32_t		leaf, start, end;
+	uint32_t		i, n;
+
+	if (!lblk) {
+		dxb->dx_magic = TFS_DX_MAGIC;
+		dxb->dx_free = 1 + (2 + dir->nentries) / per_block;
+		if (!dir->nleaves) {
+			dxb->dx_count = dir->nentries;
+			memcpy(dxb->dx_entries, dir->dx,
+			       dir->nentries * sizeof(*dir->dx));
+			return;
+		}
+
+		dxb->dx_levels = 1;
+		dxb->dx_count = dir->nleaves;
+		for (i = 0; i < dir->nleaves; i++) {
+			/* The first leaf covers everything below the second */
+			dxb->dx_entries[i].dx_hash =
+				i ? dir->dx[dir->leaves[i]].dx_hash : 0;
+			dxb->dx_entries[i].dx_ptr = 1 + dir->dentry_blocks + i;
+		}
+		return;
+	}
+
+	if (lblk <= dir->dentry_blocks) {
+		for (i = 0; i < per_block; i++) {
+			/* Entry n - 2 is in slot n, after "." and ".." */
+			n = (lblk - 1) * per_block + i;
+			if (n >= dir->nentries + 2) {
+				d_array[i].d_ino = TFS_INVALID;
+			} else if (n < 2) {
+				strcpy(d_array[i].d_name, n ? ".." : ".");
+				d_array[i].d_ino = n ? dir->parent : dir->ino;
+				d_array[i].d_type = DT_DIR;
+			} else {
+				de = &dir->entries[n - 2];
+				strcpy(d_array[i].d_name, de->name);
+				d_array[i].d_ino = de->inode->ino;
+				d_array[i].d_type = IFTODT(de->inode->st.st_mode);
+			}
+		}
+		return;
+	}
+
+	leaf = lblk - 1 - dir->dentry_blocks;
+	start = dir->leaves[leaf];
+	end = leaf + 1 < dir->nleaves ? dir->leaves[leaf + 1] : dir->nentries;
+	dxb->dx_magic = TFS_DX_MAGIC;
+	dxb->dx_count = end - start;
+	memcpy(dxb->dx_entries, &dir->dx[start],
+	       (end - start) * sizeof(*dir->dx));
+}
+
+static int mkfs_stream_dir(struct mkfs_stream *s, const struct mkfs_inode *dir)
+{
+	void		*buf;
+	uint32_t	lblk;
+	int		ret;
+
+	for (lblk = 0; lblk < dir->nblocks; lblk++) {
+		ret = mkfs_stream_get(s, 1, &buf);
+		if (ret < 0)
+			return ret;
+		mkfs_dir_block(dir, lblk, buf, s->dev->bsize);
+	}
+	return 0;
+}
+
+/*
+ * mkfs_stream_run()
+ *	- Read the blocks @ext maps from @fd straight into the stream buffer
+ *	- A file which shrank since it was scanned is padded with zeros, data
+ *	  written past the size it was scanned with, or in a hole, is left out.
+ */
+static int mkfs_stream_run(struct mkfs_stream *s, const struct mkfs_inode *ip,
+			   int fd, const struct tfs_extent *ext, bool *shrank)
+{
+	uint64_t	pos = (uint64_t)ext->e_lblk * s->dev->bsize;
+	uint64_t	left = ip->st.st_size - pos;
+	uint32_t	blocks = toyfs_ext_len(ext);
+	size_t		len;
+	ssize_t		ret;
+	void		*buf;
+	int		got;
+
+	while (blocks) {
+		got = mkfs_stream_get(s, blocks, &buf);
+		if (got < 0)
+			return got;
+		blocks -= got;
+
+		len = (size_t)got * s->dev->bsize;
+		if (len > left)
+			len = left;
+		left -= len;
+		while (len && !*shrank) {
+			ret = pread(fd, buf, len, pos);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				fprintf(stderr, "%s: %s: %s\n", prog, ip->path,
+					strerror(errno));
+				return -EIO;
+			}
+			if (!ret) {
+				fprintf(stderr, "%s: %s: file shrank while being copied\n",
+					prog, ip->path);
+				*shrank = true;
+				break;
+			}
+			buf = (char *)buf + ret;
+			pos += ret;
+			len -= ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * mkfs_stream_file()
+ *	- Write the data runs of a regular file, in the order mkfs_map_file()
+ *	  laid them out, then its overflow extent block
+ */
+static int mkfs_stream_file(struct mkfs_stream *s, const struct mkfs_inode *ip)
+{
+	struct tfs_extent_block	*eb;
+	bool			shrank = false;
+	uint32_t		i;
+	int			error = 0;
+	int			fd;
+
+	fd = open(ip->path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, ip->path, strerror(errno));
+		return -EIO;
+	}
+
+	for (i = 0; i < ip->nextents && !error; i++)
+		error = mkfs_stream_run(s, ip, fd, &ip->ext[i], &shrank);
+	close(fd);
+
+	if (error || ip->nextents <= TFS_INODE_EXTENTS)
+		return error;
+
+	error = mkfs_stream_get(s, 1, (void **)&eb);
+	if (error < 0)
+		return error;
+	eb->eb_count = ip->nextents - TFS_INODE_EXTENTS;
+	for (i = 0; i < eb->eb_count; i++) {
+		eb->eb_extents[i] = ip->ext[TFS_INODE_EXTENTS + i];
+		eb->eb_extents[i].e_pblk += ip->pblk;
+	}
+	return 0;
+}
+
+/*
+ * mkfs_write_data()
+ *	- Write the blocks of every inode, in inode number order, which is
+ *	  disk order too: the whole data region in use is a single stream.
+ */
+static int mkfs_write_data(struct tfs_dev *dev, const struct tfs_dsb *dsb,
+			   const struct mkfs_tree *t)
+{
+	struct mkfs_stream	s = {
+		.dev	= dev,
+		.start	= dsb->s_data_start + dsb->s_journal_blocks,
+	};
+	struct mkfs_inode	*ip;
+	uint32_t		i;
+	int			error = 0;
+
+	s.buf = malloc((size_t)TFS_IO_BLOCKS * dev->bsize);
+	if (!s.buf)
+		return -ENOMEM;
+
+	for (i = 0; i < t->ninodes && !error; i++) {
+		ip = t->inodes[i];
+		if (S_ISDIR(ip->st.st_mode))
+			error = mkfs_stream_dir(&s, ip);
+		else if (ip->nblocks)
+			error = mkfs_stream_file(&s, ip);
+	}
+	if (!error)
+		error = mkfs_stream_flush(&s);
+	free(s.buf);
+	return error;
+}
+
+int main(int argc, char **argv)
+{
+	struct mkfs_opts	opts = {
+		.bsize			= TFS_MIN_BSIZE,
+		.bytes_per_inode	= TFS_BYTES_PER_INODE,
+		.journal_blocks		= -1,
+	};
+	struct mkfs_tree	tree = { 0 };
+	struct tfs_dev		dev;
+	struct tfs_dsb		*dsb;
+	const char		*msg;
+	uint64_t		dev_blocks;
+	uint32_t		used;
+	int			error;
+	int			c;
+
+	prog = argv[0];
+	while ((c = getopt(argc, argv, "b:N:i:J:d:q")) != -1) {
+		switch (c) {
+		case 'b':
+			opts.bsize = parse_num(optarg);
+			if (opts.bsize < TFS_MIN_BSIZE ||
+			    opts.bsize > TFS_MAX_BSIZE ||
+			    (opts.bsize & (opts.bsize - 1)))
+				usage();
+			break;
+		case 'N':
+			opts.ninodes = parse_num(optarg);
+			break;
+		case 'i':
+			opts.bytes_per_inode = parse_num(optarg);
+			if (opts.bytes_per_inode < sizeof(struct tfs_dinode))
+				usage();
+			break;
+		case 'J':
+			opts.journal_blocks = parse_num(optarg);
+			break;
+		case 'd':
+			opts.srcdir = optarg;
+			break;
+		case 'q':
+			opts.quiet = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 && optind != argc - 2)
+		usage();
+	if (optind == argc - 2)
+		opts.nblocks = parse_num(argv[optind + 1]);
+
+	/* The device isn't touched unless the whole tree can be loaded */
+	if (mkfs_scan(&tree, &opts))
+		return 1;
+
+	/* Given a size, a missing image file is created */
+	if (opts.nblocks && access(argv[optind], F_OK) < 0 && errno == ENOENT) {
+		c = open(argv[optind], O_CREAT | O_WRONLY, 0644);
+		if (c >= 0)
+			close(c);
+	}
+
+	error = tfs_dev_open(&dev, argv[optind], true);
+	if (error) {
+		fprintf(stderr, "%s: %s: %s\n", prog, argv[optind],
+			strerror(-error));
+		return 1;
+	}
+	dev.bsize = opts.bsize;
+
+	dev_blocks = dev.size / opts.bsize;
+	if (!opts.nblocks) {
+		opts.nblocks = dev_blocks;
+	} else if (opts.nblocks > dev_blocks) {
+		if (dev.is_bdev ||
+		    ftruncate(dev.fd, opts.nblocks * opts.bsize) < 0) {
+			fprintf(stderr, "%s: %s is smaller than %llu blocks\n",
+				prog, dev.path,
+				(unsigned long long)opts.nblocks);
+			return 1;
+		}
+	}
+
+	dsb = calloc(1, opts.bsize);
+	if (!dsb) {
+		fprintf(stderr, "%s: %s\n", prog, strerror(ENOMEM));
+		return 1;
+	}
+
+	msg = mkfs_geometry(dsb, &opts, &tree);
+	if (msg) {
+		fprintf(stderr, "%s: %s: %s\n", prog, dev.path, msg);
+		return 1;
+	}
+	used = mkfs_alloc(&tree, dsb);
+
+	/*
+	 * Everything goes out in disk order, but the superblock, which goes
+	 * last: the filesystem isn't valid until then.
+	 */
+	error = mkfs_write_itable(&dev, dsb, &tree);
+	if (!error)
+		error = mkfs_write_bitmaps(&dev, dsb, &tree, used);
+	if (!error)
+		error = mkfs_write_journal(&dev, dsb);
+	if (!error)
+		error = mkfs_write_data(&dev, dsb, &tree);
+	if (!error)
+		error = tfs_dev_sync(&dev);
+	if (!error)
+		error = tfs_write_blocks(&dev, dsb, TFS_SB_BLOCK, 1);
+	if (!error)
+		error = tfs_dev_sync(&dev);
+	if (error) {
+		fprintf(stderr, "%s: %s: %s\n", prog, dev.path,
+			strerror(-error));
+		return 1;
+	}
+
+	if (!opts.quiet) {
+		printf("%s: %u blocks of %u bytes, %u inodes\n", dev.path,
+		       dsb->s_nblocks, opts.bsize, dsb->s_ninodes);
+		printf("inode table: %u blocks at %u, inode bitmap: %u at %u, "
+		       "block bitmap: %u at %u\n",
+		       dsb->s_itable_blocks, dsb->s_itable_start,
+		       dsb->s_imap_blocks, dsb->s_imap_start,
+		       dsb->s_bmap_blocks, dsb->s_bmap_start);
+		if (dsb->s_journal_blocks)
+			printf("journal: %u blocks at %u\n",
+			       dsb->s_journal_blocks, dsb->s_journal_start);
+		if (opts.srcdir)
+			printf("%s: %u inodes, %llu blocks copied\n",
+			       opts.srcdir, tree.ninodes,
+			       (unsigned long long)tree.nblocks);
+		printf("data: %u blocks free\n", dsb->s_bfree);
+	}
+
+	free(dsb);
+	tfs_dev_close(&dev);
+	return 0;
+}
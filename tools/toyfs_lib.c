@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Helpers shared by the toyfs userspace tools
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "toyfs_lib.h"
+
+/*
+ * tfs_dev_open()
+ *	- Open @path, a block device or an image file, and find its size
+ *	- Block devices are opened exclusively, which fails while they are
+ *	  mounted.
+ *	- I/O is done in TFS_MIN_BSIZE blocks, until the caller knows better
+ *	  and sets dev->bsize.
+ */
+int tfs_dev_open(struct tfs_dev *dev, const char *path, bool write)
+{
+	struct stat	st;
+	int		flags = write ? O_RDWR : O_RDONLY;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->path = path;
+	dev->bsize = TFS_MIN_BSIZE;
+
+	if (stat(path, &st) < 0)
+		return -errno;
+
+	dev->is_bdev = S_ISBLK(st.st_mode);
+	if (dev->is_bdev)
+		flags |= O_EXCL;
+
+	dev->fd = open(path, flags);
+	if (dev->fd < 0)
+		return -errno;
+
+	if (!dev->is_bdev) {
+		dev->size = st.st_size;
+		return 0;
+	}
+
+	if (ioctl(dev->fd, BLKGETSIZE64, &dev->size) < 0) {
+		close(dev->fd);
+		return -errno;
+	}
+	return 0;
+}
+
+void tfs_dev_close(struct tfs_dev *dev)
+{
+	close(dev->fd);
+	dev->fd = -1;
+}
+
+/*
+ * tfs_dev_io()
+ *	- Read or write @count blocks starting at @blk, in as few system
+ *	  calls as possible, TFS_IO_BLOCKS at most each
+ */
+static int tfs_dev_io(struct tfs_dev *dev, void *buf, uint64_t blk,
+		      uint64_t count, bool write)
+{
+	size_t		len = count * dev->bsize;
+	off_t		off = blk * dev->bsize;
+	size_t		chunk;
+	ssize_t		ret;
+
+	while (len) {
+		chunk = len < TFS_IO_BLOCKS * dev->bsize ?
+			len : TFS_IO_BLOCKS * dev->bsize;
+		if (write)
+			ret = pwrite(dev->fd, buf, chunk, off);
+		else
+			ret = pread(dev->fd, buf, chunk, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		/* Reading past the end of an image, or the device is full */
+		if (!ret)
+			return write ? -ENOSPC : -EIO;
+
+		buf = (char *)buf + ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+int tfs_read_blocks(struct tfs_dev *dev, void *buf, uint64_t blk,
+		    uint64_t count)
+{
+	return tfs_dev_io(dev, buf, blk, count, false);
+}
+
+int tfs_write_blocks(struct tfs_dev *dev, const void *buf, uint64_t blk,
+		     uint64_t count)
+{
+	return tfs_dev_io(dev, (void *)buf, blk, count, true);
+}
+
+/* Zero @count blocks starting at @blk */
+int tfs_zero_blocks(struct tfs_dev *dev, uint64_t blk, uint64_t count)
+{
+	void		*zero;
+	uint64_t	chunk;
+	int		error = 0;
+
+	zero = calloc(TFS_IO_BLOCKS, dev->bsize);
+	if (!zero)
+		return -ENOMEM;
+
+	while (count && !error) {
+		chunk = count < TFS_IO_BLOCKS ? count : TFS_IO_BLOCKS;
+		error = tfs_write_blocks(dev, zero, blk, chunk);
+		blk += chunk;
+		count -= chunk;
+	}
+	free(zero);
+	return error;
+}
+
+int tfs_dev_sync(struct tfs_dev *dev)
+{
+	return fsync(dev->fd) < 0 ? -errno : 0;
+}
+
+/* FNV-1a, see toyfs_name_hash() */
+uint32_t tfs_name_hash(const char *name)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+/*
+ * CRC32C (Castagnoli), without the final inversion, matching the kernel's
+ * crc32c()
+ */
+uint32_t tfs_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	static uint32_t		table[256];
+	const unsigned char	*p = buf;
+	uint32_t		c;
+	int			i, j;
+
+	if (!table[1]) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+			table[i] = c;
+		}
+	}
+
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/* Checksum a transaction, see toyfs_journal_crc() */
+uint32_t tfs_journal_crc(const struct tfs_journal_desc *desc,
+			 void * const *copies, uint32_t bsize)
+{
+	uint32_t	crc;
+	unsigned int	i;
+
+	crc = tfs_crc32c(~0U, desc, bsize);
+	for (i = 0; i < desc->jd_count; i++)
+		crc = tfs_crc32c(crc, copies[i], bsize);
+	return crc;
+}
+
+/* Most blocks a single transaction logs, see toyfs_journal_load() */
+unsigned int tfs_journal_max(uint32_t journal_blocks, uint32_t bsize)
+{
+	return journal_blocks - 3 < TFS_JOURNAL_TAGS(bsize) ?
+	       journal_blocks - 3 : TFS_JOURNAL_TAGS(bsize);
+}
+
+/*
+ * tfs_load_geometry()
+ *	- Fill in @geo from the on-disk superblock, with the very same rules
+ *	  toyfs_load_geometry() and toyfs_journal_load() mount with
+ *	- @dev_size is in bytes, as the block size comes from @dsb
+ *	- Returns NULL, or what's wrong with the superblock.
+ */
+const char *tfs_load_geometry(struct tfs_geometry *geo,
+			      const struct tfs_dsb *dsb, uint64_t dev_size)
+{
+	unsigned int	bits;
+
+	memset(geo, 0, sizeof(*geo));
+
+	if (dsb->s_magic != TFS_MAGIC)
+		return "bad magic number";
+
+	if (dsb->s_version == TFS_SB_VERSION_LEGACY) {
+		geo->legacy = true;
+		geo->nblocks = TFS_MAX_BLKS;
+		geo->ninodes = TFS_INODE_COUNT;
+		geo->itable_start = TFS_INODE_BLOCK;
+		geo->itable_blocks = 1;
+		geo->bmap_start = TFS_BITMAP_BLOCK;
+		geo->bmap_blocks = 1;
+		geo->data_start = TFS_FIRST_DATA_BLOCK;
+	} else if (dsb->s_version == TFS_SB_VERSION) {
+		geo->nblocks = dsb->s_nblocks;
+		geo->ninodes = dsb->s_ninodes;
+		geo->itable_start = dsb->s_itable_start;
+		geo->itable_blocks = dsb->s_itable_blocks;
+		geo->imap_start = dsb->s_imap_start;
+		geo->imap_blocks = dsb->s_imap_blocks;
+		geo->bmap_start = dsb->s_bmap_start;
+		geo->bmap_blocks = dsb->s_bmap_blocks;
+		geo->data_start = dsb->s_data_start;
+		geo->journal_start = dsb->s_journal_start;
+		geo->journal_blocks = dsb->s_journal_blocks;
+	} else {
+		return "unsupported superblock version";
+	}
+
+	bits = toyfs_dsb_bsize_bits(dsb);
+	if (bits < TFS_MIN_BSIZE_BITS || bits > TFS_MAX_BSIZE_BITS)
+		return "unsupported block size";
+	geo->bsize = 1U << bits;
+
+	if (geo->nblocks > dev_size / geo->bsize || geo->nblocks >= TFS_INVALID)
+		return "filesystem larger than the device";
+
+	if (!geo->ninodes || geo->ninodes >= TFS_INVALID ||
+	    geo->itable_start != TFS_INODE_BLOCK ||
+	    geo->itable_blocks != DIV_ROUND_UP(geo->ninodes,
+					       TFS_INODES_PER_BLOCK(geo->bsize)) ||
+	    geo->bmap_blocks != DIV_ROUND_UP(geo->nblocks,
+					     TFS_BITS_PER_BLOCK(geo->bsize)) ||
+	    geo->bmap_start + geo->bmap_blocks != geo->data_start ||
+	    geo->data_start >= geo->nblocks)
+		return "invalid geometry";
+
+	if (!geo->legacy &&
+	    (geo->imap_start != geo->itable_start + geo->itable_blocks ||
+	     geo->imap_blocks != DIV_ROUND_UP(geo->ninodes,
+					      TFS_BITS_PER_BLOCK(geo->bsize)) ||
+	     geo->bmap_start != geo->imap_start + geo->imap_blocks))
+		return "invalid geometry";
+
+	if (geo->journal_blocks &&
+	    (geo->journal_start < geo->data_start ||
+	     geo->journal_start >= geo->nblocks ||
+	     geo->journal_blocks < TFS_JOURNAL_MIN_BLOCKS ||
+	     geo->journal_blocks > geo->nblocks - geo->journal_start))
+		return "invalid journal geometry";
+
+	return NULL;
+}
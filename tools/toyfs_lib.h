@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#ifndef __TOYFS_LIB_H
+#define __TOYFS_LIB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include "toyfs_format.h"
+
+/* Largest single read or write we issue, in blocks */
+#define TFS_IO_BLOCKS		512
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define BITS_PER_LONG		(sizeof(unsigned long) * CHAR_BIT)
+#define BITS_TO_LONGS(n)	DIV_ROUND_UP(n, BITS_PER_LONG)
+
+/*
+ * Bitmaps use the very same layout the kernel gives an unsigned long
+ * array, so the on-disk inode and block bitmaps can be used in place.
+ */
+static inline bool tfs_test_bit(const unsigned long *map, uint32_t nr)
+{
+	return map[nr / BITS_PER_LONG] & (1UL << (nr % BITS_PER_LONG));
+}
+
+static inline void tfs_set_bit(unsigned long *map, uint32_t nr)
+{
+	map[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void tfs_clear_bit(unsigned long *map, uint32_t nr)
+{
+	map[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+/* Returns the previous value of the bit, safe against concurrent callers */
+static inline bool tfs_test_and_set_bit(unsigned long *map, uint32_t nr)
+{
+	unsigned long mask = 1UL << (nr % BITS_PER_LONG);
+
+	return __atomic_fetch_or(&map[nr / BITS_PER_LONG], mask,
+				 __ATOMIC_RELAXED) & mask;
+}
+
+/* Filesystem geometry, synthesized from the legacy layout if needed */
+struct tfs_geometry {
+	bool		legacy;
+	uint32_t	bsize;
+	uint32_t	nblocks;
+	uint32_t	ninodes;
+	uint32_t	itable_start;
+	uint32_t	itable_blocks;
+	uint32_t	imap_start;
+	uint32_t	imap_blocks;
+	uint32_t	bmap_start;
+	uint32_t	bmap_blocks;
+	uint32_t	data_start;
+	uint32_t	journal_start;
+	uint32_t	journal_blocks;
+};
+
+/* A device or image file, opened by tfs_dev_open() */
+struct tfs_dev {
+	int		fd;
+	const char	*path;
+	bool		is_bdev;
+	uint64_t	size;		/* In bytes */
+	uint32_t	bsize;		/* Of the blocks we read and write */
+};
+
+extern int tfs_dev_open(struct tfs_dev *dev, const char *path, bool write);
+extern void tfs_dev_close(struct tfs_dev *dev);
+extern int tfs_read_blocks(struct tfs_dev *dev, void *buf, uint64_t blk,
+			   uint64_t count);
+extern int tfs_write_blocks(struct tfs_dev *dev, const void *buf, uint64_t blk,
+			    uint64_t count);
+extern int tfs_zero_blocks(struct tfs_dev *dev, uint64_t blk, uint64_t count);
+extern int tfs_dev_sync(struct tfs_dev *dev);
+
+extern uint32_t tfs_name_hash(const char *name);
+extern uint32_t tfs_crc32c(uint32_t crc, const void *buf, size_t len);
+extern uint32_t tfs_journal_crc(const struct tfs_journal_desc *desc,
+				void * const *copies, uint32_t bsize);
+extern const char *tfs_load_geometry(struct tfs_geometry *geo,
+				     const struct tfs_dsb *dsb,
+				     uint64_t dev_size);
+extern unsigned int tfs_journal_max(uint32_t journal_blocks, uint32_t bsize);
+
+#endif /* __TOYFS_LIB_H */
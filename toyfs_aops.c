@@ -4,72 +4,836 @@
 
 #include <linux/fs.h>
 #include <linux/mm.h>
-#include <linux/mpage.h>
+#include <linux/sched/signal.h>
+#include <linux/iomap.h>
 #include <linux/buffer_head.h>
 #include "toyfs_types.h"
 #include "toyfs_iops.h"
+#include "toyfs_aops.h"
+#include "toyfs_trace.h"
 
+/*
+ * Delayed allocation
+ *
+ * Buffered writes (and pages dirtied through mmap) don't allocate anything.
+ * They reserve one block of s_bfree per block written into a hole, and
+ * record the block in i_delalloc. The overflow extent block the allocations
+ * might need is reserved along, see toyfs_ext_reserve_meta(). Blocks are only
+ * allocated at writeback, a whole run of delayed blocks at once, so files
+ * written through small appends, or by several writers at once, still end up
+ * contiguous. Files removed before being written back never touch the bitmap
+ * at all.
+ *
+ * Allocating takes a journal handle, which can't be started with a folio
+ * locked. toyfs_writepages() allocates the delayed blocks before iomap locks
+ * any folio, with i_delalloc_sem keeping new ones out until it's done.
+ *
+ * Delayed blocks are reported as IOMAP_DELALLOC, except to direct I/O, which
+ * writes back the page cache over its range first, and sees them as holes.
+ */
 
-int toyfs_write_begin(struct file *filp,
-		      struct address_space *mapping,
-		      loff_t pos,
-		      unsigned len,
-		      struct page **pagep,
-		      void **fsdata)
+/*
+ * toyfs_delalloc_lookup()
+ *	- @lblk being within a hole of @len blocks, tell whether it is delayed
+ *	- Trim @len to the run of delayed blocks starting at @lblk, or to the
+ *	  part of the hole before the next delayed block.
+ */
+static bool toyfs_delalloc_lookup(struct tfs_inode_info *tino,
+				  unsigned int lblk, unsigned int *len)
 {
-	int ret;
-	struct inode *ip = mapping->host;
+	unsigned long	index = lblk;
+	unsigned int	n;
 
-	pr_debug("inode: %px off: %lld len: %d\n",
-		ip, pos, len);
+	if (xa_load(&tino->i_delalloc, lblk)) {
+		for (n = 1; n < *len; n++) {
+			if (!xa_load(&tino->i_delalloc, lblk + n))
+				break;
+		}
+		*len = n;
+		return true;
+	}
+
+	if (xa_find(&tino->i_delalloc, &index, lblk + *len - 1, XA_PRESENT))
+		*len = index - lblk;
+	return false;
+}
+
+/*
+ * toyfs_delalloc_reserve()
+ *	- Reserve space for the @len not yet delayed blocks starting at @lblk
+ *	- Close to ENOSPC, settle for a single block so the write still makes
+ *	  progress.
+ *	- The overflow extent block is reserved first, if the inode doesn't
+ *	  have one yet.
+ */
+static int toyfs_delalloc_reserve(struct inode *inode, unsigned int lblk,
+				  unsigned int *len)
+{
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned int		i;
+	int			error;
+
+	error = toyfs_ext_reserve_meta(inode);
+	if (error)
+		return error;
+
+	error = toyfs_reserve_blocks(inode->i_sb, *len);
+	if (error && *len > 1) {
+		*len = 1;
+		error = toyfs_reserve_blocks(inode->i_sb, 1);
+	}
+	if (error) {
+		toyfs_ext_unreserve_meta(inode, false);
+		return error;
+	}
+
+	for (i = 0; i < *len; i++) {
+		error = xa_err(xa_store(&tino->i_delalloc, lblk + i,
+					xa_mk_value(1), GFP_NOFS));
+		if (error)
+			goto out_undo;
+	}
+	return 0;
+
+out_undo:
+	while (i--)
+		xa_erase(&tino->i_delalloc, lblk + i);
+	toyfs_unreserve_blocks(inode->i_sb, *len);
+	toyfs_ext_unreserve_meta(inode, false);
+	return error;
+}
+
+/*
+ * __toyfs_delalloc_release()
+ *	- Forget about the delayed blocks within [@start, @end)
+ *	- Their reservation is given back if @unreserve is set, otherwise the
+ *	  blocks were just allocated and the reservation consumed.
+ *	- Once nothing is delayed or unwritten anymore, the overflow extent
+ *	  block reservation goes too.
+ */
+static void __toyfs_delalloc_release(struct inode *inode, unsigned int start,
+				     unsigned int end, bool unreserve)
+{
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned long		index;
+	unsigned int		count = 0;
+	void			*entry;
+
+	if (start >= end)
+		return;
+
+	xa_for_each_range(&tino->i_delalloc, index, entry, start, end - 1) {
+		xa_erase(&tino->i_delalloc, index);
+		count++;
+	}
+
+	if (unreserve && count) {
+		toyfs_unreserve_blocks(inode->i_sb, count);
+		pr_debug("inode %lu: released %u delayed blocks\n",
+			 inode->i_ino, count);
+	}
+	if (count)
+		toyfs_ext_unreserve_meta(inode, false);
+}
+
+/**
+ * toyfs_delalloc_release() - Drop delayed blocks and their reservation
+ * @inode: The inode in question
+ * @start: First logical block
+ * @end: Logical block following the range
+ *
+ * Called once the page cache over the range is gone, e.g. when the file is
+ * truncated or evicted.
+ */
+void toyfs_delalloc_release(struct inode *inode, unsigned int start,
+			    unsigned int end)
+{
+	struct tfs_inode_info *tino = container_of(inode, struct tfs_inode_info,
+						    vfs_inode);
+
+	down_write(&tino->i_map_lock);
+	__toyfs_delalloc_release(inode, start, end, true);
+	up_write(&tino->i_map_lock);
+}
+
+/*
+ * __toyfs_iomap_begin()
+ *	- Map the file range starting at @pos, with a single extent lookup
+ *	- Already allocated blocks are mapped up to the end of their extent,
+ *	  holes are mapped up to the next extent, or delayed block.
+ *	- With @delay set (buffered writes), holes are turned into delayed
+ *	  blocks, see toyfs_delalloc_reserve().
+ *	- With @alloc set (direct writes), holes are allocated, a contiguous
+ *	  run covering as much of [@pos, @pos + @length) as possible. The
+ *	  blocks are unwritten until the data is on disk, so a crash never
+ *	  exposes whatever they held before. Legacy filesystems can't store
+ *	  that, and have no journal to order anything against anyway.
+ *	- Unwritten blocks are reported as such, iomap reads them as zeros and
+ *	  zeroes whatever part of them a write doesn't cover. Writeback and
+ *	  direct writes mark them written once the I/O is done, see
+ *	  toyfs_convert_unwritten().
+ *
+ * The iomap code deals with short mappings, calling us again for whatever is
+ * left of the range.
+ */
+static int __toyfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+			       unsigned flags, struct iomap *iomap,
+			       bool alloc, bool delay)
+{
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned int		blkbits = inode->i_blkbits;
+	unsigned int		max_blocks = toyfs_max_file_blocks(sb);
+	unsigned int		lblk = pos >> blkbits;
+	unsigned int		want;
+	unsigned int		len;
+	unsigned int		got;
+	bool			unwritten;
+	bool			delayed = false;
+	bool			excl = alloc || delay;
+	bool			delalloc_sem = delay && !(flags & IOMAP_FAULT);
+	struct tfs_handle	h;
+	long			fsblock;
+	int			error = 0;
+
+	if (lblk >= max_blocks)
+		return excl ? -EFBIG : -EINVAL;
+
+	want = (round_up(pos + length, i_blocksize(inode)) >> blkbits) - lblk;
+	want = min_t(unsigned int, max(want, 1U), max_blocks - lblk);
+
+	/* Direct write allocations, one extent's worth */
+	if (alloc) {
+		error = toyfs_journal_start(sb, &h, TFS_JOURNAL_CREDITS);
+		if (error)
+			return error;
+	}
+
+	/* Faults hold the folio lock, toyfs_page_mkwrite() took it already */
+	if (delalloc_sem)
+		down_read(&tino->i_delalloc_sem);
+	if (excl)
+		down_write(&tino->i_map_lock);
+	else
+		down_read(&tino->i_map_lock);
+
+	fsblock = toyfs_ext_map(tino, lblk, &len, &unwritten);
+	len = min(len, max_blocks - lblk);
+
+	if (fsblock == TFS_INVALID) {
+		len = min(want, len);
+		delayed = toyfs_delalloc_lookup(tino, lblk, &len);
+	}
 
-	ret = block_write_begin(mapping, pos, len, pagep, toyfs_get_block);
+	if (fsblock == TFS_INVALID && alloc) {
+		if (delayed)
+			fsblock = toyfs_balloc_reserved(sb, toyfs_ext_goal(tino, lblk),
+							len, &got);
+		else
+			fsblock = toyfs_balloc_range(sb, toyfs_ext_goal(tino, lblk),
+						     len, &got);
+		if (fsblock < 0) {
+			error = fsblock;
+			goto out_unlock;
+		}
 
-	if (unlikely(ret)) {
-		if ((pos + len) > ip->i_size)
-			truncate_pagecache(ip, ip->i_size);
-		pr_debug("Failed to write to inode %px\n", ip);
+		unwritten = !toyfs_is_legacy(sb->s_fs_info);
+		error = toyfs_ext_insert(inode, lblk, fsblock, got, unwritten);
+		if (error) {
+			toyfs_bfree_range(sb, fsblock, got);
+			goto out_unlock;
+		}
+
+		if (delayed)
+			__toyfs_delalloc_release(inode, lblk, lblk + got, false);
+
+		toyfs_inode_add_blocks(inode, got);
+		toyfs_journal_inode_locked(inode);
+		iomap->flags |= IOMAP_F_NEW;
+		delayed = false;
+		len = got;
+	} else if (fsblock == TFS_INVALID && delay && !delayed) {
+		error = toyfs_delalloc_reserve(inode, lblk, &len);
+		if (error)
+			goto out_unlock;
+
+		iomap->flags |= IOMAP_F_NEW;
+		delayed = true;
+	}
+
+	iomap->bdev = sb->s_bdev;
+	iomap->offset = (loff_t)lblk << blkbits;
+	iomap->length = (u64)len << blkbits;
+	iomap->validity_cookie = tino->i_map_seq;
+
+	if (fsblock != TFS_INVALID) {
+		iomap->type = unwritten ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+		iomap->addr = (u64)fsblock << blkbits;
+	} else if (delayed && !(flags & IOMAP_DIRECT)) {
+		iomap->type = IOMAP_DELALLOC;
+		iomap->addr = IOMAP_NULL_ADDR;
 	} else {
-		pr_debug("For inode: %px, got page: %px\n",
-			ip, *pagep);
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
 	}
 
-	return ret;
+	/*
+	 * O_DSYNC direct writes into already allocated blocks are completed
+	 * with FUA writes and no fsync at all. That's only fine if there
+	 * is no metadata the data depends on still sitting in memory.
+	 */
+	if ((flags & IOMAP_DIRECT) && (flags & IOMAP_WRITE) &&
+	    ((iomap->flags & IOMAP_F_NEW) ||
+	     pos + length > i_size_read(inode) ||
+	     (inode->i_state & I_DIRTY_DATASYNC)))
+		iomap->flags |= IOMAP_F_DIRTY;
+
+	trace_toyfs_iomap_begin(inode, pos, length, flags, iomap);
+out_unlock:
+	if (excl)
+		up_write(&tino->i_map_lock);
+	else
+		up_read(&tino->i_map_lock);
+	if (delalloc_sem)
+		up_read(&tino->i_delalloc_sem);
+	if (alloc)
+		toyfs_journal_stop(&h);
+	return error;
 }
 
-int toyfs_write_end(struct file *filp,
-		    struct address_space *mapping,
-		    loff_t pos,
-		    unsigned len,
-		    unsigned copied,
-		    struct page *page,
-		    void *fsdata)
+/**
+ * toyfs_prealloc() - Allocate unwritten blocks over the holes of a range
+ * @inode: The inode in question
+ * @start: First logical block
+ * @end: Logical block following the range
+ *
+ * Delayed blocks within the range are allocated too, using their own
+ * reservation. Their data is still in the page cache, and will turn the
+ * blocks written at writeback.
+ *
+ * Return: 0 on success or a negative error, blocks allocated so far are kept.
+ */
+int toyfs_prealloc(struct inode *inode, unsigned int start, unsigned int end)
 {
-	pr_debug("inode %px off: %lld len: %d page: %px\n",
-		mapping->host, pos, len, page);
-	return generic_write_end(filp, mapping, pos, len, copied, page, fsdata);
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned int		lblk = start;
+	unsigned int		goal;
+	unsigned int		len;
+	unsigned int		got;
+	struct tfs_handle	h;
+	bool			delayed;
+	long			fsblock;
+	int			error = 0;
+
+	while (lblk < end && !error) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+
+		error = toyfs_journal_start(sb, &h, TFS_JOURNAL_CREDITS);
+		if (error)
+			break;
+
+		down_write(&tino->i_map_lock);
+		fsblock = toyfs_ext_lookup(tino, lblk, &len);
+		len = min(len, end - lblk);
+		if (fsblock != TFS_INVALID) {
+			up_write(&tino->i_map_lock);
+			toyfs_journal_stop(&h);
+			lblk += len;
+			continue;
+		}
+
+		delayed = toyfs_delalloc_lookup(tino, lblk, &len);
+		goal = toyfs_ext_goal(tino, lblk);
+		if (delayed)
+			fsblock = toyfs_balloc_reserved(sb, goal, len, &got);
+		else
+			fsblock = toyfs_balloc_range(sb, goal, len, &got);
+		if (fsblock < 0) {
+			error = fsblock;
+			goto next;
+		}
+
+		error = toyfs_ext_insert(inode, lblk, fsblock, got, true);
+		if (error) {
+			toyfs_bfree_range(sb, fsblock, got);
+			goto next;
+		}
+
+		if (delayed)
+			__toyfs_delalloc_release(inode, lblk, lblk + got, false);
+
+		toyfs_inode_add_blocks(inode, got);
+		toyfs_journal_inode_locked(inode);
+		lblk += got;
+next:
+		up_write(&tino->i_map_lock);
+		toyfs_journal_stop(&h);
+	}
+
+	return error;
 }
 
+/*
+ * Inline data
+ *
+ * Small files are created inline on versioned filesystems: their data lives
+ * in i_data of the on-disk inode, within the pinned inode table buffer, and
+ * is mapped as IOMAP_INLINE. iomap copies it in and out of the page cache
+ * itself, and marks the inode dirty after every write, so the folio is never
+ * dirty and writeback never sees the file.
+ *
+ * Anything which would take the file past TFS_INLINE_SIZE, or needs blocks
+ * (mmap writes, O_DIRECT writes, fallocate), turns it into a regular block
+ * mapped file first, with toyfs_inline_convert().
+ */
+
+/*
+ * toyfs_inline_iomap_begin()
+ *	- Map the inline data of @inode, or return -ENODATA if it has none
+ *	- There is nothing past TFS_INLINE_SIZE but a hole, nobody should
+ *	  write there before having the inode converted.
+ */
+static int toyfs_inline_iomap_begin(struct inode *inode, loff_t pos,
+				    loff_t length, unsigned flags,
+				    struct iomap *iomap)
+{
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	struct tfs_dinode	*dip;
+	struct buffer_head	*bh;
+	int			error = 0;
+
+	down_read(&tino->i_map_lock);
+	if (!tino->i_inline) {
+		error = -ENODATA;
+		goto out_unlock;
+	}
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->addr = IOMAP_NULL_ADDR;
+	iomap->validity_cookie = tino->i_map_seq;
+
+	if (pos >= TFS_INLINE_SIZE) {
+		if (WARN_ON_ONCE((flags & IOMAP_WRITE) && !(flags & IOMAP_ZERO))) {
+			error = -EIO;
+			goto out_unlock;
+		}
+		iomap->type = IOMAP_HOLE;
+		iomap->offset = pos;
+		iomap->length = length;
+		goto out_unlock;
+	}
+
+	dip = toyfs_get_dinode(inode->i_sb, inode->i_ino, &bh);
+	if (IS_ERR(dip)) {
+		error = PTR_ERR(dip);
+		goto out_unlock;
+	}
+
+	iomap->type = IOMAP_INLINE;
+	iomap->offset = 0;
+	iomap->length = TFS_INLINE_SIZE;
+	iomap->inline_data = dip->i_data;
+out_unlock:
+	up_read(&tino->i_map_lock);
+	return error;
+}
+
+/**
+ * toyfs_inline_convert() - Move the data of an inline inode to a block
+ * @inode: The inode in question
+ *
+ * The data is left in the page cache, in a dirty folio covering a delayed
+ * block, and gets a real block at writeback like any other buffered write.
+ * Empty files just drop the flag.
+ *
+ * Return: 0 on success (or if the inode wasn't inline), or a negative error
+ */
+int toyfs_inline_convert(struct inode *inode)
+{
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	struct tfs_dinode	*dip;
+	struct buffer_head	*bh;
+	struct folio		*folio;
+	unsigned int		len = 1;
+	loff_t			size;
+	void			*kaddr;
+	int			error = 0;
+
+	if (!READ_ONCE(tino->i_inline))
+		return 0;
+
+	/* Folio lock first, then i_map_lock, just like writeback */
+	down_read(&tino->i_delalloc_sem);
+	folio = __filemap_get_folio(inode->i_mapping, 0,
+				    FGP_LOCK | FGP_ACCESSED | FGP_CREAT,
+				    mapping_gfp_mask(inode->i_mapping));
+	if (IS_ERR(folio)) {
+		up_read(&tino->i_delalloc_sem);
+		return PTR_ERR(folio);
+	}
+	folio_wait_stable(folio);
+
+	down_write(&tino->i_map_lock);
+	if (!tino->i_inline)
+		goto out_unlock;
+
+	size = i_size_read(inode);
+	if (size) {
+		if (!folio_test_uptodate(folio)) {
+			dip = toyfs_get_dinode(inode->i_sb, inode->i_ino, &bh);
+			if (IS_ERR(dip)) {
+				error = PTR_ERR(dip);
+				goto out_unlock;
+			}
+
+			folio_zero_range(folio, 0, folio_size(folio));
+			kaddr = kmap_local_folio(folio, 0);
+			memcpy(kaddr, dip->i_data, size);
+			kunmap_local(kaddr);
+			folio_mark_uptodate(folio);
+		}
+
+		error = toyfs_delalloc_reserve(inode, 0, &len);
+		if (error)
+			goto out_unlock;
+		folio_mark_dirty(folio);
+	}
+
+	tino->i_inline = false;
+	tino->i_map_seq++;
+	mark_inode_dirty(inode);
+	pr_debug("inode %lu: %lld bytes of inline data moved out\n",
+		 inode->i_ino, size);
+out_unlock:
+	up_write(&tino->i_map_lock);
+	folio_unlock(folio);
+	folio_put(folio);
+	up_read(&tino->i_delalloc_sem);
+	return error;
+}
+
+static int toyfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+			     unsigned flags, struct iomap *iomap,
+			     struct iomap *srcmap)
+{
+	bool write = (flags & IOMAP_WRITE) && !(flags & IOMAP_ZERO);
+	int error;
+
+	error = toyfs_inline_iomap_begin(inode, pos, length, flags, iomap);
+	if (error != -ENODATA)
+		return error;
+
+	return __toyfs_iomap_begin(inode, pos, length, flags, iomap,
+				   write && (flags & IOMAP_DIRECT),
+				   write && !(flags & IOMAP_DIRECT));
+}
+
+/*
+ * Give back the reservation of the delayed blocks a short buffered write
+ * didn't get to. iomap only hands us the ranges not dirty in the page cache.
+ */
+static int toyfs_delalloc_punch(struct inode *inode, loff_t offset,
+				loff_t length)
+{
+	unsigned int blkbits = inode->i_blkbits;
+
+	toyfs_delalloc_release(inode, DIV_ROUND_UP(offset, 1 << blkbits),
+			       DIV_ROUND_UP(offset + length, 1 << blkbits));
+	return 0;
+}
+
+/*
+ * toyfs_iomap_end()
+ *	- The iomap code updates i_size when writing past EOF, but it is
+ *	  our job to get it written back.
+ *	- Blocks reserved for a buffered write which came out short are
+ *	  released.
+ */
+static int toyfs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+			   ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+		mark_inode_dirty(inode);
+
+	if (iomap->type == IOMAP_DELALLOC && written < length)
+		return iomap_file_buffered_write_punch_delalloc(inode, iomap,
+					pos, length, written,
+					toyfs_delalloc_punch);
+	return 0;
+}
+
+const struct iomap_ops toyfs_iomap_ops = {
+	.iomap_begin	= toyfs_iomap_begin,
+	.iomap_end	= toyfs_iomap_end,
+};
+
+/*
+ * toyfs_map_blocks()
+ *	- Map the @len dirty bytes at @offset being written back, or more
+ *	- Writeback hands us folios in file order, so the previous mapping is
+ *	  reused as long as it covers @offset and the block map hasn't changed
+ *	  since. This lets contiguous dirty folios be merged into a single bio.
+ *	- Delayed blocks were allocated by toyfs_writepages() already, so
+ *	  this is a plain lookup, a whole extent is mapped at once. Nothing
+ *	  may be changed here, we are called with the folio locked.
+ */
+static int toyfs_map_blocks(struct iomap_writepage_ctx *wpc,
+			    struct inode *inode, loff_t offset,
+			    unsigned int len)
+{
+	struct tfs_inode_info *tino = container_of(inode, struct tfs_inode_info,
+						    vfs_inode);
+	int error;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length &&
+	    wpc->iomap.validity_cookie == READ_ONCE(tino->i_map_seq))
+		return 0;
+
+	error = __toyfs_iomap_begin(inode, offset, len, 0, &wpc->iomap,
+				    false, false);
+	if (!error && WARN_ON_ONCE(wpc->iomap.type == IOMAP_DELALLOC))
+		error = -EIO;
+	return error;
+}
+
+/**
+ * toyfs_convert_unwritten() - Mark unwritten blocks written
+ * @inode: The inode written to
+ * @pos: File offset of the write
+ * @len: Length of the write
+ *
+ * Called once writeback or a direct write into unwritten blocks is done,
+ * never earlier: the blocks then read as the data just written, not as
+ * zeros. Unwritten blocks around the range are left alone.
+ *
+ * Context: Starts a handle, no folio lock may be held.
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_convert_unwritten(struct inode *inode, loff_t pos, loff_t len)
+{
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned int		blkbits = inode->i_blkbits;
+	struct tfs_handle	h;
+	int			error;
+
+	error = toyfs_journal_start(inode->i_sb, &h, TFS_JOURNAL_CREDITS);
+	if (error)
+		return error;
+
+	down_write(&tino->i_map_lock);
+	error = toyfs_ext_set_unwritten(inode, pos >> blkbits,
+					DIV_ROUND_UP(pos + len,
+						     i_blocksize(inode)),
+					false);
+	if (!error)
+		toyfs_journal_inode_locked(inode);
+	up_write(&tino->i_map_lock);
+	toyfs_journal_stop(&h);
+	return error;
+}
+
+/**
+ * toyfs_end_io() - Complete writeback into unwritten blocks
+ * @work: i_ioend_work of the inode
+ *
+ * The folios only end writeback once their blocks are marked written, so
+ * fsync, and the folios being reclaimed, wait for that too.
+ */
+void toyfs_end_io(struct work_struct *work)
+{
+	struct tfs_inode_info	*tino = container_of(work, struct tfs_inode_info, i_ioend_work);
+	struct iomap_ioend	*ioend;
+	unsigned long		flags;
+	LIST_HEAD(list);
+	int			error;
+
+	spin_lock_irqsave(&tino->i_ioend_lock, flags);
+	list_replace_init(&tino->i_ioend_list, &list);
+	spin_unlock_irqrestore(&tino->i_ioend_lock, flags);
+
+	while ((ioend = list_first_entry_or_null(&list, struct iomap_ioend,
+						 io_list))) {
+		list_del_init(&ioend->io_list);
+		error = blk_status_to_errno(ioend->io_bio->bi_status);
+		if (!error)
+			error = toyfs_convert_unwritten(ioend->io_inode,
+							ioend->io_offset,
+							ioend->io_size);
+		iomap_finish_ioends(ioend, error);
+	}
+}
+
+/*
+ * Bio completion can't start a handle, hand the ioend over to the inode's
+ * work, which completes them all in submission order.
+ */
+static void toyfs_end_bio(struct bio *bio)
+{
+	struct iomap_ioend	*ioend = bio->bi_private;
+	struct inode		*inode = ioend->io_inode;
+	struct tfs_fs_info	*tfi = inode->i_sb->s_fs_info;
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned long		flags;
+
+	spin_lock_irqsave(&tino->i_ioend_lock, flags);
+	if (list_empty(&tino->i_ioend_list))
+		queue_work(tfi->s_ioend_wq, &tino->i_ioend_work);
+	list_add_tail(&ioend->io_list, &tino->i_ioend_list);
+	spin_unlock_irqrestore(&tino->i_ioend_lock, flags);
+}
+
+/* Only writes into unwritten blocks need more than iomap's own completion */
+static int toyfs_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+	if (ioend->io_type == IOMAP_UNWRITTEN)
+		ioend->io_bio->bi_end_io = toyfs_end_bio;
+	return status;
+}
+
+static const struct iomap_writeback_ops toyfs_writeback_ops = {
+	.map_blocks	= toyfs_map_blocks,
+	.prepare_ioend	= toyfs_prepare_ioend,
+};
+
+/*
+ * toyfs_delalloc_flush()
+ *	- Allocate the delayed blocks within [@start, @end), a whole delayed
+ *	  run at once, up to what a single allocation can return and never
+ *	  past EOF.
+ *	- One handle per allocation, no folio may be locked.
+ */
+static int toyfs_delalloc_flush(struct inode *inode, unsigned int start,
+				unsigned int end)
+{
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned long		index = start;
+	unsigned int		eof;
+	unsigned int		lblk;
+	unsigned int		len;
+	unsigned int		got;
+	struct tfs_handle	h;
+	long			fsblock;
+	int			error = 0;
+
+	eof = DIV_ROUND_UP(i_size_read(inode), i_blocksize(inode));
+	end = min(end, eof);
+
+	while (index < end &&
+	       xa_find(&tino->i_delalloc, &index, end - 1, XA_PRESENT)) {
+		lblk = index;
+
+		error = toyfs_journal_start(sb, &h, TFS_JOURNAL_CREDITS);
+		if (error)
+			break;
+
+		down_write(&tino->i_map_lock);
+		fsblock = toyfs_ext_lookup(tino, lblk, &len);
+		len = min(len, end - lblk);
+		if (fsblock != TFS_INVALID ||
+		    !toyfs_delalloc_lookup(tino, lblk, &len)) {
+			/* Picked by a direct write meanwhile */
+			index = lblk + len;
+			goto next;
+		}
+
+		fsblock = toyfs_balloc_reserved(sb, toyfs_ext_goal(tino, lblk),
+						len, &got);
+		if (fsblock < 0) {
+			error = fsblock;
+			goto next;
+		}
+
+		error = toyfs_ext_insert(inode, lblk, fsblock, got, false);
+		if (error) {
+			toyfs_bfree_range(sb, fsblock, got);
+			goto next;
+		}
+
+		__toyfs_delalloc_release(inode, lblk, lblk + got, false);
+		toyfs_inode_add_blocks(inode, got);
+		toyfs_journal_inode_locked(inode);
+		index = lblk + got;
+next:
+		up_write(&tino->i_map_lock);
+		toyfs_journal_stop(&h);
+		if (error)
+			break;
+	}
+
+	return error;
+}
+
+/*
+ * toyfs_writepages()
+ *	- Allocate the delayed blocks of the range first, iomap then writes
+ *	  back folios which are all mapped.
+ *	- i_delalloc_sem keeps buffered writes and faults from adding delayed
+ *	  blocks behind our back until iomap is done.
+ */
 int toyfs_writepages(
 		    struct address_space *mapping,
 		    struct writeback_control *wbc)
 {
-	pr_debug("writing pages");
-	return mpage_writepages(mapping, wbc, toyfs_get_block);
+	struct inode		*inode = mapping->host;
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	struct iomap_writepage_ctx wpc = { };
+	unsigned int		blkbits = inode->i_blkbits;
+	unsigned int		start = 0;
+	unsigned int		end = toyfs_max_file_blocks(inode->i_sb);
+	int			error;
+
+	trace_toyfs_writepages(inode, wbc);
+
+	if (!wbc->range_cyclic) {
+		start = min_t(loff_t, wbc->range_start >> blkbits, end);
+		end = min_t(loff_t, (wbc->range_end >> blkbits) + 1, end);
+	}
+
+	down_write(&tino->i_delalloc_sem);
+	error = toyfs_delalloc_flush(inode, start, end);
+	if (!error)
+		error = iomap_writepages(mapping, wbc, &wpc,
+					 &toyfs_writeback_ops);
+	up_write(&tino->i_delalloc_sem);
+	return error;
 }
 
 int toyfs_read_folio(struct file *filp, struct folio *folio)
 {
-	pr_debug("reading file %p\n", filp);
-	return block_read_full_folio(folio, toyfs_get_block);
+	return iomap_read_folio(folio, &toyfs_iomap_ops);
+}
+
+/*
+ * toyfs_readahead()
+ *	- Read a whole readahead window in one go. Each call to
+ *	  toyfs_iomap_begin() maps a whole extent, so a window within a
+ *	  contiguous file is read with a single bio, instead of one
+ *	  synchronous ->read_folio() per folio.
+ */
+static void toyfs_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &toyfs_iomap_ops);
+}
+
+static sector_t toyfs_bmap(struct address_space *mapping, sector_t block)
+{
+	return iomap_bmap(mapping, block, &toyfs_iomap_ops);
 }
 
 struct address_space_operations	toyfs_aops = {
-	.dirty_folio		= block_dirty_folio,
-	.invalidate_folio	= block_invalidate_folio,
-	.write_begin		= toyfs_write_begin,
-	.write_end		= toyfs_write_end,
+	.dirty_folio		= iomap_dirty_folio,
+	.invalidate_folio	= iomap_invalidate_folio,
+	.release_folio		= iomap_release_folio,
+	.is_partially_uptodate	= iomap_is_partially_uptodate,
+	.migrate_folio		= filemap_migrate_folio,
+	.error_remove_folio	= generic_error_remove_folio,
 	.writepages		= toyfs_writepages,
 	.read_folio		= toyfs_read_folio,
+	.readahead		= toyfs_readahead,
+	.bmap			= toyfs_bmap,
 };
-
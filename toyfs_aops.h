@@ -4,5 +4,6 @@
 #define __TOYFS_AOPS_H
 
 extern struct address_space_operations toyfs_aops;
+extern const struct iomap_ops toyfs_iomap_ops;
 
 #endif /* __TOYFS_IOPS_H */
@@ -4,118 +4,748 @@
 
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
 #include "toyfs_types.h"
+#include "toyfs_trace.h"
+
+/*
+ * toyfs_bmap_get()
+ *	- Get the buffer of bitmap block @idx, and its in-core allocation copy
+ *	  in *@mapp
+ *	- The copy is made the first time the block is needed. Until then,
+ *	  nothing was freed in it, so it is the same as the on-disk bitmap.
+ */
+static struct buffer_head *toyfs_bmap_get(struct super_block *sb,
+					  unsigned int idx,
+					  unsigned long **mapp)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct buffer_head	*bh;
+	unsigned long		*map;
+
+	bh = toyfs_meta_bh(sb, tfi->s_bmap_bh, tfi->s_bmap_start, idx);
+	if (!bh)
+		return NULL;
+
+	*mapp = READ_ONCE(tfi->s_bmap_alloc[idx]);
+	if (*mapp)
+		return bh;
+
+	map = kmalloc(sb->s_blocksize, GFP_NOFS);
+	if (!map)
+		return NULL;
+
+	spin_lock(&tfi->s_bmap_lock);
+	if (!tfi->s_bmap_alloc[idx]) {
+		memcpy(map, bh->b_data, sb->s_blocksize);
+		WRITE_ONCE(tfi->s_bmap_alloc[idx], map);
+		map = NULL;
+	}
+	*mapp = tfi->s_bmap_alloc[idx];
+	spin_unlock(&tfi->s_bmap_lock);
+
+	kfree(map);
+	return bh;
+}
+
+/*
+ * toyfs_bmap_claim()
+ *	- Search the bitmap for the first free block within [start, end), and
+ *	  claim it along with the free blocks following it, up to @want blocks
+ *	- The search is done a machine word at a time within each
+ *	  bitmap block, only reading the bitmap blocks we need. The in-core
+ *	  copy is searched, blocks pending a commit to be free aren't.
+ *	- Bitmap blocks are read (which may sleep) before taking s_bmap_lock,
+ *	  the lock is only held to search and update a block already in-core.
+ *	- Only the in-core copy is updated, the on-disk bitmap is only updated
+ *	  for the blocks actually handed out, see toyfs_bmap_mark().
+ *	- A run never crosses a bitmap block boundary, so the whole allocation
+ *	  is recorded with a single bitmap buffer update.
+ *
+ * Return: The first block claimed, -ENOSPC if there are no free blocks in
+ *	   the range or -EIO if we couldn't read the bitmap.
+ */
+static int toyfs_bmap_claim(struct super_block *sb,
+			    unsigned int start,
+			    unsigned int end,
+			    unsigned int want,
+			    unsigned int *got)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head	*bh;
+	unsigned long		*map;
+	unsigned int		idx;
+	unsigned int		base;
+	unsigned int		nbits;
+	unsigned int		bit;
+	unsigned int		last;
+
+	while (start < end) {
+		idx = start / bits;
+		base = idx * bits;
+		nbits = min(bits, end - base);
+
+		bh = toyfs_bmap_get(sb, idx, &map);
+		if (!bh)
+			return -EIO;
+
+		spin_lock(&tfi->s_bmap_lock);
+		bit = find_next_zero_bit(map, nbits, start - base);
+		toyfs_stat_add(tfi, TFS_STAT_BMAP_WORDS,
+			       min(bit, nbits - 1) / BITS_PER_LONG -
+			       (start - base) / BITS_PER_LONG + 1);
+		if (bit < nbits) {
+			/* Extend the run up to the next used block */
+			last = find_next_bit(map, min(nbits, bit + want), bit);
+			bitmap_set(map, bit, last - bit);
+			spin_unlock(&tfi->s_bmap_lock);
+
+			*got = last - bit;
+			trace_toyfs_bmap_claim(sb, idx, start, want, base + bit,
+					       *got);
+			return base + bit;
+		}
+		spin_unlock(&tfi->s_bmap_lock);
+
+		trace_toyfs_bmap_claim(sb, idx, start, want, -ENOSPC, 0);
+		start = base + nbits;
+	}
+
+	return -ENOSPC;
+}
+
+/*
+ * toyfs_bmap_mark()
+ *	- Mark a run of blocks claimed by toyfs_bmap_claim() as used on-disk,
+ *	  as they are handed out
+ */
+static void toyfs_bmap_mark(struct super_block *sb, unsigned int start,
+			    unsigned int len)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head	*bh;
+	unsigned long		*map;
+
+	/* Pinned when the run was claimed, and runs never cross bitmap blocks */
+	bh = toyfs_bmap_get(sb, start / bits, &map);
+	if (!bh)
+		return;
+
+	spin_lock(&tfi->s_bmap_lock);
+	bitmap_set((unsigned long *)bh->b_data, start % bits, len);
+	spin_unlock(&tfi->s_bmap_lock);
+
+	toyfs_journal_dirty(sb, bh);
+}
+
+/*
+ * toyfs_bmap_release()
+ *	- Clear a run of blocks claimed by toyfs_bmap_claim() but never handed
+ *	  out, e.g. the leftovers of a reservation pool
+ *	- These blocks were never accounted as used, s_bfree is left alone,
+ *	  nor marked on-disk.
+ */
+static void toyfs_bmap_release(struct super_block *sb, unsigned int start,
+			       unsigned int len)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head	*bh;
+	unsigned long		*map;
+
+	/* Pinned when the run was claimed, and runs never cross bitmap blocks */
+	bh = toyfs_bmap_get(sb, start / bits, &map);
+	if (!bh)
+		return;
+
+	spin_lock(&tfi->s_bmap_lock);
+	bitmap_clear(map, start % bits, len);
+	spin_unlock(&tfi->s_bmap_lock);
+
+	trace_toyfs_bmap_release(sb, start, len);
+}
+
+/*
+ * toyfs_bpool_take()
+ *	- Empty @pool, handing its blocks back to the caller
+ */
+static unsigned int toyfs_bpool_take(struct tfs_bpool *pool,
+				     unsigned int *start)
+{
+	unsigned int len;
+
+	spin_lock(&pool->lock);
+	*start = pool->start;
+	len = pool->len;
+	pool->len = 0;
+	spin_unlock(&pool->lock);
+
+	return len;
+}
 
 /**
- * toyfs_balloc() - Alloc a new block from the filesystem data blocks
+ * toyfs_bpool_drain() - Return all reserved blocks to the bitmap
+ * @sb: Superblock of the target FS
+ *
+ * Empty every CPU's reservation pool. Called when the bitmap runs out of
+ * free blocks, so space held in other CPUs' pools can still be allocated.
+ */
+void toyfs_bpool_drain(struct super_block *sb)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		start;
+	unsigned int		len;
+	int cpu;
+
+	if (!tfi->s_bpool)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		len = toyfs_bpool_take(per_cpu_ptr(tfi->s_bpool, cpu), &start);
+		if (len)
+			toyfs_bmap_release(sb, start, len);
+	}
+}
+
+/**
+ * toyfs_bpool_init() - Setup the per-CPU block reservation pools
  * @sb: Superblock of the target FS
  *
- * Search the bitmap block for an available block, splitting the search
- * in groups of 8-bits to make the search simpler and with more iteractions
- * than if we had used larger number of bits.
+ * Pools are only worth it if each CPU can reserve a decent run without
+ * holding a significant share of the filesystem, they are disabled on small
+ * filesystems. Legacy filesystems are always small enough not to need them,
+ * and never get any.
+ *
+ * Return: Zero in case of success or negative value otherwise
+ */
+int toyfs_bpool_init(struct super_block *sb)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		ndata = tfi->s_nblocks - tfi->s_data_start;
+	int cpu;
+
+	tfi->s_bpool_batch = min_t(unsigned int, TFS_BPOOL_BLOCKS,
+				   ndata / (4 * num_possible_cpus()));
+	if (toyfs_is_legacy(tfi) || tfi->s_bpool_batch < 2) {
+		tfi->s_bpool_batch = 0;
+		return 0;
+	}
+
+	tfi->s_bpool = alloc_percpu(struct tfs_bpool);
+	if (!tfi->s_bpool)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(tfi->s_bpool, cpu)->lock);
+	return 0;
+}
+
+/*
+ * toyfs_bmap_alloc()
+ *	- Claim a run from the bitmap, starting at @goal and wrapping around
+ *	  to the first data block if needed
+ *	- If the bitmap is full, the free blocks left (if any) are sitting in
+ *	  the reservation pools. Drain them and try again.
+ */
+static int toyfs_bmap_alloc(struct super_block *sb, unsigned int goal,
+			    unsigned int want, unsigned int *got)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	bool			drained = false;
+	int			block;
+
+again:
+	block = toyfs_bmap_claim(sb, goal, tfi->s_nblocks, want, got);
+	if (block == -ENOSPC)
+		block = toyfs_bmap_claim(sb, tfi->s_data_start, goal, want, got);
+	if (block == -ENOSPC && tfi->s_bpool && !drained) {
+		toyfs_bpool_drain(sb);
+		drained = true;
+		goto again;
+	}
+
+	return block;
+}
+
+/*
+ * __toyfs_balloc_range()
+ *	- See toyfs_balloc_range(), @reserved tells whether the blocks were
+ *	  already deducted from s_bfree
+ */
+static int __toyfs_balloc_range(struct super_block *sb, unsigned int goal,
+				unsigned int want, unsigned int *got,
+				bool reserved)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct tfs_bpool	*pool = NULL;
+	unsigned int		claimed;
+	unsigned int		start;
+	unsigned int		len;
+	bool			nogoal;
+	int			block;
+
+	*got = 0;
+	if (!want)
+		return -EINVAL;
+
+	if (!reserved && percpu_counter_compare(&tfi->s_bfree, 1) < 0) {
+		block = -ENOSPC;
+		goto out_trace;
+	}
+
+	nogoal = goal < tfi->s_data_start || goal >= tfi->s_nblocks;
+
+	if (tfi->s_bpool) {
+		pool = raw_cpu_ptr(tfi->s_bpool);
+
+		spin_lock(&pool->lock);
+		if (pool->len && (nogoal || goal == pool->start)) {
+			block = pool->start;
+			*got = min(want, pool->len);
+			pool->start += *got;
+			pool->len -= *got;
+			spin_unlock(&pool->lock);
+			toyfs_bmap_mark(sb, block, *got);
+			goto out;
+		}
+		start = pool->start;
+		len = pool->len;
+		pool->len = 0;
+		spin_unlock(&pool->lock);
+
+		if (len)
+			toyfs_bmap_release(sb, start, len);
+	}
+
+	if (nogoal)
+		goal = READ_ONCE(tfi->s_next_goal);
+	if (goal < tfi->s_data_start || goal >= tfi->s_nblocks)
+		goal = tfi->s_data_start;
+
+	block = toyfs_bmap_alloc(sb, goal, pool ? max(want, tfi->s_bpool_batch) :
+				 want, &claimed);
+	if (block < 0)
+		goto out_trace;
+
+	WRITE_ONCE(tfi->s_next_goal, block + claimed);
+	*got = min(want, claimed);
+
+	/*
+	 * Keep the leftovers for our next allocation, unless somebody else
+	 * already refilled the pool while we were searching the bitmap.
+	 */
+	if (claimed > *got) {
+		spin_lock(&pool->lock);
+		if (!pool->len) {
+			pool->start = block + *got;
+			pool->len = claimed - *got;
+			claimed = *got;
+		}
+		spin_unlock(&pool->lock);
+
+		if (claimed > *got)
+			toyfs_bmap_release(sb, block + *got, claimed - *got);
+	}
+	toyfs_bmap_mark(sb, block, *got);
+
+out:
+	if (!reserved)
+		percpu_counter_sub(&tfi->s_bfree, *got);
+	toyfs_stat_add(tfi, TFS_STAT_BALLOC_BLOCKS, *got);
+out_trace:
+	toyfs_stat_add(tfi, TFS_STAT_BALLOC_CALLS, 1);
+	trace_toyfs_balloc(sb, goal, want, block, *got, reserved);
+	return block;
+}
+
+/**
+ * toyfs_balloc_range() - Alloc a contiguous run of data blocks
+ * @sb: Superblock of the target FS
+ * @goal: Preferred first block, or 0 to use the allocation cursor
+ * @want: Maximum number of blocks to allocate
+ * @got: Returns the number of blocks actually allocated
  *
- * Context: We may have different processes allocating/freeing blocks at the
- *	    same time, perhaps this should be protected somehow.
+ * Search the bitmap for an available block, starting at @goal and wrapping
+ * around to the first data block if needed, then extend the allocation over
+ * the free blocks following it, up to @want blocks.
+ *
+ * Callers extending a file should pass the block following the file's last
+ * block as @goal, so files are laid out contiguously whenever possible.
+ * Without a valid goal, we start at the allocation cursor, which points past
+ * the last allocated block. This spreads allocations across the device instead
+ * of piling everything at its beginning, and avoids rescanning the fully
+ * allocated bitmap words on every allocation.
+ *
+ * To keep concurrent writers off s_bmap_lock, each CPU keeps a pool of
+ * blocks reserved from the bitmap in batches of s_bpool_batch blocks. As long
+ * as the goal is where the local pool starts (i.e. a file being extended from
+ * the same CPU), or there is no goal at all, blocks come from the pool.
+ * Otherwise the pool is handed back and refilled at the goal, so files stay as
+ * contiguous as they would without pools.
+ *
+ * Reserved blocks are only marked as used in the in-core copy of the bitmap,
+ * and still counted in s_bfree until they are handed out, so statfs stays
+ * exact. The on-disk bitmap never holds them, a crash doesn't leak them.
+ *
+ * Blocks reserved by toyfs_reserve_blocks() are allocated with
+ * toyfs_balloc_reserved() instead, which doesn't account them twice.
+ *
+ * Callers wanting more blocks than returned in @got should simply call us
+ * again.
+ *
+ * Context: Safe against concurrent allocations and frees, the bitmap and
+ *	    the pools are the only authority on which blocks are free.
+ *	    s_bfree is only used to bail out early on a full filesystem.
+ *
+ * Return: First block number of the allocated run, or
+ *	   negative value in case of error
+ */
+int toyfs_balloc_range(struct super_block *sb, unsigned int goal,
+		       unsigned int want, unsigned int *got)
+{
+	return __toyfs_balloc_range(sb, goal, want, got, false);
+}
+
+/**
+ * toyfs_balloc_reserved() - Alloc a contiguous run of reserved data blocks
+ * @sb: Superblock of the target FS
+ * @goal: Preferred first block, or 0 to use the allocation cursor
+ * @want: Maximum number of blocks to allocate, all of them reserved
+ * @got: Returns the number of blocks actually allocated
+ *
+ * Same as toyfs_balloc_range(), for blocks already deducted from s_bfree by
+ * toyfs_reserve_blocks(). The reservation of the @got blocks allocated is
+ * consumed, the caller still holds it for the rest.
+ *
+ * Return: First block number of the allocated run, or
+ *	   negative value in case of error
+ */
+int toyfs_balloc_reserved(struct super_block *sb, unsigned int goal,
+			  unsigned int want, unsigned int *got)
+{
+	return __toyfs_balloc_range(sb, goal, want, got, true);
+}
+
+/**
+ * toyfs_reserve_blocks() - Reserve space for blocks to be allocated later
+ * @sb: Superblock of the target FS
+ * @count: Number of blocks
+ *
+ * Reserved blocks are deducted from s_bfree right away, so statfs and other
+ * allocations see them as used, but nothing is allocated in the bitmap until
+ * toyfs_balloc_reserved() is called.
+ *
+ * Blocks freed by the running transaction are only counted in s_bfree once
+ * it commits, callers may want to retry with toyfs_should_retry_alloc().
+ *
+ * Return: Zero in case of success or -ENOSPC
+ */
+int toyfs_reserve_blocks(struct super_block *sb, unsigned int count)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+
+	percpu_counter_sub(&tfi->s_bfree, count);
+	if (percpu_counter_compare(&tfi->s_bfree, 0) < 0) {
+		percpu_counter_add(&tfi->s_bfree, count);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+/**
+ * toyfs_should_retry_alloc() - Check whether a failed allocation may succeed
+ * @sb: Superblock of the target FS
+ * @retries: Number of retries so far, zero on the first call
+ *
+ * Blocks freed by the running transaction don't count as free until it
+ * commits. If there are any, commit it so that the -ENOSPC allocation can
+ * be retried.
+ *
+ * Context: Forces a commit, no handle, folio lock or i_map_lock may be held.
+ *
+ * Return: true if the caller should retry
+ */
+bool toyfs_should_retry_alloc(struct super_block *sb, int *retries)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+
+	if (!tfi->s_journal || (*retries)++ >= TFS_ALLOC_RETRIES)
+		return false;
+	if (!READ_ONCE(tfi->s_bfree_pending))
+		return false;
+	return !toyfs_journal_force(sb, READ_ONCE(tfi->s_journal->j_tid));
+}
+
+/**
+ * toyfs_unreserve_blocks() - Give back unused reserved blocks
+ * @sb: Superblock of the target FS
+ * @count: Number of blocks
+ */
+void toyfs_unreserve_blocks(struct super_block *sb, unsigned int count)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+
+	percpu_counter_add(&tfi->s_bfree, count);
+}
+
+/**
+ * toyfs_balloc() - Alloc a new block from the filesystem data blocks
+ * @sb: Superblock of the target FS
+ * @goal: Preferred block number, or 0 to use the allocation cursor
+ *
+ * Single block version of toyfs_balloc_range()
  *
  * Return: Block number of the allocated block, or
  *	   negative value in case of error
  */
-int toyfs_balloc(struct super_block *sb)
+int toyfs_balloc(struct super_block *sb, unsigned int goal)
+{
+	unsigned int got;
+
+	return toyfs_balloc_range(sb, goal, 1, &got);
+}
+
+/**
+ * toyfs_bfree_range() - Mark a run of data blocks as free
+ * @sb: Superblock of the target FS
+ * @start: First block to be freed
+ * @len: Number of blocks
+ *
+ * The bitmap lock is taken once per bitmap block the run spans, not once
+ * per block.
+ *
+ * With a journal, the blocks are only handed back to the allocator once the
+ * transaction freeing them is committed, see toyfs_bmap_commit(). Reusing
+ * them for data any earlier would overwrite blocks which still belong to
+ * their previous owner if we crash before that.
+ *
+ * Return: The number of blocks actually freed, blocks already free in the
+ *	   bitmap are skipped.
+ */
+unsigned int toyfs_bfree_range(struct super_block *sb, unsigned int start,
+			       unsigned int len)
 {
 	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
 	struct buffer_head	*bh;
-	char			*bmap;
-	unsigned int		group = 0;
-	unsigned int		block;
+	unsigned long		*map;
+	unsigned int		end = start + len;
+	unsigned int		freed = 0;
+	unsigned int		count;
+	unsigned int		base;
+	unsigned int		last;
 	unsigned int		bit;
 
-	pr_debug("Allocating new block\n");
-	if (!tfi->s_bfree)
-		return -ENOSPC;
+	/* Replay must not overwrite these blocks once they are reused */
+	toyfs_journal_forget(sb, start, len);
 
-	bh = tfi->s_bmap_bh;
-	bmap = (char *)bh->b_data;
+	while (start < end) {
+		base = start / bits * bits;
+		last = min(end, base + bits);
 
-	for (group = 0; group < TFS_MAX_BLKS / 8; group++) {
-		/* Is current group full? */
-		pr_debug("Bitmap of group %u: 0x%x\n", group, bmap[group]);
-		if (bmap[group] == 0xFF) {
-			pr_debug("No free blocks in group %u\n", group);
+		bh = toyfs_bmap_get(sb, start / bits, &map);
+		if (!bh) {
+			pr_debug("Couldn't read bitmap to free blocks [%u, %u)\n",
+				 start, last);
+			start = last;
 			continue;
 		}
-		break;
+
+		count = 0;
+		spin_lock(&tfi->s_bmap_lock);
+		for (bit = start - base; bit < last - base; bit++) {
+			if (__test_and_clear_bit(bit, (unsigned long *)bh->b_data))
+				count++;
+		}
+		if (!tfi->s_journal)
+			bitmap_clear(map, start - base, last - start);
+		else
+			tfi->s_bfree_pending += count;
+		spin_unlock(&tfi->s_bmap_lock);
+		freed += count;
+
+		toyfs_journal_dirty(sb, bh);
+		start = last;
 	}
 
-	pr_debug("Free block in group %u\n", group);
-	bit = find_next_zero_bit((const long unsigned int *)&bmap[group], 8, 0);
+	if (freed && !tfi->s_journal)
+		percpu_counter_add(&tfi->s_bfree, freed);
+	toyfs_stat_add(tfi, TFS_STAT_BFREE_BLOCKS, freed);
+	trace_toyfs_bfree(sb, end - len, len, freed);
+	return freed;
+}
 
-	/* We must have a free block here */
-	if (bit == 8)
-		BUG();
+/**
+ * toyfs_bmap_commit() - Hand the blocks a transaction freed to the allocator
+ * @sb: The filesystem in question
+ * @bh: A buffer the transaction logged
+ *
+ * Called for every buffer of a transaction once it is committed, with
+ * handles kept out. Bitmap blocks get their in-core copy synced with what
+ * is now stable on-disk, and the blocks freed in them are counted in
+ * s_bfree again. The reservation pools are only claimed in-core, and are
+ * claimed again.
+ */
+void toyfs_bmap_commit(struct super_block *sb, struct buffer_head *bh)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	unsigned int		idx = bh->b_blocknr - tfi->s_bmap_start;
+	unsigned int		base = idx * bits;
+	struct tfs_bpool	*pool;
+	unsigned long		*map;
+	unsigned int		nbits;
+	unsigned int		freed;
+	int			cpu;
 
-	pr_debug("Free bit: %u\n", bit);
-	block = (group * 8) + bit;
+	if (bh->b_blocknr < tfi->s_bmap_start || idx >= tfi->s_bmap_blocks)
+		return;
 
-	pr_debug("Found free block: %d\n", block);
+	/* Logged buffers were updated through toyfs_bmap_get() */
+	map = tfi->s_bmap_alloc[idx];
+	if (!map)
+		return;
 
-	set_bit(bit, (long unsigned int *)&bmap[group]);
-	tfi->s_bfree--;
+	nbits = min(bits, tfi->s_nblocks - base);
+	spin_lock(&tfi->s_bmap_lock);
+	freed = bitmap_weight(map, nbits);
+	bitmap_copy(map, (unsigned long *)bh->b_data, nbits);
+	if (tfi->s_bpool) {
+		for_each_possible_cpu(cpu) {
+			pool = per_cpu_ptr(tfi->s_bpool, cpu);
+			spin_lock(&pool->lock);
+			if (pool->len && pool->start >= base &&
+			    pool->start < base + nbits)
+				bitmap_set(map, pool->start - base, pool->len);
+			spin_unlock(&pool->lock);
+		}
+	}
+	freed -= bitmap_weight(map, nbits);
+	tfi->s_bfree_pending -= freed;
+	spin_unlock(&tfi->s_bmap_lock);
 
-	mark_buffer_dirty(bh);
-	return block;
+	if (freed)
+		percpu_counter_add(&tfi->s_bfree, freed);
 }
 
 /**
  * toyfs_bfree() - Mark a data block as free
- * @tfi: Toyfs in-core superblock
+ * @sb: Superblock of the target FS
  * @block: Block number to be freed
  *
- * Just clear the bit tracking that specific number @block
+ * Single block version of toyfs_bfree_range()
  */
-void toyfs_bfree(struct tfs_fs_info *tfi, int block)
+void toyfs_bfree(struct super_block *sb, int block)
 {
-	int group = block / 8;
-	int bit = block % 8;
-	clear_bit(bit,
-		  (long unsigned int *)&tfi->s_bmap_bh[group]);
+	toyfs_bfree_range(sb, block, 1);
 }
 
-int toyfs_get_block(struct inode *inode, sector_t block,
-		    struct buffer_head *bh, int create)
+/**
+ * toyfs_bmap_count_free() - Count the free blocks in the block bitmap
+ * @sb: The filesystem in question
+ *
+ * Only needed when the free block count in the superblock can't be trusted,
+ * i.e. after journal recovery.
+ *
+ * Return: The number of free blocks or -EIO if the bitmap couldn't be read
+ */
+int toyfs_bmap_count_free(struct super_block *sb)
 {
-	unsigned long		fsblock;
-	struct super_block	*sb = inode->i_sb;
-	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head	*bh;
+	unsigned int		used = 0;
+	unsigned int		nbits;
+	unsigned int		i;
 
-	fsblock = tino->i_addr[block];
+	for (i = 0; i < tfi->s_bmap_blocks; i++) {
+		bh = toyfs_meta_bh(sb, tfi->s_bmap_bh, tfi->s_bmap_start, i);
+		if (!bh)
+			return -EIO;
 
-	if (fsblock != TFS_INVALID) {
-		map_bh(bh, sb, fsblock);
-		return 0;
+		/* The last bitmap block might be partially used */
+		nbits = min(bits, tfi->s_nblocks - i * bits);
+		used += bitmap_weight((unsigned long *)bh->b_data, nbits);
 	}
 
-	/*
-	 * We are reading and have no block on disk, just return the hole and let
-	 * kernel deal with it
-	 */
-	if (!create)
-		return 0;
+	return tfi->s_nblocks - used;
+}
 
-	/* If we reach here, we are writing */
-	if (block >= TFS_MAX_INO_BLKS)
-		return -EFBIG;
+/**
+ * toyfs_bmap_free_extents() - Build a histogram of the free extents
+ * @sb: The filesystem in question
+ * @hist: Returns the number of free extents of each size
+ * @nr: Number of buckets in @hist
+ *
+ * Bucket i counts the runs of [2^i, 2^(i+1)) free blocks, the last one also
+ * counts all the larger ones. Blocks sitting in the reservation pools, or
+ * freed by a transaction not committed yet, are counted as used.
+ *
+ * Each bitmap block is copied under s_bmap_lock and scanned once dropped,
+ * so that reading the histogram never holds up allocations for more than
+ * a memcpy() of a block.
+ *
+ * Return: The number of free extents, -ENOMEM, or -EIO if the bitmap
+ *	   couldn't be read
+ */
+int toyfs_bmap_free_extents(struct super_block *sb, unsigned int *hist,
+			    unsigned int nr)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head	*bh;
+	unsigned long		*map;
+	unsigned int		run = 0;
+	unsigned int		count = 0;
+	unsigned int		nbits;
+	unsigned int		bit;
+	unsigned int		end;
+	unsigned int		i;
 
-	fsblock = toyfs_balloc(sb);
+	map = kmalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
 
-	/* If we got an error, just return it */
-	if (fsblock < 0)
-		return fsblock;
+	memset(hist, 0, nr * sizeof(*hist));
 
-	tino->i_addr[block] = fsblock;
-	tino->i_blocks++;
-	mark_inode_dirty(inode);
-	map_bh(bh, sb, fsblock);
-	set_buffer_new(bh);
+	for (i = 0; i < tfi->s_bmap_blocks; i++) {
+		bh = toyfs_meta_bh(sb, tfi->s_bmap_bh, tfi->s_bmap_start, i);
+		if (!bh) {
+			kfree(map);
+			return -EIO;
+		}
 
-	return 0;
+		nbits = min(bits, tfi->s_nblocks - i * bits);
+
+		spin_lock(&tfi->s_bmap_lock);
+		memcpy(map, READ_ONCE(tfi->s_bmap_alloc[i]) ?:
+		       (unsigned long *)bh->b_data, sb->s_blocksize);
+		spin_unlock(&tfi->s_bmap_lock);
+
+		/* Runs carry over from one bitmap block to the next */
+		for (bit = 0; bit < nbits; bit = end) {
+			end = find_next_bit(map, nbits, bit);
+			run += end - bit;
+			if (end == nbits)
+				break;
+
+			if (run) {
+				hist[min_t(unsigned int, ilog2(run), nr - 1)]++;
+				count++;
+				run = 0;
+			}
+			end = find_next_zero_bit(map, nbits, end);
+		}
+	}
+	kfree(map);
+
+	if (run) {
+		hist[min_t(unsigned int, ilog2(run), nr - 1)]++;
+		count++;
+	}
+	return count;
 }
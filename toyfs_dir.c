@@ -6,11 +6,483 @@
 #include <linux/buffer_head.h>
 #include "toyfs_types.h"
 #include "toyfs_iops.h"
+#include "toyfs_trace.h"
+
+/*
+ * Directories
+ *
+ * Legacy filesystems store directories as a plain array of tfs_dentry, so
+ * every lookup, create and unlink needs to walk (and strcmp) the whole
+ * directory.
+ *
+ * Versioned filesystems keep a name hash index on top of the dentry blocks,
+ * (see struct tfs_dx_block). Finding a name costs reading the index root,
+ * at most one leaf and the dentry blocks holding the names with a matching
+ * hash, no matter how large the directory is. Dentries never move once
+ * written, only the index entries pointing to them do.
+ */
+
+static inline bool toyfs_dir_indexed(struct inode *dir)
+{
+	return !toyfs_is_legacy(dir->i_sb->s_fs_info);
+}
+
+/*
+ * Names filling d_name are only ended by d_type, which must stay 0 on legacy
+ * filesystems, see struct tfs_dentry.
+ */
+static inline void toyfs_dir_set_type(struct inode *dir, struct tfs_dentry *de,
+				      unsigned char type)
+{
+	if (toyfs_dir_indexed(dir))
+		de->d_type = type;
+}
+
+static inline bool toyfs_dir_name_eq(struct tfs_dentry *de, const char *name)
+{
+	return !strncmp(de->d_name, name, sizeof(de->d_name));
+}
+
+/*
+ * FNV-1a. The hash is stored on disk, so it must not depend on the
+ * architecture nor on anything set up at boot time.
+ */
+u32 toyfs_name_hash(const char *name)
+{
+	u32 hash = 0x811c9dc5;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static struct buffer_head *toyfs_dir_bread(struct inode *dir, unsigned int lblk)
+{
+	struct tfs_inode_info	*tino;
+	unsigned int		blk;
+
+	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
+	blk = toyfs_ext_lookup(tino, lblk, NULL);
+	if (blk == TFS_INVALID) {
+		pr_debug("dir %lu: block %u not mapped\n", dir->i_ino, lblk);
+		return NULL;
+	}
+	return sb_bread(dir->i_sb, blk);
+}
+
+static void toyfs_dir_init_dentries(struct inode *dir, struct buffer_head *bh,
+				    unsigned int lblk)
+{
+	struct tfs_dentry	*d_array = (struct tfs_dentry *)bh->b_data;
+	int			i;
+
+	for (i = 0; i < toyfs_entries_per_block(dir); i++)
+		d_array[i].d_ino = TFS_INVALID;
+
+	toyfs_dc_free_block(dir, lblk);
+}
+
+/*
+ * toyfs_dir_grow()
+ *	- Append a new block to @dir, returning its logical block in @lblkp
+ *	- The returned buffer is zeroed and up to date, it is up to the caller
+ *	  to format it.
+ */
+static struct buffer_head *toyfs_dir_grow(struct inode *dir,
+					  unsigned int *lblkp)
+{
+	struct super_block	*sb = dir->i_sb;
+	struct tfs_inode_info	*tino;
+	struct buffer_head	*bh;
+	unsigned int		lblk;
+	int			blk;
+	int			error;
+
+	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
+	lblk = tino->i_blocks;
+	if (lblk >= toyfs_max_file_blocks(sb))
+		return ERR_PTR(-ENOSPC);
+
+	down_write(&tino->i_map_lock);
+	blk = toyfs_balloc(sb, toyfs_ext_goal(tino, lblk));
+	if (blk < 0) {
+		error = blk;
+		goto out_unlock;
+	}
+
+	error = toyfs_ext_insert(dir, lblk, blk, 1, false);
+	if (error) {
+		toyfs_bfree(sb, blk);
+		goto out_unlock;
+	}
+	toyfs_inode_add_blocks(dir, 1);
+out_unlock:
+	up_write(&tino->i_map_lock);
+	if (error)
+		return ERR_PTR(error);
+
+	toyfs_dc_grow(dir, tino->i_blocks);
+
+	bh = sb_getblk(sb, blk);
+	if (!bh)
+		return ERR_PTR(-ENOMEM);
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+
+	trace_toyfs_dir_grow(dir, lblk, blk);
+	*lblkp = lblk;
+	return bh;
+}
+
+/* Returns the index block held by @bh, or NULL if it is a dentry block */
+static inline struct tfs_dx_block *toyfs_dx_block(struct buffer_head *bh)
+{
+	struct tfs_dx_block *dxb = (struct tfs_dx_block *)bh->b_data;
+
+	return dxb->dx_magic == TFS_DX_MAGIC ? dxb : NULL;
+}
+
+/*
+ * Returns the first entry of @dxb whose hash is >= @hash, or, if @upper is
+ * set, the first one whose hash is > @hash.
+ */
+static unsigned int toyfs_dx_search(struct tfs_dx_block *dxb, u32 hash,
+				    bool upper)
+{
+	unsigned int lo = 0, hi = dxb->dx_count;
+	unsigned int mid;
+	u32 h;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		h = dxb->dx_entries[mid].dx_hash;
+
+		if (h < hash || (upper && h == hash))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Everything we need to hold on to between looking a name up in the index
+ * and updating it.
+ */
+struct toyfs_dx_path {
+	struct buffer_head	*root_bh;
+	struct buffer_head	*leaf_bh;	/* Holds a reference even if it is the root */
+	unsigned int		root_pos;	/* Root entry pointing to the leaf */
+	unsigned int		leaf_pos;	/* The name's entry or where it should go */
+	struct buffer_head	*bh;		/* Dentry block of a name found */
+	unsigned int		slot;
+	unsigned int		nread;		/* Blocks read, for tracing */
+	unsigned int		ncmp;		/* Names compared, likewise */
+};
+
+static void toyfs_dx_release(struct toyfs_dx_path *path)
+{
+	brelse(path->bh);
+	brelse(path->leaf_bh);
+	brelse(path->root_bh);
+}
+
+/*
+ * toyfs_dx_find()
+ *	- Look @name up in the index of @dir, filling in @path
+ *	- On success, the dentry block holding @name is returned in path->bh,
+ *	  otherwise path->leaf_pos tells where @name's index entry belongs to.
+ *
+ * Return: The inode number @name points to, -ENOENT if there is no such
+ *	   entry, or a negative error. @path must always be released
+ *	   with toyfs_dx_release().
+ */
+static int toyfs_dx_find(struct inode *dir, const char *name, u32 hash,
+			 struct toyfs_dx_path *path)
+{
+	struct tfs_dx_block	*root, *leaf;
+	struct tfs_dentry	*de;
+	unsigned int		lblk = TFS_INVALID;
+	unsigned int		slot;
+	unsigned int		i;
+
+	memset(path, 0, sizeof(*path));
+
+	path->root_bh = toyfs_dir_bread(dir, 0);
+	if (!path->root_bh)
+		return -EIO;
+	path->nread++;
+
+	root = toyfs_dx_block(path->root_bh);
+	if (!root)
+		return -EFSCORRUPTED;
+
+	if (root->dx_levels && !root->dx_count)
+		return -EFSCORRUPTED;
+
+	if (root->dx_levels) {
+		path->root_pos = toyfs_dx_search(root, hash, true) - 1;
+		path->leaf_bh = toyfs_dir_bread(dir,
+				root->dx_entries[path->root_pos].dx_ptr);
+		if (!path->leaf_bh)
+			return -EIO;
+		path->nread++;
+	} else {
+		path->leaf_bh = path->root_bh;
+		get_bh(path->leaf_bh);
+	}
+
+	leaf = toyfs_dx_block(path->leaf_bh);
+	if (!leaf)
+		return -EFSCORRUPTED;
+
+	for (i = toyfs_dx_search(leaf, hash, false);
+	     i < leaf->dx_count && leaf->dx_entries[i].dx_hash == hash; i++) {
+		slot = leaf->dx_entries[i].dx_ptr;
+
+		if (lblk != slot / toyfs_entries_per_block(dir)) {
+			lblk = slot / toyfs_entries_per_block(dir);
+			brelse(path->bh);
+			path->bh = toyfs_dir_bread(dir, lblk);
+			if (!path->bh)
+				return -EIO;
+			path->nread++;
+		}
+
+		de = (struct tfs_dentry *)path->bh->b_data;
+		de += slot % toyfs_entries_per_block(dir);
+		if (de->d_ino == TFS_INVALID)
+			continue;
+		path->ncmp++;
+		if (toyfs_dir_name_eq(de, name)) {
+			path->leaf_pos = i;
+			path->slot = slot;
+			return de->d_ino;
+		}
+	}
+
+	brelse(path->bh);
+	path->bh = NULL;
+	path->leaf_pos = i;
+	return -ENOENT;
+}
+
+/*
+ * toyfs_dx_make_room()
+ *	- Make sure the leaf in @path has room for a new entry, splitting it
+ *	  in two if needed, and point @path to the half @hash belongs to.
+ *	- Leaves are split on a hash boundary, so all entries with the same
+ *	  hash always live within the same leaf.
+ *	- When the root is the only leaf, its entries are first moved to a
+ *	  leaf of their own.
+ */
+static int toyfs_dx_make_room(struct inode *dir, struct toyfs_dx_path *path,
+			      u32 hash)
+{
+	struct tfs_dx_block	*root = toyfs_dx_block(path->root_bh);
+	struct tfs_dx_block	*leaf = toyfs_dx_block(path->leaf_bh);
+	struct tfs_dx_block	*new;
+	struct buffer_head	*bh;
+	unsigned int		count = leaf->dx_count;
+	unsigned int		lblk;
+	unsigned int		mid;
+
+	if (count < TFS_DX_ENTRIES(dir->i_sb->s_blocksize))
+		return 0;
+
+	if (!root->dx_levels) {
+		bh = toyfs_dir_grow(dir, &lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		new = (struct tfs_dx_block *)bh->b_data;
+		new->dx_magic = TFS_DX_MAGIC;
+		new->dx_count = count;
+		memcpy(new->dx_entries, root->dx_entries,
+		       count * sizeof(struct tfs_dx_entry));
+
+		root->dx_levels = 1;
+		root->dx_count = 1;
+		root->dx_entries[0].dx_hash = 0;
+		root->dx_entries[0].dx_ptr = lblk;
+		toyfs_journal_dirty(dir->i_sb, path->root_bh);
+		toyfs_journal_dirty(dir->i_sb, bh);
+
+		brelse(path->leaf_bh);
+		path->leaf_bh = bh;
+		path->root_pos = 0;
+		leaf = new;
+	}
+
+	if (root->dx_count >= TFS_DX_ENTRIES(dir->i_sb->s_blocksize))
+		return -ENOSPC;
+
+	for (mid = count / 2; mid < count; mid++)
+		if (leaf->dx_entries[mid].dx_hash !=
+		    leaf->dx_entries[mid - 1].dx_hash)
+			break;
+
+	if (mid == count) {
+		for (mid = count / 2; mid > 0; mid--)
+			if (leaf->dx_entries[mid].dx_hash !=
+			    leaf->dx_entries[mid - 1].dx_hash)
+				break;
+		if (!mid)
+			return -ENOSPC;
+	}
+
+	bh = toyfs_dir_grow(dir, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	new = (struct tfs_dx_block *)bh->b_data;
+	new->dx_magic = TFS_DX_MAGIC;
+	new->dx_count = count - mid;
+	memcpy(new->dx_entries, &leaf->dx_entries[mid],
+	       new->dx_count * sizeof(struct tfs_dx_entry));
+	leaf->dx_count = mid;
+
+	memmove(&root->dx_entries[path->root_pos + 2],
+		&root->dx_entries[path->root_pos + 1],
+		(root->dx_count - path->root_pos - 1) *
+		sizeof(struct tfs_dx_entry));
+	root->dx_entries[path->root_pos + 1].dx_hash = new->dx_entries[0].dx_hash;
+	root->dx_entries[path->root_pos + 1].dx_ptr = lblk;
+	root->dx_count++;
+
+	trace_toyfs_dx_split(dir, new->dx_entries[0].dx_hash, lblk);
+
+	toyfs_journal_dirty(dir->i_sb, path->root_bh);
+	toyfs_journal_dirty(dir->i_sb, path->leaf_bh);
+	toyfs_journal_dirty(dir->i_sb, bh);
+
+	if (hash >= new->dx_entries[0].dx_hash) {
+		brelse(path->leaf_bh);
+		path->leaf_bh = bh;
+		path->leaf_pos -= mid;
+		path->root_pos++;
+	} else {
+		brelse(bh);
+	}
+	return 0;
+}
+
+/*
+ * toyfs_dx_free_slot()
+ *	- Find a free dentry slot, through the directory cache if there is
+ *	  one, or starting at the first block the root says may have one.
+ *	- Grow the directory if there is none.
+ *	- Returns the slot, with its dentry block held in path->bh
+ */
+static int toyfs_dx_free_slot(struct inode *dir, struct toyfs_dx_path *path)
+{
+	struct tfs_inode_info	*tino;
+	struct tfs_dir_cache	*dc = toyfs_dc_get(dir, false);
+	struct tfs_dx_block	*root = toyfs_dx_block(path->root_bh);
+	struct tfs_dentry	*d_array;
+	struct buffer_head	*bh;
+	unsigned int		lblk;
+	unsigned int		j;
+	int			slot;
+
+	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
+
+	slot = dc ? toyfs_dc_free_slot(dc) : -ENOSPC;
+	if (slot >= 0) {
+		lblk = slot / toyfs_entries_per_block(dir);
+		j = slot % toyfs_entries_per_block(dir);
+		bh = toyfs_dir_bread(dir, lblk);
+		if (!bh)
+			return -EIO;
+		goto found;
+	}
+
+	for (lblk = dc ? tino->i_blocks : root->dx_free;
+	     lblk < tino->i_blocks; lblk++) {
+		bh = toyfs_dir_bread(dir, lblk);
+		if (!bh)
+			return -EIO;
+
+		if (!toyfs_dx_block(bh)) {
+			d_array = (struct tfs_dentry *)bh->b_data;
+			for (j = 0; j < toyfs_entries_per_block(dir); j++)
+				if (d_array[j].d_ino == TFS_INVALID)
+					goto found;
+		}
+		brelse(bh);
+	}
+
+	bh = toyfs_dir_grow(dir, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	toyfs_dir_init_dentries(dir, bh, lblk);
+	j = 0;
+found:
+	if (root->dx_free != lblk) {
+		root->dx_free = lblk;
+		toyfs_journal_dirty(dir->i_sb, path->root_bh);
+	}
+	path->bh = bh;
+	return lblk * toyfs_entries_per_block(dir) + j;
+}
 
 /**
- * toyfs_find_entry() - Search for an entry within a directory inode
- * @dir: The directory inode to be searched
- * @name: The name we are looking for
+ * toyfs_dir_init() - Set up the blocks of a new directory
+ * @dir: The new directory inode
+ * @parent: The directory @dir is being created in
+ *
+ * Allocate the first dentry block, holding "." and "..", and on versioned
+ * filesystems, an empty index root in front of it.
+ *
+ * Return: Zero in case of success or negative value otherwise
+ */
+int toyfs_dir_init(struct inode *dir, struct inode *parent)
+{
+	struct tfs_dx_block	*root;
+	struct tfs_dentry	*d_array;
+	struct buffer_head	*bh;
+	unsigned int		lblk;
+
+	if (toyfs_dir_indexed(dir)) {
+		bh = toyfs_dir_grow(dir, &lblk);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		root = (struct tfs_dx_block *)bh->b_data;
+		root->dx_magic = TFS_DX_MAGIC;
+		root->dx_free = 1;
+		toyfs_journal_dirty(dir->i_sb, bh);
+		brelse(bh);
+	}
+
+	bh = toyfs_dir_grow(dir, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	toyfs_dir_init_dentries(dir, bh, lblk);
+	d_array = (struct tfs_dentry *)bh->b_data;
+
+	/* "." and ".." are never looked up through the index */
+	strcpy(d_array[0].d_name, ".");
+	d_array[0].d_ino = dir->i_ino;
+	toyfs_dir_set_type(dir, &d_array[0], DT_DIR);
+	strcpy(d_array[1].d_name, "..");
+	d_array[1].d_ino = parent->i_ino;
+	toyfs_dir_set_type(dir, &d_array[1], DT_DIR);
+
+	toyfs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * toyfs_find_entry_linear() - Search for an entry within a legacy directory
  *
  * Walk through all the directory data blocks associated with the
  * inode, until either a directory entry matching @name is found or
@@ -21,35 +493,33 @@
  * fragmented, and we may have free and used entries mixed up within
  * the directory blocks.
  *
- * Return: The inode number of the found entry or a negative value
- *	   on error.
+ * The blocks read and names compared are added to @nread and @ncmp.
  */
-int toyfs_find_entry(struct inode *dir, const char *name)
+static int toyfs_find_entry_linear(struct inode *dir, const char *name,
+				   unsigned int *nread, unsigned int *ncmp)
 {
 	struct buffer_head	*bh;
 	struct tfs_inode_info	*tino;
 	struct tfs_dentry	*dir_array;
 	int i = 0, j = 0;
 
-	pr_debug("Searching name: %s\n", name);
 	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
 
 	for (i = 0; i < tino->i_blocks; i++) {
-		pr_debug("searching data_block: %u\n",
-			tino->i_addr[i]);
-		bh = sb_bread(dir->i_sb, tino->i_addr[i]);
+		bh = toyfs_dir_bread(dir, i);
 
 		if (!bh)
 			return -ENOMEM;
+		(*nread)++;
 
 		dir_array = (struct tfs_dentry *)bh->b_data;
 
-		/* Up to 32 direntries per block */
-		for (j = 0; j < 32; j++) {
+		for (j = 0; j < toyfs_entries_per_block(dir); j++) {
 			if (dir_array[j].d_ino == TFS_INVALID)
 				continue;
 
-			if (strcmp(dir_array[j].d_name, name) == 0) {
+			(*ncmp)++;
+			if (toyfs_dir_name_eq(&dir_array[j], name)) {
 				brelse(bh);
 				return dir_array[j].d_ino; /* dir entry found */
 			}
@@ -57,21 +527,64 @@ int toyfs_find_entry(struct inode *dir, const char *name)
 		brelse(bh);
 	}
 
-	pr_debug("Entry not found\n");
 	return -ENOENT;
 }
 
 /**
- * toyfs_dir_add_entry -  Add a new directory entry in a directory
- * @parent: The directory where the entry will be added to
- * @name: The name for the new entry.
- * @inum: The inode number of the new entry.
+ * toyfs_find_entry() - Search for an entry within a directory inode
+ * @dir: The directory inode to be searched
+ * @name: The name we are looking for
+ *
+ * Once a directory is cached in-core, no block needs to be read at all.
+ * Otherwise, indexed directories only need to look at the dentries whose
+ * name hash matches @name's. Legacy ones need to be read as a whole anyway,
+ * so we'd rather take the chance to build their cache.
+ *
+ * Return: The inode number of the found entry or a negative value
+ *	   on error.
+ */
+int toyfs_find_entry(struct inode *dir, const char *name)
+{
+	struct tfs_fs_info	*tfi = dir->i_sb->s_fs_info;
+	struct tfs_dir_cache	*dc;
+	struct toyfs_dx_path	path;
+	u32			hash = toyfs_name_hash(name);
+	unsigned int		nread = 0;
+	unsigned int		ncmp = 0;
+	int			how;
+	int			ret;
+
+	dc = toyfs_dc_get(dir, !toyfs_dir_indexed(dir));
+	if (dc) {
+		how = TOYFS_LOOKUP_CACHE;
+		ret = toyfs_dc_lookup(dc, name, hash, NULL);
+	} else if (!toyfs_dir_indexed(dir)) {
+		how = TOYFS_LOOKUP_LINEAR;
+		ret = toyfs_find_entry_linear(dir, name, &nread, &ncmp);
+	} else {
+		how = TOYFS_LOOKUP_INDEX;
+		ret = toyfs_dx_find(dir, name, hash, &path);
+		nread = path.nread;
+		ncmp = path.ncmp;
+		toyfs_dx_release(&path);
+	}
+
+	if (ret >= 0)
+		toyfs_stat_add(tfi, TFS_STAT_LOOKUP_HITS, 1);
+	else if (ret == -ENOENT)
+		toyfs_stat_add(tfi, TFS_STAT_LOOKUP_MISSES, 1);
+	toyfs_stat_add(tfi, TFS_STAT_LOOKUP_BLOCKS, nread);
+	trace_toyfs_find_entry(dir, name, how, nread, ncmp, ret);
+	return ret;
+}
+
+/*
+ * toyfs_dir_add_linear() - Add a new directory entry in a legacy directory
  *
  * To add a new entry to a directory, we first need to search if there
  * is an already existing entry with the same name, and replace it with
  * the new entry (rename()). And the only way to do that, is to walk
- * through the whole directory, as we don't use any other clever data
- * structure.
+ * through the whole directory, as legacy directories have no index.
  *
  * We could have re-used toyfs_find_entry() to search for an already
  * existing entry, but this would need us to traverse the whole directory
@@ -84,6 +597,10 @@ int toyfs_find_entry(struct inode *dir, const char *name)
  *	- If we find a free spot, we save its block and position
  *	  in bh_tgt and idx_tgt.
  *	- If later we find an already existing entry, we simply update both.
+ *	- If the directory is full, we append a new block to it.
+ *
+ * None of this is needed once the directory is cached in-core, the cache
+ * tells us both whether the name exists and where a free slot is.
  *
  * We need to be careful here though, to not leak a buffer_head.
  *	- While we need to walk through every single block associated to
@@ -100,48 +617,66 @@ int toyfs_find_entry(struct inode *dir, const char *name)
  * existing entry are found within the same block, one after another. And
  * ensure we won't free the same buffer twice.
  *
- * XXX: Although we can't have more than 32 inodes, hardlinks occupy dir entries,
- *	so, we can end up having more than 32 entries to the same directory, requiring
- *	more than a single directory block.
- * FIXME: I don't think the directories are working well with more than a single block,
- *	  and I've gotta fix it sometime.
+ * Returns the buffer holding the entry to write, and its slot in @slotp.
  */
-
-int toyfs_dir_add_entry(struct inode *parent, const char *name, int inum)
+static struct buffer_head *toyfs_dir_add_linear(struct inode *parent,
+						const char *name, u32 hash,
+						unsigned int *slotp)
 {
 	struct tfs_inode_info	*tino;
+	struct tfs_dir_cache	*dc;
 	struct tfs_dentry	*d_array;
 	struct buffer_head	*bh_cur = NULL;	/* bh cursor to loop through all dir blocks */
 	struct buffer_head	*bh_tgt = NULL;	/* bh target block to write the free entry */
-	struct timespec64 tv;
+	unsigned int		lblk = 0;	/* directory block referenced by bh_tgt */
+	unsigned int		slot;
 	int idx_tgt = TFS_INVALID;		/* free position within the block referenced by bh_tgt */
 	int i = 0, j = 0;
 
-	tino = parent->i_private;
+	tino = container_of(parent, struct tfs_inode_info, vfs_inode);
+
+	dc = toyfs_dc_get(parent, true);
+	if (dc) {
+		if (toyfs_dc_lookup(dc, name, hash, &slot) < 0) {
+			i = toyfs_dc_free_slot(dc);
+			if (i < 0)
+				goto grow;
+			slot = i;
+		}
+
+		bh_tgt = toyfs_dir_bread(parent,
+					 slot / toyfs_entries_per_block(parent));
+		if (!bh_tgt)
+			return ERR_PTR(-ENOMEM);
+
+		*slotp = slot;
+		return bh_tgt;
+	}
 
 	for (i = 0; i < tino->i_blocks; i++) {
-		bh_cur = sb_bread(parent->i_sb, tino->i_addr[i]);
+		bh_cur = toyfs_dir_bread(parent, i);
 
 		if (!bh_cur) {
 			if (bh_tgt)
 				brelse(bh_tgt);
 
-			return -ENOMEM;
+			return ERR_PTR(-ENOMEM);
 		}
 
 		d_array = (struct tfs_dentry*)bh_cur->b_data;
-		for (j = 0; j < (TFS_BSIZE / sizeof(struct tfs_dentry)); j++) {
+		for (j = 0; j < toyfs_entries_per_block(parent); j++) {
 
 			/* Search for the first free entry in the directory */
 			if (idx_tgt == TFS_INVALID &&
 			    d_array[j].d_ino == TFS_INVALID) {
 				idx_tgt = j;
 				bh_tgt = bh_cur;
+				lblk = i;
 				continue;
 			}
 
 			/* We must search for a possible entry with the same name */
-			if (strcmp(d_array[j].d_name, name) == 0) {
+			if (toyfs_dir_name_eq(&d_array[j], name)) {
 				/*
 				 * We found an equal entry here, but we might have a different
 				 * buffer with a free entry already saved.
@@ -154,6 +689,7 @@ int toyfs_dir_add_entry(struct inode *parent, const char *name, int inum)
 
 				idx_tgt = j;
 				bh_tgt = bh_cur;
+				lblk = i;
 				goto found;
 			}
 
@@ -168,77 +704,451 @@ int toyfs_dir_add_entry(struct inode *parent, const char *name, int inum)
 		}
 	}
 
-
 	/* No free entry or same name has been found */
-	if (idx_tgt == TFS_INVALID)
-		return -ENOSPC;
+	if (idx_tgt == TFS_INVALID) {
+grow:
+		bh_tgt = toyfs_dir_grow(parent, &lblk);
+		if (IS_ERR(bh_tgt))
+			return bh_tgt;
+
+		toyfs_dir_init_dentries(parent, bh_tgt, lblk);
+		idx_tgt = 0;
+	}
+
+found:
+	*slotp = lblk * toyfs_entries_per_block(parent) + idx_tgt;
+	return bh_tgt;
+}
+
+/*
+ * toyfs_dir_add_indexed() - Add a new directory entry in an indexed directory
+ *
+ * Same as toyfs_dir_add_linear(), but an already existing entry is found
+ * through the index, and a new one is added to it. Room is made in the
+ * index before writing the dentry, so we never end up with a dentry the
+ * index doesn't know about.
+ *
+ * This is where indexed directories get cached in-core, so free slots can
+ * be found without reading the directory.
+ */
+static struct buffer_head *toyfs_dir_add_indexed(struct inode *parent,
+						 const char *name, u32 hash,
+						 unsigned int *slotp)
+{
+	struct toyfs_dx_path	path;
+	struct tfs_dx_block	*leaf;
+	struct buffer_head	*bh;
+	int			ret;
+
+	toyfs_dc_get(parent, true);
+
+	ret = toyfs_dx_find(parent, name, hash, &path);
+	if (ret >= 0)
+		goto found;
+	if (ret != -ENOENT)
+		goto out;
+
+	ret = toyfs_dx_make_room(parent, &path, hash);
+	if (ret)
+		goto out;
+
+	ret = toyfs_dx_free_slot(parent, &path);
+	if (ret < 0)
+		goto out;
+	path.slot = ret;
+
+	leaf = toyfs_dx_block(path.leaf_bh);
+	memmove(&leaf->dx_entries[path.leaf_pos + 1],
+		&leaf->dx_entries[path.leaf_pos],
+		(leaf->dx_count - path.leaf_pos) * sizeof(struct tfs_dx_entry));
+	leaf->dx_entries[path.leaf_pos].dx_hash = hash;
+	leaf->dx_entries[path.leaf_pos].dx_ptr = path.slot;
+	leaf->dx_count++;
+	toyfs_journal_dirty(parent->i_sb, path.leaf_bh);
 
 found:
-	d_array = (struct tfs_dentry*)bh_tgt->b_data;
-	d_array[idx_tgt].d_ino = inum;
-	strcpy(d_array[idx_tgt].d_name, name);
+	*slotp = path.slot;
+	bh = path.bh;
+	path.bh = NULL;
+	toyfs_dx_release(&path);
+	return bh;
+out:
+	toyfs_dx_release(&path);
+	return ERR_PTR(ret);
+}
+
+/**
+ * toyfs_dir_add_entry -  Add a new directory entry in a directory
+ * @parent: The directory where the entry will be added to
+ * @name: The name for the new entry.
+ * @inode: The inode the new entry points to.
+ *
+ * An already existing entry with the same name is replaced with the new
+ * one (rename()), otherwise the new entry takes the first free slot,
+ * growing the directory if needed.
+ *
+ * Return: Zero in case of success or negative value otherwise
+ */
+int toyfs_dir_add_entry(struct inode *parent, const char *name,
+			struct inode *inode)
+{
+	struct tfs_dentry	*d_array;
+	struct buffer_head	*bh;
+	struct timespec64	tv;
+	u32			hash = toyfs_name_hash(name);
+	unsigned int		slot;
+	unsigned int		idx;
+
+	if (toyfs_dir_indexed(parent))
+		bh = toyfs_dir_add_indexed(parent, name, hash, &slot);
+	else
+		bh = toyfs_dir_add_linear(parent, name, hash, &slot);
+
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	idx = slot % toyfs_entries_per_block(parent);
+	d_array = (struct tfs_dentry*)bh->b_data;
+	d_array[idx].d_ino = inode->i_ino;
+	toyfs_dir_set_type(parent, &d_array[idx],
+			   fs_umode_to_dtype(inode->i_mode));
+	strncpy(d_array[idx].d_name, name, sizeof(d_array[idx].d_name));
 	parent->i_size += sizeof(struct tfs_dentry);
+	toyfs_dc_add(parent, name, hash, slot, inode->i_ino);
 
 	tv = inode_set_ctime_current(parent);
 	inode_set_atime_to_ts(parent, tv);
 	inode_inc_link_count(parent);
-	mark_buffer_dirty(bh_tgt);
+	toyfs_journal_dirty(parent->i_sb, bh);
+	trace_toyfs_dir_add_entry(parent, name, slot, inode->i_ino);
 
-	brelse(bh_tgt);
+	brelse(bh);
 	return 0;
 }
 
-/**
- * toyfs_dir_del_entry() - Remove a directory entry
- * @parent: The inode directory to search for the entry
- * @name: The directory entry we want to remove.
+/*
+ * toyfs_dir_del_linear() - Remove a directory entry from a legacy directory
  *
  * This function is pretty simple. We just need to walk through all the
- * directory blocks within the inode, and zero out the entry belonging
- * to te current name.
+ * directory blocks within the inode, and look for the entry belonging
+ * to the current name.
  *
  * We don't need to finish the whole search once we found the name, as we
  * can't have two entries with the same name, otherwise we've got a bug.
+ *
+ * Cached directories don't need to be searched at all.
  */
-int toyfs_dir_del_entry(struct inode *parent, const char *name)
+static struct buffer_head *toyfs_dir_del_linear(struct inode *parent,
+						const char *name, u32 hash,
+						unsigned int *slotp)
 {
 	struct tfs_inode_info	*tino;
-	struct super_block	*sb;
+	struct tfs_dir_cache	*dc;
 	struct tfs_dentry	*d_array;
 	struct buffer_head	*bh;
-	struct timespec64	tv;
+	unsigned int		slot;
 	int i = 0;
 	int j = 0;
 
 	tino = container_of(parent, struct tfs_inode_info, vfs_inode);
-	sb = tino->vfs_inode.i_sb;
+
+	dc = toyfs_dc_get(parent, true);
+	if (dc) {
+		if (toyfs_dc_lookup(dc, name, hash, &slot) < 0)
+			return ERR_PTR(-ENOENT);
+
+		bh = toyfs_dir_bread(parent,
+				     slot / toyfs_entries_per_block(parent));
+		if (!bh)
+			return ERR_PTR(-ENOMEM);
+
+		*slotp = slot;
+		return bh;
+	}
 
 	for (i = 0; i < tino->i_blocks; i++) {
-		bh = sb_bread(sb, tino->i_addr[i]);
+		bh = toyfs_dir_bread(parent, i);
+		if (!bh)
+			return ERR_PTR(-ENOMEM);
+
 		d_array = (struct tfs_dentry *)bh->b_data;
 
-		for (j = 0; j < TFS_BSIZE / sizeof(struct tfs_dentry); j++) {
+		for (j = 0; j < toyfs_entries_per_block(parent); j++) {
 			if ((d_array[j].d_ino == TFS_INVALID) ||
-			    (strcmp(d_array[j].d_name, name))) {
+			    !toyfs_dir_name_eq(&d_array[j], name)) {
 				continue;
 			} else {
-				d_array[j].d_ino = TFS_INVALID;
-				d_array[j].d_name[0] = '\0';
-				goto done;
+				*slotp = i * toyfs_entries_per_block(parent) +
+					 j;
+				return bh;
 			}
 		}
 
 		brelse(bh);
 	}
 
-	return -ENOENT;
+	return ERR_PTR(-ENOENT);
+}
+
+/*
+ * toyfs_dir_del_indexed() - Remove a directory entry from an indexed directory
+ *
+ * Drop the entry's index entry, and let the index root know its dentry
+ * block has a free slot again.
+ */
+static struct buffer_head *toyfs_dir_del_indexed(struct inode *parent,
+						 const char *name, u32 hash,
+						 unsigned int *slotp)
+{
+	struct toyfs_dx_path	path;
+	struct tfs_dx_block	*root, *leaf;
+	struct buffer_head	*bh;
+	unsigned int		lblk;
+	int			ret;
+
+	toyfs_dc_get(parent, true);
+
+	ret = toyfs_dx_find(parent, name, hash, &path);
+	if (ret < 0) {
+		toyfs_dx_release(&path);
+		return ERR_PTR(ret);
+	}
+
+	leaf = toyfs_dx_block(path.leaf_bh);
+	leaf->dx_count--;
+	memmove(&leaf->dx_entries[path.leaf_pos],
+		&leaf->dx_entries[path.leaf_pos + 1],
+		(leaf->dx_count - path.leaf_pos) * sizeof(struct tfs_dx_entry));
+	toyfs_journal_dirty(parent->i_sb, path.leaf_bh);
+
+	root = toyfs_dx_block(path.root_bh);
+	lblk = path.slot / toyfs_entries_per_block(parent);
+	if (lblk < root->dx_free) {
+		root->dx_free = lblk;
+		toyfs_journal_dirty(parent->i_sb, path.root_bh);
+	}
+
+	*slotp = path.slot;
+	bh = path.bh;
+	path.bh = NULL;
+	toyfs_dx_release(&path);
+	return bh;
+}
+
+/**
+ * toyfs_dir_del_entry() - Remove a directory entry
+ * @parent: The inode directory to search for the entry
+ * @name: The directory entry we want to remove.
+ *
+ * Find the entry belonging to @name, and zero it out.
+ *
+ * Return: Zero in case of success, -ENOENT if there is no such entry or
+ *	   another negative value otherwise
+ */
+int toyfs_dir_del_entry(struct inode *parent, const char *name)
+{
+	struct tfs_dentry	*d_array;
+	struct buffer_head	*bh;
+	struct timespec64	tv;
+	u32			hash = toyfs_name_hash(name);
+	unsigned int		slot;
+	unsigned int		idx;
+
+	if (toyfs_dir_indexed(parent))
+		bh = toyfs_dir_del_indexed(parent, name, hash, &slot);
+	else
+		bh = toyfs_dir_del_linear(parent, name, hash, &slot);
+
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	idx = slot % toyfs_entries_per_block(parent);
+	d_array = (struct tfs_dentry *)bh->b_data;
+	d_array[idx].d_ino = TFS_INVALID;
+	d_array[idx].d_name[0] = '\0';
+	d_array[idx].d_type = DT_UNKNOWN;
+	toyfs_dc_del(parent, name, hash, slot);
 
-done:
 	tv = inode_set_ctime_current(parent);
 	inode_set_atime_to_ts(parent, tv);
 	inode_dec_link_count(parent);
-	mark_buffer_dirty(bh);
+	toyfs_journal_dirty(parent->i_sb, bh);
 	brelse(bh);
 	return 0;
 }
 
+/*
+ * toyfs_dir_find_slot()
+ *	- Find the dentry slot of @name, returning the dentry block holding
+ *	  it, without changing anything
+ *	- Through the directory cache if there is one, the index otherwise.
+ *	  toyfs_dir_del_linear() only looks the name up, legacy directories
+ *	  use it as is.
+ */
+static struct buffer_head *toyfs_dir_find_slot(struct inode *dir,
+					       const char *name, u32 hash,
+					       unsigned int *slotp)
+{
+	struct tfs_dir_cache	*dc;
+	struct toyfs_dx_path	path;
+	struct buffer_head	*bh;
+	int			ret;
+
+	if (!toyfs_dir_indexed(dir))
+		return toyfs_dir_del_linear(dir, name, hash, slotp);
+
+	dc = toyfs_dc_get(dir, false);
+	if (dc) {
+		if (toyfs_dc_lookup(dc, name, hash, slotp) < 0)
+			return ERR_PTR(-ENOENT);
+
+		bh = toyfs_dir_bread(dir,
+				     *slotp / toyfs_entries_per_block(dir));
+		return bh ? bh : ERR_PTR(-EIO);
+	}
+
+	ret = toyfs_dx_find(dir, name, hash, &path);
+	if (ret < 0) {
+		toyfs_dx_release(&path);
+		return ERR_PTR(ret);
+	}
+
+	*slotp = path.slot;
+	bh = path.bh;
+	path.bh = NULL;
+	toyfs_dx_release(&path);
+	return bh;
+}
+
+/**
+ * toyfs_dir_replace_entry() - Point an existing entry to another inode
+ * @dir: The directory holding the entry
+ * @name: The entry name
+ * @inode: The inode @name is to point to
+ *
+ * The dentry is updated in place: its slot, and so the index, are left
+ * alone, and so is the link count of @dir, it has as many entries as
+ * before. This is what renaming over an existing name, and exchanging two
+ * names, come down to.
+ *
+ * Return: The inode number @name used to point to, -ENOENT if there is no
+ *	   such entry or another negative value otherwise
+ */
+int toyfs_dir_replace_entry(struct inode *dir, const char *name,
+			    struct inode *inode)
+{
+	struct tfs_dentry	*de;
+	struct buffer_head	*bh;
+	u32			hash = toyfs_name_hash(name);
+	unsigned int		slot;
+	int			old;
+
+	bh = toyfs_dir_find_slot(dir, name, hash, &slot);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	de = (struct tfs_dentry *)bh->b_data +
+	     slot % toyfs_entries_per_block(dir);
+	old = de->d_ino;
+	de->d_ino = inode->i_ino;
+	toyfs_dir_set_type(dir, de, fs_umode_to_dtype(inode->i_mode));
+	toyfs_dc_add(dir, name, hash, slot, inode->i_ino);
+
+	inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+	toyfs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+	return old;
+}
+
+/**
+ * toyfs_dir_get_dotdot() - Get the dentry block holding ".."
+ * @dir: The directory about to be moved
+ *
+ * ".." always lives in the second slot of the first dentry block, which
+ * comes right after the index root on versioned filesystems. Renames read
+ * it before changing anything, so moving a directory can't fail half way.
+ *
+ * Return: The buffer, to be passed to toyfs_dir_set_dotdot(), or an ERR_PTR
+ */
+struct buffer_head *toyfs_dir_get_dotdot(struct inode *dir)
+{
+	struct tfs_dentry	*d_array;
+	struct buffer_head	*bh;
+
+	bh = toyfs_dir_bread(dir, toyfs_dir_indexed(dir) ? 1 : 0);
+	if (!bh)
+		return ERR_PTR(-EIO);
+
+	d_array = (struct tfs_dentry *)bh->b_data;
+	if (!toyfs_dir_name_eq(&d_array[1], "..")) {
+		pr_debug("dir %lu: \"..\" not found\n", dir->i_ino);
+		brelse(bh);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	return bh;
+}
+
+/**
+ * toyfs_dir_set_dotdot() - Point ".." of a directory to its new parent
+ * @dir: The directory being moved
+ * @bh: The buffer from toyfs_dir_get_dotdot(), released here
+ * @parent: The new parent of @dir
+ */
+void toyfs_dir_set_dotdot(struct inode *dir, struct buffer_head *bh,
+			  struct inode *parent)
+{
+	struct tfs_dentry	*d_array = (struct tfs_dentry *)bh->b_data;
+	unsigned int		lblk = toyfs_dir_indexed(dir) ? 1 : 0;
+
+	d_array[1].d_ino = parent->i_ino;
+	toyfs_dc_add(dir, "..", toyfs_name_hash(".."),
+		     lblk * toyfs_entries_per_block(dir) + 1, parent->i_ino);
+	toyfs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+}
+
+/**
+ * toyfs_dir_sync() - Write the dirty blocks of a directory and wait for them
+ * @dir: The directory being synced
+ *
+ * Directory blocks are buffers of the block device, not of the directory's
+ * own mapping. With a journal, they are committed along with the directory
+ * inode. Without one, fsync on the directory has to write them itself.
+ * Blocks which aren't cached can't be dirty.
+ *
+ * Context: Takes i_map_lock, for each block looked up.
+ * Return: 0 on success or -EIO
+ */
+int toyfs_dir_sync(struct inode *dir)
+{
+	struct tfs_inode_info	*tino;
+	struct buffer_head	*bh;
+	unsigned int		nblocks, blk, i;
+	int			error = 0;
+
+	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
+	nblocks = READ_ONCE(tino->i_blocks);
+
+	/* All in flight first, then waited for */
+	for (i = 0; i < 2 * nblocks; i++) {
+		down_read(&tino->i_map_lock);
+		blk = toyfs_ext_lookup(tino, i % nblocks, NULL);
+		up_read(&tino->i_map_lock);
+		if (blk == TFS_INVALID)
+			continue;
+
+		bh = sb_find_get_block(dir->i_sb, blk);
+		if (!bh)
+			continue;
+
+		if (i < nblocks) {
+			write_dirty_buffer(bh, REQ_SYNC);
+		} else {
+			wait_on_buffer(bh);
+			if (!buffer_uptodate(bh))
+				error = -EIO;
+		}
+		brelse(bh);
+	}
+	return error;
+}
@@ -0,0 +1,387 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/buffer_head.h>
+#include "toyfs_types.h"
+
+/*
+ * In-core directory cache
+ *
+ * The first time a directory is modified (or looked up, for legacy
+ * directories which have no index), all of its blocks are read once and
+ * two things are built out of them:
+ *	- A bitmap of free dentry slots, so new entries go straight to a free
+ *	  slot without searching for one.
+ *	- A hash table of every name in the directory, with the slot and inode
+ *	  number it points to, so lookups don't need to read anything.
+ *
+ * toyfs_dir_add_entry(), toyfs_dir_del_entry() and toyfs_dir_grow() keep it
+ * in sync with the directory. Those always run with the directory locked
+ * exclusively, so the cache can't change nor go away under lookups, which
+ * hold it shared.
+ *
+ * The cache is an optimization only: if we ever fail to keep it up to date
+ * (i.e. out of memory), it is simply dropped, and built again next time.
+ */
+
+#define TFS_DC_MIN_BITS	4
+
+struct toyfs_dc_entry {
+	struct hlist_node	de_node;
+	u32			de_hash;
+	unsigned int		de_slot;
+	unsigned int		de_ino;
+	char			de_name[];
+};
+
+static inline struct hlist_head *toyfs_dc_bucket(struct tfs_dir_cache *dc,
+						 u32 hash)
+{
+	return &dc->dc_names[hash_32(hash, dc->dc_bits)];
+}
+
+static struct toyfs_dc_entry *toyfs_dc_find(struct tfs_dir_cache *dc,
+					    const char *name, u32 hash)
+{
+	struct toyfs_dc_entry *de;
+
+	hlist_for_each_entry(de, toyfs_dc_bucket(dc, hash), de_node)
+		if (de->de_hash == hash && !strcmp(de->de_name, name))
+			return de;
+	return NULL;
+}
+
+static void toyfs_dc_free(struct tfs_dir_cache *dc)
+{
+	struct toyfs_dc_entry	*de;
+	struct hlist_node	*tmp;
+	unsigned int		i;
+
+	if (!dc)
+		return;
+
+	for (i = 0; dc->dc_names && i < (1U << dc->dc_bits); i++)
+		hlist_for_each_entry_safe(de, tmp, &dc->dc_names[i], de_node)
+			kfree(de);
+
+	kvfree(dc->dc_names);
+	kvfree(dc->dc_free);
+	kfree(dc);
+}
+
+/* Double the hash table size. Failing is fine, chains just get longer */
+static void toyfs_dc_rehash(struct tfs_dir_cache *dc)
+{
+	struct hlist_head	*names;
+	struct toyfs_dc_entry	*de;
+	struct hlist_node	*tmp;
+	unsigned int		bits = dc->dc_bits + 1;
+	unsigned int		i;
+
+	names = kvcalloc(1U << bits, sizeof(struct hlist_head), GFP_NOFS);
+	if (!names)
+		return;
+
+	for (i = 0; i < (1U << dc->dc_bits); i++) {
+		hlist_for_each_entry_safe(de, tmp, &dc->dc_names[i], de_node) {
+			hlist_del(&de->de_node);
+			hlist_add_head(&de->de_node,
+				       &names[hash_32(de->de_hash, bits)]);
+		}
+	}
+
+	kvfree(dc->dc_names);
+	dc->dc_names = names;
+	dc->dc_bits = bits;
+}
+
+static int toyfs_dc_insert(struct tfs_dir_cache *dc, const char *name,
+			   u32 hash, unsigned int slot, unsigned int ino)
+{
+	struct toyfs_dc_entry	*de;
+	size_t			len = strlen(name);
+
+	if (dc->dc_count >= (2U << dc->dc_bits))
+		toyfs_dc_rehash(dc);
+
+	de = kmalloc(struct_size(de, de_name, len + 1), GFP_NOFS);
+	if (!de)
+		return -ENOMEM;
+
+	de->de_hash = hash;
+	de->de_slot = slot;
+	de->de_ino = ino;
+	memcpy(de->de_name, name, len + 1);
+	hlist_add_head(&de->de_node, toyfs_dc_bucket(dc, hash));
+	dc->dc_count++;
+	return 0;
+}
+
+/* Make room for @nblocks directory blocks worth of slots in dc_free */
+static int toyfs_dc_resize(struct inode *dir, struct tfs_dir_cache *dc,
+			   unsigned int nblocks)
+{
+	unsigned int	per_block = toyfs_entries_per_block(dir);
+	unsigned long	*free;
+	unsigned int	nslots;
+
+	if (nblocks * per_block <= dc->dc_nslots)
+		return 0;
+
+	nslots = roundup_pow_of_two(nblocks) * per_block;
+	free = kvcalloc(BITS_TO_LONGS(nslots), sizeof(unsigned long), GFP_NOFS);
+	if (!free)
+		return -ENOMEM;
+
+	if (dc->dc_free)
+		bitmap_copy(free, dc->dc_free, dc->dc_nslots);
+
+	kvfree(dc->dc_free);
+	dc->dc_free = free;
+	dc->dc_nslots = nslots;
+	return 0;
+}
+
+static struct tfs_dir_cache *toyfs_dc_build(struct inode *dir)
+{
+	struct tfs_inode_info	*tino;
+	struct tfs_dir_cache	*dc;
+	struct tfs_dentry	*d_array;
+	struct buffer_head	*bh;
+	unsigned int		blk;
+	unsigned int		lblk;
+	unsigned int		slot;
+	unsigned int		j;
+
+	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
+
+	dc = kzalloc(sizeof(*dc), GFP_NOFS);
+	if (!dc)
+		return NULL;
+
+	dc->dc_bits = TFS_DC_MIN_BITS;
+	dc->dc_names = kvcalloc(1U << dc->dc_bits, sizeof(struct hlist_head),
+				GFP_NOFS);
+	if (!dc->dc_names || toyfs_dc_resize(dir, dc, tino->i_blocks))
+		goto out_free;
+
+	for (lblk = 0; lblk < tino->i_blocks; lblk++) {
+		blk = toyfs_ext_lookup(tino, lblk, NULL);
+		if (blk == TFS_INVALID)
+			goto out_free;
+
+		bh = sb_bread(dir->i_sb, blk);
+		if (!bh)
+			goto out_free;
+
+		d_array = (struct tfs_dentry *)bh->b_data;
+		if (d_array[0].d_ino == TFS_DX_MAGIC) {
+			brelse(bh);
+			continue;
+		}
+
+		for (j = 0; j < toyfs_entries_per_block(dir); j++) {
+			slot = lblk * toyfs_entries_per_block(dir) + j;
+
+			if (d_array[j].d_ino == TFS_INVALID) {
+				set_bit(slot, dc->dc_free);
+				continue;
+			}
+
+			if (toyfs_dc_insert(dc, d_array[j].d_name,
+					    toyfs_name_hash(d_array[j].d_name),
+					    slot, d_array[j].d_ino)) {
+				brelse(bh);
+				goto out_free;
+			}
+		}
+		brelse(bh);
+	}
+
+	pr_debug("dir %lu: cached %u names\n", dir->i_ino, dc->dc_count);
+	return dc;
+
+out_free:
+	toyfs_dc_free(dc);
+	return NULL;
+}
+
+/* Called with the directory locked exclusively */
+static void toyfs_dc_drop(struct inode *dir)
+{
+	struct tfs_inode_info *tino;
+
+	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
+	pr_debug("dir %lu: dropping directory cache\n", dir->i_ino);
+	toyfs_dc_free(tino->i_dir_cache);
+	WRITE_ONCE(tino->i_dir_cache, NULL);
+}
+
+/**
+ * toyfs_dc_get() - Get the in-core cache of a directory
+ * @dir: The directory inode
+ * @build: Build the cache if there is none yet
+ *
+ * Concurrent lookups may race to build the cache, only the first one to be
+ * done gets to install it.
+ *
+ * Return: The directory cache, or NULL if there is none and it couldn't
+ *	   (or shouldn't) be built. Callers must then do without it.
+ */
+struct tfs_dir_cache *toyfs_dc_get(struct inode *dir, bool build)
+{
+	struct tfs_inode_info	*tino;
+	struct tfs_dir_cache	*dc;
+	struct tfs_dir_cache	*old;
+
+	tino = container_of(dir, struct tfs_inode_info, vfs_inode);
+
+	dc = READ_ONCE(tino->i_dir_cache);
+	if (dc || !build)
+		return dc;
+
+	dc = toyfs_dc_build(dir);
+	if (!dc)
+		return NULL;
+
+	old = cmpxchg(&tino->i_dir_cache, NULL, dc);
+	if (old) {
+		toyfs_dc_free(dc);
+		dc = old;
+	}
+	return dc;
+}
+
+/**
+ * toyfs_dc_lookup() - Look a name up in a directory cache
+ * @dc: The directory cache
+ * @name: The name we are looking for
+ * @hash: toyfs_name_hash() of @name
+ * @slotp: Optional, returns the dentry slot holding @name
+ *
+ * Return: The inode number of the entry, or -ENOENT if there is none
+ */
+int toyfs_dc_lookup(struct tfs_dir_cache *dc, const char *name, u32 hash,
+		    unsigned int *slotp)
+{
+	struct toyfs_dc_entry *de = toyfs_dc_find(dc, name, hash);
+
+	if (!de)
+		return -ENOENT;
+
+	if (slotp)
+		*slotp = de->de_slot;
+	return de->de_ino;
+}
+
+/**
+ * toyfs_dc_free_slot() - Find the first free dentry slot in a directory
+ * @dc: The directory cache
+ *
+ * Return: A free slot, or -ENOSPC if the directory needs to grow
+ */
+int toyfs_dc_free_slot(struct tfs_dir_cache *dc)
+{
+	unsigned int slot = find_first_bit(dc->dc_free, dc->dc_nslots);
+
+	return slot < dc->dc_nslots ? slot : -ENOSPC;
+}
+
+/**
+ * toyfs_dc_grow() - Account for new directory blocks
+ * @dir: The directory inode
+ * @nblocks: The new number of blocks of @dir
+ *
+ * Their slots are not free until toyfs_dc_free_block() is called, as the
+ * new blocks might be index blocks.
+ */
+void toyfs_dc_grow(struct inode *dir, unsigned int nblocks)
+{
+	struct tfs_dir_cache *dc = toyfs_dc_get(dir, false);
+
+	if (dc && toyfs_dc_resize(dir, dc, nblocks))
+		toyfs_dc_drop(dir);
+}
+
+/**
+ * toyfs_dc_free_block() - Mark all slots of a new dentry block free
+ * @dir: The directory inode
+ * @lblk: The directory block
+ */
+void toyfs_dc_free_block(struct inode *dir, unsigned int lblk)
+{
+	struct tfs_dir_cache *dc = toyfs_dc_get(dir, false);
+
+	if (dc)
+		bitmap_set(dc->dc_free, lblk * toyfs_entries_per_block(dir),
+			   toyfs_entries_per_block(dir));
+}
+
+/**
+ * toyfs_dc_add() - Record a new (or replaced) directory entry
+ * @dir: The directory inode
+ * @name: The entry name
+ * @hash: toyfs_name_hash() of @name
+ * @slot: The dentry slot @name was written to
+ * @ino: The inode number @name now points to
+ */
+void toyfs_dc_add(struct inode *dir, const char *name, u32 hash,
+		  unsigned int slot, unsigned int ino)
+{
+	struct tfs_dir_cache	*dc = toyfs_dc_get(dir, false);
+	struct toyfs_dc_entry	*de;
+
+	if (!dc)
+		return;
+
+	clear_bit(slot, dc->dc_free);
+
+	de = toyfs_dc_find(dc, name, hash);
+	if (de) {
+		de->de_ino = ino;
+		return;
+	}
+
+	if (toyfs_dc_insert(dc, name, hash, slot, ino))
+		toyfs_dc_drop(dir);
+}
+
+/**
+ * toyfs_dc_del() - Forget about a removed directory entry
+ * @dir: The directory inode
+ * @name: The entry name
+ * @hash: toyfs_name_hash() of @name
+ * @slot: The dentry slot @name was removed from
+ */
+void toyfs_dc_del(struct inode *dir, const char *name, u32 hash,
+		  unsigned int slot)
+{
+	struct tfs_dir_cache	*dc = toyfs_dc_get(dir, false);
+	struct toyfs_dc_entry	*de;
+
+	if (!dc)
+		return;
+
+	set_bit(slot, dc->dc_free);
+
+	de = toyfs_dc_find(dc, name, hash);
+	if (de) {
+		hlist_del(&de->de_node);
+		dc->dc_count--;
+		kfree(de);
+	}
+}
+
+/**
+ * toyfs_dc_destroy() - Free the directory cache of an inode
+ * @tino: The toyfs inode being freed
+ */
+void toyfs_dc_destroy(struct tfs_inode_info *tino)
+{
+	toyfs_dc_free(tino->i_dir_cache);
+	tino->i_dir_cache = NULL;
+}
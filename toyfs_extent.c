@@ -0,0 +1,873 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/buffer_head.h>
+#include "toyfs_types.h"
+
+/*
+ * Extent block map
+ *
+ * Each file's block map is kept in-core as an array of extents sorted by
+ * logical block, which can't overlap each other. Mapping a file range is then
+ * a single binary search, no matter how large the range is.
+ *
+ * As long as the file has at most TFS_INODE_EXTENTS extents, they are stored
+ * within the in-core inode itself (i_inline_ext). Once it needs more, a
+ * TFS_MAX_EXTENTS() sized array is allocated and hooked into i_extents.
+ *
+ * On disk, versioned filesystems store the first TFS_INODE_EXTENTS extents
+ * within the inode, and the remaining ones within a single overflow extent
+ * block. Legacy filesystems still use the i_addr[] block map, which we convert
+ * from/to extents when reading/writing the inode.
+ */
+
+static inline struct tfs_extent *toyfs_ext_array(struct tfs_inode_info *tino)
+{
+	return tino->i_extents ? tino->i_extents : tino->i_inline_ext;
+}
+
+/*
+ * Maximum number of blocks a single file can have. Legacy filesystems are
+ * limited by the i_addr[] array, versioned filesystems by the 32-bit i_size.
+ */
+unsigned int toyfs_max_file_blocks(struct super_block *sb)
+{
+	if (toyfs_is_legacy(sb->s_fs_info))
+		return TFS_MAX_INO_BLKS;
+
+	return U32_MAX >> sb->s_blocksize_bits;
+}
+
+/*
+ * toyfs_ext_search()
+ *	- Binary search the extent list for @lblk
+ *	- Return the index of the extent containing @lblk, or if @lblk is
+ *	  within a hole, the index of the first extent after it.
+ */
+static unsigned int toyfs_ext_search(struct tfs_inode_info *tino,
+				     unsigned int lblk)
+{
+	struct tfs_extent	*ext = toyfs_ext_array(tino);
+	unsigned int		lo = 0;
+	unsigned int		hi = tino->i_nextents;
+	unsigned int		mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (lblk >= toyfs_ext_end(&ext[mid]))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * toyfs_ext_map() - Map a logical file block
+ * @tino: The inode to be searched
+ * @lblk: Logical block within the file
+ * @len: Optional, returns the number of blocks from @lblk with the same mapping
+ * @unwritten: Optional, returns whether the mapped blocks are unwritten
+ *
+ * Return: The disk block mapped at @lblk, or TFS_INVALID if @lblk is within a
+ *	   hole. In the latter case @len is set to the hole's size.
+ */
+unsigned int toyfs_ext_map(struct tfs_inode_info *tino, unsigned int lblk,
+			   unsigned int *len, bool *unwritten)
+{
+	struct tfs_extent	*ext = toyfs_ext_array(tino);
+	unsigned int		idx = toyfs_ext_search(tino, lblk);
+	unsigned int		hole_end = U32_MAX;
+
+	if (unwritten)
+		*unwritten = false;
+
+	if (idx < tino->i_nextents) {
+		if (lblk >= ext[idx].e_lblk) {
+			if (len)
+				*len = toyfs_ext_end(&ext[idx]) - lblk;
+			if (unwritten)
+				*unwritten = toyfs_ext_unwritten(&ext[idx]);
+			return ext[idx].e_pblk + (lblk - ext[idx].e_lblk);
+		}
+		hole_end = ext[idx].e_lblk;
+	}
+
+	if (len)
+		*len = hole_end - lblk;
+	return TFS_INVALID;
+}
+
+/**
+ * toyfs_ext_lookup() - Map a logical file block
+ * @tino: The inode to be searched
+ * @lblk: Logical block within the file
+ * @len: Optional, returns the number of blocks from @lblk with the same mapping
+ *
+ * Same as toyfs_ext_map(), for callers which know there can't be unwritten
+ * blocks in their way (i.e. directories).
+ *
+ * Return: The disk block mapped at @lblk, or TFS_INVALID if @lblk is within a
+ *	   hole.
+ */
+unsigned int toyfs_ext_lookup(struct tfs_inode_info *tino,
+			      unsigned int lblk, unsigned int *len)
+{
+	return toyfs_ext_map(tino, lblk, len, NULL);
+}
+
+/**
+ * toyfs_ext_goal() - Find a good disk block to map @lblk to
+ * @tino: The inode being written
+ * @lblk: Logical block within the file not yet mapped
+ *
+ * Return: The disk block which would make @lblk physically contiguous to
+ *	   the previous extent in the file, or 0 if there is none.
+ */
+unsigned int toyfs_ext_goal(struct tfs_inode_info *tino, unsigned int lblk)
+{
+	struct tfs_extent	*ext = toyfs_ext_array(tino);
+	unsigned int		idx = toyfs_ext_search(tino, lblk);
+
+	if (!idx)
+		return 0;
+
+	idx--;
+	return ext[idx].e_pblk + (lblk - ext[idx].e_lblk);
+}
+
+/* Move the extent list out of the inode once it doesn't fit there anymore */
+static int toyfs_ext_grow(struct tfs_inode_info *tino)
+{
+	unsigned int max = TFS_MAX_EXTENTS(tino->vfs_inode.i_sb->s_blocksize);
+	struct tfs_extent *ext;
+
+	if (tino->i_nextents >= max)
+		return -EFBIG;
+
+	if (tino->i_extents || tino->i_nextents < TFS_INODE_EXTENTS)
+		return 0;
+
+	ext = kmalloc_array(max, sizeof(struct tfs_extent), GFP_NOFS);
+	if (!ext)
+		return -ENOMEM;
+
+	memcpy(ext, tino->i_inline_ext, sizeof(tino->i_inline_ext));
+	tino->i_extents = ext;
+	return 0;
+}
+
+/* Can @next be appended to @prev? */
+static inline bool toyfs_ext_mergeable(struct tfs_extent *prev,
+				       struct tfs_extent *next)
+{
+	return toyfs_ext_end(prev) == next->e_lblk &&
+	       prev->e_pblk + toyfs_ext_len(prev) == next->e_pblk &&
+	       toyfs_ext_unwritten(prev) == toyfs_ext_unwritten(next);
+}
+
+/*
+ * __toyfs_ext_add()
+ *	- Add a new in-core mapping for a range not mapped yet
+ *	- Merge it with its neighbours if they are contiguous, both logically
+ *	  and physically, and in the same state, so the extent list stays as
+ *	  short as possible.
+ */
+static int __toyfs_ext_add(struct tfs_inode_info *tino, unsigned int lblk,
+			   unsigned int pblk, unsigned int len, bool unwritten)
+{
+	struct tfs_extent	*ext = toyfs_ext_array(tino);
+	struct tfs_extent	*prev = NULL;
+	struct tfs_extent	*next = NULL;
+	struct tfs_extent	new = {
+		.e_lblk	= lblk,
+		.e_pblk	= pblk,
+		.e_len	= len | (unwritten ? TFS_EXT_UNWRITTEN : 0),
+	};
+	unsigned int		idx = toyfs_ext_search(tino, lblk);
+	int			error;
+
+	if (idx > 0)
+		prev = &ext[idx - 1];
+	if (idx < tino->i_nextents)
+		next = &ext[idx];
+
+	if (next && lblk + len > next->e_lblk) {
+		pr_debug("Mapping [%u, %u) overlaps extent at %u\n",
+			 lblk, lblk + len, next->e_lblk);
+		return -EFSCORRUPTED;
+	}
+
+	if (prev && toyfs_ext_mergeable(prev, &new)) {
+		prev->e_len += len;
+
+		/* We might have just filled the hole between prev and next */
+		if (next && toyfs_ext_mergeable(prev, next)) {
+			prev->e_len += toyfs_ext_len(next);
+			memmove(next, next + 1,
+				(tino->i_nextents - idx - 1) * sizeof(*next));
+			tino->i_nextents--;
+		}
+		return 0;
+	}
+
+	if (next && toyfs_ext_mergeable(&new, next)) {
+		next->e_lblk = lblk;
+		next->e_pblk = pblk;
+		next->e_len += len;
+		return 0;
+	}
+
+	error = toyfs_ext_grow(tino);
+	if (error)
+		return error;
+
+	ext = toyfs_ext_array(tino);
+	memmove(&ext[idx + 1], &ext[idx],
+		(tino->i_nextents - idx) * sizeof(*ext));
+	ext[idx] = new;
+	tino->i_nextents++;
+	return 0;
+}
+
+/*
+ * toyfs_ext_sync_note()
+ *	- Remember the block bitmap blocks covering [@pblk, @pblk + @len),
+ *	  just allocated for the inode, so toyfs_fsync() can write them
+ */
+static void toyfs_ext_sync_note(struct tfs_inode_info *tino,
+				unsigned int pblk, unsigned int len)
+{
+	struct super_block *sb = tino->vfs_inode.i_sb;
+	unsigned int bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+
+	tino->i_sync_bmap_lo = min(tino->i_sync_bmap_lo, pblk / bits);
+	tino->i_sync_bmap_hi = max(tino->i_sync_bmap_hi,
+				   (pblk + len - 1) / bits);
+}
+
+/**
+ * toyfs_ext_sync_reset() - Forget the bitmap blocks to be written by fsync
+ * @tino: The inode in question
+ */
+void toyfs_ext_sync_reset(struct tfs_inode_info *tino)
+{
+	tino->i_sync_bmap_lo = TFS_INVALID;
+	tino->i_sync_bmap_hi = 0;
+}
+
+/*
+ * toyfs_ext_block_alloc()
+ *	- Allocate the overflow extent block if the extent list might outgrow
+ *	  the on-disk inode by one more extent
+ */
+static int toyfs_ext_block_alloc(struct inode *inode, unsigned int goal)
+{
+	struct tfs_inode_info	*tino;
+	struct super_block	*sb = inode->i_sb;
+	unsigned int		got;
+	int			blk;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+
+	if (toyfs_is_legacy(sb->s_fs_info) ||
+	    tino->i_nextents < TFS_INODE_EXTENTS ||
+	    tino->i_ext_block != TFS_INVALID)
+		return 0;
+
+	if (tino->i_meta_resv) {
+		blk = toyfs_balloc_reserved(sb, goal, 1, &got);
+		if (blk >= 0)
+			tino->i_meta_resv = false;
+	} else {
+		blk = toyfs_balloc(sb, goal);
+	}
+	if (blk < 0)
+		return blk;
+
+	pr_debug("Inode %lu: overflow extent block %d\n", inode->i_ino, blk);
+	tino->i_ext_block = blk;
+	toyfs_ext_sync_note(tino, blk, 1);
+	return 0;
+}
+
+/* Does the file have any unwritten extent left? */
+static bool toyfs_ext_has_unwritten(struct tfs_inode_info *tino)
+{
+	struct tfs_extent	*ext = toyfs_ext_array(tino);
+	unsigned int		i;
+
+	for (i = 0; i < tino->i_nextents; i++) {
+		if (toyfs_ext_unwritten(&ext[i]))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * toyfs_ext_reserve_meta() - Reserve the overflow extent block in advance
+ * @inode: The inode in question
+ *
+ * Allocating delayed blocks, or converting unwritten ones, at writeback can
+ * add extents, and so need the overflow extent block. That must not fail
+ * with -ENOSPC, the data was already reported as written. Whoever creates
+ * delayed or unwritten blocks reserves it first, see toyfs_ext_block_alloc().
+ *
+ * Context: Called with i_map_lock held for writing.
+ *
+ * Return: 0 on success or -ENOSPC
+ */
+int toyfs_ext_reserve_meta(struct inode *inode)
+{
+	struct tfs_inode_info	*tino;
+	int			error;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+
+	if (toyfs_is_legacy(inode->i_sb->s_fs_info) || tino->i_meta_resv ||
+	    tino->i_ext_block != TFS_INVALID)
+		return 0;
+
+	error = toyfs_reserve_blocks(inode->i_sb, 1);
+	if (!error)
+		tino->i_meta_resv = true;
+	return error;
+}
+
+/**
+ * toyfs_ext_unreserve_meta() - Give back the overflow extent block reservation
+ * @inode: The inode in question
+ * @force: Give it back even if delayed or unwritten blocks are left
+ *
+ * Context: Called with i_map_lock held for writing, or on eviction with
+ *	    @force set.
+ */
+void toyfs_ext_unreserve_meta(struct inode *inode, bool force)
+{
+	struct tfs_inode_info	*tino;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+
+	if (!tino->i_meta_resv)
+		return;
+	if (!force && (!xa_empty(&tino->i_delalloc) ||
+		       toyfs_ext_has_unwritten(tino)))
+		return;
+
+	toyfs_unreserve_blocks(inode->i_sb, 1);
+	tino->i_meta_resv = false;
+}
+
+/**
+ * toyfs_ext_insert() - Map a range of a file to newly allocated disk blocks
+ * @inode: The inode being written
+ * @lblk: First logical block of the range, must be within a hole
+ * @pblk: First disk block of the range
+ * @len: Number of blocks
+ * @unwritten: The blocks were preallocated, and hold no data yet
+ *
+ * If the extent list may outgrow the on-disk inode, we allocate the overflow
+ * extent block before touching the extent list, so toyfs_write_inode() never
+ * needs to allocate space, and we never end up with in-core extents which
+ * can't be written back. The new range might still be merged into an existing
+ * extent, in which case the overflow block is simply kept for later use.
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_ext_insert(struct inode *inode, unsigned int lblk,
+		     unsigned int pblk, unsigned int len, bool unwritten)
+{
+	struct tfs_inode_info	*tino;
+	int			error;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+
+	/* Unwritten blocks will be converted at writeback */
+	if (unwritten) {
+		error = toyfs_ext_reserve_meta(inode);
+		if (error)
+			return error;
+	}
+
+	error = toyfs_ext_block_alloc(inode, pblk + len);
+	if (error)
+		return error;
+
+	error = __toyfs_ext_add(tino, lblk, pblk, len, unwritten);
+	if (error)
+		return error;
+
+	toyfs_ext_sync_note(tino, pblk, len);
+	WRITE_ONCE(tino->i_map_seq, tino->i_map_seq + 1);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * toyfs_ext_split()
+ *	- Make sure no extent straddles @lblk, splitting the one containing it
+ *	  in two if needed, so a range starting or ending at @lblk can be
+ *	  updated on its own
+ */
+static int toyfs_ext_split(struct inode *inode, unsigned int lblk)
+{
+	struct tfs_inode_info	*tino;
+	struct tfs_extent	*ext;
+	unsigned int		idx;
+	unsigned int		head;
+	int			error;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	idx = toyfs_ext_search(tino, lblk);
+	ext = toyfs_ext_array(tino);
+
+	if (idx >= tino->i_nextents || ext[idx].e_lblk >= lblk)
+		return 0;
+
+	error = toyfs_ext_block_alloc(inode, ext[idx].e_pblk);
+	if (!error)
+		error = toyfs_ext_grow(tino);
+	if (error)
+		return error;
+
+	ext = toyfs_ext_array(tino);
+	memmove(&ext[idx + 1], &ext[idx],
+		(tino->i_nextents - idx) * sizeof(*ext));
+	tino->i_nextents++;
+
+	/* The unwritten flag is in the high bit, and stays where it is */
+	head = lblk - ext[idx].e_lblk;
+	ext[idx].e_len -= toyfs_ext_len(&ext[idx]) - head;
+	ext[idx + 1].e_lblk = lblk;
+	ext[idx + 1].e_pblk += head;
+	ext[idx + 1].e_len -= head;
+	return 0;
+}
+
+/*
+ * toyfs_ext_merge()
+ *	- Merge back the extents within [@first, @last] with their previous
+ *	  neighbour, whenever possible
+ */
+static void toyfs_ext_merge(struct tfs_inode_info *tino, unsigned int first,
+			    unsigned int last)
+{
+	struct tfs_extent	*ext = toyfs_ext_array(tino);
+	unsigned int		idx = max(first, 1U);
+
+	while (idx <= last && idx < tino->i_nextents) {
+		if (!toyfs_ext_mergeable(&ext[idx - 1], &ext[idx])) {
+			idx++;
+			continue;
+		}
+
+		ext[idx - 1].e_len += toyfs_ext_len(&ext[idx]);
+		memmove(&ext[idx], &ext[idx + 1],
+			(tino->i_nextents - idx - 1) * sizeof(*ext));
+		tino->i_nextents--;
+		last--;
+	}
+}
+
+/**
+ * toyfs_ext_set_unwritten() - Change the state of the blocks within a range
+ * @inode: The inode in question
+ * @start: First logical block
+ * @end: Logical block following the range
+ * @unwritten: Flag the blocks as unwritten, or as holding data
+ *
+ * Holes within the range are left alone. Changing the state of part of an
+ * extent splits it, so this can fail with -EFBIG once the extent list is full.
+ * Splits of unwritten extents at writeback use the overflow extent block
+ * reserved when the blocks were flagged unwritten.
+ *
+ * Context: Called with i_map_lock held for writing.
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_ext_set_unwritten(struct inode *inode, unsigned int start,
+			    unsigned int end, bool unwritten)
+{
+	struct tfs_inode_info	*tino;
+	struct tfs_extent	*ext;
+	unsigned int		first;
+	unsigned int		idx;
+	int			error;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+
+	if (start >= end)
+		return 0;
+
+	error = unwritten ? toyfs_ext_reserve_meta(inode) : 0;
+	if (!error)
+		error = toyfs_ext_split(inode, start);
+	if (!error)
+		error = toyfs_ext_split(inode, end);
+	if (error)
+		return error;
+
+	ext = toyfs_ext_array(tino);
+	first = toyfs_ext_search(tino, start);
+	for (idx = first; idx < tino->i_nextents && ext[idx].e_lblk < end; idx++) {
+		if (unwritten)
+			ext[idx].e_len |= TFS_EXT_UNWRITTEN;
+		else
+			ext[idx].e_len &= ~TFS_EXT_UNWRITTEN;
+	}
+
+	toyfs_ext_merge(tino, first, idx);
+
+	WRITE_ONCE(tino->i_map_seq, tino->i_map_seq + 1);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/**
+ * toyfs_ext_remove() - Unmap a range of a file and free its blocks
+ * @inode: The inode in question
+ * @start: First logical block
+ * @end: Logical block following the range, U32_MAX to truncate
+ *
+ * Extents partially within the range are trimmed. Only punching a hole in
+ * the middle of an extent needs to split it, which can fail with -EFBIG once
+ * the extent list is full. Truncating never fails. The overflow extent block,
+ * if any, is kept even if it isn't needed anymore.
+ *
+ * Context: Called with i_map_lock held for writing.
+ *
+ * Return: The number of blocks freed or a negative error
+ */
+int toyfs_ext_remove(struct inode *inode, unsigned int start, unsigned int end)
+{
+	struct tfs_inode_info	*tino;
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_extent	*ext;
+	unsigned int		first;
+	unsigned int		idx;
+	unsigned int		cut;
+	int			freed = 0;
+	int			error;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+
+	if (start >= end)
+		return 0;
+
+	ext = toyfs_ext_array(tino);
+	idx = toyfs_ext_search(tino, start);
+	if (idx < tino->i_nextents && ext[idx].e_lblk < start &&
+	    toyfs_ext_end(&ext[idx]) > end) {
+		error = toyfs_ext_split(inode, end);
+		if (error)
+			return error;
+		ext = toyfs_ext_array(tino);
+	}
+
+	/* Keep the head of an extent starting before the range */
+	if (idx < tino->i_nextents && ext[idx].e_lblk < start) {
+		cut = toyfs_ext_end(&ext[idx]) - start;
+		toyfs_bfree_range(sb, ext[idx].e_pblk + (start - ext[idx].e_lblk),
+				  cut);
+		ext[idx].e_len -= cut;
+		freed += cut;
+		idx++;
+	}
+
+	first = idx;
+	while (idx < tino->i_nextents && toyfs_ext_end(&ext[idx]) <= end) {
+		toyfs_bfree_range(sb, ext[idx].e_pblk, toyfs_ext_len(&ext[idx]));
+		freed += toyfs_ext_len(&ext[idx]);
+		idx++;
+	}
+
+	/* And the tail of an extent going past its end */
+	if (idx < tino->i_nextents && ext[idx].e_lblk < end) {
+		cut = end - ext[idx].e_lblk;
+		toyfs_bfree_range(sb, ext[idx].e_pblk, cut);
+		ext[idx].e_lblk += cut;
+		ext[idx].e_pblk += cut;
+		ext[idx].e_len -= cut;
+		freed += cut;
+	}
+
+	memmove(&ext[first], &ext[idx],
+		(tino->i_nextents - idx) * sizeof(*ext));
+	tino->i_nextents -= idx - first;
+
+	if (freed) {
+		WRITE_ONCE(tino->i_map_seq, tino->i_map_seq + 1);
+		mark_inode_dirty(inode);
+	}
+	return freed;
+}
+
+/*
+ * toyfs_ext_tail()
+ *	- Find the last part of [@start, *@end) a single handle may free:
+ *	  the tail of the last extent within the range, as much of it as one
+ *	  bitmap block covers
+ *	- Return false once nothing within the range is mapped anymore,
+ *	  otherwise the part is returned in [*@first, *@end).
+ */
+static bool toyfs_ext_tail(struct inode *inode, unsigned int start,
+			   unsigned int *first, unsigned int *end)
+{
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned int		bits = TFS_BITS_PER_BLOCK(inode->i_sb->s_blocksize);
+	struct tfs_extent	*ext = toyfs_ext_array(tino);
+	unsigned int		idx;
+	unsigned int		last;
+	unsigned int		pblk;
+
+	idx = toyfs_ext_search(tino, *end - 1);
+	if (idx == tino->i_nextents || ext[idx].e_lblk >= *end) {
+		if (!idx)
+			return false;
+		idx--;
+	}
+	if (toyfs_ext_end(&ext[idx]) <= start)
+		return false;
+
+	last = min(*end, toyfs_ext_end(&ext[idx]));
+	pblk = ext[idx].e_pblk + (last - 1 - ext[idx].e_lblk);
+	pblk = max(round_down(pblk, bits), ext[idx].e_pblk);
+
+	*first = max(start, ext[idx].e_lblk + (pblk - ext[idx].e_pblk));
+	*end = last;
+	return true;
+}
+
+/**
+ * toyfs_ext_truncate() - Unmap a range of a file and free its blocks
+ * @inode: The inode in question
+ * @start: First logical block
+ * @end: Logical block following the range, U32_MAX to truncate
+ *
+ * Same as toyfs_ext_remove(), in as many handles as needed for a large or
+ * fragmented range: each one frees blocks from a single bitmap block, so
+ * the credits of a handle always cover it. The range is freed from its end
+ * backward, and the inode logged along every time. A crash in the middle
+ * leaves some of the blocks still mapped, never a freed block mapped.
+ *
+ * Context: Starts its own handles, none may be held. Takes i_map_lock.
+ *
+ * Return: The number of blocks freed or a negative error
+ */
+int toyfs_ext_truncate(struct inode *inode, unsigned int start,
+		       unsigned int end)
+{
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	struct tfs_handle	h;
+	unsigned int		first;
+	int			freed = 0;
+	int			ret = 0;
+
+	if (WARN_ON_ONCE(current->journal_info))
+		return -EINVAL;
+
+	while (start < end) {
+		ret = toyfs_journal_start(inode->i_sb, &h, TFS_JOURNAL_CREDITS);
+		if (ret)
+			break;
+
+		down_write(&tino->i_map_lock);
+		if (!toyfs_ext_tail(inode, start, &first, &end)) {
+			up_write(&tino->i_map_lock);
+			toyfs_journal_stop(&h);
+			break;
+		}
+
+		ret = toyfs_ext_remove(inode, first, end);
+		if (ret > 0) {
+			toyfs_inode_sub_blocks(inode, ret);
+			freed += ret;
+		}
+		toyfs_journal_inode_locked(inode);
+		up_write(&tino->i_map_lock);
+		toyfs_journal_stop(&h);
+		if (ret < 0)
+			break;
+		end = first;
+	}
+
+	return ret < 0 ? ret : freed;
+}
+
+/**
+ * toyfs_ext_load() - Load the block map from the on-disk inode
+ * @inode: The in-core inode being read
+ * @dip: The on-disk inode
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_ext_load(struct inode *inode, struct tfs_dinode *dip)
+{
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct tfs_inode_info	*tino;
+	struct tfs_extent_block	*eb;
+	struct buffer_head	*bh;
+	struct tfs_extent	*ext;
+	int			error = 0;
+	int			i;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	toyfs_ext_init(tino);
+
+	if (toyfs_is_legacy(tfi)) {
+		for (i = 0; i < TFS_MAX_INO_BLKS; i++) {
+			if (dip->i_addr[i] == TFS_INVALID)
+				continue;
+
+			error = __toyfs_ext_add(tino, i, dip->i_addr[i], 1, false);
+			if (error)
+				return error;
+		}
+		goto validate;
+	}
+
+	for (i = 0; i < TFS_INODE_EXTENTS; i++) {
+		ext = &dip->i_extents[i];
+		if (!toyfs_ext_len(ext))
+			break;
+
+		tino->i_inline_ext[i] = *ext;
+		tino->i_nextents++;
+	}
+
+	tino->i_ext_block = dip->i_ext_block;
+	if (tino->i_ext_block == TFS_INVALID)
+		goto validate;
+
+	if (tino->i_ext_block >= tfi->s_nblocks)
+		return -EFSCORRUPTED;
+
+	bh = sb_bread(sb, tino->i_ext_block);
+	if (!bh)
+		return -EIO;
+
+	/*
+	 * The overflow block only ever holds what doesn't fit in the inode,
+	 * anything else would leave us without an extent array to load it in.
+	 */
+	eb = (struct tfs_extent_block *)bh->b_data;
+	if (eb->eb_count > TFS_EXTENTS_PER_BLOCK(sb->s_blocksize) ||
+	    (eb->eb_count && tino->i_nextents < TFS_INODE_EXTENTS) ||
+	    tino->i_nextents + eb->eb_count > TFS_MAX_EXTENTS(sb->s_blocksize)) {
+		error = -EFSCORRUPTED;
+		goto out_brelse;
+	}
+
+	if (eb->eb_count) {
+		error = toyfs_ext_grow(tino);
+		if (error)
+			goto out_brelse;
+
+		memcpy(&tino->i_extents[tino->i_nextents], eb->eb_extents,
+		       eb->eb_count * sizeof(struct tfs_extent));
+		tino->i_nextents += eb->eb_count;
+	}
+	brelse(bh);
+
+validate:
+	ext = toyfs_ext_array(tino);
+	for (i = 0; i < tino->i_nextents; i++) {
+		if (!toyfs_ext_len(&ext[i]) ||
+		    ext[i].e_pblk < tfi->s_data_start ||
+		    ext[i].e_pblk >= tfi->s_nblocks ||
+		    toyfs_ext_len(&ext[i]) > tfi->s_nblocks - ext[i].e_pblk ||
+		    (i && ext[i].e_lblk < toyfs_ext_end(&ext[i - 1]))) {
+			pr_debug("Inode %lu: invalid extent %d\n", inode->i_ino, i);
+			return -EFSCORRUPTED;
+		}
+	}
+	return 0;
+
+out_brelse:
+	brelse(bh);
+	return error;
+}
+
+/**
+ * toyfs_ext_store() - Store the block map into the on-disk inode
+ * @inode: The in-core inode being written
+ * @dip: The on-disk inode
+ * @sync: Write the overflow extent block synchronously, never set with a
+ *	  journal, which logs it instead
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_ext_store(struct inode *inode, struct tfs_dinode *dip, bool sync)
+{
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_inode_info	*tino;
+	struct tfs_extent_block	*eb;
+	struct buffer_head	*bh;
+	struct tfs_extent	*ext;
+	unsigned int		count;
+	int			i, j;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	ext = toyfs_ext_array(tino);
+
+	if (toyfs_is_legacy(sb->s_fs_info)) {
+		for (i = 0; i < TFS_MAX_INO_BLKS; i++)
+			dip->i_addr[i] = TFS_INVALID;
+
+		for (i = 0; i < tino->i_nextents; i++) {
+			for (j = 0; j < toyfs_ext_len(&ext[i]); j++)
+				dip->i_addr[ext[i].e_lblk + j] = ext[i].e_pblk + j;
+		}
+		return 0;
+	}
+
+	memset(dip->i_extents, 0, sizeof(dip->i_extents));
+	count = min_t(unsigned int, tino->i_nextents, TFS_INODE_EXTENTS);
+	memcpy(dip->i_extents, ext, count * sizeof(struct tfs_extent));
+	dip->i_ext_block = tino->i_ext_block;
+
+	if (tino->i_ext_block == TFS_INVALID)
+		return 0;
+
+	bh = sb_bread(sb, tino->i_ext_block);
+	if (!bh)
+		return -EIO;
+
+	eb = (struct tfs_extent_block *)bh->b_data;
+	eb->eb_count = tino->i_nextents - count;
+	memcpy(eb->eb_extents, &ext[count],
+	       eb->eb_count * sizeof(struct tfs_extent));
+
+	toyfs_journal_dirty(sb, bh);
+	if (sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			brelse(bh);
+			return -EIO;
+		}
+	}
+	brelse(bh);
+	return 0;
+}
+
+/* Initialize an empty block map */
+void toyfs_ext_init(struct tfs_inode_info *tino)
+{
+	tino->i_nextents = 0;
+	tino->i_ext_block = TFS_INVALID;
+	tino->i_extents = NULL;
+	tino->i_meta_resv = false;
+	toyfs_ext_sync_reset(tino);
+}
+
+/* Free the in-core extent list, if it has been moved out of the inode */
+void toyfs_ext_destroy(struct tfs_inode_info *tino)
+{
+	kfree(tino->i_extents);
+	tino->i_extents = NULL;
+}
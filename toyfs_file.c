@@ -3,98 +3,627 @@
 #define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
 
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/iomap.h>
+#include <linux/falloc.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include "toyfs_types.h"
 #include "toyfs_iops.h"
 #include "toyfs_aops.h"
 
+/*
+ * How many directory blocks to read ahead of the one being emitted, so
+ * listing a large directory doesn't wait on one block read at a time.
+ */
+#define TFS_DIR_RA_BLOCKS	16
+
+/**
+ * toyfs_readdir() - Emit the entries of a directory
+ * @fdir: The directory file being read
+ * @ctx: Where to emit the entries to, and where to start from (ctx->pos)
+ *
+ * ctx->pos is in byte granularity: an entry's position is its dentry slot
+ * times the size of a dentry, which makes it a stable cookie. Dentries
+ * never move once written, so we can always resume right where we left
+ * off, no matter how many entries were added or removed in between.
+ *
+ * "." and ".." are emitted by dir_emit_dots(), at positions 0 and 1. Their
+ * on-disk entries hold the first two slots of the first dentry block, so
+ * they never clash with real entries. Index blocks have no entries to
+ * emit, and are skipped.
+ *
+ * Return: Zero, or a negative value if a directory block can't be read
+ */
 int toyfs_readdir(struct file *fdir, struct dir_context *ctx)
 {
-#if 0 /* ASSIGNMENT */
-
-	struct inode	*ip;
+	struct inode		*ip = file_inode(fdir);
+	struct super_block	*sb = ip->i_sb;
 	struct tfs_inode_info	*tino;
 	struct buffer_head	*bh;
 	struct tfs_dentry	*d_array;
-	int			start;	/* dentry we should start reading */
-	int			cur;	/* dentry we are currently at */
-	int			idx;	/* dentry idx within the current block */
-	int			block = 0;
-	int			size;
-	int			ret;
+	unsigned int		per_block = toyfs_entries_per_block(ip);
+	unsigned int		nblocks;
+	unsigned int		block;
+	unsigned int		ra;
+	unsigned int		idx;
+	unsigned int		blk;
 
-	return -EOPNOTSUPP;
-
-	ip = file_inode(fdir);
 	tino = container_of(ip, struct tfs_inode_info, vfs_inode);
 
-	/*
-	 * It is given to us via dir_context struct, where
-	 * we should start reading the directory
-	 */
+	if (!dir_emit_dots(fdir, ctx))
+		return 0;
+
+	nblocks = tino->i_blocks;
+	idx = ctx->pos / sizeof(struct tfs_dentry);
+	block = idx / per_block;
+	idx %= per_block;
+
+	for (ra = block + 1; block < nblocks; block++, idx = 0) {
+		for (; ra < nblocks && ra <= block + TFS_DIR_RA_BLOCKS; ra++) {
+			blk = toyfs_ext_lookup(tino, ra, NULL);
+			if (blk != TFS_INVALID)
+				sb_breadahead(sb, blk);
+		}
 
-	start = ctx->pos / sizeof(struct tfs_dentry);
-
-	while (block < TFS_MAX_INO_BLKS) {
-
-		/* Some code here */
-
-		for (idx = 0; idx < TFS_ENTRIES_PER_BLOCK; idx++) {
-
-			/* some code here */
-
-			/*
-			 * We must call dir_emit() for each valid directory entry within the
-			 * directory we are reading.
-			 *
-			 * The function returns 0 if it could add the directory entry to its
-			 * internal buffer.
-			 *
-			 * The buffer is limited in size, which meants toyfs_readdir() can be
-			 * called in a loop while reading a directory.
-			 *
-			 * If dir_emit() returns a non-zero value, we must return. It will most
-			 * likely empty its buffer, and call toyfs_readdir() again.
-			 *
-			 * Look back at the top of the function. We may be called with a non-zero
-			 * ctx->pos value. Which means, we must start reading the directory data
-			 * from where ctx->pos is.
-			 *
-			 * After a successful call to dir_emit(), we must also update the ctx->pos
-			 * value.
-			 *
-			 * Remember this is in the 'file struct' context, ctx->pos is in byte
-			 * granularity, so, for each directory we successfully read and emit via
-			 * dir_emit(), we must update ctx->pos with the proper amount of bytes.
-			 */
-			ret = dir_emit(ctx, d_array[idx].d_name, size,
-				       d_array[idx].d_ino, DT_UNKNOWN);
-
-			/* We filled the whole dir buffer */
-			if (!ret) {
+		blk = toyfs_ext_lookup(tino, block, NULL);
+		if (blk == TFS_INVALID)
+			return -EIO;
+
+		bh = sb_bread(sb, blk);
+		if (!bh)
+			return -EIO;
+
+		d_array = (struct tfs_dentry *)bh->b_data;
+		if (d_array[0].d_ino == TFS_DX_MAGIC)
+			idx = per_block;
+
+		for (; idx < per_block; idx++) {
+			struct tfs_dentry *de = &d_array[idx];
+
+			if (de->d_ino == TFS_INVALID ||
+			    !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+
+			ctx->pos = (block * per_block + idx) *
+				   sizeof(struct tfs_dentry);
+
+			/* The user buffer is full, we'll be called again from ctx->pos */
+			if (!dir_emit(ctx, de->d_name,
+				      strnlen(de->d_name, sizeof(de->d_name)),
+				      de->d_ino, de->d_type)) {
 				brelse(bh);
 				return 0;
 			}
-
-			/* Some code here maybe? */
 		}
-		/* Some code here maybe? */
+		brelse(bh);
+
+		ctx->pos = (block + 1) * per_block *
+			   sizeof(struct tfs_dentry);
 	}
-	/* Some code here maybe? */
 
-#endif /* ASSIGNMENT */
 	return 0;
 }
 
+/*
+ * O_DIRECT I/O must be aligned to the filesystem block size, both in file
+ * offset and length. This keeps direct writes from ever having to zero
+ * (or read-modify-write) partial blocks behind the page cache's back.
+ * The user buffer alignment against the device is checked by iomap itself.
+ */
+static bool toyfs_dio_aligned(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	return IS_ALIGNED(iocb->ki_pos | iov_iter_count(iter),
+			  i_blocksize(inode));
+}
+
+/*
+ * toyfs_file_read_iter()
+ *	- Buffered reads go through the page cache
+ *	- O_DIRECT reads are mapped with toyfs_iomap_begin() and read straight
+ *	  into the user buffer. iomap writes back any dirty page cache over
+ *	  the range first, so we never read stale data from disk.
+ */
+static ssize_t toyfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode	*inode = file_inode(iocb->ki_filp);
+	ssize_t		ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	if (!toyfs_dio_aligned(iocb, to))
+		return -EINVAL;
+
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &toyfs_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+/*
+ * Blocks direct writes allocate are unwritten, like preallocated ones, and
+ * only turn written here, once the data is on disk.
+ *
+ * Extending direct writes are always waited for with the inode locked (see
+ * toyfs_dio_write()), so it is safe to update i_size from here. It must be
+ * done before iomap invalidates the page cache, otherwise a racing buffered
+ * read could zero out the tail of the new data.
+ */
+static int toyfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+				  unsigned int flags)
+{
+	struct inode	*inode = file_inode(iocb->ki_filp);
+	loff_t		end = iocb->ki_pos + size;
+
+	if (error)
+		return error;
+
+	/* The data is on disk, the unwritten blocks we wrote into can be read */
+	if (flags & IOMAP_DIO_UNWRITTEN) {
+		error = toyfs_convert_unwritten(inode, iocb->ki_pos, size);
+		if (error)
+			return error;
+	}
+
+	if (end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static const struct iomap_dio_ops toyfs_dio_write_ops = {
+	.end_io		= toyfs_dio_write_end_io,
+};
+
+/*
+ * toyfs_dio_write()
+ *	- Called with the inode locked, after the write checks are done
+ *	- Blocks are allocated by toyfs_iomap_begin() right away (there is no
+ *	  page cache to delay them for), unwritten until the I/O completes.
+ *	  The bios are submitted straight from the user buffer.
+ *	- iomap writes back and invalidates the page cache over the range both
+ *	  before and after the write. If the invalidation fails (someone keeps
+ *	  redirtying the pages through mmap), iomap returns -ENOTBLK and we
+ *	  fall back to a buffered write for whatever is left, and then write
+ *	  it back and drop it from the page cache ourselves.
+ */
+static ssize_t toyfs_dio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode	*inode = file_inode(iocb->ki_filp);
+	unsigned int	flags = 0;
+	loff_t		pos;
+	ssize_t		ret;
+	ssize_t		written;
+	int		error;
+
+	if (!toyfs_dio_aligned(iocb, from))
+		return -EINVAL;
+
+	if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))
+		flags |= IOMAP_DIO_FORCE_WAIT;
+
+	ret = iomap_dio_rw(iocb, from, &toyfs_iomap_ops, &toyfs_dio_write_ops,
+			   flags, NULL, 0);
+	if (ret == -ENOTBLK)
+		ret = 0;
+	if (ret < 0 || !iov_iter_count(from))
+		return ret;
+
+	pos = iocb->ki_pos;
+	written = iomap_file_buffered_write(iocb, from, &toyfs_iomap_ops);
+	if (written <= 0)
+		return ret ? ret : written;
+
+	error = filemap_write_and_wait_range(inode->i_mapping, pos,
+					     pos + written - 1);
+	if (!error)
+		invalidate_mapping_pages(inode->i_mapping, pos >> PAGE_SHIFT,
+					 (pos + written - 1) >> PAGE_SHIFT);
+
+	/* iomap only syncs what it wrote itself */
+	return generic_write_sync(iocb, ret + written);
+}
+
+/*
+ * toyfs_file_write_iter()
+ *	- Buffered writes go straight through iomap, which maps (and reserves
+ *	  space for) the whole write range in as few calls to
+ *	  toyfs_iomap_begin() as the block map allows. Blocks are allocated
+ *	  at writeback.
+ *	- O_DIRECT writes are handed over to toyfs_dio_write(), O_DSYNC is
+ *	  dealt with at I/O completion by iomap.
+ *	- Inline files are converted first, unless the write still fits.
+ *	- -ENOSPC is retried once blocks freed by the running transaction
+ *	  are committed. Only i_rwsem is held there, which handles never
+ *	  wait for.
+ */
+static ssize_t toyfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file	*file = iocb->ki_filp;
+	struct inode	*inode = file_inode(file);
+	int		retries = 0;
+	ssize_t		ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+retry:
+	if ((iocb->ki_flags & IOCB_DIRECT) ||
+	    iocb->ki_pos + iov_iter_count(from) > TFS_INLINE_SIZE) {
+		ret = toyfs_inline_convert(inode);
+		if (ret == -ENOSPC &&
+		    toyfs_should_retry_alloc(inode->i_sb, &retries))
+			goto retry;
+		if (ret)
+			goto out_unlock;
+	}
+
+	if (iocb->ki_flags & IOCB_DIRECT)
+		ret = toyfs_dio_write(iocb, from);
+	else
+		ret = iomap_file_buffered_write(iocb, from, &toyfs_iomap_ops);
+	if (ret == -ENOSPC && toyfs_should_retry_alloc(inode->i_sb, &retries))
+		goto retry;
+	if (iocb->ki_flags & IOCB_DIRECT)
+		goto out_unlock;
+	inode_unlock(inode);
+
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+
+out_unlock:
+	inode_unlock(inode);
+	return ret;
+}
+
+/*
+ * Pages dirtied through mmap get their blocks reserved at fault time, so we
+ * can fail the fault with SIGBUS instead of losing data at writeback.
+ * Inline data can't be written through mmap, the file gets a block first.
+ * The folio isn't locked yet nor anymore here, so a failed reservation can
+ * be retried after a commit, see toyfs_should_retry_alloc().
+ */
+static vm_fault_t toyfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode		*inode = file_inode(vmf->vma->vm_file);
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	int			retries = 0;
+	vm_fault_t		ret;
+	int			error;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+retry:
+	error = toyfs_inline_convert(inode);
+	if (error) {
+		ret = vmf_fs_error(error);
+	} else {
+		/* Before the folio lock, see toyfs_writepages() */
+		down_read(&tino->i_delalloc_sem);
+		ret = iomap_page_mkwrite(vmf, &toyfs_iomap_ops);
+		up_read(&tino->i_delalloc_sem);
+	}
+	if (ret == VM_FAULT_SIGBUS &&
+	    toyfs_should_retry_alloc(inode->i_sb, &retries))
+		goto retry;
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct toyfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= toyfs_page_mkwrite,
+};
+
+static int toyfs_file_open(struct inode *inode, struct file *file)
+{
+	file->f_mode |= FMODE_CAN_ODIRECT;
+	return generic_file_open(inode, file);
+}
+
+static int toyfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &toyfs_file_vm_ops;
+	return 0;
+}
+
+/*
+ * toyfs_zero_partial()
+ *	- Zero the parts of the partial blocks at both ends of [@start, @end)
+ *	  through the page cache, the whole blocks in between are dealt with
+ *	  by the caller
+ *	- Nothing needs zeroing past EOF, and iomap would extend the file.
+ */
+static int toyfs_zero_partial(struct inode *inode, loff_t start, loff_t end)
+{
+	unsigned int	bsize = i_blocksize(inode);
+	loff_t		head_end = min(end, round_up(start, bsize));
+	loff_t		tail_start = max(round_down(end, bsize), head_end);
+	loff_t		isize = i_size_read(inode);
+	int		error = 0;
+
+	head_end = min(head_end, isize);
+	if (start < head_end)
+		error = iomap_zero_range(inode, start, head_end - start, NULL,
+					 &toyfs_iomap_ops);
+
+	end = min(end, isize);
+	if (!error && tail_start < end)
+		error = iomap_zero_range(inode, tail_start, end - tail_start, NULL,
+					 &toyfs_iomap_ops);
+	return error;
+}
+
+/**
+ * toyfs_fallocate() - Preallocate or deallocate file space
+ * @file: The file in question
+ * @mode: FALLOC_FL_* flags
+ * @offset: Start of the range, in bytes
+ * @len: Length of the range, in bytes
+ *
+ * Preallocated blocks are recorded as unwritten extents, which read as zeros
+ * without any I/O, so writes into them don't need to allocate. With
+ * FALLOC_FL_PUNCH_HOLE, the whole blocks of the range are freed. With
+ * FALLOC_FL_ZERO_RANGE, they are turned (or allocated as) unwritten. Either
+ * way, the partial blocks at both ends are zeroed.
+ *
+ * Legacy filesystems can't record unwritten blocks, so they don't support
+ * fallocate at all. Inline files are moved to a block first.
+ *
+ * Return: 0 on success or a negative error
+ */
+static long toyfs_fallocate(struct file *file, int mode, loff_t offset,
+			    loff_t len)
+{
+	struct inode		*inode = file_inode(file);
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	unsigned int		blkbits = inode->i_blkbits;
+	unsigned int		start = DIV_ROUND_UP(offset, i_blocksize(inode));
+	unsigned int		end = (offset + len) >> blkbits;
+	loff_t			new_size = 0;
+	struct tfs_handle	h;
+	int			freed;
+	long			error;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+
+	if (toyfs_is_legacy(inode->i_sb->s_fs_info))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	inode_dio_wait(inode);
+
+	if (!(mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) &&
+	    offset + len > i_size_read(inode)) {
+		new_size = offset + len;
+		error = inode_newsize_ok(inode, new_size);
+		if (error)
+			goto out_unlock;
+	}
+
+	error = file_modified(file);
+	if (error)
+		goto out_unlock;
+
+	error = toyfs_inline_convert(inode);
+	if (error)
+		goto out_unlock;
+
+	/* Keep page faults away while blocks come and go */
+	filemap_invalidate_lock(inode->i_mapping);
+
+	if (!(mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))) {
+		error = toyfs_prealloc(inode, offset >> blkbits,
+				       DIV_ROUND_UP(offset + len,
+						    i_blocksize(inode)));
+		goto out_size;
+	}
+
+	error = toyfs_zero_partial(inode, offset, offset + len);
+	if (error || start >= end)
+		goto out_size;
+
+	truncate_pagecache_range(inode, (loff_t)start << blkbits,
+				 ((loff_t)end << blkbits) - 1);
+	toyfs_delalloc_release(inode, start, end);
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		freed = toyfs_ext_truncate(inode, start, end);
+		error = min(freed, 0);
+		goto out_size;
+	}
+
+	error = toyfs_journal_start(inode->i_sb, &h, TFS_JOURNAL_CREDITS);
+	if (error)
+		goto out_size;
+
+	down_write(&tino->i_map_lock);
+	error = toyfs_ext_set_unwritten(inode, start, end, true);
+	toyfs_journal_inode_locked(inode);
+	up_write(&tino->i_map_lock);
+	toyfs_journal_stop(&h);
+
+	if (!error)
+		error = toyfs_prealloc(inode, start, end);
+
+out_size:
+	if (!error && new_size)
+		i_size_write(inode, new_size);
+	if (!error && (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)))
+		inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+	mark_inode_dirty(inode);
+	filemap_invalidate_unlock(inode->i_mapping);
+out_unlock:
+	inode_unlock(inode);
+	return error;
+}
+
+/**
+ * toyfs_fsync() - Make the data and metadata of a file stable
+ * @file: The file in question
+ * @start: First byte of the range to write back
+ * @end: Last byte of the range to write back
+ * @datasync: Only the metadata needed to read the data back matters
+ *
+ * Only the dirty folios of the range are written back. Then, if needed, only
+ * the metadata of this very inode: its inode table block, the block bitmap
+ * blocks its allocations dirtied since the last fsync, and its overflow
+ * extent block. They are all in flight at once, and followed by a single
+ * device cache flush.
+ *
+ * Directories go through here too: their blocks are committed with the
+ * directory inode, or written by toyfs_dir_sync() without a journal.
+ *
+ * fdatasync skips the metadata altogether when only the timestamps changed,
+ * which is what overwriting an already written file comes down to. Size
+ * changes and block map changes (allocations, unwritten blocks turned
+ * written) are always written, even if the inode was written back but not
+ * synced already, see toyfs_write_inode().
+ *
+ * Return: 0 on success or a negative error
+ */
+static int toyfs_fsync(struct file *file, loff_t start, loff_t end,
+		       int datasync)
+{
+	struct inode		*inode = file->f_mapping->host;
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct tfs_inode_info	*tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	struct buffer_head	*ebh = NULL;
+	struct buffer_head	*bh;
+	struct tfs_dinode	*dip;
+	unsigned int		lo, hi, i;
+	bool			meta;
+	int			error;
+	int			err2;
+
+	error = file_write_and_wait_range(file, start, end);
+	if (error)
+		return error;
+
+	if (S_ISDIR(inode->i_mode) && !tfi->s_journal) {
+		error = toyfs_dir_sync(inode);
+		if (error)
+			return error;
+	}
+
+	if (datasync)
+		meta = (inode->i_state & I_DIRTY_DATASYNC) ||
+		       test_bit(TFS_SYNC_DATASYNC, &tino->i_sync_flags);
+	else
+		meta = (inode->i_state & I_DIRTY_INODE) ||
+		       test_bit(TFS_SYNC_INODE, &tino->i_sync_flags);
+	if (!meta)
+		goto out_flush;
+
+	/*
+	 * With a journal, everything the inode depends on went in the same
+	 * transaction as the inode itself, or an earlier one.
+	 */
+	if (tfi->s_journal) {
+		error = sync_inode_metadata(inode, 1);
+		if (!error &&
+		    test_and_clear_bit(TFS_SYNC_INODE, &tino->i_sync_flags)) {
+			clear_bit(TFS_SYNC_DATASYNC, &tino->i_sync_flags);
+			error = toyfs_journal_force(sb, READ_ONCE(tino->i_sync_tid));
+		}
+		goto out_flush;
+	}
+
+	down_write(&tino->i_map_lock);
+	lo = tino->i_sync_bmap_lo;
+	hi = min(tino->i_sync_bmap_hi, tfi->s_bmap_blocks - 1);
+	toyfs_ext_sync_reset(tino);
+	if (tino->i_ext_block != TFS_INVALID)
+		ebh = sb_find_get_block(sb, tino->i_ext_block);
+	up_write(&tino->i_map_lock);
+
+	/* Bitmap buffers not read yet can't be dirty */
+	for (i = lo; i <= hi; i++) {
+		bh = READ_ONCE(tfi->s_bmap_bh[i]);
+		if (bh)
+			write_dirty_buffer(bh, REQ_SYNC);
+	}
+	if (ebh)
+		write_dirty_buffer(ebh, REQ_SYNC);
+
+	/* Writes the inode, and its overflow block again if it changed */
+	error = sync_inode_metadata(inode, 1);
+
+	/* Written back by the flusher, but never synced */
+	if (!error && test_and_clear_bit(TFS_SYNC_INODE, &tino->i_sync_flags)) {
+		clear_bit(TFS_SYNC_DATASYNC, &tino->i_sync_flags);
+		dip = toyfs_get_dinode(sb, inode->i_ino, &bh);
+		if (IS_ERR(dip)) {
+			error = PTR_ERR(dip);
+		} else {
+			sync_dirty_buffer(bh);
+			if (buffer_req(bh) && !buffer_uptodate(bh))
+				error = -EIO;
+		}
+	}
+
+	for (i = lo; i <= hi; i++) {
+		bh = READ_ONCE(tfi->s_bmap_bh[i]);
+		if (!bh)
+			continue;
+
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			error = -EIO;
+	}
+	if (ebh) {
+		wait_on_buffer(ebh);
+		if (!buffer_uptodate(ebh))
+			error = -EIO;
+		brelse(ebh);
+	}
+
+out_flush:
+	err2 = blkdev_issue_flush(sb->s_bdev);
+	pr_debug("inode %lu: datasync %d, metadata %d: %d\n", inode->i_ino,
+		 datasync, meta, error ? error : err2);
+	return error ? error : err2;
+}
+
 struct file_operations toyfs_file_operations = {
-	.fsync		= generic_file_fsync,
+	.open		= toyfs_file_open,
+	.fsync		= toyfs_fsync,
 	.llseek		= generic_file_llseek,
-	.read_iter	= generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
-	.mmap		= generic_file_mmap,
+	.read_iter	= toyfs_file_read_iter,
+	.write_iter	= toyfs_file_write_iter,
+	.mmap		= toyfs_file_mmap,
+	.fallocate	= toyfs_fallocate,
 };
 
 struct file_operations toyfs_dir_file_operations = {
+	.fsync		= toyfs_fsync,
+	.read		= generic_read_dir,
+	.llseek		= generic_file_llseek,
 	.iterate_shared = toyfs_readdir,
 };
 
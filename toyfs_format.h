@@ -0,0 +1,342 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#ifndef __TOYFS_FORMAT_H
+#define __TOYFS_FORMAT_H
+
+/*
+ * On disk format, shared by the kernel and the userspace tools, see tools/.
+ * Everything is stored in host byte order.
+ */
+
+#include <linux/types.h>
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+
+/*
+ * Block size
+ *
+ * Versioned filesystems record theirs in s_log_block_size, as a power of two
+ * multiple of TFS_MIN_BSIZE, up to TFS_MAX_BSIZE. Legacy filesystems, and
+ * versioned ones made before the field existed (it reads as zero), use
+ * TFS_MIN_BSIZE.
+ *
+ * The superblock always starts at byte 0 of the device, whatever the block
+ * size, so it can be read with TFS_MIN_BSIZE blocks first.
+ */
+#define TFS_MIN_BSIZE_BITS	11
+#define TFS_MAX_BSIZE_BITS	16
+#define TFS_MIN_BSIZE		(1U << TFS_MIN_BSIZE_BITS)	/* 2KiB */
+#define TFS_MAX_BSIZE		(1U << TFS_MAX_BSIZE_BITS)	/* 64KiB */
+
+/*
+ * Legacy (version 0) filesystems have a fixed geometry: 1MiB in size, a
+ * single inode table block and a single bitmap block.
+ *
+ * Newer filesystems record their geometry in the superblock, see struct tfs_dsb.
+ */
+#define TFS_MAX_BLKS	512
+
+/*
+ * Number of blocks allocated for a single inode
+ * Yes, to make things simple, we hardcode it.
+ *
+ * Each block address is encoded within a 32-bit integer,
+ * the whole tfs_dinode structure is 36 bytes + 4 * num of blocks
+ * We use a amaximum of 7 blocks here so the whole inode structure
+ * is rounded to a power of 2 (64 bytes).
+ *
+ * So, in a single inode block, we can have 32 inodes.
+ * Legacy filesystems have a single inode block, so at most 32 inodes.
+ */
+#define TFS_INODE_COUNT		32
+
+/* Every inode can use up to 7 data blocks*/
+#define	TFS_MAX_INO_BLKS	7
+
+
+/*
+ * directory entry name is hardcoded within the dir entry, set a maximum value
+ * Set it to 28 bytes, so the whole dir entry struct is rounded to a power of 2 (32bytes)
+ */
+#define TFS_MAX_NLEN 28
+
+#define TFS_MAGIC 0x5F544F59 /* _TOY */
+
+/*
+ * Invalid reference
+ *
+ * Can be used to identify free dentries, free inodes, etc
+ * We need something like this, because we support inode 0.
+ *
+ * This is safe to use, because the superblock geometry is validated at mount
+ * time to have less than TFS_INVALID blocks and inodes, so we should never
+ * have a valid reference pointing to this same value.
+ */
+#define TFS_INVALID 0xdeadbeef
+
+/* Inode alloc flags */
+#define TFS_INODE_INUSE	1
+#define TFS_INODE_FREE	0
+
+/* s_flags fields */
+#define TFS_SB_CLEAN	0
+#define TFS_SB_DIRTY	1
+
+/* Superblock versions */
+#define TFS_SB_VERSION_LEGACY	0	/* Fixed layout, geometry fields are unused */
+#define TFS_SB_VERSION		1	/* Geometry recorded in the superblock */
+
+/* Disk location of metadata blocks on legacy filesystems */
+#define TFS_SB_BLOCK		(0)
+#define TFS_INODE_BLOCK		(1)
+#define TFS_BITMAP_BLOCK	(2)
+#define TFS_FIRST_DATA_BLOCK	(3)
+#define TFS_LAST_DATA_BLOCK	(TFS_MAX_BLKS -1)
+
+/* Number of bits tracked by a single bitmap block */
+#define TFS_BITS_PER_BLOCK(bsize)	((bsize) * 8)
+
+/*
+ * On disk superblock
+ *
+ * Legacy filesystems only have the fields up to s_inodes, and track
+ * inode allocation within s_inodes itself. Everything after it was
+ * zeroed by the legacy mkfs, so s_version reads as TFS_SB_VERSION_LEGACY.
+ *
+ * Versioned filesystems have the following layout, all regions being
+ * contiguous and in this order:
+ *
+ *	superblock | inode table | inode bitmap | block bitmap | data blocks
+ *
+ * The block bitmap covers the whole device (metadata blocks are marked
+ * as in use), while the inode bitmap has one bit per inode slot in the
+ * inode table.
+ *
+ * Versioned filesystems may also have a metadata journal, a contiguous run
+ * of blocks within the data region marked as in use, see toyfs_journal.c.
+ */
+struct tfs_dsb {
+	__u32	s_magic;
+	__u32	s_flags;
+
+	/* free inode and block fields require locking */
+	__u32	s_ifree;
+	__u32	s_bfree;
+	__u32	s_inodes[TFS_INODE_COUNT];	/* Legacy only */
+
+	__u32	s_version;
+	__u32	s_nblocks;		/* Device size, in blocks */
+	__u32	s_ninodes;		/* Number of inodes in the inode table */
+	__u32	s_itable_start;
+	__u32	s_itable_blocks;
+	__u32	s_imap_start;
+	__u32	s_imap_blocks;
+	__u32	s_bmap_start;
+	__u32	s_bmap_blocks;
+	__u32	s_data_start;		/* First data block */
+	__u32	s_journal_start;	/* First journal block, see below */
+	__u32	s_journal_blocks;	/* Zero if there is no journal */
+	__u32	s_log_block_size;	/* Block size: TFS_MIN_BSIZE << this */
+};
+
+/* log2 of the block size of the filesystem @dsb is the superblock of */
+static inline unsigned int toyfs_dsb_bsize_bits(const struct tfs_dsb *dsb)
+{
+	if (dsb->s_version == TFS_SB_VERSION_LEGACY)
+		return TFS_MIN_BSIZE_BITS;
+	return TFS_MIN_BSIZE_BITS + dsb->s_log_block_size;
+}
+
+/*
+ * On disk journal
+ *
+ * The first journal block holds the journal superblock, and is followed by
+ * the log. The log only ever holds a single transaction: a descriptor block
+ * listing the home location of every block logged, the copies of these
+ * blocks, and a commit block with a checksum of everything before it.
+ */
+#define TFS_JOURNAL_MAGIC	0x4A594F54	/* TOYJ */
+
+/* jh_type values */
+#define TFS_JOURNAL_SUPER	1
+#define TFS_JOURNAL_DESC	2
+#define TFS_JOURNAL_COMMIT	3
+
+struct tfs_journal_header {
+	__u32	jh_magic;
+	__u32	jh_type;
+	__u32	jh_seq;		/* Transaction ID, or the next one for the super */
+};
+
+struct tfs_journal_super {
+	struct tfs_journal_header	js_header;
+	__u32				js_blocks;	/* s_journal_blocks */
+};
+
+struct tfs_journal_desc {
+	struct tfs_journal_header	jd_header;
+	__u32				jd_count;
+	__u32				jd_blocks[];
+};
+
+struct tfs_journal_commit {
+	struct tfs_journal_header	jc_header;
+	__u32				jc_count;
+	__u32				jc_crc;		/* crc32c of desc + blocks */
+};
+
+#define TFS_JOURNAL_TAGS(bsize) \
+	(((bsize) - sizeof(struct tfs_journal_desc)) / sizeof(__u32))
+
+/* Journal super, descriptor and commit blocks, plus some room to log */
+#define TFS_JOURNAL_MIN_BLOCKS	16
+
+/*
+ * On disk extent
+ *
+ * Maps e_len logically contiguous file blocks starting at e_lblk to the
+ * physically contiguous disk blocks starting at e_pblk.
+ * Unused extent slots have e_len == 0.
+ *
+ * Preallocated blocks which were never written are flagged with
+ * TFS_EXT_UNWRITTEN, in the otherwise unused high bit of e_len. Reading
+ * them returns zeros, no matter what the disk holds. Legacy filesystems
+ * can't record it, and never have unwritten extents.
+ */
+struct tfs_extent {
+	__u32	e_lblk;
+	__u32	e_pblk;
+	__u32	e_len;
+};
+
+#define TFS_EXT_UNWRITTEN	(1U << 31)
+
+static inline unsigned int toyfs_ext_len(const struct tfs_extent *ext)
+{
+	return ext->e_len & ~TFS_EXT_UNWRITTEN;
+}
+
+static inline unsigned int toyfs_ext_end(const struct tfs_extent *ext)
+{
+	return ext->e_lblk + toyfs_ext_len(ext);
+}
+
+static inline bool toyfs_ext_unwritten(const struct tfs_extent *ext)
+{
+	return ext->e_len & TFS_EXT_UNWRITTEN;
+}
+
+/*
+ * Number of extents stored within the on-disk inode. They use the very same
+ * space legacy filesystems use for the i_addr[] block map, with room left for
+ * an overflow extent block pointer.
+ */
+#define TFS_INODE_EXTENTS	2
+
+/* Bytes of data an inline inode holds, in place of its block map */
+#define TFS_INLINE_SIZE		(TFS_MAX_INO_BLKS * sizeof(__u32))
+
+#define TFS_IMODE_MASK		0xffff
+#define TFS_IMODE_INLINE	(1U << 16)
+
+/*
+ * Extent overflow block, holding the extents which don't fit in the inode.
+ */
+struct tfs_extent_block {
+	__u32			eb_count;
+	__u32			eb_reserved[2];
+	struct tfs_extent	eb_extents[];
+};
+
+#define TFS_EXTENTS_PER_BLOCK(bsize) \
+	(((bsize) - sizeof(struct tfs_extent_block)) / sizeof(struct tfs_extent))
+
+/* Maximum number of extents a single inode can have */
+#define TFS_MAX_EXTENTS(bsize)	(TFS_INODE_EXTENTS + TFS_EXTENTS_PER_BLOCK(bsize))
+
+/*
+ * On disk inode
+ *
+ * Legacy filesystems map each data block through i_addr[], versioned
+ * filesystems use extents instead.
+ *
+ * On versioned filesystems, symlink targets and regular files of up to
+ * TFS_INLINE_SIZE bytes are kept in i_data instead, with no block at all.
+ * Such inodes have TFS_IMODE_INLINE set in i_mode, above the 16 bits the
+ * file mode uses.
+ */
+struct tfs_dinode {
+	__u32	i_mode;
+	__u32	i_nlink;
+	__u32	i_atime;
+	__u32	i_mtime;
+	__u32	i_ctime;
+	__u32	i_uid;
+	__u32	i_gid;
+	__u32	i_size;
+	__u32	i_blocks;
+	union {
+		__u32	i_addr[TFS_MAX_INO_BLKS];	/* Legacy only */
+		struct {
+			struct tfs_extent	i_extents[TFS_INODE_EXTENTS];
+			__u32			i_ext_block;
+		};
+		__u8	i_data[TFS_INLINE_SIZE];	/* TFS_IMODE_INLINE */
+	};
+};
+
+/*
+ * On disk directory entry
+ *
+ * d_type holds the DT_* type of the entry, or DT_UNKNOWN (0) for entries
+ * written before we had it. It takes the last byte of what used to be the
+ * name, so names get one byte shorter on versioned filesystems. Legacy ones
+ * keep their 27 characters names, d_type is always 0 there, and ends the
+ * names which fill d_name.
+ */
+struct tfs_dentry {
+	__u32	d_ino;
+	char	d_name[TFS_MAX_NLEN - 1];
+	__u8	d_type;
+};
+
+/* Longest name a directory entry can hold, leaving room for the NUL */
+#define TFS_NAME_LEN		(TFS_MAX_NLEN - 2)
+#define TFS_LEGACY_NAME_LEN	(TFS_MAX_NLEN - 1)
+
+#define TFS_ENTRIES_PER_BLOCK(bsize)	((bsize) / sizeof(struct tfs_dentry))
+
+/*
+ * Directory index (versioned filesystems only)
+ *
+ * Directory block 0 is the index root, mapping name hashes to index leaves,
+ * each leaf mapping name hashes to dentry slots (lblk * TFS_ENTRIES_PER_BLOCK
+ * + index within the block). Entries are kept sorted by hash in both, and
+ * root entry i covers the hashes from its dx_hash up to the next entry's.
+ * While the directory is small, the root is the only leaf (dx_levels == 0).
+ *
+ * Index blocks start with TFS_DX_MAGIC where dentry blocks have d_ino, so
+ * they can be told apart when walking the whole directory.
+ */
+#define TFS_DX_MAGIC	0x58444654	/* TFDX */
+
+struct tfs_dx_entry {
+	__u32	dx_hash;
+	__u32	dx_ptr;		/* Root: leaf block - Leaf: dentry slot */
+};
+
+struct tfs_dx_block {
+	__u32			dx_magic;
+	__u16			dx_count;
+	__u8			dx_levels;	/* Root only */
+	__u8			dx_reserved;
+	__u32			dx_free;	/* Root only: first block with free slots */
+	struct tfs_dx_entry	dx_entries[];
+};
+
+#define TFS_DX_ENTRIES(bsize) \
+	(((bsize) - sizeof(struct tfs_dx_block)) / sizeof(struct tfs_dx_entry))
+#define TFS_INODES_PER_BLOCK(bsize)	((bsize) / sizeof(struct tfs_dinode))
+
+#endif /* __TOYFS_FORMAT_H */
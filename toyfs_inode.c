@@ -3,12 +3,150 @@
 #define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
 
 #include <linux/fs.h>
+#include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/pagemap.h>
 #include <linux/writeback.h>
+#include <linux/sched.h>
 #include "toyfs_types.h"
 #include "toyfs_file.h"
 #include "toyfs_iops.h"
 #include "toyfs_aops.h"
+#include "toyfs_trace.h"
+
+/* Inode table blocks read ahead past the one we need */
+#define TFS_ITABLE_RA_BLOCKS	8
+
+/*
+ * toyfs_itable_readahead()
+ *	- Start reading inode table block @idx, which we're about to wait
+ *	  for, along with the ones following it. Walking a cold tree, the
+ *	  inodes we need next are usually the ones allocated right after.
+ *	- Blocks already pinned are skipped, toyfs_meta_bh() finds the
+ *	  others in the buffer cache.
+ */
+static void toyfs_itable_readahead(struct super_block *sb, unsigned int idx)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		end;
+	unsigned int		i;
+
+	end = min(idx + 1 + TFS_ITABLE_RA_BLOCKS, tfi->s_itable_blocks);
+	for (i = idx; i < end; i++) {
+		if (!READ_ONCE(tfi->s_inode_bh[i]))
+			sb_breadahead(sb, tfi->s_itable_start + i);
+	}
+}
+
+/**
+ * toyfs_get_dinode() - Get the on-disk inode from the inode table
+ * @sb: The filesystem in question
+ * @inum: Inode number
+ * @bhp: Returns the inode table buffer holding the inode
+ *
+ * The inode table buffers are pinned in-core, so the caller must only
+ * mark *@bhp dirty after updating the inode, and never brelse() it.
+ *
+ * Return: Pointer to the on-disk inode, or an ERR_PTR
+ */
+struct tfs_dinode *toyfs_get_dinode(struct super_block *sb,
+				    unsigned int inum,
+				    struct buffer_head **bhp)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct buffer_head	*bh;
+	unsigned int		idx;
+
+	if (inum >= tfi->s_ninodes) {
+		pr_debug("Invalid inode number %u\n", inum);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+
+	idx = inum / TFS_INODES_PER_BLOCK(sb->s_blocksize);
+	if (!READ_ONCE(tfi->s_inode_bh[idx]))
+		toyfs_itable_readahead(sb, idx);
+
+	bh = toyfs_meta_bh(sb, tfi->s_inode_bh, tfi->s_itable_start, idx);
+	if (!bh)
+		return ERR_PTR(-EIO);
+
+	*bhp = bh;
+	return (struct tfs_dinode *)bh->b_data +
+	       (inum % TFS_INODES_PER_BLOCK(sb->s_blocksize));
+}
+
+/**
+ * toyfs_imap_init() - Build the in-core inode bitmap
+ * @sb: The filesystem being mounted
+ *
+ * Legacy filesystems track inode allocation within the superblock inode
+ * list, versioned filesystems have an on-disk inode bitmap, one bit per
+ * inode table slot. Either way, we keep a bitmap of the inodes in use
+ * in-core, so allocating an inode never needs to read anything, and can
+ * be done with a spinlock held.
+ *
+ * Return: Zero in case of success or negative value otherwise
+ */
+int toyfs_imap_init(struct super_block *sb)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head	*bh;
+	unsigned int		nbits;
+	int i;
+
+	tfi->s_imap = kvcalloc(BITS_TO_LONGS(tfi->s_ninodes),
+			       sizeof(unsigned long), GFP_KERNEL);
+	if (!tfi->s_imap)
+		return -ENOMEM;
+
+	if (toyfs_is_legacy(tfi)) {
+		for (i = 0; i < TFS_INODE_COUNT; i++)
+			if (tfi->s_inodes[i] != TFS_INODE_FREE)
+				__set_bit(i, tfi->s_imap);
+		return 0;
+	}
+
+	for (i = 0; i < tfi->s_imap_blocks; i++) {
+		bh = toyfs_meta_bh(sb, tfi->s_imap_bh, tfi->s_imap_start, i);
+		if (!bh)
+			return -EIO;
+
+		/* The last bitmap block might be partially used */
+		nbits = min(bits, tfi->s_ninodes - i * bits);
+		bitmap_copy(tfi->s_imap + i * (bits / BITS_PER_LONG),
+			    (unsigned long *)bh->b_data, nbits);
+	}
+	return 0;
+}
+
+/*
+ * Reflect an allocated or freed inode in the on-disk inode bitmap or list.
+ * The inode has already been claimed (or released) in-core, so nobody else
+ * touches its bit.
+ */
+static void toyfs_imap_update(struct super_block *sb, unsigned int inum,
+			      bool inuse)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	unsigned int		bits = TFS_BITS_PER_BLOCK(sb->s_blocksize);
+	struct buffer_head	*bh;
+	unsigned long		*map;
+
+	if (toyfs_is_legacy(tfi)) {
+		tfi->s_inodes[inum] = inuse ? TFS_INODE_INUSE : TFS_INODE_FREE;
+		return;
+	}
+
+	/* Pinned by toyfs_imap_init() */
+	bh = READ_ONCE(tfi->s_imap_bh[inum / bits]);
+	map = (unsigned long *)bh->b_data;
+	if (inuse)
+		set_bit(inum % bits, map);
+	else
+		clear_bit(inum % bits, map);
+	toyfs_journal_dirty(sb, bh);
+}
 
 /**
  * toyfs_ialloc() - Alloc a new inode on-disk
@@ -22,27 +160,88 @@
 int toyfs_ialloc(struct super_block *sb)
 {
 	struct tfs_fs_info	*tfi = sb->s_fs_info;
-	int i;
+	unsigned int		inum;
 
-	if (!tfi->s_ifree) {
-		pr_debug("We ran out of inodes\n");
+	spin_lock(&tfi->s_imap_lock);
+	inum = find_first_zero_bit(tfi->s_imap, tfi->s_ninodes);
+	if (inum >= tfi->s_ninodes) {
+		spin_unlock(&tfi->s_imap_lock);
+		trace_toyfs_ialloc(sb, -ENOSPC);
 		return -ENOSPC;
 	}
+	__set_bit(inum, tfi->s_imap);
+	spin_unlock(&tfi->s_imap_lock);
 
-	tfi->s_ifree--;
-	for (i = 0; i < TFS_INODE_COUNT; i++ ) {
-		if (tfi->s_inodes[i] == TFS_INODE_FREE) {
-			tfi->s_inodes[i] = TFS_INODE_INUSE;
-			pr_debug("Allocated inode %d\n", i);
-			return i;
-		}
-	}
+	toyfs_imap_update(sb, inum, true);
+	percpu_counter_dec(&tfi->s_ifree);
+
+	trace_toyfs_ialloc(sb, inum);
+	return inum;
+}
+
+/**
+ * toyfs_ifree() - Free an on-disk inode
+ * @sb: The filesystem in question
+ * @inum: The inode number to be freed
+ */
+void toyfs_ifree(struct super_block *sb, unsigned int inum)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	bool			freed;
+
+	if (inum >= tfi->s_ninodes)
+		return;
+
+	toyfs_imap_update(sb, inum, false);
+
+	spin_lock(&tfi->s_imap_lock);
+	freed = __test_and_clear_bit(inum, tfi->s_imap);
+	spin_unlock(&tfi->s_imap_lock);
+
+	if (freed)
+		percpu_counter_inc(&tfi->s_ifree);
+	trace_toyfs_ifree(sb, inum);
+}
+
+static struct kmem_cache *toyfs_inode_cachep;
+
+/*
+ * Slab constructor, only called when the slab allocates new objects, not
+ * every time an inode is allocated from it. It only initializes what
+ * survives an inode being freed and allocated again.
+ */
+static void toyfs_inode_init_once(void *obj)
+{
+	struct tfs_inode_info *tino = obj;
+
+	inode_init_once(&tino->vfs_inode);
+	init_rwsem(&tino->i_map_lock);
+	xa_init(&tino->i_delalloc);
+	init_rwsem(&tino->i_delalloc_sem);
+	spin_lock_init(&tino->i_ioend_lock);
+	INIT_LIST_HEAD(&tino->i_ioend_list);
+	INIT_WORK(&tino->i_ioend_work, toyfs_end_io);
+}
+
+int __init toyfs_init_inodecache(void)
+{
+	toyfs_inode_cachep = kmem_cache_create("toyfs_inode_cache",
+					       sizeof(struct tfs_inode_info), 0,
+					       SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT,
+					       toyfs_inode_init_once);
+	if (!toyfs_inode_cachep)
+		return -ENOMEM;
+	return 0;
+}
 
+void toyfs_destroy_inodecache(void)
+{
 	/*
-	 * If we reach here, the filesystem is corrupted. The inode free
-	 * count shows free inodes, but none has been found in the inode list
+	 * Make sure all delayed rcu free inodes are flushed before we
+	 * destroy cache.
 	 */
-	BUG();
+	rcu_barrier();
+	kmem_cache_destroy(toyfs_inode_cachep);
 }
 
 /**
@@ -52,18 +251,26 @@ int toyfs_ialloc(struct super_block *sb)
  * Allocate a new toyfs in-core inode object, giving we already have
  * an VFS inode embedded, all we need to do is alloc the tfs_inode_info
  *
- * Return: The vfs inode pointer or negative ERR_PTR
+ * The VFS inode and the locks were initialized by the slab constructor,
+ * we only need to reset the toyfs specific state.
+ *
+ * Return: The vfs inode pointer or NULL
  */
 struct inode* toyfs_alloc_inode(struct super_block *sb)
 {
 	struct tfs_inode_info	*tino;
 
-	tino = kzalloc(sizeof(struct tfs_inode_info), GFP_NOFS);
+	tino = alloc_inode_sb(sb, toyfs_inode_cachep, GFP_NOFS);
 	if (!tino)
-		return ERR_PTR(-ENOMEM);
-
-	/* We must do some basic initialization before returning it */
-	inode_init_once(&tino->vfs_inode);
+		return NULL;
+
+	tino->i_blocks = 0;
+	tino->i_map_seq = 0;
+	tino->i_inline = false;
+	tino->i_stored_seq = 0;
+	tino->i_sync_flags = 0;
+	tino->i_dir_cache = NULL;
+	toyfs_ext_init(tino);
 	return &tino->vfs_inode;
 }
 
@@ -71,16 +278,115 @@ struct inode* toyfs_alloc_inode(struct super_block *sb)
  * toyfs_free_inode() - Free memory allocated for an inode object
  * @inode: The vfs inode embedded within the toyfs inode.
  *
- * There is nothing much to do here other than kfree() the toyfs inode
+ * Free whatever the inode has allocated on the side, and give it back to
+ * the inode cache.
  */
 void toyfs_free_inode(struct inode *inode)
 {
 	struct tfs_inode_info *tino;
 	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
-	kfree(tino);
+	toyfs_ext_destroy(tino);
+	toyfs_dc_destroy(tino);
+	kmem_cache_free(toyfs_inode_cachep, tino);
 	pr_debug("Freeing inode %lu\n", inode->i_ino);
 }
 
+/*
+ * toyfs_fill_dinode()
+ *	- Copy the in-core inode into its on-disk copy
+ *	- Tell whether fdatasync would care about what changed through
+ *	  @datasync.
+ *	- The caller holds i_map_lock, the extent list can't change under us.
+ */
+static int toyfs_fill_dinode(struct inode *inode, struct tfs_dinode *dip,
+			     bool sync, bool *datasync)
+{
+	struct tfs_inode_info	*tino;
+	unsigned int		seq;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	lockdep_assert_held(&tino->i_map_lock);
+
+	seq = READ_ONCE(tino->i_map_seq);
+	*datasync = dip->i_size != inode->i_size || seq != tino->i_stored_seq;
+	tino->i_stored_seq = seq;
+
+	dip->i_mode = inode->i_mode;
+	dip->i_nlink = inode->i_nlink;
+	dip->i_uid = i_uid_read(inode);
+	dip->i_gid = i_gid_read(inode);
+	dip->i_size = inode->i_size;
+	dip->i_atime = inode_get_atime_sec(inode);
+	dip->i_mtime = inode_get_mtime_sec(inode);
+	dip->i_ctime = inode_get_ctime_sec(inode);
+
+	dip->i_blocks = tino->i_blocks;
+
+	/* Inline data is written in place, i_data is already up to date */
+	if (READ_ONCE(tino->i_inline)) {
+		dip->i_mode |= TFS_IMODE_INLINE;
+		return 0;
+	}
+
+	return toyfs_ext_store(inode, dip, sync);
+}
+
+/**
+ * toyfs_journal_inode_locked() - Log an inode within the current handle
+ * @inode: The inode updated
+ *
+ * Same as toyfs_journal_inode(), for callers which updated the block map
+ * and still hold i_map_lock.
+ */
+void toyfs_journal_inode_locked(struct inode *inode)
+{
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct tfs_handle	*h = current->journal_info;
+	struct tfs_inode_info	*tino;
+	struct tfs_dinode	*dip;
+	struct buffer_head	*bh;
+	bool			datasync;
+
+	if (!tfi->s_journal || WARN_ON_ONCE(!h))
+		goto out_dirty;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	dip = toyfs_get_dinode(sb, inode->i_ino, &bh);
+	if (IS_ERR(dip) || toyfs_fill_dinode(inode, dip, false, &datasync))
+		goto out_dirty;
+
+	toyfs_journal_dirty(sb, bh);
+	tino->i_sync_tid = h->h_tid;
+	if (datasync)
+		set_bit(TFS_SYNC_DATASYNC, &tino->i_sync_flags);
+	set_bit(TFS_SYNC_INODE, &tino->i_sync_flags);
+	return;
+
+out_dirty:
+	mark_inode_dirty(inode);
+}
+
+/**
+ * toyfs_journal_inode() - Log an inode within the current handle
+ * @inode: The inode updated
+ *
+ * Namespace operations log the inodes they update along with the directory
+ * blocks they modify, so they are committed, or lost, as a whole. Without a
+ * journal, the inode is only marked dirty, and written back later.
+ *
+ * Context: Takes i_map_lock, the handle must be started first.
+ */
+void toyfs_journal_inode(struct inode *inode)
+{
+	struct tfs_inode_info *tino = container_of(inode, struct tfs_inode_info,
+						    vfs_inode);
+
+	down_read(&tino->i_map_lock);
+	toyfs_journal_inode_locked(inode);
+	up_read(&tino->i_map_lock);
+}
+
 /**
  * toyfs_write_inode() - Write the toyfs inode back to disk
  * @inode: The vfs inode to be written
@@ -88,53 +394,101 @@ void toyfs_free_inode(struct inode *inode)
  *
  * Format the on-disk inode as needed and write it back to disk.
  *
- * We do not support DIO, so, there is not much to be done other than
- * mark the buffer dirty.
+ * File data never goes through here (the page cache and O_DIRECT write it
+ * on their own, and iomap writes inline data straight into the inode
+ * buffer), so, there is not much to be done other than mark the
+ * buffer dirty.
  * Only in case wbc tells us this should be done synchronously, then, we
- * need to call sync_dirty_buffer().
+ * need to call sync_dirty_buffer(). Not when that's part of a sync(2) or
+ * syncfs(2) though: the inode table block is recorded in s_itable_dirty
+ * instead, and toyfs_sync_fs() writes it once for all of its inodes.
+ *
+ * With a journal, the inode is logged instead, and a synchronous write
+ * commits the transaction it went in. i_sync_tid records that transaction
+ * for toyfs_fsync() otherwise.
  *
  * Return: Zero in case of success or negative value otherwise
  */
 int toyfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-	struct tfs_dinode	*i_array;
-	struct tfs_fs_info	*tfi;
+	struct super_block	*sb = inode->i_sb;
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	bool			sync = wbc->sync_mode == WB_SYNC_ALL &&
+				       !wbc->for_sync;
+	struct tfs_dinode	*dip;
 	struct buffer_head	*bh;
 	struct tfs_inode_info	*tino;
+	struct tfs_handle	h;
+	bool			datasync;
 	int			ino;
-	int			i;
+	int			error;
 
-	tfi  = inode->i_sb->s_fs_info;
 	ino = inode->i_ino;
 	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
-	bh = tfi->s_inode_bh;
-	i_array = (struct tfs_dinode *)bh->b_data;
-	pr_debug("Writing inode %d to disk\n", ino);
-
-	i_array[ino].i_mode = inode->i_mode;
-	i_array[ino].i_nlink = inode->i_nlink;
-	i_array[ino].i_uid = i_uid_read(inode);
-	i_array[ino].i_gid = i_gid_read(inode);
-	i_array[ino].i_size = inode->i_size;
 
-	i_array[ino].i_blocks = tino->i_blocks;
+	/* The inode and extent blocks, plus allocating the latter */
+	error = toyfs_journal_start(sb, &h, 4);
+	if (error)
+		return error;
 
-	for (i = 0; i < TFS_MAX_INO_BLKS; i++)
-		i_array[ino].i_addr[i] = tino->i_addr[i];
+	dip = toyfs_get_dinode(sb, ino, &bh);
+	if (IS_ERR(dip)) {
+		error = PTR_ERR(dip);
+		goto out_stop;
+	}
+	trace_toyfs_write_inode(inode, wbc);
+	toyfs_stat_add(tfi, TFS_STAT_WRITE_INODE, 1);
+	if (sync)
+		toyfs_stat_add(tfi, TFS_STAT_WRITE_INODE_SYNC, 1);
+
+	down_read(&tino->i_map_lock);
+	error = toyfs_fill_dinode(inode, dip, sync && !tfi->s_journal,
+				  &datasync);
+	up_read(&tino->i_map_lock);
+	if (error)
+		goto out_stop;
+
+	toyfs_journal_dirty(sb, bh);
+	if (tfi->s_journal) {
+		tino->i_sync_tid = h.h_tid;
+		toyfs_journal_stop(&h);
+		if (sync)
+			error = toyfs_journal_force(sb, h.h_tid);
+		goto out_flags;
+	}
+	toyfs_journal_stop(&h);
 
-	mark_buffer_dirty(bh);
-	if (wbc->sync_mode == WB_SYNC_ALL) {
+	set_bit(ino / TFS_INODES_PER_BLOCK(sb->s_blocksize),
+		tfi->s_itable_dirty);
+	if (sync) {
 		sync_dirty_buffer(bh);
 		if (buffer_req(bh) && !buffer_uptodate(bh)) {
 			return -EIO;
 		}
 	}
 
+out_flags:
+	if (error)
+		return error;
+
+	if (sync) {
+		clear_bit(TFS_SYNC_DATASYNC, &tino->i_sync_flags);
+		clear_bit(TFS_SYNC_INODE, &tino->i_sync_flags);
+	} else {
+		if (datasync)
+			set_bit(TFS_SYNC_DATASYNC, &tino->i_sync_flags);
+		set_bit(TFS_SYNC_INODE, &tino->i_sync_flags);
+	}
+
 	/*
-	 * Inode buffer is pinned in-core for the duration of the mount, we don't call brelse()
+	 * Inode buffers are pinned in-core for the duration of the mount, we don't call brelse()
 	 * here, but instead, it should be called when unmounting the FS
 	 */
 	return 0;
+
+out_stop:
+	toyfs_journal_stop(&h);
+	return error;
 }
 
 /**
@@ -146,58 +500,161 @@ int toyfs_write_inode(struct inode *inode, struct writeback_control *wbc)
  * opened, actually calls close()
  *
  * We can only proceed if there are no more links to the inode,
- * decreasing link count is not this function's job.
- *
+ * decreasing link count is not this function's job. The whole block map is
+ * then released with toyfs_ext_truncate(), an extent at a time, and the
+ * overflow extent block and the inode itself are freed within a last handle.
  */
 void toyfs_evict_inode(struct inode *inode)
 {
-#if 0 /* ASSIGNMENT */
-	struct tfs_fs_info	*tfi;
+	struct super_block	*sb = inode->i_sb;
 	struct tfs_inode_info	*tino;
-	struct buffer_head	*bh;
-	char			*bmap;
-	int			i;
+	struct tfs_handle	h;
+	bool			free_inode;
+	int			error;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	free_inode = !inode->i_nlink && !is_bad_inode(inode);
 
 	/*
 	 * We need to truncate ALL the pages associated
 	 * with this inode before we get rid of the inode
 	 */
 	truncate_inode_pages_final(&inode->i_data);
+
+	/* Writeback is done, but the work completing it may still be running */
+	flush_work(&tino->i_ioend_work);
+
+	/* Whatever is still delayed or unwritten now will never be written */
+	toyfs_delalloc_release(inode, 0, U32_MAX);
+	toyfs_ext_unreserve_meta(inode, true);
+
+	/* Not much we can do about it, the blocks are leaked */
+	if (free_inode) {
+		error = toyfs_ext_truncate(inode, 0, U32_MAX);
+		if (error >= 0)
+			error = toyfs_journal_start(sb, &h, TFS_JOURNAL_CREDITS);
+		if (error < 0) {
+			pr_debug("Inode %lu: couldn't free its blocks: %d\n",
+				 inode->i_ino, error);
+			free_inode = false;
+		}
+	}
+
+	if (free_inode) {
+		down_write(&tino->i_map_lock);
+		if (tino->i_ext_block != TFS_INVALID)
+			toyfs_bfree(sb, tino->i_ext_block);
+		tino->i_ext_block = TFS_INVALID;
+		toyfs_inode_set_blocks(inode, 0);
+		up_write(&tino->i_map_lock);
+	}
+
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
 
-	/* We need to check if the current inode can actually be freed */
+	if (free_inode) {
+		toyfs_ifree(sb, inode->i_ino);
+		pr_debug("Freed inode %lu\n", inode->i_ino);
+		toyfs_journal_stop(&h);
+	}
+}
 
-	/*
-	 * This function is 'simple', we must:
-	 *	- set the inode as free in the inode table
-	 *	- increase the inode free count
-	 *	- increase the block free count
-	 *	- Free all blocks this inode might still have
-	 *	  associated.
-	 */
+/*
+ * toyfs_symlink_set()
+ *	- Cache the target of a symlink in tino->i_link
+ *	- Path walks get it from there through simple_get_link(), without
+ *	  any I/O, and without leaving RCU walk: i_link lives as long as the
+ *	  inode, which is only freed after a grace period.
+ */
+static int toyfs_symlink_set(struct inode *inode, const char *target,
+			     unsigned int len)
+{
+	struct tfs_inode_info *tino = container_of(inode, struct tfs_inode_info,
+						    vfs_inode);
+
+	if (len >= TFS_MAX_NLEN)
+		return -ENAMETOOLONG;
+
+	memcpy(tino->i_link, target, len);
+	tino->i_link[len] = '\0';
+	inode->i_link = tino->i_link;
+	inode->i_size = len;
+	inode->i_op = &toyfs_symlink_inode_operations;
+	return 0;
+}
+
+/**
+ * toyfs_symlink_load() - Cache the target of a symlink read from disk
+ * @inode: The in-core inode, block map already loaded
+ * @dip: The on-disk inode
+ *
+ * Inline targets come straight from the inode table, block based ones
+ * (legacy filesystems) cost a single read, when the inode is loaded. From
+ * then on, following the link never needs the disk.
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_symlink_load(struct inode *inode, struct tfs_dinode *dip)
+{
+	struct tfs_inode_info	*tino;
+	struct buffer_head	*bh;
+	unsigned int		pblk;
+	unsigned int		len;
+	int			error;
+
+	tino = container_of(inode, struct tfs_inode_info, vfs_inode);
+	if (dip->i_size >= TFS_MAX_NLEN) {
+		pr_debug("Inode %lu: invalid symlink size %u\n",
+			 inode->i_ino, dip->i_size);
+		return -EFSCORRUPTED;
+	}
+
+	if (tino->i_inline)
+		return toyfs_symlink_set(inode, dip->i_data, dip->i_size);
+
+	pblk = toyfs_ext_lookup(tino, 0, &len);
+	if (pblk == TFS_INVALID)
+		return -EFSCORRUPTED;
+
+	bh = sb_bread(inode->i_sb, pblk);
+	if (!bh)
+		return -EIO;
 
-#endif /* ASSIGNMENT */
+	error = toyfs_symlink_set(inode, bh->b_data,
+				  strnlen(bh->b_data, dip->i_size));
+	brelse(bh);
+	return error;
 }
 
 /**
- * toyfs_read_inode() - Read an inode from disk
+ * toyfs_read_inode() - Get an inode, reading it from disk if needed
+ * @sb: The filesystem in question
+ * @inum: Inode number, from a directory entry or the root
+ *
+ * Inodes already in the inode cache are returned as they are. Otherwise the
+ * inode comes from the pinned inode table, see toyfs_get_dinode(), only
+ * block based symlinks need to read anything else.
+ *
+ * Inode numbers out of the inode table, or not allocated, mean the
+ * directory pointing at them is corrupted.
  *
  * Return: The vfs inode pointer associated with
- *	   the inode read from disk
+ *	   the inode read from disk, or an ERR_PTR
  */
 struct inode* toyfs_read_inode(struct super_block *sb, unsigned int inum)
 {
-	return ERR_PTR(-EOPNOTSUPP);
-
-#if 0 /* ASSIGNMENT */
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
 	struct inode		*ip;
-	struct tfs_fs_info	*tfi;
-	struct tfs_dinode	*di_arr, *dip;
+	struct tfs_dinode	*dip;
 	struct tfs_inode_info	*tino;
 	struct buffer_head	*i_bh;
-	int i = 0;
+	umode_t			mode;
+	int			error = 0;
 
+	if (inum >= tfi->s_ninodes || !test_bit(inum, tfi->s_imap)) {
+		pr_debug("Invalid inode number %u\n", inum);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
 
 	/*
 	 * iget_locked() allocate a new -empty- in-core
@@ -205,31 +662,79 @@ struct inode* toyfs_read_inode(struct super_block *sb, unsigned int inum)
 	 * inode and the vfs inode counterpart.
 	 */
 	ip = iget_locked(sb, inum);
+	if (!ip)
+		return ERR_PTR(-ENOMEM);
+
+	/* Already cached, nothing to read */
+	if (!(ip->i_state & I_NEW))
+		return ip;
+
+	tino = container_of(ip, struct tfs_inode_info, vfs_inode);
+	dip = toyfs_get_dinode(sb, inum, &i_bh);
+	if (IS_ERR(dip)) {
+		error = PTR_ERR(dip);
+		goto out_failed;
+	}
 
 	/* Some inode fields should be initialized for every file type */
+	mode = dip->i_mode & TFS_IMODE_MASK;
+	ip->i_mode = mode;
+	ip->i_private = tino;
+	set_nlink(ip, dip->i_nlink);
+	i_uid_write(ip, dip->i_uid);
+	i_gid_write(ip, dip->i_gid);
+	ip->i_size = dip->i_size;
+	inode_set_atime(ip, dip->i_atime, 0);
+	inode_set_mtime(ip, dip->i_mtime, 0);
+	inode_set_ctime(ip, dip->i_ctime, 0);
+	toyfs_inode_set_blocks(ip, dip->i_blocks);
+
+	/*
+	 * The block map is loaded the same way for every file type, inline
+	 * inodes have none, i_data holds their data instead.
+	 */
+	if (dip->i_mode & TFS_IMODE_INLINE)
+		tino->i_inline = true;
+	else
+		error = toyfs_ext_load(ip, dip);
+	if (error)
+		goto out_failed;
 
 	/* Inodes should be initialized differently, depending on the file type */
-	if (S_ISDIR(dip->i_mode)) {
-		/* Write something here */
-	} else if (S_ISREG(dip->i_mode)) {
-		/* Write something here */
-	} else if (S_ISLNK(dip->i_mode)) {
+	if (S_ISDIR(mode)) {
+		ip->i_op = &toyfs_dir_inode_operations;
+		ip->i_fop = &toyfs_dir_file_operations;
+		ip->i_mapping->a_ops = &toyfs_aops;
+	} else if (S_ISREG(mode)) {
+		ip->i_op = &toyfs_inode_operations;
+		ip->i_fop = &toyfs_file_operations;
+		ip->i_mapping->a_ops = &toyfs_aops;
+		mapping_set_large_folios(ip->i_mapping);
+	} else if (S_ISLNK(mode)) {
 		/*
 		 * A symbolik link has the target location stored in
-		 * the inode's first data block.
-		 *
-		 * We should read the content from there and copy it
-		 * into tino->i_link.
+		 * the inode's first data block, or in dip->i_data when
+		 * it is inline. It's cached in tino->i_link for good.
 		 */
+		error = toyfs_symlink_load(ip, dip);
 	} else {
-		pr_debug("Inode with invalid mode - FS corrupted\n");
-		BUG();
+		pr_debug("Inode %u with invalid mode 0%o - FS corrupted\n",
+			 inum, mode);
+		error = -EFSCORRUPTED;
 	}
+	if (error)
+		goto out_failed;
+
+	/* What's on disk is what we'd write */
+	tino->i_stored_seq = tino->i_map_seq;
 
 	unlock_new_inode(ip);
 	return ip;
 
-#endif /* ASSIGNMENT */
+out_failed:
+	/* Bad inodes are never freed by toyfs_evict_inode() */
+	iget_failed(ip);
+	return ERR_PTR(error);
 }
 
 
@@ -242,11 +747,10 @@ struct inode* toyfs_new_inode(struct inode *parent,
 	struct timespec64 tv;
 	struct tfs_inode_info *tino;
 	struct super_block *sb = parent->i_sb;
+	struct tfs_dinode *dip = NULL;
 	struct buffer_head *bh;
-	struct tfs_dentry *d_array;
 	int inum, blk;
 	int error = 0;
-	int i = 0;
 
 	ip = new_inode(sb);
 	if (!ip)
@@ -270,86 +774,103 @@ struct inode* toyfs_new_inode(struct inode *parent,
 	ip->i_ino = inum;
 	ip->i_private = tino;
 
-	for (i = 0; i < TFS_MAX_INO_BLKS; i++)
-		tino->i_addr[i] = TFS_INVALID;
-
 	insert_inode_hash(ip);
 
+	/*
+	 * Files and symlinks start inline on versioned filesystems, they only
+	 * get blocks once they outgrow the inode.
+	 */
+	if ((S_ISREG(mode) || S_ISLNK(mode)) &&
+	    !toyfs_is_legacy(sb->s_fs_info)) {
+		dip = toyfs_get_dinode(sb, inum, &bh);
+		if (IS_ERR(dip)) {
+			error = PTR_ERR(dip);
+			goto out_iput;
+		}
+
+		memset(dip->i_data, 0, TFS_INLINE_SIZE);
+		tino->i_inline = true;
+	}
+
 	if (S_ISREG(mode)) {
-		tino->i_blocks = 0;
-		ip->i_blocks = 0;
+		toyfs_inode_set_blocks(ip, 0);
 		ip->i_size = 0;
 		ip->i_op = &toyfs_inode_operations;
 		ip->i_fop = &toyfs_file_operations;
 		ip->i_mapping->a_ops = &toyfs_aops;
+		mapping_set_large_folios(ip->i_mapping);
 	} else if (S_ISDIR(mode)) {
-		blk = toyfs_balloc(sb);
-		if (blk < 0)
-			return ERR_PTR(blk);
-
-		bh = sb_bread(sb, blk);
-		d_array = (struct tfs_dentry*)bh->b_data;
-		for (i = 0; i < (TFS_BSIZE / sizeof(struct tfs_dentry)); i++)
-			d_array[i].d_ino = TFS_INVALID;
-
-		strcpy(d_array[0].d_name, ".");
-		d_array[0].d_ino = ip->i_ino;
-		strcpy(d_array[1].d_name, "..");
-		d_array[1].d_ino = parent->i_ino;
-
-		tino->i_blocks = 1;
-		tino->i_addr[0] = blk;
+		error = toyfs_dir_init(ip, parent);
+		if (error)
+			goto out_iput;
 
-		ip->i_blocks = 1;
 		ip->i_size = 2 * sizeof(struct tfs_dentry); /* . and .. */
 		ip->i_op = &toyfs_dir_inode_operations;
 		ip->i_fop = &toyfs_dir_file_operations;
 		ip->i_mapping->a_ops = &toyfs_aops;
 
 		inode_inc_link_count(ip);
-		mark_buffer_dirty(bh);
-		brelse(bh);
 	} else if (S_ISLNK(mode)) {
 		char *dst;
 		int len = strnlen(lnk_target, TFS_MAX_NLEN);
 
-		if (len >= TFS_MAX_NLEN)
-			return ERR_PTR(-ENAMETOOLONG);
-
-		blk = toyfs_balloc(sb);
-		if (blk < 0)
-			return ERR_PTR(blk);
-
-		bh = sb_bread(sb, blk);
-		dst = (char *)bh->b_data;
-		strncpy(dst, lnk_target, len + 1);
-
-		pr_debug("Link created to: %s\n", dst);
-		tino->i_blocks = 1;
-		tino->i_addr[0] = blk;
-
-		ip->i_link = tino->i_link;
-		ip->i_blocks = 1;
-		ip->i_size = len;
-		ip->i_op = &simple_symlink_inode_operations;
-		memcpy(ip->i_link, lnk_target, len + 1);
-		mark_buffer_dirty(bh);
-		brelse(bh);
+		error = toyfs_symlink_set(ip, lnk_target, len);
+		if (error)
+			goto out_iput;
+
+		/* The target always fits in i_data, NUL included */
+		if (dip) {
+			memcpy(dip->i_data, lnk_target, len);
+			toyfs_journal_dirty(sb, bh);
+			toyfs_inode_set_blocks(ip, 0);
+			pr_debug("Inline link created to: %s\n", ip->i_link);
+		} else {
+			blk = toyfs_balloc(sb, 0);
+			if (blk < 0) {
+				error = blk;
+				goto out_iput;
+			}
+
+			/* From here on, evicting the inode frees the block */
+			error = toyfs_ext_insert(ip, 0, blk, 1, false);
+			if (error) {
+				toyfs_bfree(sb, blk);
+				goto out_iput;
+			}
+			toyfs_inode_set_blocks(ip, 1);
+
+			bh = sb_bread(sb, blk);
+			if (!bh) {
+				error = -EIO;
+				goto out_iput;
+			}
+			dst = (char *)bh->b_data;
+			strncpy(dst, lnk_target, len + 1);
+
+			pr_debug("Link created to: %s\n", dst);
+			toyfs_journal_dirty(sb, bh);
+			brelse(bh);
+		}
 	} else {
 		BUG();
 	}
 
-	mark_inode_dirty(ip);
+	toyfs_journal_inode(ip);
 
-	error = toyfs_dir_add_entry(parent, dentry->d_name.name, inum);
+	error = toyfs_dir_add_entry(parent, dentry->d_name.name, ip);
 	if (error)
-		/*need to cleanup */
-		return ERR_PTR(error);
+		goto out_iput;
 
 	d_instantiate(dentry, ip);
 
 	pr_debug("Link counts - parent: %d inode: %d\n",
 		parent->i_nlink, ip->i_nlink);
 	return ip;
+
+out_iput:
+	/* Unlinked, eviction gives back the inode number and its blocks */
+	clear_nlink(ip);
+	iput(ip);
+	return ERR_PTR(error);
 }
 
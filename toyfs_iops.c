@@ -4,6 +4,8 @@
 
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/iomap.h>
+#include <linux/buffer_head.h>
 #include "toyfs_types.h"
 #include "toyfs_file.h"
 #include "toyfs_aops.h"
@@ -11,6 +13,12 @@
 /*
  * Lookup for a directory entry within the FS and
  * instantiate a new dcache entry pointing to it.
+ *
+ * Names which don't exist get a negative dentry, which needs no
+ * d_revalidate: the VFS trusts it as is. Entries are only ever added
+ * through the VFS (create, mkdir, symlink, link, rename), which turns
+ * the negative dentry positive itself, so it can't go stale behind its
+ * back.
  */
 struct dentry* toyfs_lookup(struct inode *parent,
 			    struct dentry *dentry,
@@ -21,7 +29,7 @@ struct dentry* toyfs_lookup(struct inode *parent,
 	int		inum = -1; /* Inode 0 is the rootdir */
 
 	pr_debug("Attempting to lookup name: %s\n", name);
-	if (strlen(name) > TFS_MAX_NLEN)
+	if (strlen(name) > toyfs_name_len(parent->i_sb))
 		return ERR_PTR(-ENAMETOOLONG);
 
 	inum = toyfs_find_entry(parent, name);
@@ -50,6 +58,33 @@ struct dentry* toyfs_lookup(struct inode *parent,
 	return d_splice_alias(ip, dentry);
 }
 
+/*
+ * toyfs_journal_new_inode()
+ *	- Create a new inode with toyfs_new_inode(), within a handle
+ *	- The new inode logs itself, the parent is logged here, its size or
+ *	  link count changed.
+ */
+static struct inode *toyfs_journal_new_inode(struct inode *parent,
+					     struct dentry *dentry,
+					     umode_t mode,
+					     const char *lnk_target)
+{
+	struct tfs_handle	h;
+	struct inode		*inode;
+	int			error;
+
+	error = toyfs_journal_start(parent->i_sb, &h, TFS_JOURNAL_CREDITS);
+	if (error)
+		return ERR_PTR(error);
+
+	inode = toyfs_new_inode(parent, dentry, mode, lnk_target);
+	if (!IS_ERR(inode))
+		toyfs_journal_inode(parent);
+
+	toyfs_journal_stop(&h);
+	return inode;
+}
+
 /*
  * toyfs_create
  * - Create a new file within the filesystem
@@ -64,7 +99,8 @@ int toyfs_create(
 	bool excl)
 {
 	pr_debug("Creating regular file inode\n");
-	struct inode *inode = toyfs_new_inode(parent, dentry, S_IFREG | mode, NULL);
+	struct inode *inode = toyfs_journal_new_inode(parent, dentry,
+						      S_IFREG | mode, NULL);
 
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
@@ -85,7 +121,8 @@ int toyfs_mkdir(
 	pr_debug("Creating directory inode: \"%s\"\n",
 		dentry->d_name.name);
 
-	struct inode *inode = toyfs_new_inode(parent, dentry, S_IFDIR | mode, NULL);
+	struct inode *inode = toyfs_journal_new_inode(parent, dentry,
+						      S_IFDIR | mode, NULL);
 
 	if (IS_ERR(inode))
 	    return PTR_ERR(inode);
@@ -97,23 +134,33 @@ int toyfs_link(struct dentry *old_dentry,
 	       struct inode *parent,
 	       struct dentry *new_dentry)
 {
-	int		error;
-	struct inode	*inode;
+	int			error;
+	struct inode		*inode;
+	struct tfs_handle	h;
 
 	inode = d_inode(old_dentry);
 
+	error = toyfs_journal_start(parent->i_sb, &h, TFS_JOURNAL_CREDITS);
+	if (error)
+		return error;
+
 	pr_debug("Creating hardlink for inode: %lu\n", inode->i_ino);
 	error = toyfs_dir_add_entry(parent,
 				    new_dentry->d_name.name,
-				    inode->i_ino);
+				    inode);
 	if (error)
-		return error;
+		goto out_stop;
 
 	inode_set_ctime_current(inode);
 	inode_inc_link_count(inode);
+	toyfs_journal_inode(inode);
+	toyfs_journal_inode(parent);
 	ihold(inode);
 	d_instantiate(new_dentry, inode);
-	return 0;
+
+out_stop:
+	toyfs_journal_stop(&h);
+	return error;
 }
 
 int toyfs_symlink(struct mnt_idmap *idmap,
@@ -124,7 +171,8 @@ int toyfs_symlink(struct mnt_idmap *idmap,
 	struct inode *inode;
 
 	pr_debug("Creating symlink\n");
-	inode = toyfs_new_inode(parent, dentry, S_IFLNK | S_IRWXUGO, target);
+	inode = toyfs_journal_new_inode(parent, dentry, S_IFLNK | S_IRWXUGO,
+					target);
 
 	return 0;
 }
@@ -132,83 +180,265 @@ int toyfs_symlink(struct mnt_idmap *idmap,
 int toyfs_unlink(struct inode *parent, struct dentry *dentry)
 {
 	struct inode		*inode = d_inode(dentry);
+	struct tfs_handle	h;
 	const char		*name;
 	int ret;
 
 	name = dentry->d_name.name;
-	ret = toyfs_find_entry(parent, name);
+
+	ret = toyfs_journal_start(parent->i_sb, &h, TFS_JOURNAL_CREDITS);
+	if (ret)
+		return ret;
 
 	pr_debug("Unlinking inode %px\n", inode);
 	pr_debug("\tInitial link count - parent: %d - ino: %d\n",
 		parent->i_nlink, inode->i_nlink);
-	if (ret < 0)
-		return ret;
 
+	/* Finding the entry is toyfs_dir_del_entry()'s job, no need to look twice */
 	ret = toyfs_dir_del_entry(parent, name);
 
 	if (ret)
-		return ret;
+		goto out_stop;
 
 	inode_dec_link_count(inode);
+	toyfs_journal_inode(inode);
+	toyfs_journal_inode(parent);
 
 	pr_debug("\tfinal link count - parent: %d - ino: %d\n",
 		parent->i_nlink, inode->i_nlink);
-	return 0;
 
+out_stop:
+	toyfs_journal_stop(&h);
+	return ret;
 }
 
 int toyfs_rmdir(struct inode *parent, struct dentry *dentry)
 {
-	struct inode	*inode = d_inode(dentry);
+	struct inode		*inode = d_inode(dentry);
+	struct tfs_handle	h;
 	int error;
 
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
 
+	error = toyfs_journal_start(parent->i_sb, &h, TFS_JOURNAL_CREDITS);
+	if (error)
+		return error;
+
 	error = toyfs_unlink(parent, dentry);
 
 	if (!error) {
 		inode_dec_link_count(inode);
+		toyfs_journal_inode(inode);
 		pr_debug("Dropping last nlink for dir: %px\n",
 			inode);
 	}
+
+	toyfs_journal_stop(&h);
 	return error;
 }
 
+/*
+ * toyfs_rename()
+ *	- Every name involved is looked up exactly once. An existing target
+ *	  is pointed to the source inode in place, and the source entry
+ *	  removed, plain renames add the new entry first. Either way, if
+ *	  removing the source fails, the target is put back.
+ *	- RENAME_EXCHANGE points both entries to each other's inode.
+ *	- RENAME_NOREPLACE needs nothing from us, the VFS already fails it if
+ *	  the target exists.
+ *	- Directories moving to another parent get their ".." updated, its
+ *	  block is read before anything is changed.
+ *	- Directory link counts follow their number of entries, which only
+ *	  removing the source entry changes. A replaced target loses its
+ *	  link, all of them for a directory.
+ */
 int toyfs_rename(struct mnt_idmap *idmap,
 		 struct inode *old_dir, struct dentry *old_dentry,
 		 struct inode *new_dir, struct dentry *new_dentry,
 		 unsigned int flags)
 {
+	struct inode		*inode = d_inode(old_dentry);
+	struct inode		*target = d_inode(new_dentry);
+	const char		*old_name = old_dentry->d_name.name;
+	const char		*new_name = new_dentry->d_name.name;
+	struct buffer_head	*dotdot = NULL;
+	struct buffer_head	*tdotdot = NULL;
+	bool			exchange = flags & RENAME_EXCHANGE;
+	struct tfs_handle	h;
+	int			error;
+
+	if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+		return -EINVAL;
+
+	/* Only empty directories can be renamed over */
+	if (!exchange && target && S_ISDIR(target->i_mode) &&
+	    target->i_nlink > 2)
+		return -ENOTEMPTY;
 
-	struct tfs_inode_info *tino;
-	struct inode *inode = d_inode(old_dentry);
-	int error = -EINVAL;
+	error = toyfs_journal_start(old_dir->i_sb, &h, 2 * TFS_JOURNAL_CREDITS);
+	if (error)
+		return error;
 
-	tino = container_of(old_dir, struct tfs_inode_info, vfs_inode);
+	if (old_dir != new_dir) {
+		if (S_ISDIR(inode->i_mode)) {
+			dotdot = toyfs_dir_get_dotdot(inode);
+			if (IS_ERR(dotdot)) {
+				error = PTR_ERR(dotdot);
+				dotdot = NULL;
+				goto out_release;
+			}
+		}
+		if (exchange && S_ISDIR(target->i_mode)) {
+			tdotdot = toyfs_dir_get_dotdot(target);
+			if (IS_ERR(tdotdot)) {
+				error = PTR_ERR(tdotdot);
+				tdotdot = NULL;
+				goto out_release;
+			}
+		}
+	}
 
-	/*
-	 * BUG: There are a few bugs in this function,
-	 * let's see if students realize which ones...
-	 */
+	if (target) {
+		error = toyfs_dir_replace_entry(new_dir, new_name, inode);
+		if (error < 0)
+			goto out_release;
+
+		if (exchange)
+			error = toyfs_dir_replace_entry(old_dir, old_name, target);
+		else
+			error = toyfs_dir_del_entry(old_dir, old_name);
+		if (error < 0) {
+			toyfs_dir_replace_entry(new_dir, new_name, target);
+			goto out_release;
+		}
+		error = 0;
+	} else {
+		error = toyfs_dir_add_entry(new_dir, new_name, inode);
+		if (error)
+			goto out_release;
+
+		error = toyfs_dir_del_entry(old_dir, old_name);
+		if (error) {
+			toyfs_dir_del_entry(new_dir, new_name);
+			goto out_release;
+		}
+	}
 
-	/*
-	 * When renaming on top of an already existing file, we must make sure to
-	 * decrease its link count
-	 */
-	if (d_inode(new_dentry) != NULL)
-		toyfs_unlink(new_dir, new_dentry);
+	if (dotdot) {
+		toyfs_dir_set_dotdot(inode, dotdot, new_dir);
+		dotdot = NULL;
+	}
+	if (tdotdot) {
+		toyfs_dir_set_dotdot(target, tdotdot, old_dir);
+		tdotdot = NULL;
+	}
 
-	error = toyfs_dir_del_entry(old_dir, old_dentry->d_name.name);
+	inode_set_ctime_current(inode);
+	toyfs_journal_inode(inode);
+	if (target) {
+		inode_set_ctime_current(target);
+		if (!exchange && S_ISDIR(target->i_mode))
+			clear_nlink(target);
+		else if (!exchange)
+			drop_nlink(target);
+		toyfs_journal_inode(target);
+	}
+	toyfs_journal_inode(old_dir);
+	if (new_dir != old_dir)
+		toyfs_journal_inode(new_dir);
+
+out_release:
+	brelse(dotdot);
+	brelse(tdotdot);
+	toyfs_journal_stop(&h);
+	return error;
+}
 
-	error = toyfs_dir_add_entry(new_dir,
-				    new_dentry->d_name.name,
-				    inode->i_ino);
+/*
+ * toyfs_truncate()
+ *	- Change the size of a regular file to @size
+ *	- When shrinking, the tail of the new last block is zeroed through the
+ *	  page cache, then everything past it is unmapped with
+ *	  toyfs_ext_truncate(), freeing each extent as a range.
+ *	- When growing, the tail of the old last block is zeroed, it might
+ *	  hold data written through mmap past the old EOF. Inline files
+ *	  growing past what the inode holds are converted first.
+ */
+static int toyfs_truncate(struct inode *inode, loff_t size)
+{
+	loff_t			old_size = i_size_read(inode);
+	unsigned int		bsize = i_blocksize(inode);
+	unsigned int		start;
+	int			freed;
+	int			error = 0;
+
+	inode_dio_wait(inode);
+	if (size > TFS_INLINE_SIZE) {
+		error = toyfs_inline_convert(inode);
+		if (error)
+			return error;
+	}
+
+	filemap_invalidate_lock(inode->i_mapping);
+
+	if (size < old_size)
+		error = iomap_truncate_page(inode, size, NULL, &toyfs_iomap_ops);
+	else if (old_size & (bsize - 1))
+		error = iomap_zero_range(inode, old_size,
+					 min(size, round_up(old_size, bsize)) -
+					 old_size, NULL, &toyfs_iomap_ops);
+	if (error)
+		goto out_unlock;
+
+	truncate_setsize(inode, size);
+
+	if (size < old_size) {
+		/* The page cache is done with, handles can be held now */
+		start = DIV_ROUND_UP(size, bsize);
+		toyfs_delalloc_release(inode, start, U32_MAX);
 
-	/* FIXME: we need to cleanup and remove the added entry if we fail */
+		freed = toyfs_ext_truncate(inode, start, U32_MAX);
+		pr_debug("inode %lu: truncated to %lld, %d blocks freed\n",
+			 inode->i_ino, size, freed);
+		error = min(freed, 0);
+		if (error)
+			goto out_unlock;
+	}
+
+	mark_inode_dirty(inode);
+out_unlock:
+	filemap_invalidate_unlock(inode->i_mapping);
 	return error;
 }
 
+/*
+ * toyfs_setattr()
+ *	- Size changes go through toyfs_truncate(), everything else is
+ *	  copied into the inode and written back with it
+ */
+int toyfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+		  struct iattr *iattr)
+{
+	struct inode	*inode = d_inode(dentry);
+	int		error;
+
+	error = setattr_prepare(idmap, dentry, iattr);
+	if (error)
+		return error;
+
+	if ((iattr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) &&
+	    iattr->ia_size != i_size_read(inode)) {
+		error = toyfs_truncate(inode, iattr->ia_size);
+		if (error)
+			return error;
+	}
+
+	setattr_copy(idmap, inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
 struct inode_operations toyfs_dir_inode_operations = {
 	.lookup		= toyfs_lookup,
 	.create		= toyfs_create,
@@ -218,10 +448,18 @@ struct inode_operations toyfs_dir_inode_operations = {
 	.unlink		= toyfs_unlink,
 	.rmdir		= toyfs_rmdir,
 	.rename		= toyfs_rename,
+	.setattr	= toyfs_setattr,
 };
 
 struct inode_operations toyfs_inode_operations = {
 	.unlink		= toyfs_unlink,
 	.rmdir		= toyfs_rmdir,
+	.setattr	= toyfs_setattr,
+};
+
+/* The target is always cached in i_link, see toyfs_symlink_load() */
+struct inode_operations toyfs_symlink_inode_operations = {
+	.get_link	= simple_get_link,
+	.setattr	= toyfs_setattr,
 };
 
@@ -4,5 +4,6 @@
 #define __TOYFS_IOPS_H
 extern const struct inode_operations toyfs_dir_inode_operations;
 extern const struct inode_operations toyfs_inode_operations;
+extern const struct inode_operations toyfs_symlink_inode_operations;
 
 #endif /* __TOYFS_IOPS_H */
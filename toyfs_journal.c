@@ -0,0 +1,690 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32c.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "toyfs_types.h"
+
+/*
+ * Metadata journal
+ *
+ * Every update to the superblock, the bitmaps, the inode table, directory
+ * and extent blocks is done within a handle, see toyfs_journal_start(). The
+ * buffers updated are not marked dirty, but added to the running transaction
+ * with toyfs_journal_dirty() instead, and they are pinned until the
+ * transaction is committed. Writeback never sees them, so nothing reaches
+ * its home location before the journal holds it.
+ *
+ * toyfs_journal_commit() waits for the handles of the running transaction
+ * to be done, and keeps new ones out until it's done. The blocks are copied
+ * aside, and logged in one go, right after a descriptor block holding their
+ * home location, and followed by a commit block. A single cache flush makes
+ * the whole transaction stable, the commit block checksum lets replay tell
+ * whether all of it made it to disk. The copies are then written to their
+ * home location (checkpointed), before the next commit overwrites the log.
+ *
+ * Since everything a transaction logs is checkpointed before the next one
+ * starts, the log never holds more than the last transaction, and replay is
+ * just a matter of writing it again, which is harmless if it was already
+ * checkpointed.
+ *
+ * Transactions are committed when fsync or sync needs them, once they are
+ * full, or TFS_JOURNAL_INTERVAL after their first update. Tasks forcing a
+ * commit wait for each other on j_commit_mutex, whoever gets it commits
+ * everything the others need too (group commit).
+ *
+ * Blocks freed by the running transaction can't be reused until it commits,
+ * until then they still belong to their previous owner on-disk, see
+ * toyfs_bmap_commit(). Those which were part of it are dropped from it, so
+ * replaying it never overwrites a block which may have been reused for data.
+ *
+ * Only metadata is journaled, and data writes are not ordered against it: a
+ * transaction allocating blocks at writeback may commit before the data
+ * written to them has reached the disk. After a crash, such blocks may read
+ * as whatever they held before, including stale data of another file. Direct
+ * writes and writes into preallocated blocks don't have that problem, their
+ * blocks stay unwritten until the data write completed, and the commit's
+ * cache flush makes the data stable first. fsync makes both stable together.
+ */
+
+/* Set while a buffer is part of the running transaction */
+#define BH_TfsJournal		BH_PrivateStart
+
+/* Commit a transaction at most this long after its first update */
+#define TFS_JOURNAL_INTERVAL	(5 * HZ)
+
+/* Transaction IDs wrap around */
+static inline bool toyfs_tid_geq(unsigned int a, unsigned int b)
+{
+	return (int)(a - b) >= 0;
+}
+
+static inline struct tfs_journal *toyfs_journal(struct super_block *sb)
+{
+	struct tfs_fs_info *tfi = sb->s_fs_info;
+
+	return tfi->s_journal;
+}
+
+/*
+ * toyfs_journal_write()
+ *	- Write @count in-core block copies to the disk blocks in @blocks
+ *	- All bios are chained to the last one, so we only wait once.
+ */
+static int toyfs_journal_write(struct tfs_journal *j, const unsigned int *blocks,
+			       void **bufs, unsigned int count, blk_opf_t flags)
+{
+	struct block_device	*bdev = j->j_sb->s_bdev;
+	unsigned int		bsize = j->j_sb->s_blocksize;
+	struct bio		*bio = NULL;
+	struct bio		*prev;
+	struct blk_plug		plug;
+	unsigned int		i;
+	int			error;
+
+	if (!count)
+		return 0;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < count; i++) {
+		prev = bio;
+		bio = bio_alloc(bdev, 1, REQ_OP_WRITE | REQ_SYNC | REQ_META |
+				(i ? 0 : flags), GFP_NOFS);
+		bio->bi_iter.bi_sector = (sector_t)blocks[i] *
+					 (bsize >> SECTOR_SHIFT);
+		__bio_add_page(bio, virt_to_page(bufs[i]), bsize,
+			       offset_in_page(bufs[i]));
+		if (prev) {
+			bio_chain(prev, bio);
+			submit_bio(prev);
+		}
+	}
+	error = submit_bio_wait(bio);
+	bio_put(bio);
+	blk_finish_plug(&plug);
+	return error;
+}
+
+/*
+ * toyfs_journal_crc()
+ *	- Checksum a transaction: its descriptor and the copies it logs
+ */
+static u32 toyfs_journal_crc(struct tfs_journal *j,
+			     struct tfs_journal_desc *desc, void **copies)
+{
+	unsigned int	bsize = j->j_sb->s_blocksize;
+	u32		crc;
+	unsigned int	i;
+
+	crc = crc32c(~0U, desc, bsize);
+	for (i = 0; i < desc->jd_count; i++)
+		crc = crc32c(crc, copies[i], bsize);
+	return crc;
+}
+
+/*
+ * toyfs_journal_abort()
+ *	- The journal can't be trusted to hold what we give it anymore, fail
+ *	  every handle from now on. What was committed is still replayed at
+ *	  the next mount.
+ */
+static void toyfs_journal_abort(struct tfs_journal *j, int error)
+{
+	pr_debug("journal aborted: %d, the filesystem needs to be remounted\n",
+		 error);
+	WRITE_ONCE(j->j_aborted, true);
+}
+
+/*
+ * toyfs_journal_commit()
+ *	- Commit and checkpoint the running transaction, with j_commit_mutex
+ *	  held
+ *	- Handles are kept out the whole time: nothing may be freed, and
+ *	  reused for data, before it's checkpointed.
+ *	- The log is written with a cache flush ahead of it, so the previous
+ *	  checkpoint is stable before we overwrite its log, and another one
+ *	  after completion, which commits the transaction.
+ */
+static int toyfs_journal_commit(struct tfs_journal *j)
+{
+	struct tfs_journal_desc		*desc = j->j_desc;
+	struct tfs_journal_commit	*commit = j->j_commit;
+	unsigned int			bsize = j->j_sb->s_blocksize;
+	struct buffer_head		*bh;
+	unsigned int			*log;
+	unsigned int			count;
+	unsigned int			i;
+	int				error;
+
+	down_write(&j->j_trans_sem);
+	count = j->j_nbufs;
+	if (!count) {
+		j->j_credits = 0;
+		up_write(&j->j_trans_sem);
+		return 0;
+	}
+
+	error = -EIO;
+	if (j->j_aborted)
+		goto out_release;
+
+	error = -ENOMEM;
+	log = kmalloc_array(count + 2, sizeof(*log), GFP_NOFS);
+	if (!log)
+		goto out_release;
+
+	memset(desc, 0, bsize);
+	desc->jd_header.jh_magic = TFS_JOURNAL_MAGIC;
+	desc->jd_header.jh_type = TFS_JOURNAL_DESC;
+	desc->jd_header.jh_seq = j->j_tid;
+	desc->jd_count = count;
+	for (i = 0; i < count; i++) {
+		bh = j->j_bufs[i];
+		lock_buffer(bh);
+		memcpy(j->j_copies[i], bh->b_data, bsize);
+		unlock_buffer(bh);
+		desc->jd_blocks[i] = bh->b_blocknr;
+	}
+
+	memset(commit, 0, bsize);
+	commit->jc_header.jh_magic = TFS_JOURNAL_MAGIC;
+	commit->jc_header.jh_type = TFS_JOURNAL_COMMIT;
+	commit->jc_header.jh_seq = j->j_tid;
+	commit->jc_count = count;
+	commit->jc_crc = toyfs_journal_crc(j, desc, j->j_copies);
+
+	for (i = 0; i < count + 2; i++)
+		log[i] = j->j_start + 1 + i;
+
+	error = toyfs_journal_write(j, log, (void **)&desc, 1, REQ_PREFLUSH);
+	if (!error)
+		error = toyfs_journal_write(j, log + 1, j->j_copies, count, 0);
+	if (!error)
+		error = toyfs_journal_write(j, log + count + 1,
+					    (void **)&commit, 1, 0);
+	if (!error)
+		error = blkdev_issue_flush(j->j_sb->s_bdev);
+	kfree(log);
+	if (error)
+		goto out_abort;
+
+	WRITE_ONCE(j->j_commit_tid, j->j_tid);
+
+	/* Committed, the copies can go home */
+	error = toyfs_journal_write(j, desc->jd_blocks, j->j_copies, count, 0);
+	if (error)
+		goto out_abort;
+
+	pr_debug("transaction %u: %u blocks committed\n", j->j_tid, count);
+	goto out_release;
+
+out_abort:
+	toyfs_journal_abort(j, error);
+out_release:
+	for (i = 0; i < count; i++) {
+		if (!error)
+			toyfs_bmap_commit(j->j_sb, j->j_bufs[i]);
+		clear_bit(BH_TfsJournal, &j->j_bufs[i]->b_state);
+		brelse(j->j_bufs[i]);
+	}
+	j->j_nbufs = 0;
+	j->j_credits = 0;
+	j->j_tid++;
+	up_write(&j->j_trans_sem);
+	return error;
+}
+
+/**
+ * toyfs_journal_force() - Make sure a transaction is committed
+ * @sb: The filesystem in question
+ * @tid: The transaction ID (h_tid of any of its handles)
+ *
+ * Must not be called with a handle held.
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_journal_force(struct super_block *sb, unsigned int tid)
+{
+	struct tfs_journal	*j = toyfs_journal(sb);
+	int			error = 0;
+
+	if (!j || toyfs_tid_geq(READ_ONCE(j->j_commit_tid), tid))
+		return 0;
+
+	if (WARN_ON_ONCE(current->journal_info))
+		return -EDEADLK;
+
+	mutex_lock(&j->j_commit_mutex);
+	if (!toyfs_tid_geq(j->j_commit_tid, tid) &&
+	    toyfs_tid_geq(j->j_tid, tid))
+		error = toyfs_journal_commit(j);
+	mutex_unlock(&j->j_commit_mutex);
+	return error;
+}
+
+static void toyfs_journal_commit_work(struct work_struct *work)
+{
+	struct tfs_journal *j = container_of(to_delayed_work(work),
+					     struct tfs_journal, j_commit_work);
+
+	toyfs_journal_force(j->j_sb, READ_ONCE(j->j_tid));
+}
+
+/**
+ * toyfs_journal_start() - Start a journal handle
+ * @sb: The filesystem in question
+ * @h: The handle, usually on the caller's stack
+ * @credits: The most blocks the handle may update
+ *
+ * Every metadata update must be done within a handle, so a transaction is
+ * never committed with half an operation in it. Handles may be nested, an
+ * inner handle uses the credits of the outer one.
+ *
+ * If the running transaction doesn't have room for @credits more blocks, it
+ * is committed first. Which means no folio lock, nor anything else a task
+ * starting a handle might take, may be held while starting a handle, or
+ * waited for with a handle held.
+ *
+ * This is a no-op on filesystems without a journal.
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_journal_start(struct super_block *sb, struct tfs_handle *h,
+			unsigned int credits)
+{
+	struct tfs_journal	*j = toyfs_journal(sb);
+	struct tfs_handle	*outer = current->journal_info;
+	unsigned int		tid;
+	int			error;
+
+	h->h_journal = j;
+	h->h_nested = false;
+	if (!j)
+		return 0;
+
+	if (outer) {
+		h->h_nested = true;
+		h->h_tid = outer->h_tid;
+		return 0;
+	}
+
+	credits = min(credits, j->j_max);
+	for (;;) {
+		if (READ_ONCE(j->j_aborted))
+			return -EIO;
+
+		down_read(&j->j_trans_sem);
+		spin_lock(&j->j_lock);
+		if (j->j_credits + credits <= j->j_max) {
+			j->j_credits += credits;
+			h->h_tid = j->j_tid;
+			spin_unlock(&j->j_lock);
+			break;
+		}
+		tid = j->j_tid;
+		spin_unlock(&j->j_lock);
+		up_read(&j->j_trans_sem);
+
+		error = toyfs_journal_force(sb, tid);
+		if (error)
+			return error;
+	}
+
+	current->journal_info = h;
+	return 0;
+}
+
+/**
+ * toyfs_journal_stop() - Release a journal handle
+ * @h: The handle from toyfs_journal_start()
+ */
+void toyfs_journal_stop(struct tfs_handle *h)
+{
+	if (!h->h_journal || h->h_nested)
+		return;
+
+	current->journal_info = NULL;
+	up_read(&h->h_journal->j_trans_sem);
+}
+
+/**
+ * toyfs_journal_dirty() - Add an updated metadata buffer to the journal
+ * @sb: The filesystem in question
+ * @bh: The buffer updated, within the current handle
+ *
+ * This is what metadata updates call instead of mark_buffer_dirty(), which
+ * is still what happens without a journal. The buffer is pinned until the
+ * transaction is committed.
+ */
+void toyfs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct tfs_journal	*j = toyfs_journal(sb);
+	bool			first = false;
+	bool			full = false;
+
+	if (!j) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+
+	/* Without a handle, a commit may be copying the buffer right now */
+	if (WARN_ON_ONCE(!current->journal_info)) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+
+	if (test_bit(BH_TfsJournal, &bh->b_state))
+		return;
+
+	spin_lock(&j->j_lock);
+	if (!test_and_set_bit(BH_TfsJournal, &bh->b_state)) {
+		if (j->j_nbufs < j->j_max) {
+			get_bh(bh);
+			j->j_bufs[j->j_nbufs++] = bh;
+			first = j->j_nbufs == 1;
+		} else {
+			clear_bit(BH_TfsJournal, &bh->b_state);
+			full = true;
+		}
+	}
+	spin_unlock(&j->j_lock);
+
+	/* Handles went over their credits, better unordered than lost */
+	if (WARN_ON_ONCE(full))
+		mark_buffer_dirty(bh);
+	if (first)
+		schedule_delayed_work(&j->j_commit_work, TFS_JOURNAL_INTERVAL);
+}
+
+/**
+ * toyfs_journal_forget() - Drop freed blocks from the running transaction
+ * @sb: The filesystem in question
+ * @start: First block freed
+ * @len: Number of blocks freed
+ *
+ * Called within the handle freeing the blocks, before they can be reused.
+ */
+void toyfs_journal_forget(struct super_block *sb, unsigned int start,
+			  unsigned int len)
+{
+	struct tfs_journal	*j = toyfs_journal(sb);
+	struct buffer_head	*bh;
+	unsigned int		i;
+
+	if (!j || !READ_ONCE(j->j_nbufs))
+		return;
+
+	spin_lock(&j->j_lock);
+	for (i = 0; i < j->j_nbufs; i++) {
+		bh = j->j_bufs[i];
+		if (bh->b_blocknr < start || bh->b_blocknr >= start + len)
+			continue;
+
+		clear_bit(BH_TfsJournal, &bh->b_state);
+		j->j_bufs[i--] = j->j_bufs[--j->j_nbufs];
+		brelse(bh);
+	}
+	spin_unlock(&j->j_lock);
+}
+
+/*
+ * toyfs_journal_replay()
+ *	- Write the transaction in the log back to its home location, if it
+ *	  was fully committed
+ *	- Bump *@tid past it, the next transaction must not be mistaken for
+ *	  it.
+ */
+static int toyfs_journal_replay(struct tfs_journal *j, unsigned int *tid)
+{
+	struct super_block		*sb = j->j_sb;
+	struct tfs_fs_info		*tfi = sb->s_fs_info;
+	struct tfs_journal_desc		*desc = j->j_desc;
+	struct tfs_journal_commit	*commit;
+	struct buffer_head		*bh;
+	unsigned int			count;
+	unsigned int			i;
+	int				error = 0;
+
+	bh = sb_bread(sb, j->j_start + 1);
+	if (!bh)
+		return -EIO;
+	memcpy(desc, bh->b_data, sb->s_blocksize);
+	brelse(bh);
+
+	if (desc->jd_header.jh_magic != TFS_JOURNAL_MAGIC ||
+	    desc->jd_header.jh_type != TFS_JOURNAL_DESC ||
+	    !desc->jd_count || desc->jd_count > j->j_max) {
+		pr_debug("journal is empty\n");
+		return 0;
+	}
+
+	count = desc->jd_count;
+	if (toyfs_tid_geq(desc->jd_header.jh_seq, *tid))
+		*tid = desc->jd_header.jh_seq + 1;
+
+	for (i = 0; i < count; i++) {
+		bh = sb_bread(sb, j->j_start + 2 + i);
+		if (!bh)
+			return -EIO;
+		memcpy(j->j_copies[i], bh->b_data, sb->s_blocksize);
+		brelse(bh);
+	}
+
+	bh = sb_bread(sb, j->j_start + 2 + count);
+	if (!bh)
+		return -EIO;
+	commit = (struct tfs_journal_commit *)bh->b_data;
+	if (commit->jc_header.jh_magic != TFS_JOURNAL_MAGIC ||
+	    commit->jc_header.jh_type != TFS_JOURNAL_COMMIT ||
+	    commit->jc_header.jh_seq != desc->jd_header.jh_seq ||
+	    commit->jc_count != count ||
+	    commit->jc_crc != toyfs_journal_crc(j, desc, j->j_copies)) {
+		pr_debug("transaction %u was never committed\n",
+			 desc->jd_header.jh_seq);
+		brelse(bh);
+		return 0;
+	}
+	brelse(bh);
+
+	for (i = 0; i < count; i++) {
+		if (desc->jd_blocks[i] >= tfi->s_nblocks ||
+		    (desc->jd_blocks[i] >= j->j_start &&
+		     desc->jd_blocks[i] < j->j_start + j->j_blocks))
+			return -EFSCORRUPTED;
+
+		bh = sb_getblk(sb, desc->jd_blocks[i]);
+		if (!bh)
+			return -ENOMEM;
+		lock_buffer(bh);
+		memcpy(bh->b_data, j->j_copies[i], sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+
+	error = sync_blockdev(sb->s_bdev);
+	pr_debug("transaction %u: %u blocks replayed: %d\n",
+		 desc->jd_header.jh_seq, count, error);
+	return error;
+}
+
+/*
+ * toyfs_journal_write_super()
+ *	- Record the next transaction ID in the journal superblock
+ */
+static int toyfs_journal_write_super(struct tfs_journal *j)
+{
+	struct tfs_journal_super	*jsb;
+	struct buffer_head		*bh;
+	int				error = 0;
+
+	bh = sb_bread(j->j_sb, j->j_start);
+	if (!bh)
+		return -EIO;
+
+	jsb = (struct tfs_journal_super *)bh->b_data;
+	jsb->js_header.jh_seq = j->j_tid;
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	if (buffer_req(bh) && !buffer_uptodate(bh))
+		error = -EIO;
+	brelse(bh);
+	return error;
+}
+
+static void toyfs_journal_free(struct tfs_journal *j)
+{
+	unsigned int i;
+
+	if (j->j_copies) {
+		for (i = 0; i < j->j_max; i++)
+			kfree(j->j_copies[i]);
+	}
+	kvfree(j->j_copies);
+	kvfree(j->j_bufs);
+	kfree(j->j_desc);
+	kfree(j->j_commit);
+	kfree(j);
+}
+
+/**
+ * toyfs_journal_load() - Setup the journal, and replay it if needed
+ * @sb: The filesystem being mounted, geometry already loaded
+ * @dsb: The on-disk superblock
+ * @recovered: Set if the filesystem wasn't cleanly unmounted
+ *
+ * Filesystems without a journal are left alone. A transaction is replayed
+ * only if the filesystem wasn't cleanly unmounted, in which case the free
+ * inode and block counts of @dsb can't be trusted either.
+ *
+ * Read-only mounts never write anything, those needing a replay are refused.
+ *
+ * Return: 0 on success or a negative error
+ */
+int toyfs_journal_load(struct super_block *sb, struct tfs_dsb *dsb,
+		       bool *recovered)
+{
+	struct tfs_fs_info		*tfi = sb->s_fs_info;
+	struct tfs_journal_super	*jsb;
+	struct tfs_journal		*j;
+	struct buffer_head		*bh;
+	unsigned int			tid;
+	unsigned int			i;
+	int				error;
+
+	*recovered = false;
+	if (toyfs_is_legacy(tfi) || !dsb->s_journal_blocks)
+		return 0;
+
+	if (dsb->s_journal_start < tfi->s_data_start ||
+	    dsb->s_journal_start >= tfi->s_nblocks ||
+	    dsb->s_journal_blocks < TFS_JOURNAL_MIN_BLOCKS ||
+	    dsb->s_journal_blocks > tfi->s_nblocks - dsb->s_journal_start) {
+		pr_debug("Invalid journal geometry\n");
+		return -EFSCORRUPTED;
+	}
+
+	bh = sb_bread(sb, dsb->s_journal_start);
+	if (!bh)
+		return -EIO;
+	jsb = (struct tfs_journal_super *)bh->b_data;
+	if (jsb->js_header.jh_magic != TFS_JOURNAL_MAGIC ||
+	    jsb->js_header.jh_type != TFS_JOURNAL_SUPER ||
+	    jsb->js_blocks != dsb->s_journal_blocks) {
+		pr_debug("Invalid journal superblock\n");
+		brelse(bh);
+		return -EFSCORRUPTED;
+	}
+	tid = jsb->js_header.jh_seq;
+	brelse(bh);
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+
+	j->j_sb = sb;
+	j->j_start = dsb->s_journal_start;
+	j->j_blocks = dsb->s_journal_blocks;
+	j->j_max = min_t(unsigned int, j->j_blocks - 3,
+			 TFS_JOURNAL_TAGS(sb->s_blocksize));
+	init_rwsem(&j->j_trans_sem);
+	mutex_init(&j->j_commit_mutex);
+	spin_lock_init(&j->j_lock);
+	INIT_DELAYED_WORK(&j->j_commit_work, toyfs_journal_commit_work);
+
+	error = -ENOMEM;
+	j->j_bufs = kvcalloc(j->j_max, sizeof(*j->j_bufs), GFP_KERNEL);
+	j->j_copies = kvcalloc(j->j_max, sizeof(*j->j_copies), GFP_KERNEL);
+	j->j_desc = kmalloc(sb->s_blocksize, GFP_KERNEL);
+	j->j_commit = kmalloc(sb->s_blocksize, GFP_KERNEL);
+	if (!j->j_bufs || !j->j_copies || !j->j_desc || !j->j_commit)
+		goto out_free;
+
+	/* Block sized kmalloc() buffers never cross a page boundary */
+	for (i = 0; i < j->j_max; i++) {
+		j->j_copies[i] = kmalloc(sb->s_blocksize, GFP_KERNEL);
+		if (!j->j_copies[i])
+			goto out_free;
+	}
+
+	if (dsb->s_flags == TFS_SB_DIRTY) {
+		if (sb_rdonly(sb)) {
+			pr_debug("journal needs replay, mount read-write\n");
+			error = -EROFS;
+			goto out_free;
+		}
+		error = toyfs_journal_replay(j, &tid);
+		if (error)
+			goto out_free;
+		*recovered = true;
+	}
+
+	j->j_tid = tid;
+	j->j_commit_tid = tid - 1;
+	if (!sb_rdonly(sb)) {
+		error = toyfs_journal_write_super(j);
+		if (error)
+			goto out_free;
+	}
+
+	tfi->s_journal = j;
+	pr_debug("journal: %u blocks at %u, transaction %u\n",
+		 j->j_blocks, j->j_start, tid);
+	return 0;
+
+out_free:
+	toyfs_journal_free(j);
+	return error;
+}
+
+/**
+ * toyfs_journal_destroy() - Commit whatever is left, and free the journal
+ * @sb: The filesystem being unmounted
+ */
+void toyfs_journal_destroy(struct super_block *sb)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct tfs_journal	*j = tfi->s_journal;
+
+	if (!j)
+		return;
+
+	cancel_delayed_work_sync(&j->j_commit_work);
+	toyfs_journal_force(sb, j->j_tid);
+
+	/* Make the last checkpoint stable, read-only mounts never wrote one */
+	if (!j->j_aborted && !sb_rdonly(sb)) {
+		blkdev_issue_flush(sb->s_bdev);
+		toyfs_journal_write_super(j);
+	}
+
+	tfi->s_journal = NULL;
+	toyfs_journal_free(j);
+}
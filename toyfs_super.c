@@ -6,15 +6,19 @@
 #include <linux/fs.h>
 #include <linux/statfs.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
 #include <linux/buffer_head.h>
 #include "toyfs_types.h"
 #include "toyfs_iops.h"
 #include "toyfs_aops.h"
 
+#define CREATE_TRACE_POINTS
+#include "toyfs_trace.h"
+
 int toyfs_statfs(struct dentry *dentry, struct kstatfs *kst)
 {
 	struct super_block *sb		= dentry->d_sb;
-	struct tfs_fs_info *tfi	= sb->s_fs_info;
+	struct tfs_fs_info	*tfi	= sb->s_fs_info;
 	int error = 0;
 
 	/*
@@ -23,43 +27,208 @@ int toyfs_statfs(struct dentry *dentry, struct kstatfs *kst)
 	 */
 	u64 id = huge_encode_dev(sb->s_dev);
 
-	kst->f_bsize = TFS_BSIZE;
-	kst->f_blocks = TFS_MAX_BLKS;
-	kst->f_bfree = tfi->s_bfree;
-	kst->f_bavail = tfi->s_bfree;
-	kst->f_files = TFS_INODE_COUNT;
-	kst->f_ffree = tfi->s_ifree;
+	kst->f_bsize = sb->s_blocksize;
+	kst->f_blocks = tfi->s_nblocks;
+	kst->f_bfree = percpu_counter_sum_positive(&tfi->s_bfree);
+	kst->f_bavail = kst->f_bfree;
+	kst->f_files = tfi->s_ninodes;
+	kst->f_ffree = percpu_counter_sum_positive(&tfi->s_ifree);
 	kst->f_fsid = u64_to_fsid(id);
-	kst->f_namelen = TFS_MAX_NLEN;
-	kst->f_frsize = TFS_BSIZE;
+	kst->f_namelen = toyfs_name_len(dentry->d_sb);
+	kst->f_frsize = sb->s_blocksize;
 
 	return error;
 }
 
+/**
+ * toyfs_meta_bh() - Get the buffer of a metadata block
+ * @sb: The filesystem in question
+ * @cache: Pinned buffers of the metadata region (tfi->s_*_bh)
+ * @start: First disk block of the metadata region
+ * @idx: Block index within the metadata region
+ *
+ * Metadata blocks are only read from disk the first time they are needed,
+ * so mounting a large filesystem doesn't require reading the whole inode
+ * table and bitmaps. Once read, the buffer stays pinned in @cache until
+ * unmount, callers must not brelse() it.
+ *
+ * Two tasks may race to read the same block, in which case the loser
+ * releases its own reference and uses the one already cached.
+ *
+ * Return: The buffer_head or NULL if the block couldn't be read
+ */
+struct buffer_head *toyfs_meta_bh(struct super_block *sb,
+				  struct buffer_head **cache,
+				  unsigned int start,
+				  unsigned int idx)
+{
+	struct buffer_head *bh = READ_ONCE(cache[idx]);
+
+	if (bh)
+		return bh;
+
+	bh = sb_bread(sb, start + idx);
+	if (!bh)
+		return NULL;
+
+	if (cmpxchg(&cache[idx], NULL, bh) != NULL) {
+		brelse(bh);
+		bh = READ_ONCE(cache[idx]);
+	}
+
+	return bh;
+}
+
+static void toyfs_release_meta(struct buffer_head **cache, unsigned int count)
+{
+	int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < count; i++)
+		brelse(cache[i]);
+	kvfree(cache);
+}
+
+static void toyfs_release_bmap_alloc(struct tfs_fs_info *tfi)
+{
+	int i;
+
+	if (!tfi->s_bmap_alloc)
+		return;
+
+	for (i = 0; i < tfi->s_bmap_blocks; i++)
+		kfree(tfi->s_bmap_alloc[i]);
+	kvfree(tfi->s_bmap_alloc);
+}
+
+static void toyfs_release_fs_info(struct tfs_fs_info *tfi)
+{
+	/* Nothing may read the counters or the bitmap through sysfs anymore */
+	toyfs_sysfs_unregister(tfi);
+	toyfs_release_meta(tfi->s_bmap_bh, tfi->s_bmap_blocks);
+	toyfs_release_bmap_alloc(tfi);
+	toyfs_release_meta(tfi->s_imap_bh, tfi->s_imap_blocks);
+	toyfs_release_meta(tfi->s_inode_bh, tfi->s_itable_blocks);
+	kvfree(tfi->s_itable_dirty);
+	kvfree(tfi->s_imap);
+	free_percpu(tfi->s_bpool);
+	free_percpu(tfi->s_stats);
+	if (tfi->s_ioend_wq)
+		destroy_workqueue(tfi->s_ioend_wq);
+	percpu_counter_destroy(&tfi->s_bfree);
+	percpu_counter_destroy(&tfi->s_ifree);
+	brelse(tfi->s_sbh);
+	kfree(tfi);
+}
+
 void toyfs_put_super(struct super_block *sb)
 {
 	struct tfs_fs_info	*tfi = sb->s_fs_info;
-	struct buffer_head	*sbh;
 	struct tfs_dsb		*dsb;
 	int i;
 
-	sbh = sb_bread(sb, TFS_SB_BLOCK);
-	dsb = (struct tfs_dsb *)sbh->b_data;
+	dsb = (struct tfs_dsb *)tfi->s_sbh->b_data;
 
-	dsb->s_ifree = tfi->s_ifree;
-	dsb->s_bfree = tfi->s_bfree;
+	/* Everything but the superblock is home after this */
+	toyfs_journal_destroy(sb);
 
-	for (i = 0; i < TFS_INODE_COUNT; i++)
-		dsb->s_inodes[i] = tfi->s_inodes[i];
+	/* Nothing changed, and the superblock may not be written either */
+	if (sb_rdonly(sb))
+		goto out_release;
 
-	mark_buffer_dirty(tfi->s_bmap_bh);
-	mark_buffer_dirty(tfi->s_inode_bh);
-	mark_buffer_dirty(sbh);
-	brelse(tfi->s_bmap_bh);
-	brelse(tfi->s_inode_bh);
-	brelse(sbh);
+	dsb->s_flags = TFS_SB_CLEAN;
+	dsb->s_ifree = percpu_counter_sum_positive(&tfi->s_ifree);
+	dsb->s_bfree = percpu_counter_sum_positive(&tfi->s_bfree);
 
-	kfree(tfi);
+	if (toyfs_is_legacy(tfi)) {
+		for (i = 0; i < TFS_INODE_COUNT; i++)
+			dsb->s_inodes[i] = tfi->s_inodes[i];
+	}
+
+	/*
+	 * Inode table and bitmap buffers are dirtied as they are modified,
+	 * only the superblock needs to be written here.
+	 */
+	mark_buffer_dirty(tfi->s_sbh);
+out_release:
+	toyfs_release_fs_info(tfi);
+	sb->s_fs_info = NULL;
+}
+
+/**
+ * toyfs_sync_fs() - Write back the inode table
+ * @sb: The filesystem in question
+ * @wait: Wait for the writes to complete
+ *
+ * With a journal, this commits the running transaction, or just schedules
+ * the commit if we're not asked to wait. There's nothing else to write.
+ *
+ * Without one, inodes written back as part of a sync only dirty their inode
+ * table buffer, see toyfs_write_inode(). The blocks are written here, once
+ * each no matter how many of their inodes were dirty, with all the writes in
+ * flight at once. Blocks dirtied again while we wait are left for the next
+ * call.
+ *
+ * Everything else (bitmaps, directory and extent blocks) goes out with the
+ * block device, right after this.
+ *
+ * Return: 0 on success, or -EIO if an inode table block couldn't be written
+ */
+int toyfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	struct tfs_journal	*j = tfi->s_journal;
+	struct buffer_head	*bh;
+	unsigned int		i;
+	int			error = 0;
+
+	if (j) {
+		if (wait)
+			return toyfs_journal_force(sb, READ_ONCE(j->j_tid));
+		mod_delayed_work(system_wq, &j->j_commit_work, 0);
+		return 0;
+	}
+
+	for_each_set_bit(i, tfi->s_itable_dirty, tfi->s_itable_blocks) {
+		clear_bit(i, tfi->s_itable_dirty);
+		write_dirty_buffer(tfi->s_inode_bh[i], wait ? REQ_SYNC : 0);
+	}
+
+	if (!wait)
+		return 0;
+
+	/* An earlier !wait call may have started some of them */
+	for (i = 0; i < tfi->s_itable_blocks; i++) {
+		bh = READ_ONCE(tfi->s_inode_bh[i]);
+		if (!bh)
+			continue;
+
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			error = -EIO;
+	}
+
+	pr_debug("inode table synced: %d\n", error);
+	return error;
+}
+
+/*
+ * toyfs_remount_fs()
+ *	- Read-only mounts of a journaled filesystem leave its superblock
+ *	  clean and never replay, going read-write would skip both. Going
+ *	  read-only would leave it dirty. Neither is supported, the
+ *	  filesystem has to be mounted again.
+ */
+static int toyfs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	struct tfs_fs_info *tfi = sb->s_fs_info;
+
+	sync_filesystem(sb);
+	if (tfi->s_journal && ((*flags ^ sb->s_flags) & SB_RDONLY))
+		return -EINVAL;
+	return 0;
 }
 
 struct super_operations toyfs_sops = {
@@ -68,9 +237,82 @@ struct super_operations toyfs_sops = {
 	.free_inode	= toyfs_free_inode,
 	.evict_inode	= toyfs_evict_inode,
 	.statfs		= toyfs_statfs,
+	.sync_fs	= toyfs_sync_fs,
 	.put_super	= toyfs_put_super,
+	.remount_fs	= toyfs_remount_fs,
 };
 
+/*
+ * toyfs_load_geometry()
+ *	- Fill in the filesystem geometry from the on-disk superblock
+ *	- Legacy filesystems have a fixed geometry, so we synthesize it
+ *	- Versioned filesystems must describe a sane and contiguous layout
+ *	  fitting in the device.
+ */
+static int toyfs_load_geometry(struct tfs_fs_info *tfi,
+			       struct tfs_dsb *dsb,
+			       sector_t dev_blocks,
+			       unsigned int bsize)
+{
+	if (dsb->s_version == TFS_SB_VERSION_LEGACY) {
+		tfi->s_nblocks = TFS_MAX_BLKS;
+		tfi->s_ninodes = TFS_INODE_COUNT;
+		tfi->s_itable_start = TFS_INODE_BLOCK;
+		tfi->s_itable_blocks = 1;
+		tfi->s_imap_start = 0;
+		tfi->s_imap_blocks = 0;
+		tfi->s_bmap_start = TFS_BITMAP_BLOCK;
+		tfi->s_bmap_blocks = 1;
+		tfi->s_data_start = TFS_FIRST_DATA_BLOCK;
+	} else if (dsb->s_version == TFS_SB_VERSION) {
+		tfi->s_nblocks = dsb->s_nblocks;
+		tfi->s_ninodes = dsb->s_ninodes;
+		tfi->s_itable_start = dsb->s_itable_start;
+		tfi->s_itable_blocks = dsb->s_itable_blocks;
+		tfi->s_imap_start = dsb->s_imap_start;
+		tfi->s_imap_blocks = dsb->s_imap_blocks;
+		tfi->s_bmap_start = dsb->s_bmap_start;
+		tfi->s_bmap_blocks = dsb->s_bmap_blocks;
+		tfi->s_data_start = dsb->s_data_start;
+	} else {
+		pr_debug("Unsupported superblock version: %u\n", dsb->s_version);
+		return -EINVAL;
+	}
+	tfi->s_version = dsb->s_version;
+
+	if (tfi->s_nblocks > dev_blocks || tfi->s_nblocks >= TFS_INVALID) {
+		pr_debug("Filesystem size (%u) doesn't fit the device (%llu)\n",
+			 tfi->s_nblocks, (unsigned long long)dev_blocks);
+		return -EINVAL;
+	}
+
+	if (!tfi->s_ninodes || tfi->s_ninodes >= TFS_INVALID ||
+	    tfi->s_itable_start != TFS_INODE_BLOCK ||
+	    tfi->s_itable_blocks != DIV_ROUND_UP(tfi->s_ninodes,
+						 TFS_INODES_PER_BLOCK(bsize)) ||
+	    tfi->s_bmap_blocks != DIV_ROUND_UP(tfi->s_nblocks,
+					       TFS_BITS_PER_BLOCK(bsize)) ||
+	    tfi->s_bmap_start + tfi->s_bmap_blocks != tfi->s_data_start ||
+	    tfi->s_data_start >= tfi->s_nblocks)
+		goto corrupted;
+
+	if (!toyfs_is_legacy(tfi) &&
+	    (tfi->s_imap_start != tfi->s_itable_start + tfi->s_itable_blocks ||
+	     tfi->s_imap_blocks != DIV_ROUND_UP(tfi->s_ninodes,
+						TFS_BITS_PER_BLOCK(bsize)) ||
+	     tfi->s_bmap_start != tfi->s_imap_start + tfi->s_imap_blocks))
+		goto corrupted;
+
+	if (dsb->s_ifree > tfi->s_ninodes || dsb->s_bfree > tfi->s_nblocks)
+		goto corrupted;
+
+	return 0;
+
+corrupted:
+	pr_debug("Invalid filesystem geometry\n");
+	return -EFSCORRUPTED;
+}
+
 int toyfs_fill_super(
 	struct super_block *sb,
 	void *data,
@@ -79,9 +321,11 @@ int toyfs_fill_super(
 	struct tfs_dsb		*tfs_dsb;
 	struct tfs_fs_info	*tfi;
 	struct buffer_head	*sbh;
-	struct buffer_head	*bmap_bh;
-	struct buffer_head	*inode_bh;
 	struct inode		*root_ino;
+	struct tfs_handle	h;
+	unsigned int		bits;
+	bool			recovered;
+	int			count;
 	int i = 0;
 	int error = 0;
 
@@ -89,91 +333,217 @@ int toyfs_fill_super(
 	if (!tfi)
 		return -ENOMEM;
 
-	/* Basic super_block initialization */
-	sb_set_blocksize(sb, TFS_BSIZE);
+	spin_lock_init(&tfi->s_bmap_lock);
+	spin_lock_init(&tfi->s_imap_lock);
+
+	/*
+	 * Basic super_block initialization. Until we know the block size,
+	 * use the smallest one the device takes, the superblock is at byte 0
+	 * either way.
+	 */
+	if (!sb_min_blocksize(sb, TFS_MIN_BSIZE)) {
+		pr_debug("Couldn't set block size\n");
+		error = -EINVAL;
+		goto sb_err_out;
+	}
 	sb->s_time_min = 0;
 	sb->s_time_max = U32_MAX;
 
 	/* Yes, we use buffer_heads here... for now */
-	sbh = sb_bread(sb, 0);
-	if (!sbh)
+	sbh = sb_bread(sb, TFS_SB_BLOCK);
+	if (!sbh) {
+		error = -EIO;
 		goto sb_err_out;
-
-	tfs_dsb = (struct tfs_dsb*)sbh->b_data;
-
-	bmap_bh = sb_bread(sb, TFS_BITMAP_BLOCK);
-	if (!bmap_bh) {
-		pr_debug("Couldn't read bitmap block\n");
-		error = -ENOMEM;
-		goto sbh_err_out;
 	}
-	pr_debug("bitmap loaded\n");
 
-	inode_bh = sb_bread(sb, TFS_INODE_BLOCK);
-	if (!inode_bh) {
-		pr_debug("Couldn't read inode block\n");
-		error = -ENOMEM;
-		goto bbh_err_out;
-	}
+	tfs_dsb = (struct tfs_dsb*)sbh->b_data;
+	tfi->s_sbh = sbh;
 
 	if (tfs_dsb->s_magic != TFS_MAGIC) {
 		pr_debug("Invalid Magic number\n");
 		error = -EFSCORRUPTED;
-		goto ibh_err_out;
+		goto tfi_err_out;
 	}
-	if (tfs_dsb->s_flags == TFS_SB_DIRTY) {
+	/* With a journal, a dirty filesystem only needs to be recovered */
+	if (tfs_dsb->s_flags == TFS_SB_DIRTY &&
+	    (tfs_dsb->s_version == TFS_SB_VERSION_LEGACY ||
+	     !tfs_dsb->s_journal_blocks)) {
 		pr_debug("Filesystem is corrupted, run fsck before mounting");
 		error = -EFSCORRUPTED;
-		goto ibh_err_out;
+		goto tfi_err_out;
+	}
+	pr_debug("FS is %s\n", tfs_dsb->s_flags == TFS_SB_DIRTY ? "dirty" : "clean");
+
+	/*
+	 * Blocks larger than a page would need the page cache to never use
+	 * smaller folios, we don't go there.
+	 */
+	bits = toyfs_dsb_bsize_bits(tfs_dsb);
+	if (bits < TFS_MIN_BSIZE_BITS || bits > TFS_MAX_BSIZE_BITS ||
+	    bits > PAGE_SHIFT) {
+		pr_debug("Unsupported block size: %u << %u\n", TFS_MIN_BSIZE,
+			 tfs_dsb->s_log_block_size);
+		error = -EINVAL;
+		goto tfi_err_out;
+	}
+
+	if (bits != sb->s_blocksize_bits) {
+		brelse(sbh);
+		tfi->s_sbh = NULL;
+		if (!sb_set_blocksize(sb, 1U << bits)) {
+			pr_debug("Couldn't set block size\n");
+			error = -EINVAL;
+			goto tfi_err_out;
+		}
+
+		sbh = sb_bread(sb, TFS_SB_BLOCK);
+		if (!sbh) {
+			error = -EIO;
+			goto tfi_err_out;
+		}
+		tfs_dsb = (struct tfs_dsb *)sbh->b_data;
+		tfi->s_sbh = sbh;
+	}
+
+	error = toyfs_load_geometry(tfi, tfs_dsb, sb_bdev_nr_blocks(sb),
+				    sb->s_blocksize);
+	if (error)
+		goto tfi_err_out;
+
+	/*
+	 * Metadata blocks are read on demand, we only need room to pin them
+	 * here. See toyfs_meta_bh().
+	 */
+	tfi->s_inode_bh = kvcalloc(tfi->s_itable_blocks,
+				   sizeof(struct buffer_head *), GFP_KERNEL);
+	tfi->s_bmap_bh = kvcalloc(tfi->s_bmap_blocks,
+				  sizeof(struct buffer_head *), GFP_KERNEL);
+	tfi->s_bmap_alloc = kvcalloc(tfi->s_bmap_blocks,
+				     sizeof(unsigned long *), GFP_KERNEL);
+	if (tfi->s_imap_blocks)
+		tfi->s_imap_bh = kvcalloc(tfi->s_imap_blocks,
+					  sizeof(struct buffer_head *), GFP_KERNEL);
+	tfi->s_itable_dirty = kvcalloc(BITS_TO_LONGS(tfi->s_itable_blocks),
+				       sizeof(unsigned long), GFP_KERNEL);
+	if (!tfi->s_inode_bh || !tfi->s_bmap_bh || !tfi->s_bmap_alloc ||
+	    !tfi->s_itable_dirty ||
+	    (tfi->s_imap_blocks && !tfi->s_imap_bh)) {
+		error = -ENOMEM;
+		goto tfi_err_out;
 	}
-	pr_debug("FS is clean\n");
 
 	/* All in-core structures are allocated, finish initializing SB and fs_info */
 	sb->s_fs_info = tfi;
-	sb->s_magic = tfi->s_magic;
+	sb->s_magic = tfs_dsb->s_magic;
 	sb->s_op = &toyfs_sops;
+	sb->s_maxbytes = (loff_t)toyfs_max_file_blocks(sb) <<
+			 sb->s_blocksize_bits;
 
 	tfi->s_magic = tfs_dsb->s_magic;
-	tfi->s_ifree = tfs_dsb->s_ifree;
-	tfi->s_bfree = tfs_dsb->s_bfree;
-	tfi->s_bmap_bh = bmap_bh;
-	tfi->s_inode_bh = inode_bh;
 
+	error = percpu_counter_init(&tfi->s_ifree, tfs_dsb->s_ifree, GFP_KERNEL);
+	if (!error)
+		error = percpu_counter_init(&tfi->s_bfree, tfs_dsb->s_bfree,
+					    GFP_KERNEL);
+	if (error)
+		goto tfi_err_out;
+
+	tfi->s_stats = alloc_percpu(struct tfs_stats);
+	if (!tfi->s_stats) {
+		error = -ENOMEM;
+		goto tfi_err_out;
+	}
+
+	tfi->s_ioend_wq = alloc_workqueue("toyfs-ioend/%s",
+					  WQ_MEM_RECLAIM | WQ_FREEZABLE, 0,
+					  sb->s_id);
+	if (!tfi->s_ioend_wq) {
+		error = -ENOMEM;
+		goto tfi_err_out;
+	}
 
 	pr_debug("Superblock initialization...\n");
-	pr_debug("\tmagic: 0x%x - free ino: %u, free blocks: %u\n",
-		tfi->s_magic, tfi->s_ifree, tfi->s_bfree);
+	pr_debug("\tmagic: 0x%x - version: %u - free ino: %u, free blocks: %u\n",
+		tfi->s_magic, tfi->s_version, tfs_dsb->s_ifree, tfs_dsb->s_bfree);
+	pr_debug("\tblocks: %u - inodes: %u - inode blocks: %u - bitmap blocks: %u\n",
+		tfi->s_nblocks, tfi->s_ninodes, tfi->s_itable_blocks,
+		tfi->s_bmap_blocks);
+
+	if (toyfs_is_legacy(tfi)) {
+		for (i = 0; i < TFS_INODE_COUNT; i++)
+			tfi->s_inodes[i] = tfs_dsb->s_inodes[i];
+	}
 
-	for (i = 0; i < TFS_INODE_COUNT; i++)
-		tfi->s_inodes[i] = tfs_dsb->s_inodes[i];
+	/* Before anything else reads metadata it may replay */
+	error = toyfs_journal_load(sb, tfs_dsb, &recovered);
+	if (error)
+		goto tfi_err_out;
+
+	error = toyfs_imap_init(sb);
+	if (error)
+		goto tfi_err_out;
+
+	/* The free counts are only written at unmount */
+	if (recovered) {
+		count = toyfs_bmap_count_free(sb);
+		if (count < 0) {
+			error = count;
+			goto tfi_err_out;
+		}
+		percpu_counter_set(&tfi->s_bfree, count);
+		percpu_counter_set(&tfi->s_ifree, tfi->s_ninodes -
+				   bitmap_weight(tfi->s_imap, tfi->s_ninodes));
+		pr_debug("Recovered, free ino: %lld, free blocks: %lld\n",
+			 percpu_counter_sum(&tfi->s_ifree),
+			 percpu_counter_sum(&tfi->s_bfree));
+	}
 
+	error = toyfs_bpool_init(sb);
+	if (error)
+		goto tfi_err_out;
+
+	error = toyfs_sysfs_register(sb);
+	if (error)
+		goto tfi_err_out;
+
+	/* Until put_super() marks it clean again, replay is needed */
+	if (tfi->s_journal && !sb_rdonly(sb)) {
+		error = toyfs_journal_start(sb, &h, 1);
+		if (error)
+			goto tfi_err_out;
+		tfs_dsb->s_flags = TFS_SB_DIRTY;
+		toyfs_journal_dirty(sb, sbh);
+		toyfs_journal_stop(&h);
+
+		error = toyfs_journal_force(sb, h.h_tid);
+		if (error)
+			goto tfi_err_out;
+	}
 
 	/* All set, let's setup the root inode */
-
 	root_ino = toyfs_read_inode(sb, 0);
+	if (IS_ERR(root_ino)) {
+		pr_debug("Couldn't read root inode\n");
+		error = PTR_ERR(root_ino);
+		goto tfi_err_out;
+	}
 
-	/* XXX: missing error handling */
 	sb->s_root = d_make_root(root_ino);
+	if (!sb->s_root) {
+		error = -ENOMEM;
+		goto tfi_err_out;
+	}
 
-	/*
-	 * BUG: Forgot to fix this.
-	 * the buffers are not released but are not
-	 * stored anywhere either
-	 */
+	return 0;
+
+tfi_err_out:
+	if (tfi->s_journal)
+		toyfs_journal_destroy(sb);
+	/* This also releases the superblock buffer */
+	toyfs_release_fs_info(tfi);
+	sb->s_fs_info = NULL;
 	return error;
-	/*
-	 * Fall through
-	 *
-	 * Mount is still incomplete, fall through here, so nobody try to mount this, or it will
-	 * explode in legacy_get_tree() because we have no real root dentry setup so far.
-	 */
-	error = -EFSCORRUPTED;
-bbh_err_out:
-	brelse(bmap_bh);
-ibh_err_out:
-	brelse(inode_bh);
-sbh_err_out:
-	brelse(sbh);
+
 sb_err_out:
 	kfree(tfi);
 	sb->s_fs_info = NULL;
@@ -203,14 +573,32 @@ static int __init toyfs_mod_init(void)
 {
 	int error = 0;
 
+	error = toyfs_init_inodecache();
+	if (error)
+		return error;
+
+	error = toyfs_sysfs_init();
+	if (error) {
+		toyfs_destroy_inodecache();
+		return error;
+	}
+
 	error = register_filesystem(&toyfs_fs_type);
+	if (error) {
+		toyfs_sysfs_exit();
+		toyfs_destroy_inodecache();
+		return error;
+	}
+
 	pr_debug("ToyFS module loaded\n");
-	return error;
+	return 0;
 }
 
 static void __exit toyfs_mod_exit(void)
 {
 	unregister_filesystem(&toyfs_fs_type);
+	toyfs_sysfs_exit();
+	toyfs_destroy_inodecache();
 	pr_debug("ToyFS module unloaded\n");
 }
 
@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/slab.h>
+#include "toyfs_types.h"
+
+/*
+ * Statistics
+ *
+ * Every mounted filesystem gets a /sys/fs/toyfs/<dev>/ directory, with one
+ * read-only file per counter of enum tfs_stat_item. Counters are per-CPU and
+ * never reset, so the hot paths only ever touch their local CPU's copy;
+ * sample them twice and diff for rates.
+ *
+ * free_extents is computed when read, by walking the whole block bitmap.
+ */
+
+/* Buckets of the free_extents histogram, the last one holds 32768+ blocks */
+#define TFS_FREE_EXTENT_BUCKETS	16
+
+static struct kset *toyfs_kset;
+
+struct toyfs_attr {
+	struct attribute	attr;
+	ssize_t			(*show)(struct tfs_fs_info *tfi,
+					struct toyfs_attr *a, char *buf);
+	enum tfs_stat_item	item;
+};
+
+static u64 toyfs_stat_sum(struct tfs_fs_info *tfi, enum tfs_stat_item item)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(tfi->s_stats, cpu)->st_count[item];
+	return sum;
+}
+
+static ssize_t toyfs_stat_show(struct tfs_fs_info *tfi, struct toyfs_attr *a,
+			       char *buf)
+{
+	return sysfs_emit(buf, "%llu\n", toyfs_stat_sum(tfi, a->item));
+}
+
+/*
+ * toyfs_free_extents_show()
+ *	- One "<blocks> <extents>" line per bucket, <blocks> being the
+ *	  smallest extent size the bucket holds
+ */
+static ssize_t toyfs_free_extents_show(struct tfs_fs_info *tfi,
+				       struct toyfs_attr *a, char *buf)
+{
+	unsigned int	hist[TFS_FREE_EXTENT_BUCKETS];
+	int		len = 0;
+	int		error;
+	int		i;
+
+	error = toyfs_bmap_free_extents(tfi->s_sb, hist,
+					TFS_FREE_EXTENT_BUCKETS);
+	if (error < 0)
+		return error;
+
+	for (i = 0; i < TFS_FREE_EXTENT_BUCKETS; i++)
+		len += sysfs_emit_at(buf, len, "%u%s %u\n", 1U << i,
+				     i == TFS_FREE_EXTENT_BUCKETS - 1 ? "+" : "",
+				     hist[i]);
+	return len;
+}
+
+#define TOYFS_STAT_ATTR(_name, _item)					\
+static struct toyfs_attr toyfs_attr_##_name = {				\
+	.attr	= { .name = __stringify(_name), .mode = 0444 },		\
+	.show	= toyfs_stat_show,					\
+	.item	= _item,						\
+}
+
+TOYFS_STAT_ATTR(balloc_calls, TFS_STAT_BALLOC_CALLS);
+TOYFS_STAT_ATTR(blocks_allocated, TFS_STAT_BALLOC_BLOCKS);
+TOYFS_STAT_ATTR(blocks_freed, TFS_STAT_BFREE_BLOCKS);
+TOYFS_STAT_ATTR(bitmap_words_scanned, TFS_STAT_BMAP_WORDS);
+TOYFS_STAT_ATTR(lookup_hits, TFS_STAT_LOOKUP_HITS);
+TOYFS_STAT_ATTR(lookup_misses, TFS_STAT_LOOKUP_MISSES);
+TOYFS_STAT_ATTR(lookup_blocks_read, TFS_STAT_LOOKUP_BLOCKS);
+TOYFS_STAT_ATTR(inode_writebacks, TFS_STAT_WRITE_INODE);
+TOYFS_STAT_ATTR(inode_sync_writes, TFS_STAT_WRITE_INODE_SYNC);
+
+static struct toyfs_attr toyfs_attr_free_extents = {
+	.attr	= { .name = "free_extents", .mode = 0444 },
+	.show	= toyfs_free_extents_show,
+};
+
+static struct attribute *toyfs_sb_attrs[] = {
+	&toyfs_attr_balloc_calls.attr,
+	&toyfs_attr_blocks_allocated.attr,
+	&toyfs_attr_blocks_freed.attr,
+	&toyfs_attr_bitmap_words_scanned.attr,
+	&toyfs_attr_lookup_hits.attr,
+	&toyfs_attr_lookup_misses.attr,
+	&toyfs_attr_lookup_blocks_read.attr,
+	&toyfs_attr_inode_writebacks.attr,
+	&toyfs_attr_inode_sync_writes.attr,
+	&toyfs_attr_free_extents.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(toyfs_sb);
+
+static ssize_t toyfs_attr_show(struct kobject *kobj, struct attribute *attr,
+			       char *buf)
+{
+	struct tfs_fs_info *tfi = container_of(kobj, struct tfs_fs_info,
+					       s_kobj);
+	struct toyfs_attr *a = container_of(attr, struct toyfs_attr, attr);
+
+	return a->show(tfi, a, buf);
+}
+
+static const struct sysfs_ops toyfs_attr_ops = {
+	.show	= toyfs_attr_show,
+};
+
+static void toyfs_sb_release(struct kobject *kobj)
+{
+	struct tfs_fs_info *tfi = container_of(kobj, struct tfs_fs_info,
+					       s_kobj);
+
+	complete(&tfi->s_kobj_unregister);
+}
+
+static const struct kobj_type toyfs_sb_ktype = {
+	.default_groups	= toyfs_sb_groups,
+	.sysfs_ops	= &toyfs_attr_ops,
+	.release	= toyfs_sb_release,
+};
+
+/**
+ * toyfs_sysfs_register() - Create the statistics directory of a filesystem
+ * @sb: The filesystem being mounted
+ *
+ * tfi->s_stats must be allocated already, the counters are live as soon as
+ * the directory shows up.
+ *
+ * Return: Zero in case of success or negative value otherwise
+ */
+int toyfs_sysfs_register(struct super_block *sb)
+{
+	struct tfs_fs_info	*tfi = sb->s_fs_info;
+	int			error;
+
+	tfi->s_sb = sb;
+	tfi->s_kobj.kset = toyfs_kset;
+	init_completion(&tfi->s_kobj_unregister);
+
+	error = kobject_init_and_add(&tfi->s_kobj, &toyfs_sb_ktype, NULL,
+				     "%s", sb->s_id);
+	if (error) {
+		kobject_put(&tfi->s_kobj);
+		wait_for_completion(&tfi->s_kobj_unregister);
+	}
+	return error;
+}
+
+/**
+ * toyfs_sysfs_unregister() - Remove the statistics directory of a filesystem
+ * @tfi: The filesystem in question
+ *
+ * Readers still in a show method are waited for, nothing looks at @tfi
+ * through sysfs anymore once we return. Does nothing if the directory was
+ * never registered.
+ */
+void toyfs_sysfs_unregister(struct tfs_fs_info *tfi)
+{
+	if (!tfi->s_kobj.state_in_sysfs)
+		return;
+
+	kobject_del(&tfi->s_kobj);
+	kobject_put(&tfi->s_kobj);
+	wait_for_completion(&tfi->s_kobj_unregister);
+}
+
+/**
+ * toyfs_sysfs_init() - Create /sys/fs/toyfs
+ *
+ * Return: Zero in case of success or negative value otherwise
+ */
+int toyfs_sysfs_init(void)
+{
+	toyfs_kset = kset_create_and_add("toyfs", NULL, fs_kobj);
+	if (!toyfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void toyfs_sysfs_exit(void)
+{
+	kset_unregister(toyfs_kset);
+}
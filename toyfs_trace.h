@@ -0,0 +1,380 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * Tracepoints
+ *
+ * The allocators, directory lookups and the writeback paths report what
+ * they do here rather than through pr_debug(), so they can be watched and
+ * aggregated (perf, bpftrace, trace-cmd) on any build, at no cost while the
+ * events are disabled. See /sys/kernel/tracing/events/toyfs/.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM toyfs
+
+#if !defined(_TOYFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TOYFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/iomap.h>
+#include "toyfs_format.h"
+
+#ifndef _TOYFS_TRACE_DEFS
+#define _TOYFS_TRACE_DEFS
+
+/* Where toyfs_find_entry() got its answer from */
+#define TOYFS_LOOKUP_CACHE	0	/* The in-core directory cache */
+#define TOYFS_LOOKUP_LINEAR	1	/* Reading the whole legacy directory */
+#define TOYFS_LOOKUP_INDEX	2	/* The on-disk hash index */
+
+#endif /* _TOYFS_TRACE_DEFS */
+
+TRACE_EVENT(toyfs_balloc,
+	TP_PROTO(struct super_block *sb, unsigned int goal, unsigned int want,
+		 int block, unsigned int got, bool reserved),
+	TP_ARGS(sb, goal, want, block, got, reserved),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned int,	goal)
+		__field(unsigned int,	want)
+		__field(int,		block)
+		__field(unsigned int,	got)
+		__field(bool,		reserved)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->goal		= goal;
+		__entry->want		= want;
+		__entry->block		= block;
+		__entry->got		= got;
+		__entry->reserved	= reserved;
+	),
+
+	TP_printk("dev %d,%d goal %u want %u block %d got %u%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal,
+		  __entry->want, __entry->block, __entry->got,
+		  __entry->reserved ? " reserved" : "")
+);
+
+/* One per bitmap block searched, @block is negative if it had no room */
+TRACE_EVENT(toyfs_bmap_claim,
+	TP_PROTO(struct super_block *sb, unsigned int group, unsigned int start,
+		 unsigned int want, int block, unsigned int got),
+	TP_ARGS(sb, group, start, want, block, got),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned int,	group)
+		__field(unsigned int,	start)
+		__field(unsigned int,	want)
+		__field(int,		block)
+		__field(unsigned int,	got)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->group	= group;
+		__entry->start	= start;
+		__entry->want	= want;
+		__entry->block	= block;
+		__entry->got	= got;
+	),
+
+	TP_printk("dev %d,%d group %u start %u want %u block %d got %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->group,
+		  __entry->start, __entry->want, __entry->block, __entry->got)
+);
+
+/* Reserved blocks going back to the bitmap, unused */
+TRACE_EVENT(toyfs_bmap_release,
+	TP_PROTO(struct super_block *sb, unsigned int start, unsigned int len),
+	TP_ARGS(sb, start, len),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned int,	start)
+		__field(unsigned int,	len)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->start	= start;
+		__entry->len	= len;
+	),
+
+	TP_printk("dev %d,%d start %u len %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->start,
+		  __entry->len)
+);
+
+TRACE_EVENT(toyfs_bfree,
+	TP_PROTO(struct super_block *sb, unsigned int start, unsigned int len,
+		 unsigned int freed),
+	TP_ARGS(sb, start, len, freed),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned int,	start)
+		__field(unsigned int,	len)
+		__field(unsigned int,	freed)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->start	= start;
+		__entry->len	= len;
+		__entry->freed	= freed;
+	),
+
+	TP_printk("dev %d,%d start %u len %u freed %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->start,
+		  __entry->len, __entry->freed)
+);
+
+DECLARE_EVENT_CLASS(toyfs_inode_alloc_class,
+	TP_PROTO(struct super_block *sb, int ino),
+	TP_ARGS(sb, ino),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(int,	ino)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->ino	= ino;
+	),
+
+	TP_printk("dev %d,%d ino %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino)
+);
+
+/* @ino is negative if there was no inode left */
+DEFINE_EVENT(toyfs_inode_alloc_class, toyfs_ialloc,
+	TP_PROTO(struct super_block *sb, int ino),
+	TP_ARGS(sb, ino)
+);
+
+DEFINE_EVENT(toyfs_inode_alloc_class, toyfs_ifree,
+	TP_PROTO(struct super_block *sb, int ino),
+	TP_ARGS(sb, ino)
+);
+
+/*
+ * What a lookup cost: directory blocks read and names compared, none of
+ * them when the answer came from the directory cache.
+ */
+TRACE_EVENT(toyfs_find_entry,
+	TP_PROTO(struct inode *dir, const char *name, int how,
+		 unsigned int blocks, unsigned int compared, int ret),
+	TP_ARGS(dir, name, how, blocks, compared, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	dir)
+		__array(char,		name, TFS_LEGACY_NAME_LEN + 1)
+		__field(int,		how)
+		__field(unsigned int,	blocks)
+		__field(unsigned int,	compared)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dir->i_sb->s_dev;
+		__entry->dir		= dir->i_ino;
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		__entry->how		= how;
+		__entry->blocks		= blocks;
+		__entry->compared	= compared;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s %s blocks %u compared %u ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->name,
+		  __print_symbolic(__entry->how,
+				   { TOYFS_LOOKUP_CACHE,	"cache" },
+				   { TOYFS_LOOKUP_LINEAR,	"linear" },
+				   { TOYFS_LOOKUP_INDEX,	"index" }),
+		  __entry->blocks, __entry->compared, __entry->ret)
+);
+
+TRACE_EVENT(toyfs_dir_add_entry,
+	TP_PROTO(struct inode *dir, const char *name, unsigned int slot,
+		 unsigned long ino),
+	TP_ARGS(dir, name, slot, ino),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	dir)
+		__array(char,		name, TFS_LEGACY_NAME_LEN + 1)
+		__field(unsigned int,	slot)
+		__field(unsigned long,	ino)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		__entry->slot	= slot;
+		__entry->ino	= ino;
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s slot %u ino %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->name, __entry->slot, __entry->ino)
+);
+
+TRACE_EVENT(toyfs_dir_grow,
+	TP_PROTO(struct inode *dir, unsigned int lblk, unsigned int pblk),
+	TP_ARGS(dir, lblk, pblk),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	dir)
+		__field(unsigned int,	lblk)
+		__field(unsigned int,	pblk)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__entry->lblk	= lblk;
+		__entry->pblk	= pblk;
+	),
+
+	TP_printk("dev %d,%d dir %lu lblk %u pblk %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->lblk, __entry->pblk)
+);
+
+/* An index leaf split, the hashes from @hash on moving to block @lblk */
+TRACE_EVENT(toyfs_dx_split,
+	TP_PROTO(struct inode *dir, u32 hash, unsigned int lblk),
+	TP_ARGS(dir, hash, lblk),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	dir)
+		__field(u32,		hash)
+		__field(unsigned int,	lblk)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__entry->hash	= hash;
+		__entry->lblk	= lblk;
+	),
+
+	TP_printk("dev %d,%d dir %lu hash 0x%x lblk %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->hash, __entry->lblk)
+);
+
+TRACE_EVENT(toyfs_write_inode,
+	TP_PROTO(struct inode *inode, struct writeback_control *wbc),
+	TP_ARGS(inode, wbc),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		size)
+		__field(blkcnt_t,	blocks)
+		__field(int,		sync_mode)
+		__field(bool,		for_sync)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->size		= i_size_read(inode);
+		__entry->blocks		= inode->i_blocks;
+		__entry->sync_mode	= wbc->sync_mode;
+		__entry->for_sync	= wbc->for_sync;
+	),
+
+	TP_printk("dev %d,%d ino %lu size %lld blocks %llu sync_mode %d%s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->size, (unsigned long long)__entry->blocks,
+		  __entry->sync_mode, __entry->for_sync ? " for_sync" : "")
+);
+
+TRACE_EVENT(toyfs_writepages,
+	TP_PROTO(struct inode *inode, struct writeback_control *wbc),
+	TP_ARGS(inode, wbc),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(long,		nr_to_write)
+		__field(loff_t,		range_start)
+		__field(loff_t,		range_end)
+		__field(int,		sync_mode)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->nr_to_write	= wbc->nr_to_write;
+		__entry->range_start	= wbc->range_start;
+		__entry->range_end	= wbc->range_end;
+		__entry->sync_mode	= wbc->sync_mode;
+	),
+
+	TP_printk("dev %d,%d ino %lu nr_to_write %ld range [%lld, %lld] sync_mode %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->nr_to_write, __entry->range_start,
+		  __entry->range_end, __entry->sync_mode)
+);
+
+/* Every mapping handed to iomap, writeback's included */
+TRACE_EVENT(toyfs_iomap_begin,
+	TP_PROTO(struct inode *inode, loff_t pos, loff_t length,
+		 unsigned int flags, struct iomap *iomap),
+	TP_ARGS(inode, pos, length, flags, iomap),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(loff_t,		length)
+		__field(unsigned int,	flags)
+		__field(u16,		type)
+		__field(u64,		addr)
+		__field(u64,		map_len)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->pos		= pos;
+		__entry->length		= length;
+		__entry->flags		= flags;
+		__entry->type		= iomap->type;
+		__entry->addr		= iomap->addr;
+		__entry->map_len	= iomap->length;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld length %lld flags 0x%x -> %s addr %llu length %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->length, __entry->flags,
+		  __print_symbolic(__entry->type,
+				   { IOMAP_HOLE,	"hole" },
+				   { IOMAP_DELALLOC,	"delalloc" },
+				   { IOMAP_MAPPED,	"mapped" },
+				   { IOMAP_UNWRITTEN,	"unwritten" },
+				   { IOMAP_INLINE,	"inline" }),
+		  __entry->addr, __entry->map_len)
+);
+
+#endif /* _TOYFS_TRACE_H */
+
+/* This part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE toyfs_trace
+#include <trace/define_trace.h>
@@ -4,119 +4,308 @@
 #define __TOYFS_TYPES_H
 
 #include <linux/fs.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include "toyfs_format.h"
 
 #define EFSCORRUPTED	EUCLEAN
 
-/* We only support 2048 block size */
-#define TFS_BSIZE	2048
+/* Maximum number of blocks reserved at once by a CPU, see toyfs_balloc_range() */
+#define TFS_BPOOL_BLOCKS	64
 
-/* Yup. Filesystem maximum size is 1MiB */
-#define TFS_MAX_BLKS	512
+/* Commits forced before giving up on -ENOSPC, see toyfs_should_retry_alloc() */
+#define TFS_ALLOC_RETRIES	1
 
 /*
- * Number of blocks allocated for a single inode
- * Yes, to make things simple, we hardcode it.
+ * In-core journal, see toyfs_journal.c
  *
- * Each block address is encoded within a 32-bit integer,
- * the whole tfs_dinode structure is 36 bytes + 4 * num of blocks
- * We use a amaximum of 7 blocks here so the whole inode structure
- * is rounded to a power of 2 (64 bytes).
- *
- * So, in the single inode block, we can have 32 inodes
- * Yes, the whole filesystem will have at most 32 inodes
+ * Handles hold j_trans_sem for read, the commit takes it for write. j_lock
+ * protects the running transaction: j_credits, j_nbufs and j_bufs.
  */
-#define TFS_INODE_COUNT		32
+struct tfs_journal {
+	struct super_block	*j_sb;
+	unsigned int		j_start;	/* Journal superblock */
+	unsigned int		j_blocks;
+	unsigned int		j_max;		/* Most blocks a transaction logs */
+
+	struct rw_semaphore	j_trans_sem;
+	struct mutex		j_commit_mutex;
+	spinlock_t		j_lock;
+	unsigned int		j_tid;		/* Running transaction */
+	unsigned int		j_commit_tid;	/* Last one committed */
+	unsigned int		j_credits;
+	unsigned int		j_nbufs;
+	struct buffer_head	**j_bufs;
+	bool			j_aborted;
+
+	/* Commit buffers: j_max block copies, the descriptor and commit */
+	void			**j_copies;
+	struct tfs_journal_desc	*j_desc;
+	struct tfs_journal_commit *j_commit;
+	struct delayed_work	j_commit_work;
+};
 
-/* Every inode can use up to 7 data blocks*/
-#define	TFS_MAX_INO_BLKS	7
+/* A journal handle, see toyfs_journal_start() */
+struct tfs_handle {
+	struct tfs_journal	*h_journal;
+	unsigned int		h_tid;
+	bool			h_nested;
+};
 
+/* Credits for a single namespace operation */
+#define TFS_JOURNAL_CREDITS	16
 
 /*
- * directory entry name is hardcoded within the dir entry, set a maximum value
- * Set it to 28 bytes, so the whole dir entry struct is rounded to a power of 2 (32bytes)
+ * Per-CPU block reservation pool: a run of blocks already claimed in the
+ * in-core copy of the bitmap, but not handed out yet, nor marked on-disk.
  */
-#define TFS_MAX_NLEN 28
-
-#define TFS_MAGIC 0x5F544F59 /* _TOY */
+struct tfs_bpool {
+	spinlock_t		lock;
+	unsigned int		start;
+	unsigned int		len;
+};
 
 /*
- * Invalid reference
- *
- * Can be used to identify free dentries, free inodes, etc
- * We need something like this, because we support inode 0.
- *
- * This is safe to use, because we don't access more than 32
- * inodes or 512 blocks, so we should never have a valid reference
- * pointing to this same value.
+ * Per-CPU statistics, exported in /sys/fs/toyfs/<dev>/, see toyfs_sysfs.c.
+ * Counters only ever go up, and are only summed up when read.
  */
-#define TFS_INVALID 0xdeadbeef
-
-/* Inode alloc flags */
-#define TFS_INODE_INUSE	1
-#define TFS_INODE_FREE	0
-
-/* s_flags fields */
-#define TFS_SB_CLEAN	0
-#define TFS_SB_DIRTY	1
-
-/* Disk location of metadata blocks */
-#define TFS_SB_BLOCK		(0)
-#define TFS_INODE_BLOCK		(1)
-#define TFS_BITMAP_BLOCK	(2)
-#define TFS_FIRST_DATA_BLOCK	(3)
-#define TFS_LAST_DATA_BLOCK	(TFS_MAX_BLKS -1)
-
-/* On disk superblock */
-struct tfs_dsb {
-	__u32	s_magic;
-	__u32	s_flags;
-
-	/* free inode and block fields require locking */
-	__u32	s_ifree;
-	__u32	s_bfree;
-	__u32	s_inodes[32];
+enum tfs_stat_item {
+	TFS_STAT_BALLOC_CALLS,		/* Block allocation requests */
+	TFS_STAT_BALLOC_BLOCKS,		/* Blocks allocated */
+	TFS_STAT_BFREE_BLOCKS,		/* Blocks freed */
+	TFS_STAT_BMAP_WORDS,		/* Bitmap words scanned by allocations */
+	TFS_STAT_LOOKUP_HITS,		/* toyfs_find_entry() calls finding the name */
+	TFS_STAT_LOOKUP_MISSES,		/* ... and not finding it */
+	TFS_STAT_LOOKUP_BLOCKS,		/* Directory blocks they read */
+	TFS_STAT_WRITE_INODE,		/* toyfs_write_inode() calls */
+	TFS_STAT_WRITE_INODE_SYNC,	/* ... forced to write synchronously */
+	TFS_STAT_NR,
+};
+
+struct tfs_stats {
+	u64			st_count[TFS_STAT_NR];
 };
 
 /* In memory superblock (linked to s_fs_info) */
 struct tfs_fs_info {
 	unsigned int		s_magic;
 	unsigned int		s_flags;
-	unsigned int		s_bfree;
-	unsigned int		s_ifree;
-	struct buffer_head	*s_bmap_bh;
-	struct buffer_head	*s_inode_bh;
-	unsigned int		s_inodes[32];
+	unsigned int		s_version;
+
+	/*
+	 * Free block and inode counters. The allocators only update their
+	 * local CPU's delta, the counters are only summed up when an exact
+	 * value is needed.
+	 */
+	struct percpu_counter	s_bfree;
+	struct percpu_counter	s_ifree;
+
+	/* Geometry, synthesized from the legacy layout if needed */
+	unsigned int		s_nblocks;
+	unsigned int		s_ninodes;
+	unsigned int		s_itable_start;
+	unsigned int		s_itable_blocks;
+	unsigned int		s_imap_start;
+	unsigned int		s_imap_blocks;
+	unsigned int		s_bmap_start;
+	unsigned int		s_bmap_blocks;
+	unsigned int		s_data_start;
+
+	/* Block allocation cursor, see toyfs_balloc() */
+	unsigned int		s_next_goal;
+
+	/* Block reservation pools, NULL when disabled */
+	struct tfs_bpool __percpu *s_bpool;
+	unsigned int		s_bpool_batch;
+
+	/*
+	 * s_bmap_lock protects the block bitmap buffers contents.
+	 *
+	 * Inode allocation uses an in-core copy of the inode bitmap (or of
+	 * the legacy inode list), built at mount time and protected by
+	 * s_imap_lock. The on-disk copy is updated once the inode is ours.
+	 */
+	spinlock_t		s_bmap_lock;
+	spinlock_t		s_imap_lock;
+	unsigned long		*s_imap;
+
+	/*
+	 * In-core copy of each block bitmap block, made when the block is
+	 * first read, which is what allocations search. Blocks freed by the
+	 * running transaction are only cleared there once it commits, see
+	 * toyfs_bmap_commit(), blocks in the reservation pools are only set
+	 * there. Also protected by s_bmap_lock.
+	 */
+	unsigned long		**s_bmap_alloc;
+	unsigned int		s_bfree_pending;
+
+	/*
+	 * Metadata buffers, one slot per block of each region. Buffers are
+	 * read the first time they are needed via toyfs_meta_bh(), and are
+	 * pinned until unmount.
+	 */
+	struct buffer_head	*s_sbh;
+	struct buffer_head	**s_bmap_bh;
+	struct buffer_head	**s_imap_bh;
+	struct buffer_head	**s_inode_bh;
+	unsigned int		s_inodes[TFS_INODE_COUNT];	/* Legacy only */
+
+	/*
+	 * Inode table blocks dirtied by toyfs_write_inode() since they were
+	 * last written by toyfs_sync_fs(), one bit per s_inode_bh slot.
+	 */
+	unsigned long		*s_itable_dirty;
+
+	/* Metadata journal, NULL if the filesystem has none */
+	struct tfs_journal	*s_journal;
+
+	/* Completes writeback into unwritten blocks, see toyfs_end_io() */
+	struct workqueue_struct	*s_ioend_wq;
+
+	/* Statistics, and their /sys/fs/toyfs/<dev>/ directory */
+	struct super_block	*s_sb;
+	struct tfs_stats __percpu *s_stats;
+	struct kobject		s_kobj;
+	struct completion	s_kobj_unregister;
 };
 
-/* On disk inode */
-struct tfs_dinode {
-	__u32	i_mode;
-	__u32	i_nlink;
-	__u32	i_atime;
-	__u32	i_mtime;
-	__u32	i_ctime;
-	__u32	i_uid;
-	__u32	i_gid;
-	__u32	i_size;
-	__u32	i_blocks;
-	__u32	i_addr[TFS_MAX_INO_BLKS];
+static inline void toyfs_stat_add(struct tfs_fs_info *tfi,
+				  enum tfs_stat_item item, u64 count)
+{
+	this_cpu_add(tfi->s_stats->st_count[item], count);
+}
+
+static inline bool toyfs_is_legacy(struct tfs_fs_info *tfi)
+{
+	return tfi->s_version == TFS_SB_VERSION_LEGACY;
+}
+
+/* Longest name the directories of @sb can hold, see struct tfs_dentry */
+static inline unsigned int toyfs_name_len(struct super_block *sb)
+{
+	return toyfs_is_legacy(sb->s_fs_info) ? TFS_LEGACY_NAME_LEN :
+						TFS_NAME_LEN;
+}
+
+/*
+ * In-core directory cache, see toyfs_dir_cache.c
+ *
+ * There is one bit in dc_free for every dentry slot (TFS_ENTRIES_PER_BLOCK()
+ * per directory block), set while the slot is free. Index blocks never have
+ * free slots.
+ */
+struct tfs_dir_cache {
+	unsigned long		*dc_free;
+	unsigned int		dc_nslots;	/* Bits in dc_free */
+	unsigned int		dc_count;	/* Names cached */
+	unsigned int		dc_bits;	/* log2 of dc_names buckets */
+	struct hlist_head	*dc_names;
 };
 
-/* In-core inode */
+/*
+ * In-core inode
+ *
+ * The block map is always kept as a sorted extent list in-core, regardless
+ * of the on-disk format. Small extent lists live within the inode itself,
+ * larger ones are moved to i_extents, see toyfs_extent.c.
+ */
 struct tfs_inode_info {
-	struct inode	vfs_inode;
-	unsigned int	i_blocks;
-	unsigned int	i_addr[TFS_MAX_INO_BLKS];
-	char		i_link[TFS_MAX_NLEN];
+	struct inode		vfs_inode;
+	unsigned int		i_blocks;
+
+	/*
+	 * i_map_lock protects the block map against concurrent writers and
+	 * writeback, and i_map_seq is bumped on every block map change so
+	 * cached mappings can be revalidated.
+	 */
+	struct rw_semaphore	i_map_lock;
+	unsigned int		i_map_seq;
+	unsigned int		i_nextents;
+	unsigned int		i_ext_block;
+	bool			i_meta_resv;	/* i_ext_block is reserved */
+	struct tfs_extent	*i_extents;
+	struct tfs_extent	i_inline_ext[TFS_INODE_EXTENTS];
+
+	/*
+	 * Logical blocks written to the page cache but not allocated yet, each
+	 * one holding a block reservation. Protected by i_map_lock.
+	 */
+	struct xarray		i_delalloc;
+
+	/*
+	 * Writeback I/O into unwritten blocks, completed by i_ioend_work
+	 * once the bios are done. Protected by i_ioend_lock.
+	 */
+	spinlock_t		i_ioend_lock;
+	struct list_head	i_ioend_list;
+	struct work_struct	i_ioend_work;
+
+	/*
+	 * Held for write by toyfs_writepages() while it allocates delayed
+	 * blocks and writes them back, so that no new ones show up meanwhile.
+	 * Taken for read before adding delayed blocks, and before locking
+	 * the folio when doing so under a folio lock.
+	 */
+	struct rw_semaphore	i_delalloc_sem;
+	struct tfs_dir_cache	*i_dir_cache;	/* Directories only */
+	char			i_link[TFS_MAX_NLEN];
+
+	/*
+	 * Inline inodes keep their data in the on-disk inode, which iomap
+	 * reads and writes in place, see toyfs_inline_convert(). The flag is
+	 * only cleared, under i_map_lock.
+	 */
+	bool			i_inline;
+
+	/*
+	 * What toyfs_fsync() has to write besides the inode itself: the block
+	 * bitmap blocks [i_sync_bmap_lo, i_sync_bmap_hi] our allocations
+	 * dirtied (protected by i_map_lock, empty when lo > hi), and whether
+	 * toyfs_write_inode() left the inode in a dirty buffer.
+	 */
+	unsigned int		i_sync_bmap_lo;
+	unsigned int		i_sync_bmap_hi;
+	unsigned int		i_stored_seq;	/* i_map_seq last written */
+	unsigned long		i_sync_flags;
+	unsigned int		i_sync_tid;	/* Transaction of the last write */
 };
 
-/* On disk directory entry */
-struct tfs_dentry {
-	__u32	d_ino;
-	char	d_name[TFS_MAX_NLEN];
-};
+/* i_sync_flags bits */
+#define TFS_SYNC_INODE		0	/* Inode buffer not synced */
+#define TFS_SYNC_DATASYNC	1	/* ... and fdatasync needs it */
 
-#define TFS_ENTRIES_PER_BLOCK ((TFS_BSIZE) / (sizeof(struct tfs_dentry)))
+/*
+ * i_blocks counts filesystem blocks, the VFS counts 512 byte units. Both are
+ * updated together, under i_map_lock.
+ */
+static inline void toyfs_inode_set_blocks(struct inode *inode,
+					  unsigned int count)
+{
+	container_of(inode, struct tfs_inode_info, vfs_inode)->i_blocks = count;
+	inode_set_bytes(inode, (loff_t)count << inode->i_blkbits);
+}
+
+static inline void toyfs_inode_add_blocks(struct inode *inode,
+					  unsigned int count)
+{
+	container_of(inode, struct tfs_inode_info, vfs_inode)->i_blocks += count;
+	inode_add_bytes(inode, (loff_t)count << inode->i_blkbits);
+}
+
+static inline void toyfs_inode_sub_blocks(struct inode *inode,
+					  unsigned int count)
+{
+	container_of(inode, struct tfs_inode_info, vfs_inode)->i_blocks -= count;
+	inode_sub_bytes(inode, (loff_t)count << inode->i_blkbits);
+}
+
+/* Dentry slots in each block of @dir, TFS_ENTRIES_PER_BLOCK() */
+static inline unsigned int toyfs_entries_per_block(struct inode *dir)
+{
+	return TFS_ENTRIES_PER_BLOCK(dir->i_sb->s_blocksize);
+}
 
 /* Function declarations */
 extern int toyfs_fill_super(struct super_block *sb,
@@ -127,15 +316,93 @@ extern struct dentry* toyfs_mount(struct file_system_type *fs_type,
 				  void *data);
 extern struct inode* toyfs_read_inode(struct super_block *sb,
 				      unsigned int inum);
+extern int toyfs_init_inodecache(void);
+extern void toyfs_destroy_inodecache(void);
 extern struct inode* toyfs_alloc_inode(struct super_block *sb);
 extern struct dentry* toyfs_lookup(struct inode *parent, struct dentry *dentry,
 				   unsigned int flags);
-extern int toyfs_balloc(struct super_block *sb);
-extern void toyfs_bfree(struct tfs_fs_info *tfi, int block);
+extern struct buffer_head *toyfs_meta_bh(struct super_block *sb,
+					 struct buffer_head **cache,
+					 unsigned int start,
+					 unsigned int idx);
+extern struct tfs_dinode *toyfs_get_dinode(struct super_block *sb,
+					   unsigned int inum,
+					   struct buffer_head **bhp);
+extern unsigned int toyfs_max_file_blocks(struct super_block *sb);
+extern unsigned int toyfs_ext_lookup(struct tfs_inode_info *tino,
+				     unsigned int lblk, unsigned int *len);
+extern unsigned int toyfs_ext_map(struct tfs_inode_info *tino,
+				  unsigned int lblk, unsigned int *len,
+				  bool *unwritten);
+extern unsigned int toyfs_ext_goal(struct tfs_inode_info *tino,
+				   unsigned int lblk);
+extern int toyfs_ext_insert(struct inode *inode, unsigned int lblk,
+			    unsigned int pblk, unsigned int len,
+			    bool unwritten);
+extern int toyfs_ext_reserve_meta(struct inode *inode);
+extern void toyfs_ext_unreserve_meta(struct inode *inode, bool force);
+extern int toyfs_ext_set_unwritten(struct inode *inode, unsigned int start,
+				   unsigned int end, bool unwritten);
+extern int toyfs_ext_truncate(struct inode *inode, unsigned int start,
+			      unsigned int end);
+extern int toyfs_ext_remove(struct inode *inode, unsigned int start,
+			    unsigned int end);
+extern int toyfs_ext_load(struct inode *inode, struct tfs_dinode *dip);
+extern int toyfs_ext_store(struct inode *inode, struct tfs_dinode *dip,
+			   bool sync);
+extern void toyfs_ext_sync_reset(struct tfs_inode_info *tino);
+extern void toyfs_ext_init(struct tfs_inode_info *tino);
+extern void toyfs_ext_destroy(struct tfs_inode_info *tino);
+extern int toyfs_balloc_range(struct super_block *sb, unsigned int goal,
+			      unsigned int want, unsigned int *got);
+extern int toyfs_balloc_reserved(struct super_block *sb, unsigned int goal,
+				 unsigned int want, unsigned int *got);
+extern int toyfs_reserve_blocks(struct super_block *sb, unsigned int count);
+extern void toyfs_unreserve_blocks(struct super_block *sb, unsigned int count);
+extern bool toyfs_should_retry_alloc(struct super_block *sb, int *retries);
+extern void toyfs_delalloc_release(struct inode *inode, unsigned int start,
+				   unsigned int end);
+extern int toyfs_convert_unwritten(struct inode *inode, loff_t pos,
+				   loff_t len);
+extern void toyfs_end_io(struct work_struct *work);
+extern int toyfs_prealloc(struct inode *inode, unsigned int start,
+			  unsigned int end);
+extern int toyfs_inline_convert(struct inode *inode);
+extern int toyfs_balloc(struct super_block *sb, unsigned int goal);
+extern void toyfs_bfree(struct super_block *sb, int block);
+extern unsigned int toyfs_bfree_range(struct super_block *sb,
+				      unsigned int start, unsigned int len);
+extern int toyfs_bpool_init(struct super_block *sb);
+extern void toyfs_bpool_drain(struct super_block *sb);
+extern void toyfs_bmap_commit(struct super_block *sb, struct buffer_head *bh);
+extern int toyfs_bmap_count_free(struct super_block *sb);
+extern int toyfs_bmap_free_extents(struct super_block *sb,
+				   unsigned int *hist, unsigned int nr);
 extern int toyfs_ialloc(struct super_block *sb);
+extern void toyfs_ifree(struct super_block *sb, unsigned int inum);
+extern int toyfs_imap_init(struct super_block *sb);
 extern int toyfs_dir_add_entry(struct inode *parent, const char *name,
-			       int inum);
+			       struct inode *inode);
 extern int toyfs_dir_del_entry(struct inode *parent, const char *name);
+extern int toyfs_dir_replace_entry(struct inode *dir, const char *name,
+				   struct inode *inode);
+extern struct buffer_head *toyfs_dir_get_dotdot(struct inode *dir);
+extern void toyfs_dir_set_dotdot(struct inode *dir, struct buffer_head *bh,
+				 struct inode *parent);
+extern int toyfs_dir_init(struct inode *dir, struct inode *parent);
+extern int toyfs_dir_sync(struct inode *dir);
+extern u32 toyfs_name_hash(const char *name);
+extern struct tfs_dir_cache *toyfs_dc_get(struct inode *dir, bool build);
+extern int toyfs_dc_lookup(struct tfs_dir_cache *dc, const char *name,
+			   u32 hash, unsigned int *slotp);
+extern int toyfs_dc_free_slot(struct tfs_dir_cache *dc);
+extern void toyfs_dc_grow(struct inode *dir, unsigned int nblocks);
+extern void toyfs_dc_free_block(struct inode *dir, unsigned int lblk);
+extern void toyfs_dc_add(struct inode *dir, const char *name, u32 hash,
+			 unsigned int slot, unsigned int ino);
+extern void toyfs_dc_del(struct inode *dir, const char *name, u32 hash,
+			 unsigned int slot);
+extern void toyfs_dc_destroy(struct tfs_inode_info *tino);
 
 extern struct inode* toyfs_new_inode(struct inode *parent,
 				     struct dentry *dentry,
@@ -153,29 +420,14 @@ extern int toyfs_mkdir(struct mnt_idmap *idmap,
 extern int toyfs_readdir(struct file *fdir, struct dir_context *ctx);
 
 extern int toyfs_read_folio(struct file *filp, struct folio *folio);
-extern int toyfs_get_block(struct inode *inode, sector_t block,
-			   struct buffer_head *bh, int create);
-
-extern int toyfs_write_begin(struct file *filp,
-			     struct address_space *mapping,
-			     loff_t pos,
-			     unsigned len,
-			     struct page **pagep,
-			     void **fsdata);
-
-extern int toyfs_write_end(struct file *filp,
-			   struct address_space *mapping,
-			   loff_t pos,
-			   unsigned len,
-			   unsigned copied,
-			   struct page *page,
-			   void *fsdata);
-
 extern int toyfs_writepages(struct address_space *mapping,
 			    struct writeback_control *wbc);
 
 extern void toyfs_free_inode(struct inode *inode);
 extern int toyfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+extern void toyfs_journal_inode(struct inode *inode);
+extern void toyfs_journal_inode_locked(struct inode *inode);
+extern int toyfs_symlink_load(struct inode *inode, struct tfs_dinode *dip);
 
 extern int toyfs_find_entry(struct inode *dir, const char *name);
 
@@ -196,5 +448,21 @@ extern int toyfs_rename(struct mnt_idmap *idmap,
 			unsigned int flags);
 extern int toyfs_statfs(struct dentry *dentry, struct kstatfs *kst);
 extern void toyfs_put_super(struct super_block *sb);
+extern int toyfs_sync_fs(struct super_block *sb, int wait);
+extern int toyfs_journal_load(struct super_block *sb, struct tfs_dsb *dsb,
+			      bool *recovered);
+extern void toyfs_journal_destroy(struct super_block *sb);
+extern int toyfs_journal_start(struct super_block *sb, struct tfs_handle *h,
+			       unsigned int credits);
+extern void toyfs_journal_stop(struct tfs_handle *h);
+extern void toyfs_journal_dirty(struct super_block *sb,
+				struct buffer_head *bh);
+extern void toyfs_journal_forget(struct super_block *sb, unsigned int start,
+				 unsigned int len);
+extern int toyfs_journal_force(struct super_block *sb, unsigned int tid);
+extern int toyfs_sysfs_init(void);
+extern void toyfs_sysfs_exit(void);
+extern int toyfs_sysfs_register(struct super_block *sb);
+extern void toyfs_sysfs_unregister(struct tfs_fs_info *tfi);
 
 #endif /* __TOYFS_TYPES_H */